@@ -0,0 +1,177 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany batch.c
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "lib_hh.h"
+#include "cmd_args.h"
+#include "thread_pool.h"
+
+/**
+ * A neuron of a batch run, as given by one row of the table.
+ */
+typedef struct BatchNeuron {
+  HHParams params;          // Model parameters.
+  unsigned long long seed;  // Seed of its tip currents.
+} BatchNeuron;
+
+/**
+ * State of HH_VLEN neurons stepped together, one per lane. Every array is
+ * made of rows of HH_VLEN doubles, entry `l' of a row belonging to the
+ * neuron in lane `l', and all of them sit in one block of their own.
+ */
+typedef struct BatchGroup {
+  double *y;            // Soma state, NUMVAR rows.
+  double *params;       // Parameters of somaLanes (see LANE_DT).
+  double *g_ld;         // Leak conductance of the dendrite compartments.
+  double *i_prev;       // Dendritic current at the start of the dendrite
+  double *i_next;       // step in progress and at its end.
+  double *g_before;     // Lateral conductance tables of every length of
+  double *g_after;      // dendrite, see Batch.
+  double *volt;         // Compartments of every dendrite, one after the
+                        // other, from the tip (dummy) to the soma.
+  double *samples;      // Soma potential sampled during the last ms,
+                        // `sample_rate' rows.
+} BatchGroup;
+
+/**
+ * Share of the groups stepped by one thread, and its scratch space. Each
+ * entry sits on its own cache lines.
+ */
+typedef struct BatchThread {
+  _Alignas(CACHE_LINE) int first; // First group of the share.
+  int num_groups;       // Groups in the share.
+  double *scratch;      // The rows below, in one block.
+  double *y0;           // Soma state at the start of a step, NUMVAR rows.
+  double *dydt;         // Its first derivative, NUMVAR rows.
+  double *rk;           // rk4Step stages, 4*NUMVAR rows.
+  double *vddt;         // First RK4 stage of a dendrite, num_comps rows.
+  double *cur;          // Tip currents of a dendrite, one row.
+  double *current;      // Currents it injects into the soma, one row.
+  double *g_table;      // conductanceTableOf of one lane, 2*num_comps.
+} BatchThread;
+
+/**
+ * Neurons integrated together by seq_hh --batch. They all have the same
+ * dendrites and steps, and differ in their model parameters and seeds. The
+ * neurons are packed HH_VLEN to a group in table order, the last group
+ * padded with copies of the last neuron, and stepped by a pool of threads
+ * one ms at a time, every thread keeping to its own groups.
+ *
+ * Dendrites of the same length share their conductance tables: dendrite
+ * `d' uses rows `table[shape[d]]' onwards of `g_before' and `g_after'.
+ */
+typedef struct Batch {
+  int num_neurons;      // Neurons in the table.
+  int num_groups;       // Groups of HH_VLEN neurons.
+  BatchNeuron *neurons; // Parameters of each lane of every group.
+  HHRng *rngs;          // Generator of the tip currents of each lane.
+  int num_dendrs;       // Dendrites of every neuron.
+  int num_comps;        // Most compartments of any dendrite, dummy and soma
+                        // included.
+  int *comps;           // Compartments of each dendrite, likewise.
+  size_t *offset;       // First row of each dendrite in `volt'.
+  int num_shapes;       // Different numbers of compartments.
+  int *shape;           // Length of each dendrite, as an index of `table'.
+  size_t *table;        // First row of the tables of each length.
+  int steps;            // Soma steps per ms.
+  int substeps;         // Soma steps per dendrite step.
+  int draws;            // Steps of the grid per dendrite step.
+  int sample_rate;      // Samples of the soma potential per ms.
+  size_t group_len;     // Doubles in the block of a group.
+  double *block;        // State of every group, group after group.
+  BatchGroup *groups;   // Where each group's state is in `block'.
+  int t_ms;             // ms being stepped.
+
+  int num_threads;      // Threads stepping the groups.
+  BatchThread *threads; // Share and scratch space of each.
+  size_t scratch_len;   // Doubles of scratch space of a thread.
+  Pool *pool;           // The threads themselves.
+} Batch;
+
+/**
+ * Name: batchRead
+ *
+ * Description:
+ * Reads the table of neurons of a batch run. The first line that is not
+ * blank or a '#' comment names the columns, each one of 'inj-mean',
+ * 'g-comp', 'g-distr', 'g-na', 'g-k', 'g-l', 'g-ld' and 'seed'. Every
+ * following line is a neuron, with one value per column. What the table
+ * leaves out comes from the command line. Errors are reported on stderr.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the table
+ * @param cmd_args      (INPUT) options of the run
+ * @param num_neurons   (OUTPUT) number of neurons
+ *
+ * Returns:
+ * @return BatchNeuron* the neurons, or NULL if the table can't be read
+ */
+BatchNeuron *batchRead( const char *fname, const CmdArgs *cmd_args,
+                        int *num_neurons );
+
+/**
+ * Name: batchCreate
+ *
+ * Description:
+ * Sets up the neurons of a batch run at rest. The state of every group is
+ * first written by the thread that will step it.
+ *
+ * Parameters:
+ * @param cmd_args      (INPUT) options of the run
+ * @param neurons       (INPUT) the neurons, as read by batchRead
+ * @param num_neurons   (INPUT) their number
+ *
+ * Returns:
+ * @return Batch*       the batch, or NULL if out of memory
+ */
+Batch *batchCreate( const CmdArgs *cmd_args, const BatchNeuron *neurons,
+                    int num_neurons );
+
+/**
+ * Name: batchStep
+ *
+ * Description:
+ * Advances every neuron from the start of a ms to its end with the same
+ * steps as seq_hh, and keeps the samples of the soma potential taken
+ * during it for batchSample. Every neuron gives, bit for bit, the trace of
+ * seq_hh run alone with its parameters and one thread.
+ *
+ * Parameters:
+ * @param batch         (INOUT) the batch
+ * @param t_ms          (INPUT) ms to step, from 1
+ */
+void batchStep( Batch *batch, int t_ms );
+
+/**
+ * Name: batchSample
+ *
+ * Description:
+ * A sample of the soma potential of a neuron taken by the last batchStep.
+ *
+ * Parameters:
+ * @param batch         (INPUT) the batch
+ * @param n             (INPUT) the neuron, in table order
+ * @param k             (INPUT) the sample, the last one at the end of the ms
+ *
+ * Returns:
+ * @return double       the potential, mV
+ */
+double batchSample( const Batch *batch, int n, int k );
+
+/**
+ * Name: batchFree
+ *
+ * Description:
+ * Releases a batch. NULL is ignored.
+ *
+ * Parameters:
+ * @param batch         (INPUT) the batch
+ */
+void batchFree( Batch *batch );
+
+#endif
@@ -0,0 +1,182 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany checkpoint.c and checkpoint_mpi.c
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "engine.h"
+#include "trace.h"
+#include "cmd_args.h"
+#include "constants.h"
+
+#include <stdint.h>
+
+// First bytes of a checkpoint.
+#define CKPT_MAGIC "HHCKPT02"
+#define CKPT_MAGIC_LEN 8
+
+/**
+ * Header of a checkpoint, taken at the end of a whole ms.
+ *
+ * It is followed by every compartment of every dendrite, dummy and soma ones
+ * included, `num_comps' doubles per dendrite in order of global id, and then
+ * by the soma potential at every whole ms up to `t_ms'. The tip currents are
+ * a function of the dendrite and the step, so the ms reached is all there is
+ * to the state of the generator. The trace itself stays in its data file;
+ * the header only says how far it went. Numbers are in the byte order of the
+ * machine.
+ */
+typedef struct CkptHeader {
+  char magic[CKPT_MAGIC_LEN]; // CKPT_MAGIC.
+  int32_t num_dendrs;   // Dendrites of the neuron.
+  int32_t num_comps;    // Compartments per dendrite, dummy and soma included.
+  int32_t steps;        // Integration steps per ms.
+  int32_t substeps;     // Soma steps per dendrite step.
+  int32_t integrator;   // HHIntegrator of the dendrites.
+  int32_t rng;          // HHRngMode of the tip currents.
+  uint64_t seed;        // Seed of the counter-based generator.
+  int32_t sample_rate;  // Samples of the trace per ms.
+  int32_t format;       // TraceFormat of the trace.
+  HHParams params;      // Model parameters; comp_time may change on restart.
+  char time_str[16];    // Names the data and graph files of the run.
+
+  int32_t t_ms;         // Last whole ms simulated.
+  int32_t trace_head;   // Bytes of the comment line the trace starts with.
+  double y[NUMVAR];     // Soma state, as used by soma().
+  double i_dendr;       // Dendritic current into the soma.
+  int64_t trace_samples;// Samples in the trace.
+  int64_t trace_len;    // Bytes in the trace.
+  double exec_time;     // Wall time of the run so far, s, runs it was
+                        // continued from included.
+} CkptHeader;
+
+/**
+ * Name: checkpointInit
+ *
+ * Description:
+ * Fills in the parts of a checkpoint header that don't change during a run.
+ *
+ * Parameters:
+ * @param hdr           (OUTPUT) the header
+ * @param cmd_args      (INPUT) options of the run
+ * @param num_comps     (INPUT) compartments per dendrite, dummy and soma ones
+ *                      included
+ * @param time_str      (INPUT) time stamp in the names of the output files
+ */
+void checkpointInit( CkptHeader *hdr, const CmdArgs *cmd_args, int num_comps,
+                     const char *time_str );
+
+/**
+ * Name: checkpointUpdate
+ *
+ * Description:
+ * Fills in the state of the soma and flushes the trace, before a checkpoint
+ * is written at the end of ms `t_ms'.
+ *
+ * Parameters:
+ * @param hdr           (INOUT) the header
+ * @param t_ms          (INPUT) last whole ms simulated
+ * @param y             (INPUT) soma state
+ * @param i_dendr       (INPUT) dendritic current into the soma
+ * @param exec_time     (INPUT) wall time of the run so far, s, runs it was
+ *                      continued from included
+ * @param trace         (INOUT) the trace, written up to `t_ms'
+ *
+ * Returns:
+ * @return int          nonzero if the trace could be flushed
+ */
+int checkpointUpdate( CkptHeader *hdr, int t_ms, const double *y,
+                      double i_dendr, double exec_time, TraceWriter *trace );
+
+/**
+ * Name: checkpointWrite
+ *
+ * Description:
+ * Writes a checkpoint of a whole neuron. The file is written under a
+ * temporary name and then renamed, so an interrupted write leaves the
+ * previous checkpoint in place.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the checkpoint
+ * @param hdr           (INPUT) header, see checkpointUpdate
+ * @param eng           (INPUT) every dendrite
+ * @param res           (INPUT) soma potential at every whole ms
+ *
+ * Returns:
+ * @return int          nonzero if the checkpoint was written
+ */
+int checkpointWrite( const char *fname, const CkptHeader *hdr, Engine *eng,
+                     const double *res );
+
+/**
+ * Name: checkpointWriteShared
+ *
+ * Description:
+ * Writes a checkpoint from every rank of MPI_COMM_WORLD. Every rank writes
+ * the dendrites of its engine with one collective MPI-IO call, through a
+ * file view that only covers them; rank 0 also writes the header and the
+ * soma potentials. Written under a temporary name and then renamed, like
+ * checkpointWrite. Collective. Only in mpi_hh.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the checkpoint
+ * @param hdr           (INPUT) header, see checkpointUpdate; only used on
+ *                      rank 0
+ * @param eng           (INPUT) the dendrites of this rank, global ids in
+ *                      increasing order
+ * @param num_dendrs    (INPUT) dendrites over all ranks
+ * @param buf           (INPUT) scratch space of eng->num_comps doubles per
+ *                      dendrite of the engine
+ * @param res           (INPUT) soma potential at every whole ms, only used
+ *                      on rank 0
+ *
+ * Returns:
+ * @return int          nonzero if the checkpoint was written, on all ranks
+ */
+int checkpointWriteShared( const char *fname, const CkptHeader *hdr,
+                           Engine *eng, int num_dendrs, double *buf,
+                           const double *res );
+
+/**
+ * Name: checkpointRead
+ *
+ * Description:
+ * Reads the header of a checkpoint and checks it against the options of
+ * the run that is to continue from it. Mismatches are reported on stderr.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the checkpoint
+ * @param cmd_args      (INPUT) options of the new run
+ * @param hdr           (OUTPUT) the header
+ *
+ * Returns:
+ * @return int          nonzero if the run can continue from the checkpoint
+ */
+int checkpointRead( const char *fname, const CmdArgs *cmd_args,
+                    CkptHeader *hdr );
+
+/**
+ * Name: checkpointRestore
+ *
+ * Description:
+ * Loads the dendrites of an engine, and optionally the soma potentials,
+ * from a checkpoint. Only the parts wanted are read, so every rank of
+ * mpi_hh can load its own dendrites.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the checkpoint
+ * @param hdr           (INPUT) its header, see checkpointRead
+ * @param eng           (INOUT) the dendrites to load
+ * @param res           (OUTPUT) soma potential at every whole ms up to
+ *                      hdr->t_ms, or NULL
+ *
+ * Returns:
+ * @return int          nonzero if everything was read
+ */
+int checkpointRestore( const char *fname, const CkptHeader *hdr, Engine *eng,
+                       double *res );
+
+#endif
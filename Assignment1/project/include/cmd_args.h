@@ -1,12 +1,63 @@
 #ifndef CMD_ARGS_H
 #define CMD_ARGS_H
 
+#include "lib_hh.h"
+#include "trace.h"
+
+/**
+ * How mpi_hh exchanges the soma potential and the dendritic currents every
+ * integration step.
+ */
+typedef enum HHSyncMode {
+  SYNC_STAR,    // Point-to-point messages between rank 0 and every worker.
+  SYNC_COLL,    // MPI_Bcast and MPI_Reduce.
+  SYNC_TREE     // Binomial trees of point-to-point messages.
+} HHSyncMode;
+
+/**
+ * How mpi_hh splits the work between its ranks.
+ */
+typedef enum HHDecompose {
+  DECOMPOSE_AUTO,         // Whichever of the two is expected to be faster.
+  DECOMPOSE_DENDRITES,    // Whole dendrites, see assign_dendrites.
+  DECOMPOSE_COMPARTMENTS  // Runs of compartments, cutting dendrites if need
+                          // be, see partitionChain.
+} HHDecompose;
+
 /**
  * Container for values given in the command line.
  */
 typedef struct CmdArgs {
   int num_dendrs; // The number of dendrites to simulate.
-  int num_comps;  // The number of compartments per dendrite.
+  int num_comps;  // The number of compartments per dendrite (the most).
+  char *morphology; // File of compartments per dendrite, or NULL.
+  int *comps;     // Compartments of each dendrite, or NULL if all the same.
+  char *batch;    // Table of neurons seq_hh steps together, or NULL.
+  HHKernel kernel; // Kernel used to step the dendrites.
+  int validate;   // Nonzero to check the kernel against the reference one.
+  HHRngMode rng;  // Generator of the dendrite tip currents.
+  unsigned long long seed; // Seed of the counter-based generator.
+  int num_threads; // Threads stepping the dendrites (per process).
+  HHSyncMode sync; // Per-step exchange used by mpi_hh.
+  int overlap;    // Nonzero to step the dendrites while v_m is in flight.
+  int window;     // Steps per waveform relaxation window, 0 for lock-step.
+  HHDecompose decompose; // How mpi_hh splits the work between its ranks.
+  int rebalance;  // ms between load checks of mpi_hh, 0 for never.
+  double rebalance_threshold; // Imbalance above which dendrites migrate.
+  double tolerance; // Convergence tolerance of waveform relaxation, mV.
+  char *reference; // Trace to compare the results with, or NULL.
+  HHIntegrator integrator; // Integration method of the dendrites.
+  int steps;      // Integration steps per ms.
+  int adaptive;   // Nonzero to let the soma error pick the step size.
+  int substeps;   // Soma steps per dendrite step.
+  HHParams params; // Model parameters.
+  int sample_rate; // Samples of the soma potential written per ms.
+  TraceFormat format; // Format of the data file.
+  char *record;   // Compartment recording to write, or NULL.
+  int record_every; // Integration steps between frames of the recording.
+  char *checkpoint; // Checkpoint to write, or NULL.
+  int checkpoint_every; // ms between checkpoints.
+  char *restart;  // Checkpoint to continue from, or NULL.
 } CmdArgs;
 
 /**
@@ -36,4 +87,19 @@ void usage( char *name );
  */
 int parseArgs( CmdArgs *cmd_args, int argc, char **argv ); 
 
+/**
+ * Name: dendriteComps
+ *
+ * Description:
+ * Lists the compartments of every dendrite, dummy and soma compartments
+ * included, as taken by engineCreate.
+ *
+ * Parameters:
+ * @param cmd_args  the parsed arguments
+ *
+ * Returns:
+ * @return int*     one entry per dendrite, or NULL if out of memory
+ */
+int *dendriteComps( const CmdArgs *cmd_args );
+
 #endif
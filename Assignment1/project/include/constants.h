@@ -11,5 +11,6 @@
 #define DENDRCONDDISTR 100  // Deviation of compartmental conductance, nS
 
 #define FNAME_LEN 80        // Filename lengths.
+#define CKPT_EVERY 100      // Default time between checkpoints, ms
 
 #endif
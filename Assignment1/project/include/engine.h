@@ -0,0 +1,332 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany engine.c
+*/
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "lib_hh.h"
+#include "thread_pool.h"
+
+/**
+ * Tables shared by all the dendrites of an engine with the same number of
+ * compartments.
+ */
+typedef struct EngineShape {
+  int num_comps;        // Compartments, dummy and soma included.
+  double *g_before;     // Lateral conductance tables (fused kernel).
+  double *g_after;
+  double *implicit;     // Table of the implicit integrators.
+} EngineShape;
+
+/**
+ * Share of an engine stepped by one thread. Each entry sits on its own cache
+ * lines so that the per-step partial sums do not false-share.
+ */
+typedef struct EngineThread {
+  _Alignas(CACHE_LINE) double sum;  // Current injected by these dendrites.
+  int *dendrs;          // Dendrites of the share, in increasing order.
+  int num_dendrs;
+  int *units;           // What the thread steps: dendrites (SIMD: batches).
+  int num_units;
+  size_t first_volt;    // Potentials of the share: `num_volts' from
+  size_t num_volts;     // `volt + first_volt', padding lanes included.
+  double cost;          // Compartment updates of the share per step.
+  double busy;          // Seconds spent stepping the share.
+  HHWorkspace *ws;      // Scratch space of the scalar kernel.
+  double *vddt;         // RK4 first stage of one batch (SIMD kernel).
+  double cur[HH_VLEN];  // Tip currents of one batch, 0 in padding lanes.
+  double current[HH_VLEN]; // Currents injected by one batch.
+} EngineThread;
+
+/**
+ * A set of dendrites stepped together. The engine owns the membrane potential
+ * of every compartment of its dendrites, stored in one contiguous aligned
+ * block, along with all the scratch space needed to step them.
+ *
+ * Dendrites may have different numbers of compartments. Two layouts are
+ * used, depending on the kernel:
+ *  - KERNEL_SCALAR: dendrite-major, row `d' holds every compartment of
+ *    dendrite `d' (`rows[d][c]').
+ *  - KERNEL_SIMD: the dendrites, from the longest to the shortest, are put
+ *    in batches of HH_VLEN of the same length; the last batch of each
+ *    length is padded. Within a batch compartment `c' of every dendrite is
+ *    contiguous (`rows[d][c*HH_VLEN]').
+ *
+ * With more than one thread the dendrites (SIMD: batches) are split in
+ * shares, one per thread of a persistent pool. If they all cost the same
+ * the shares are contiguous and even; otherwise they are packed by
+ * compartment count, longest first (partitionLPT). Either way the
+ * potentials of a share are stored together, from a cache line of their
+ * own, and are first written by the thread that steps them, so their pages
+ * end up local to its core, as do those of the copy kept by
+ * engineEnableRollback. The thread calling engineStep takes the first share
+ * and adds up the partial currents.
+ */
+typedef struct Engine {
+  HHKernel kernel;      // Kernel used to step the dendrites.
+  int num_dendrs;       // Number of dendrites owned by this engine.
+  int num_comps;        // Most compartments of any dendrite, dummy and soma
+                        // included.
+  int *comps;           // Compartments of each dendrite, likewise.
+  int *gids;            // Global id of each owned dendrite (keys the RNG).
+  const HHRng *rng;     // Generator of the tip currents.
+  int pitch;            // Distance between compartments of a dendrite.
+  size_t num_volts;     // Potentials stored, padding included.
+  double *volt;         // Membrane potential of every compartment.
+  double **rows;        // Start of each dendrite.
+  size_t *offset;       // Start of each dendrite when stored dendrite-major.
+  int num_batches;      // Batches of dendrites (SIMD layout).
+  int *lanes;           // Dendrite in each lane of each batch, -1 if padding.
+  double **batches;     // Start of each batch.
+  int num_shapes;       // Different numbers of compartments.
+  EngineShape *shapes;  // Tables of each, from the longest dendrites.
+  int *shape;           // Shape of each dendrite.
+  double *cur;          // Tip current of each dendrite for the current step.
+  double *current;      // Current injected into the soma by each dendrite.
+  HHIntegrator integrator; // Integration method (see engineSetIntegrator).
+  int draws;            // Steps of 1/STEPS ms per integration step.
+  double implicit_dt;   // Step size the implicit tables were built for.
+  double *v_old;        // Stash between engineStepBegin and engineStepFinish,
+                        // one entry per dendrite (SIMD: per lane).
+
+  int num_threads;      // Threads stepping the dendrites.
+  EngineThread *threads;// Share and scratch space of each thread.
+  Pool *pool;           // The threads themselves.
+
+  // Arguments of the step in progress, read by every thread.
+  long first;           // First step of 1/STEPS ms covered by the step.
+  int span;             // Steps of 1/STEPS ms covered by the step.
+  double delta_t;
+  double v_m;
+
+  // Validation against the reference kernel (see engineValidate).
+  double *ref_volt;     // Dendrites stepped with dendriteStep, row-major.
+  double max_error;     // Largest difference seen so far, mV or pA.
+  // Copy of the potentials to go back to (see engineEnableRollback).
+  double *saved_volt;
+  double *saved_ref;
+} Engine;
+
+/**
+ * Name: engineCreate
+ *
+ * Description:
+ * Sets up an engine for the given dendrites. Every compartment starts at the
+ * rest potential.
+ *
+ * Parameters:
+ * @param kernel        (INPUT) kernel used to step the dendrites
+ * @param num_dendrs    (INPUT) number of dendrites owned by the engine
+ * @param gids          (INPUT) global id of each dendrite, or NULL for
+ *                              0 .. num_dendrs-1
+ * @param num_comps     (INPUT) compartments per dendrite, dummy and soma
+ *                              compartments included
+ * @param comps         (INPUT) compartments of every dendrite of the neuron,
+ *                              by global id, likewise, or NULL for
+ *                              `num_comps' each
+ * @param rng           (INPUT) generator of the tip currents, must outlive
+ *                              the engine
+ * @param num_threads   (INPUT) threads stepping the dendrites, the caller of
+ *                              engineStep included
+ *
+ * Returns:
+ * @return Engine*      the new engine, or NULL if out of memory
+ */
+Engine *engineCreate( HHKernel kernel, int num_dendrs, const int *gids,
+                      int num_comps, const int *comps, const HHRng *rng,
+                      int num_threads );
+
+/**
+ * Name: engineStep
+ *
+ * Description:
+ * Advances every dendrite of the engine by one integration step.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param step          (INPUT) global integration step, counted from 0
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ *
+ * Returns:
+ * @return double       total current injected into the soma by the dendrites
+ */
+double engineStep( Engine *eng, long step, double delta_t, double v_m );
+
+/**
+ * Name: engineStepSpan
+ *
+ * Description:
+ * Advances every dendrite of the engine by a step of any whole number of
+ * steps of 1/STEPS ms, for callers that change the step size as they go.
+ * The tip current of each dendrite is the mean of the draws of the steps
+ * covered (see injectedCurrentSpan).
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param first         (INPUT) first step of 1/STEPS ms covered, counted
+ *                      from 0
+ * @param span          (INPUT) steps of 1/STEPS ms covered
+ * @param v_m           (INPUT) soma membrane potential
+ *
+ * Returns:
+ * @return double       total current injected into the soma by the dendrites
+ */
+double engineStepSpan( Engine *eng, long first, int span, double v_m );
+
+/**
+ * Name: engineStepBegin
+ *
+ * Description:
+ * First half of engineStep. Draws the tip currents and steps every
+ * compartment but the ones next to the soma, which are the only ones that
+ * depend on the soma potential. Lets the caller wait for the new soma
+ * potential while the bulk of the step is being done. Must be followed by
+ * engineStepFinish before the next step.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param step          (INPUT) global integration step, counted from 0
+ * @param delta_t       (INPUT) integration time step size
+ */
+void engineStepBegin( Engine *eng, long step, double delta_t );
+
+/**
+ * Name: engineStepFinish
+ *
+ * Description:
+ * Second half of engineStep. Steps the compartments next to the soma. The
+ * two halves give exactly the same results as engineStep.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param v_m           (INPUT) soma membrane potential
+ *
+ * Returns:
+ * @return double       total current injected into the soma by the dendrites
+ */
+double engineStepFinish( Engine *eng, double v_m );
+
+/**
+ * Name: engineValidate
+ *
+ * Description:
+ * Makes the engine step a shadow copy of its dendrites with the reference
+ * kernel (dendriteStep) alongside the selected one. After every step the
+ * potentials and currents of both are compared and the largest difference is
+ * kept in `max_error'. Must be called before the first step.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ *
+ * Returns:
+ * @return int          0 if out of memory, nonzero otherwise
+ */
+int engineValidate( Engine *eng );
+
+/**
+ * Name: engineSetIntegrator
+ *
+ * Description:
+ * Selects how the dendrites are integrated. Engines start with explicit RK4
+ * at the reference step of 1/STEPS ms. The implicit integrators are stable
+ * for larger steps; with a step of `draws' times 1/STEPS ms the tip current
+ * of each step is the mean of the reference draws it covers (see
+ * injectedCurrentMean). Must be called before the first step.
+ * INTEGRATOR_PS engines are stepped by psStep instead of engineStep.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param integrator    (INPUT) integration method
+ * @param draws         (INPUT) steps of 1/STEPS ms per integration step
+ *
+ * Returns:
+ * @return int          0 if out of memory, nonzero otherwise
+ */
+int engineSetIntegrator( Engine *eng, HHIntegrator integrator, int draws );
+
+/**
+ * Name: engineEnableRollback
+ *
+ * Description:
+ * Sets the engine up to go back to an earlier state with engineSave and
+ * engineRestore, and saves the current one. Must be called after
+ * engineValidate, if that is used at all.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ *
+ * Returns:
+ * @return int          0 if out of memory, nonzero otherwise
+ */
+int engineEnableRollback( Engine *eng );
+
+/**
+ * Name: engineSave
+ *
+ * Description:
+ * Remembers the potential of every compartment, shadow copy included.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ */
+void engineSave( Engine *eng );
+
+/**
+ * Name: engineRestore
+ *
+ * Description:
+ * Puts the engine back in the state of the last engineSave.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ */
+void engineRestore( Engine *eng );
+
+/**
+ * Name: engineVolt
+ *
+ * Description:
+ * Returns a pointer to the potential of compartment `c' of local dendrite `d'
+ * regardless of the layout used by the engine.
+ *
+ * Parameters:
+ * @param eng           (INPUT) the engine
+ * @param d             (INPUT) local index of the dendrite
+ * @param c             (INPUT) compartment index
+ *
+ * Returns:
+ * @return double*      where that potential is stored
+ */
+double *engineVolt( Engine *eng, int d, int c );
+
+/**
+ * Name: engineBalance
+ *
+ * Description:
+ * Load imbalance of the threads of the engine (see partitionImbalance):
+ * predicted from the compartments of each share, and measured from the
+ * time each thread spent stepping its share so far.
+ *
+ * Parameters:
+ * @param eng           (INPUT) the engine
+ * @param predicted     (OUTPUT) imbalance of the compartment counts
+ * @param measured      (OUTPUT) imbalance of the stepping times
+ */
+void engineBalance( const Engine *eng, double *predicted, double *measured );
+
+/**
+ * Name: engineFree
+ *
+ * Description:
+ * Releases an engine obtained from engineCreate. NULL is ignored.
+ *
+ * Parameters:
+ * @param eng           (INPUT) engine to release
+ */
+void engineFree( Engine *eng );
+
+#endif
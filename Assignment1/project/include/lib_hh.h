@@ -9,6 +9,239 @@
 #ifndef LIB_HH_H
 #define LIB_HH_H
 
+#include <stddef.h>
+
+// Number of dendrites advanced together by dendriteStepBatch. This matches the
+// number of doubles in one vector register of the target instruction set.
+#if defined(__AVX512F__)
+  #define HH_VLEN 8
+#elif defined(__AVX__)
+  #define HH_VLEN 4
+#else
+  #define HH_VLEN 2
+#endif
+
+// A vector of HH_VLEN doubles. Arithmetic on it is element-wise, and a scalar
+// operand is broadcast to every element.
+typedef double hhvec __attribute__((vector_size(HH_VLEN * sizeof(double))));
+
+/**
+ * Dendrite stepping kernels that can be selected at run time.
+ */
+typedef enum HHKernel {
+  KERNEL_SCALAR,  // dendriteStep, one dendrite at a time.
+  KERNEL_SIMD,    // dendriteStepBatch, HH_VLEN dendrites at a time.
+  KERNEL_FUSED    // dendriteStepFused, one dendrite at a time in one pass.
+} HHKernel;
+
+/**
+ * Random number generators used for the current injected at dendrite tips.
+ */
+typedef enum HHRngMode {
+  RNG_COUNTER,  // Stateless counter-based generator (SplitMix64).
+  RNG_COMPAT    // Reproduces the historical srand(seed); rand() stream.
+} HHRngMode;
+
+/**
+ * Integration methods for the dendrites.
+ */
+typedef enum HHIntegrator {
+  INTEGRATOR_RK4,   // Explicit RK4, compartment by compartment (reference).
+  INTEGRATOR_BE,    // Implicit backward Euler over the whole dendrite.
+  INTEGRATOR_CN,    // Implicit Crank-Nicolson over the whole dendrite.
+  INTEGRATOR_PS     // Parker-Sochacki series of the whole neuron.
+} HHIntegrator;
+
+// Highest order of the Parker-Sochacki series.
+#define PS_MAX_ORDER 64
+// Terms of (exp(u)-1)/u used by somaSeries near u = 0.
+#define PS_NEAR_TERMS 20
+
+/**
+ * Series of the soma state and of the intermediate terms of soma(), as used
+ * by somaSeries.
+ */
+enum {
+  PS_V, PS_N, PS_M, PS_H,                   // State.
+  PS_N2, PS_N4, PS_M2, PS_M3, PS_M3H,       // Powers of the gates.
+  PS_EAN, PS_DAN, PS_AN, PS_BN, PS_SN,      // Rates of n and their sum.
+  PS_EAM, PS_DAM, PS_AM, PS_EBM, PS_DBM, PS_BM, PS_SM, // Same for m.
+  PS_AH, PS_EBH, PS_DBH, PS_BH, PS_SH,      // Same for h.
+  // Horner stages of the rates of the form x/(exp(x)-1) near x = 0.
+  PS_HAN, PS_HAM = PS_HAN + PS_NEAR_TERMS, PS_HBM = PS_HAM + PS_NEAR_TERMS,
+  PS_NUM_SERIES = PS_HBM + PS_NEAR_TERMS
+};
+
+// Layout of the parameters of somaLanes: HH_VLEN values, one per lane, of
+// the dendritic current and of each soma conductance, then the step size.
+#define LANE_I_DENDR  0
+#define LANE_G_NA     HH_VLEN
+#define LANE_G_K      (2*HH_VLEN)
+#define LANE_G_L      (3*HH_VLEN)
+#define LANE_DT       (4*HH_VLEN)
+#define LANE_PARAMS   (4*HH_VLEN + 1)
+
+/**
+ * Parameters of the model that can be changed at run time. The defaults are
+ * the values of constants.h and of the original model.
+ */
+typedef struct HHParams {
+  int comp_time;        // Samples of the soma potential, one per ms.
+  int steps;            // Steps per ms of the finest integration grid, on
+                        // which the tip currents are drawn.
+  double inj_mean;      // Mean current injected at a dendrite tip, pA.
+  double g_comp;        // Lateral compartment conductance, nS.
+  double g_distr;       // Rise of the lateral conductance towards the soma, nS.
+  double g_na;          // Na soma conductance, nS.
+  double g_k;           // K soma conductance, nS.
+  double g_l;           // Leak soma conductance, nS.
+  double g_ld;          // Leak dendrite compartment conductance, nS.
+} HHParams;
+
+/**
+ * Name: hhParamsDefault
+ *
+ * Description:
+ * Fills in the default model parameters.
+ *
+ * Parameters:
+ * @param params        (OUTPUT) the parameters
+ */
+void hhParamsDefault( HHParams *params );
+
+/**
+ * Name: hhSetParams
+ *
+ * Description:
+ * Sets the model parameters used by every function of this library. Must be
+ * called before anything is set up, and never during a simulation.
+ *
+ * Parameters:
+ * @param params        (INPUT) the parameters
+ */
+void hhSetParams( const HHParams *params );
+
+/**
+ * Name: hhParams
+ *
+ * Description:
+ * Returns the model parameters in use.
+ *
+ * Returns:
+ * @return const HHParams*  the parameters
+ */
+const HHParams *hhParams( void );
+
+/**
+ * Generator of the tip currents. Draws are a pure function of the generator,
+ * the global dendrite id and the global integration step, so they do not
+ * depend on how dendrites are split between threads or ranks, and a
+ * generator can be shared by any number of threads.
+ */
+typedef struct HHRng {
+  HHRngMode mode;           // Which generator is used.
+  unsigned long long key;   // Seed of the counter-based generator.
+  int steps;                // Integration steps per ms (compat seeds wrap).
+  int compat_len;           // Number of entries in `compat'.
+  int *compat;              // First rand() after srand(seed), per seed.
+} HHRng;
+
+/**
+ * Scratch storage used while stepping dendrites and the soma. A workspace is
+ * created once, before the simulation loop, and handed to every step so that
+ * the integration itself never touches the heap. A workspace must not be
+ * shared by two threads stepping at the same time.
+ */
+typedef struct HHWorkspace {
+  int num_comps;  // Largest dendrite (in compartments) this was sized for.
+  double *vddt;   // First RK4 derivative of each dendritic compartment.
+  double *rk;     // RK4 and RK45 stage storage for up to NUMVAR variables.
+} HHWorkspace;
+
+/**
+ * Name: workspaceCreate
+ *
+ * Description:
+ * Allocates a workspace able to step dendrites of up to `num_comps'
+ * compartments (dummy and soma compartments included) as well as the soma.
+ *
+ * Parameters:
+ * @param num_comps     (INPUT) number of compartments in the longest dendrite
+ *
+ * Returns:
+ * @return HHWorkspace* the new workspace, or NULL if out of memory
+ */
+HHWorkspace *workspaceCreate( int num_comps );
+
+/**
+ * Name: workspaceFree
+ *
+ * Description:
+ * Releases a workspace obtained from workspaceCreate. NULL is ignored.
+ *
+ * Parameters:
+ * @param ws            (INPUT) workspace to release
+ */
+void workspaceFree( HHWorkspace *ws );
+
+/**
+ * Name: hhMalloc
+ *
+ * Description:
+ * malloc() wrapper used for all simulation storage. Every call is counted so
+ * that the drivers can verify that nothing is allocated once the simulation
+ * loop has started.
+ *
+ * Parameters:
+ * @param size          (INPUT) number of bytes to allocate
+ *
+ * Returns:
+ * @return void*        the allocated memory, or NULL if out of memory
+ */
+void *hhMalloc( size_t size );
+
+/**
+ * Name: hhMallocAligned
+ *
+ * Description:
+ * Counted allocation, like hhMalloc, of memory aligned to `align' bytes. The
+ * memory is released with free().
+ *
+ * Parameters:
+ * @param align         (INPUT) alignment, a power of two multiple of
+ *                              sizeof(void*)
+ * @param size          (INPUT) number of bytes to allocate
+ *
+ * Returns:
+ * @return void*        the allocated memory, or NULL if out of memory
+ */
+void *hhMallocAligned( size_t align, size_t size );
+
+/**
+ * Name: hhAllocCount
+ *
+ * Description:
+ * Returns how many allocations were made through hhMalloc so far.
+ *
+ * Returns:
+ * @return long         number of hhMalloc calls since program start
+ */
+long hhAllocCount( void );
+
+/**
+ * Name: hhHeapAllocCount
+ *
+ * Description:
+ * Returns how many heap allocations were made so far by any code in the
+ * process, the C library and MPI included, when it runs with alloc_shim.so
+ * preloaded (see alloc_shim.c). Without it they are not counted.
+ *
+ * Returns:
+ * @return long         number of allocations since program start, or -1 if
+ *                      alloc_shim.so is not loaded
+ */
+long hhHeapAllocCount( void );
+
 /**
  * Name: dendriteStep
  *
@@ -20,16 +253,460 @@
  *
  * Parameters:
  * @param v_d           (INOUT) membrane potential
- * @param seed          (INPUT) seed for random number generator
+ * @param cur           (INPUT) current injected at the tip of the dendrite
  * @param num_comps     (INPUT) number of compartments in dendrite
  * @param delta_t       (INPUT) integration time step size
  * @param v_m           (INPUT) ??? 'Vm of compartment of this dendrite is
  *                              actually soma Vm' ???
+ * @param ws            (INOUT) scratch space sized for at least `num_comps'
+ * Returns:
+ * @return double       current injected by this dendrite into soma
+ */
+double dendriteStep( double *v_d, double cur, int num_comps, double delta_t,
+                     double v_m, HHWorkspace *ws );
+
+/**
+ * Name: dendriteStepBatch
+ *
+ * Description:
+ * Vectorized version of dendriteStep that advances HH_VLEN dendrites at once.
+ * The dendrites are stored compartment-major (structure of arrays): the
+ * potential of compartment `c' of lane `l' is found at `v[c*stride + l]'.
+ * `v' and `stride' must keep every compartment row aligned to a full vector.
+ *
+ * Each lane goes through exactly the same arithmetic as dendriteStep, so the
+ * resulting potentials and currents are identical to the scalar kernel.
+ *
+ * Parameters:
+ * @param v             (INOUT) membrane potentials of the batch
+ * @param stride        (INPUT) distance between two compartment rows
+ * @param cur           (INPUT) current injected at the tip of each lane
+ * @param num_comps     (INPUT) number of compartments in each dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ * @param vddt          (INOUT) scratch space of num_comps*HH_VLEN doubles,
+ *                              aligned like `v'
+ * @param current       (OUTPUT) current injected into soma by each lane
+ */
+void dendriteStepBatch( double *v, int stride, const double *cur,
+                        int num_comps, double delta_t, double v_m,
+                        double *vddt, double *current );
+
+/**
+ * Name: dendriteStepLanes
+ *
+ * Description:
+ * Steps the same dendrite of HH_VLEN neurons at once, one neuron per lane.
+ * Unlike dendriteStepBatch every lane has its own conductances and soma
+ * potential. The potential of compartment `c' of lane `l' is found at
+ * `v[c*HH_VLEN + l]', and so are the entries of the tables. Each lane goes
+ * through exactly the same arithmetic as dendriteStep.
+ *
+ * Parameters:
+ * @param v             (INOUT) membrane potentials, aligned to a vector
+ * @param cur           (INPUT) current injected at the tip of each lane
+ * @param num_comps     (INPUT) number of compartments in the dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential of each lane
+ * @param g_before      (INPUT) num_comps-2 rows of conductances towards the
+ *                              tip (conductanceTableOf of each lane)
+ * @param g_after       (INPUT) likewise, towards the soma
+ * @param g_ld          (INPUT) leak conductance of each lane
+ * @param vddt          (INOUT) scratch space of num_comps*HH_VLEN doubles
+ * @param current       (OUTPUT) current injected into soma by each lane
+ *
+ * All the arrays must be aligned to a vector.
+ */
+void dendriteStepLanes( double *v, const double *cur, int num_comps,
+                        double delta_t, const double *v_m,
+                        const double *g_before, const double *g_after,
+                        const double *g_ld, double *vddt, double *current );
+
+/**
+ * Name: dendriteBatchBegin
+ *
+ * Description:
+ * First half of dendriteStepBatch. Steps every compartment of the batch but
+ * the one next to the soma, which is the only one that depends on v_m, so it
+ * can run while the new soma potential is still on its way. The old
+ * potential of the neighbour of that compartment is kept in `v_old' for
+ * dendriteBatchFinish.
+ *
+ * Parameters:
+ * @param v             (INOUT) membrane potentials of the batch
+ * @param stride        (INPUT) distance between two compartment rows
+ * @param cur           (INPUT) current injected at the tip of each lane
+ * @param num_comps     (INPUT) number of compartments in each dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param vddt          (INOUT) scratch space of num_comps*HH_VLEN doubles,
+ *                              aligned like `v'
+ * @param v_old         (OUTPUT) HH_VLEN doubles aligned like `v'
+ */
+void dendriteBatchBegin( double *v, int stride, const double *cur,
+                         int num_comps, double delta_t, double *vddt,
+                         double *v_old );
+
+/**
+ * Name: dendriteBatchFinish
+ *
+ * Description:
+ * Second half of dendriteStepBatch. Steps the compartment next to the soma
+ * once v_m is known. Together with dendriteBatchBegin it gives exactly the
+ * same results as dendriteStepBatch.
+ *
+ * Parameters:
+ * @param v             (INOUT) membrane potentials of the batch
+ * @param stride        (INPUT) distance between two compartment rows
+ * @param cur           (INPUT) current injected at the tip of each lane
+ * @param num_comps     (INPUT) number of compartments in each dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ * @param v_old         (INPUT) what dendriteBatchBegin left there
+ * @param current       (OUTPUT) current injected into soma by each lane
+ */
+void dendriteBatchFinish( double *v, int stride, const double *cur,
+                          int num_comps, double delta_t, double v_m,
+                          const double *v_old, double *current );
+
+/**
+ * Name: dendriteStepFused
+ *
+ * Description:
+ * Single pass version of dendriteStep. The first RK4 stage of a compartment is
+ * computed right before the compartment is integrated, keeping the old
+ * potential of the previous compartment in a rolling variable, so the
+ * compartments are only walked once. The dendrite derivative is inlined and
+ * the lateral conductances come from tables built by conductanceTable.
+ *
+ * Results are identical to dendriteStep given the same tip current.
+ *
+ * Parameters:
+ * @param v_d           (INOUT) membrane potential
+ * @param cur           (INPUT) current injected at the tip of the dendrite
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ * @param g_before      (INPUT) conductance towards the tip of each compartment
+ * @param g_after       (INPUT) conductance towards the soma of each compartment
+ *
+ * Returns:
+ * @return double       current injected by this dendrite into soma
+ */
+double dendriteStepFused( double *v_d, double cur, int num_comps,
+                          double delta_t, double v_m, const double *g_before,
+                          const double *g_after );
+
+/**
+ * Name: dendriteStepBegin
+ *
+ * Description:
+ * First half of dendriteStepFused. Steps every compartment but the one next
+ * to the soma, which is the only one that depends on v_m, so it can run while
+ * the new soma potential is still on its way.
+ *
+ * Parameters:
+ * @param v_d           (INOUT) membrane potential
+ * @param cur           (INPUT) current injected at the tip of the dendrite
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param g_before      (INPUT) conductance towards the tip of each compartment
+ * @param g_after       (INPUT) conductance towards the soma of each compartment
+ * @param v_old         (OUTPUT) old potential of the neighbour of the
+ *                              compartment next to the soma
+ */
+void dendriteStepBegin( double *v_d, double cur, int num_comps,
+                        double delta_t, const double *g_before,
+                        const double *g_after, double *v_old );
+
+/**
+ * Name: dendriteStepFinish
+ *
+ * Description:
+ * Second half of dendriteStepFused. Steps the compartment next to the soma
+ * once v_m is known. Together with dendriteStepBegin it gives exactly the
+ * same results as dendriteStepFused, and therefore dendriteStep.
+ *
+ * Parameters:
+ * @param v_d           (INOUT) membrane potential
+ * @param cur           (INPUT) current injected at the tip of the dendrite
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ * @param g_before      (INPUT) conductance towards the tip of each compartment
+ * @param g_after       (INPUT) conductance towards the soma of each compartment
+ * @param v_old         (INPUT) what dendriteStepBegin left there
+ *
+ * Returns:
+ * @return double       current injected by this dendrite into soma
+ */
+double dendriteStepFinish( double *v_d, double cur, int num_comps,
+                           double delta_t, double v_m, const double *g_before,
+                           const double *g_after, double v_old );
+
+/**
+ * Name: conductanceTable
+ *
+ * Description:
+ * Fills the lateral conductance tables used by dendriteStepFused. Entry `i'
+ * describes the compartment at `v_d[i+1]': `g_before[i]' links it to the
+ * compartment on the tip side and `g_after[i]' to the one on the soma side.
+ *
+ * Parameters:
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param g_before      (OUTPUT) num_comps-2 conductances, nS
+ * @param g_after       (OUTPUT) num_comps-2 conductances, nS
+ */
+void conductanceTable( int num_comps, double *g_before, double *g_after );
+
+/**
+ * Name: conductanceTableOf
+ *
+ * Description:
+ * conductanceTable for the given parameters instead of those set with
+ * hhSetParams.
+ *
+ * Parameters:
+ * @param p             (INPUT) model parameters
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param g_before      (OUTPUT) num_comps-2 conductances, nS
+ * @param g_after       (OUTPUT) num_comps-2 conductances, nS
+ */
+void conductanceTableOf( const HHParams *p, int num_comps, double *g_before,
+                         double *g_after );
+
+/**
+ * Name: implicitTable
+ *
+ * Description:
+ * Precomputes the parts of the tridiagonal system solved by
+ * dendriteStepImplicit that only depend on the dendrite and the step size:
+ * the eliminated super-diagonal and the inverse pivots of the Thomas
+ * algorithm. Entries 1 .. num_comps-2 of each half are used.
+ *
+ * Parameters:
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param method        (INPUT) INTEGRATOR_BE or INTEGRATOR_CN
+ * @param g_before      (INPUT) conductance towards the tip of each compartment
+ * @param g_after       (INPUT) conductance towards the soma of each compartment
+ * @param table         (OUTPUT) 2*num_comps doubles
+ */
+void implicitTable( int num_comps, double delta_t, HHIntegrator method,
+                    const double *g_before, const double *g_after,
+                    double *table );
+
+/**
+ * Name: dendriteStepImplicit
+ *
+ * Description:
+ * Advances a dendrite by one step of backward Euler or Crank-Nicolson. The
+ * cable equation of the whole dendrite is solved at once with an O(n)
+ * Thomas sweep from the tip to the soma and back, so the step is stable for
+ * any step size, unlike the explicit RK4 of dendriteStep. The soma potential
+ * is held at `v_m' over the step.
+ *
+ * Compartment `c' of the dendrite is found at `v[c*stride]', so the kernel
+ * works on both the dendrite-major and the compartment-major layout.
+ *
+ * Parameters:
+ * @param v             (INOUT) membrane potential
+ * @param stride        (INPUT) distance between two compartments
+ * @param cur           (INPUT) current injected at the tip of the dendrite
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ * @param method        (INPUT) INTEGRATOR_BE or INTEGRATOR_CN
+ * @param g_before      (INPUT) conductance towards the tip of each compartment
+ * @param g_after       (INPUT) conductance towards the soma of each compartment
+ * @param table         (INPUT) built by implicitTable for the same arguments
+ * @param work          (INOUT) scratch space of num_comps doubles
+ *
  * Returns:
  * @return double       current injected by this dendrite into soma
  */
-double dendriteStep( double *v_d, int seed, int num_comps, double delta_t,
-                     double v_m );
+double dendriteStepImplicit( double *v, int stride, double cur,
+                             int num_comps, double delta_t, double v_m,
+                             HHIntegrator method, const double *g_before,
+                             const double *g_after, const double *table,
+                             double *work );
+
+/**
+ * Name: dendriteSeries
+ *
+ * Description:
+ * One order of the Parker-Sochacki series of a dendrite. The series are
+ * taken in the time within the step divided by the step size, so the new
+ * potential is the plain sum of the coefficients. The coefficients of order
+ * `k+1' of the cable equation follow from the ones of order `k' of the
+ * compartment and its neighbours; the tip current and the leak reversal
+ * potential only enter order 0.
+ *
+ * Parameters:
+ * @param coef          (INPUT) order `k' of every compartment; the dummy
+ *                      compartment is ignored
+ * @param next          (OUTPUT) order `k+1' of every compartment
+ * @param num_comps     (INPUT) number of compartments in dendrite
+ * @param k             (INPUT) order
+ * @param delta_t       (INPUT) integration time step size
+ * @param cur           (INPUT) current injected at the tip of the dendrite
+ * @param v_k           (INPUT) order `k' of the soma potential
+ * @param g_before      (INPUT) conductance towards the tip of each compartment
+ * @param g_after       (INPUT) conductance towards the soma of each compartment
+ *
+ * Returns:
+ * @return double       order `k' of the current injected into the soma
+ */
+double dendriteSeries( const double *coef, double *next, int num_comps,
+                       int k, double delta_t, double cur, double v_k,
+                       const double *g_before, const double *g_after );
+
+/**
+ * Name: somaSeries
+ *
+ * Description:
+ * One order of the Parker-Sochacki series of the soma. Given orders 0 to
+ * `k' of the state and orders 0 to `k-1' of the intermediate terms, fills in
+ * order `k' of the intermediate terms and order `k+1' of the state. The rate
+ * functions of soma() are expanded with the recurrences of exp, products and
+ * quotients of series. The series are taken in the time within the step
+ * divided by the step size (see dendriteSeries).
+ *
+ * Parameters:
+ * @param series        (INOUT) PS_NUM_SERIES series of PS_MAX_ORDER+1
+ *                      coefficients
+ * @param k             (INPUT) order, below PS_MAX_ORDER
+ * @param delta_t       (INPUT) integration time step size
+ * @param i_inj         (INPUT) current injected into the soma
+ * @param i_dendr       (INPUT) order `k' of the dendritic current
+ */
+void somaSeries( double series[][PS_MAX_ORDER+1], int k, double delta_t,
+                 double i_inj, double i_dendr );
+
+/**
+ * Name: hhRngInit
+ *
+ * Description:
+ * Sets up a generator. In RNG_COMPAT mode the historical seeds
+ * (step within the ms + dendrite + 1) are drawn once from the C library here,
+ * so later draws are table lookups that do not touch the global rand() state.
+ *
+ * Parameters:
+ * @param rng           (OUTPUT) generator to set up
+ * @param mode          (INPUT) generator to use
+ * @param key           (INPUT) seed of the counter-based generator
+ * @param num_dendrs    (INPUT) number of dendrites in the whole neuron
+ * @param steps         (INPUT) integration steps per ms
+ *
+ * Returns:
+ * @return int          0 if out of memory, nonzero otherwise
+ */
+int hhRngInit( HHRng *rng, HHRngMode mode, unsigned long long key,
+               int num_dendrs, int steps );
+
+/**
+ * Name: hhRngUniform
+ *
+ * Description:
+ * Returns the uniform draw in [0, 1] of a dendrite at a given step.
+ *
+ * Parameters:
+ * @param rng           (INPUT) the generator
+ * @param dendrite      (INPUT) global id of the dendrite
+ * @param step          (INPUT) global integration step, counted from 0
+ *
+ * Returns:
+ * @return double       the draw
+ */
+double hhRngUniform( const HHRng *rng, int dendrite, long step );
+
+/**
+ * Name: hhRngFree
+ *
+ * Description:
+ * Releases the storage of a generator set up by hhRngInit.
+ *
+ * Parameters:
+ * @param rng           (INOUT) the generator
+ */
+void hhRngFree( HHRng *rng );
+
+/**
+ * Name: injectedCurrent
+ *
+ * Description:
+ * Returns the current injected at the tip of a dendrite at a given step,
+ * uniformly distributed within 10% of the mean set by hhSetParams.
+ *
+ * Parameters:
+ * @param rng           (INPUT) generator of the tip currents
+ * @param dendrite      (INPUT) global id of the dendrite
+ * @param step          (INPUT) global integration step, counted from 0
+ *
+ * Returns:
+ * @return double       injected current, pA
+ */
+double injectedCurrent( const HHRng *rng, int dendrite, long step );
+
+/**
+ * Name: injectedCurrentMean
+ *
+ * Description:
+ * Returns the mean of the tip currents of `draws' consecutive steps of
+ * 1/STEPS ms, starting at step `step*draws'. Integrators that take steps of
+ * `draws' times 1/STEPS see the same input as the reference one, averaged
+ * over each step. With one draw this is injectedCurrent.
+ *
+ * Parameters:
+ * @param rng           (INPUT) generator of the tip currents
+ * @param dendrite      (INPUT) global id of the dendrite
+ * @param step          (INPUT) global integration step, counted from 0
+ * @param draws         (INPUT) steps of 1/STEPS ms per integration step
+ *
+ * Returns:
+ * @return double       injected current, pA
+ */
+double injectedCurrentMean( const HHRng *rng, int dendrite, long step,
+                            int draws );
+
+/**
+ * Name: injectedCurrentSpan
+ *
+ * Description:
+ * Returns the mean of the tip currents of `count' consecutive steps of
+ * 1/STEPS ms, starting at step `first'. Used by integrators whose steps
+ * change in size.
+ *
+ * Parameters:
+ * @param rng           (INPUT) generator of the tip currents
+ * @param dendrite      (INPUT) global id of the dendrite
+ * @param first         (INPUT) first step of 1/STEPS ms, counted from 0
+ * @param count         (INPUT) number of steps of 1/STEPS ms
+ *
+ * Returns:
+ * @return double       injected current, pA
+ */
+double injectedCurrentSpan( const HHRng *rng, int dendrite, long first,
+                            int count );
+
+/**
+ * Name: injectedCurrentSpanOf
+ *
+ * Description:
+ * injectedCurrentSpan for a neuron whose mean tip current is not the one set
+ * with hhSetParams.
+ *
+ * Parameters:
+ * @param rng           (INPUT) generator of the tip currents
+ * @param inj_mean      (INPUT) mean current injected at a dendrite tip, pA
+ * @param dendrite      (INPUT) global id of the dendrite
+ * @param first         (INPUT) first step of 1/STEPS ms, counted from 0
+ * @param count         (INPUT) number of steps of 1/STEPS ms
+ *
+ * Returns:
+ * @return double       injected current, pA
+ */
+double injectedCurrentSpanOf( const HHRng *rng, double inj_mean, int dendrite,
+                              long first, int count );
 
 /**
  * Name: rk4Step
@@ -53,9 +730,110 @@ double dendriteStep( double *v_d, int seed, int num_comps, double delta_t,
  * @param fp        (INPUT) ??? model parameters ???
  * @param dt        (INPUT) ??? integration step ???
  * @param derivs    (INPUT) ??? model computation method ???
+ * @param work      (INOUT) scratch space of at least 4*nv doubles
  */
 void rk4Step( double *y, double *y0, double *dydt0, int nv, double *fp,
-              double dt, void (*derivs)(double *,double *,double *) );
+              double dt, void (*derivs)(double *,double *,double *),
+              double *work );
+
+/**
+ * Name: rk45Step
+ *
+ * Description:
+ * One step of the 5th order Dormand-Prince Runge-Kutta method, with its
+ * embedded 4th order solution as an estimate of the local error. Called
+ * like rk4Step; `y' gets the 5th order solution.
+ *
+ * Parameters:
+ * @param y         (OUTPUT) state at the end of the step
+ * @param y0        (INPUT) state at the start of the step, not `y' itself
+ * @param dydt0     (INPUT) derivatives at the start of the step
+ * @param nv        (INPUT) size of y, y0, and dydt0
+ * @param fp        (INPUT) model parameters passed to `derivs'
+ * @param dt        (INPUT) integration step
+ * @param derivs    (INPUT) model computation method
+ * @param work      (INOUT) scratch space of at least 7*nv doubles
+ *
+ * Returns:
+ * @return double   largest difference between the two solutions, each
+ *                  divided by 1 plus the size of the variable
+ */
+double rk45Step( double *y, double *y0, double *dydt0, int nv, double *fp,
+                 double dt, void (*derivs)(double *,double *,double *),
+                 double *work );
+
+/**
+ * Step size controller of the adaptive soma stepper. Steps are whole numbers
+ * of steps of 1/STEPS ms, so that they line up with the tip current draws and
+ * the 1 ms output grid.
+ */
+typedef struct HHStepControl {
+  double tolerance;     // Largest accepted error estimate of rk45Step.
+  int span;             // Size of the next step, in steps of 1/STEPS ms.
+  int max_span;         // Largest step the dendrite integrator allows.
+  int last;             // Size of the last step taken.
+  long steps;           // Steps taken.
+  long rejected;        // Steps retried with a smaller size.
+  int smallest;         // Smallest and largest step taken.
+  int largest;
+} HHStepControl;
+
+/**
+ * Name: stepControlInit
+ *
+ * Description:
+ * Sets up a step size controller. The first step is one step of 1/STEPS ms.
+ *
+ * Parameters:
+ * @param ctl       (OUTPUT) the controller
+ * @param tolerance (INPUT) largest accepted error estimate (see rk45Step)
+ * @param max_span  (INPUT) largest step, in steps of 1/STEPS ms
+ */
+void stepControlInit( HHStepControl *ctl, double tolerance, int max_span );
+
+/**
+ * Name: somaStepAdaptive
+ *
+ * Description:
+ * Advances the soma by one step of rk45Step with the size proposed by the
+ * controller, retrying with smaller steps while the error estimate is above
+ * the tolerance. The dendritic current is held over the step. The next size
+ * is proposed from the error of the step taken, growing at most 5 times.
+ *
+ * Parameters:
+ * @param ctl         (INOUT) the controller
+ * @param y           (INOUT) soma state
+ * @param soma_params (INOUT) soma parameters; the step size is set to the one
+ *                    taken
+ * @param limit       (INPUT) largest step allowed here, in steps of 1/STEPS
+ *                    ms, e.g. up to the next output time
+ * @param ws          (INOUT) scratch space
+ *
+ * Returns:
+ * @return int        size of the step taken, in steps of 1/STEPS ms
+ */
+int somaStepAdaptive( HHStepControl *ctl, double *y, double *soma_params,
+                      int limit, HHWorkspace *ws );
+
+/**
+ * Name: stepControlCurrent
+ *
+ * Description:
+ * Accounts for the dendritic current held by somaStepAdaptive. Once the
+ * dendrites have followed the last step, the change of their current bounds
+ * the error of holding it; the next step is shrunk until that error would be
+ * within the tolerance. This is what keeps the steps short around a spike,
+ * where the dendrites pull hardest on the soma. It is a heuristic: the error
+ * of the dendrite integrator itself is not estimated.
+ *
+ * Parameters:
+ * @param ctl         (INOUT) the controller
+ * @param v_m         (INPUT) soma membrane potential, mV
+ * @param i_held      (INPUT) dendritic current held over the last step, pA
+ * @param i_new       (INPUT) dendritic current at the end of it, pA
+ */
+void stepControlCurrent( HHStepControl *ctl, double v_m, double i_held,
+                         double i_new );
 
 /**
  * Name: soma
@@ -70,6 +848,23 @@ void rk4Step( double *y, double *y0, double *dydt0, int nv, double *fp,
  */
 void soma( double *dydx, double *y, double *param );
 
+/**
+ * Name: somaLanes
+ *
+ * Description:
+ * soma() for HH_VLEN neurons at once, one per lane, to be stepped with
+ * rk4Step over NUMVAR*HH_VLEN variables. Variable `i' of lane `l' is found at
+ * `y[i*HH_VLEN + l]'. Each lane gives exactly what soma() gives with its
+ * conductances.
+ *
+ * Parameters:
+ * @param dydx    (OUTPUT) derivatives, laid out like `y'
+ * @param y       (INPUT)  soma states, aligned to a vector
+ * @param param   (INPUT)  LANE_PARAMS values (see LANE_DT), aligned to a
+ *                         vector
+ */
+void somaLanes( double *dydx, double *y, double *param );
+
 /**
  * Name: dendrite
  *
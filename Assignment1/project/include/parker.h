@@ -0,0 +1,88 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany parker.c
+*/
+
+#ifndef PARKER_H
+#define PARKER_H
+
+#include "engine.h"
+
+/**
+ * Counters kept by psStep.
+ */
+typedef struct PSStats {
+  long steps;           // Steps taken.
+  long terms;           // Sum over all steps of the order used.
+  int max_order;        // Highest order used by any step.
+  long capped;          // Steps that reached PS_MAX_ORDER.
+} PSStats;
+
+/**
+ * State of the Parker-Sochacki integrator. The soma and every dendrite of an
+ * engine are expanded together, so no part of the neuron sees another one
+ * frozen over a step.
+ */
+typedef struct PSSolver {
+  double tolerance;     // Largest accepted last term, mV or gate units.
+  double *coef;         // Current order of every compartment, dendrite-major.
+  double *next;         // Next order of every compartment.
+  double *sum;          // Partial sums, the new potentials.
+  double series[PS_NUM_SERIES][PS_MAX_ORDER+1]; // Soma series.
+  PSStats stats;
+} PSSolver;
+
+/**
+ * Name: psCreate
+ *
+ * Description:
+ * Sets up a Parker-Sochacki integrator for the dendrites of an engine and
+ * the soma they are attached to.
+ *
+ * Parameters:
+ * @param eng           (INPUT) the dendrites
+ * @param tolerance     (INPUT) largest accepted last term of a series
+ *
+ * Returns:
+ * @return PSSolver*    the integrator, or NULL if out of memory
+ */
+PSSolver *psCreate( Engine *eng, double tolerance );
+
+/**
+ * Name: psStep
+ *
+ * Description:
+ * Advances the soma and the dendrites of the engine by one step, expanding
+ * the solution in a power series of the time within the step. The
+ * coefficients follow from the ones of the previous order (Parker and
+ * Sochacki); the exponential rate functions of soma() are expanded with the
+ * usual recurrences for exp, products and quotients. Terms are added until
+ * the last one is below the tolerance for every variable. The tip currents
+ * are held for the step (see injectedCurrentMean).
+ *
+ * Parameters:
+ * @param ps            (INOUT) the integrator
+ * @param eng           (INOUT) the dendrites; the engine's own kernels and
+ *                      threads are not used
+ * @param step          (INPUT) global index of the step, keys the tip
+ *                      currents
+ * @param delta_t       (INPUT) step size, ms
+ * @param y             (INOUT) soma state, as used by soma()
+ * @param i_inj         (INPUT) current injected into the soma, pA
+ */
+void psStep( PSSolver *ps, Engine *eng, long step, double delta_t, double *y,
+             double i_inj );
+
+/**
+ * Name: psFree
+ *
+ * Description:
+ * Releases an integrator obtained from psCreate. NULL is ignored.
+ *
+ * Parameters:
+ * @param ps            (INPUT) integrator to release
+ */
+void psFree( PSSolver *ps );
+
+#endif
@@ -0,0 +1,173 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany partition.c
+*/
+
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include "cmd_args.h"
+
+// Estimated costs, in compartment updates of the scalar kernel (about 80 ns
+// each). One soma RK4 step costs about as much as 3 compartments and one
+// message between nodes about as much as 20.
+#define SOMA_COST 3.0
+#define MSG_COST  20.0
+
+/**
+ * A contiguous run of compartments of one dendrite, as cut by
+ * partitionChain.
+ */
+typedef struct PartitionPiece {
+  int item;             // Dendrite the compartments belong to.
+  int first;            // First of them, counted from 0 at the tip.
+  int count;            // Number of compartments.
+  int rank;             // Rank they are given to.
+} PartitionPiece;
+
+/**
+ * Name: partitionSomaCost
+ *
+ * Description:
+ * Estimates the work rank 0 does every dendrite step on top of what a worker
+ * does: the soma RK4 steps and the extra messages of the synchronisation
+ * mode. The result is scaled by the number of threads per rank, as the
+ * dendrite threads of rank 0 sit idle while the soma is stepped.
+ *
+ * Parameters:
+ * @param mode          (INPUT) synchronisation mode in use
+ * @param num_tasks     (INPUT) number of MPI processes
+ * @param num_threads   (INPUT) threads stepping the dendrites of each rank
+ * @param substeps      (INPUT) soma steps per dendrite step
+ *
+ * Returns:
+ * @return double       estimated cost, in compartment updates
+ */
+double partitionSomaCost( HHSyncMode mode, int num_tasks, int num_threads,
+                          int substeps );
+
+/**
+ * Name: partitionGreedy
+ *
+ * Description:
+ * Hands out items, in order, each to the rank with the least load so far.
+ * Ties go to the lowest rank, so equally loaded ranks get the items
+ * cyclically.
+ *
+ * Parameters:
+ * @param num_items     (INPUT) number of items
+ * @param cost          (INPUT) cost of each item
+ * @param num_ranks     (INPUT) number of ranks
+ * @param load          (INPUT/OUTPUT) initial load of each rank, updated with
+ *                      the cost of the items it receives
+ * @param owner         (OUTPUT) rank owning each item
+ */
+void partitionGreedy( int num_items, const double *cost, int num_ranks,
+                      double *load, int *owner );
+
+/**
+ * Name: partitionLPT
+ *
+ * Description:
+ * Longest processing time first: like partitionGreedy, but the items are
+ * handed out from the most to the least costly, so that the last ones to go
+ * out are small enough to even the loads. Items of the same cost keep their
+ * order, so with equal costs the result is that of partitionGreedy.
+ *
+ * Parameters:
+ * @param num_items     (INPUT) number of items
+ * @param cost          (INPUT) cost of each item
+ * @param num_ranks     (INPUT) number of ranks
+ * @param load          (INPUT/OUTPUT) initial load of each rank, updated with
+ *                      the cost of the items it receives
+ * @param owner         (OUTPUT) rank owning each item
+ *
+ * Returns:
+ * @return int          0 if out of memory, nonzero otherwise
+ */
+int partitionLPT( int num_items, const double *cost, int num_ranks,
+                  double *load, int *owner );
+
+/**
+ * Name: partitionChain
+ *
+ * Description:
+ * Lays the items end to end, tip first, and cuts the chain into one
+ * contiguous run per rank, rank 0 first, so that the loads come out even.
+ * Items are cut wherever a run ends; every cut costs both ranks on either
+ * side of it a message each way per step.
+ *
+ * Parameters:
+ * @param num_items     (INPUT) number of items
+ * @param size          (INPUT) compartments of each item
+ * @param num_ranks     (INPUT) number of ranks
+ * @param load          (INPUT/OUTPUT) initial load of each rank, updated with
+ *                      the compartments it receives and the cuts it sits on
+ * @param pieces        (OUTPUT) the pieces in chain order, room for
+ *                      num_items+num_ranks-1 entries
+ *
+ * Returns:
+ * @return int          number of pieces
+ */
+int partitionChain( int num_items, const int *size, int num_ranks,
+                    double *load, PartitionPiece *pieces );
+
+/**
+ * Name: partitionMigrate
+ *
+ * Description:
+ * Evens out the step times of ranks that run at different speeds by moving
+ * as few items as it takes: while it shortens the longest step, the item
+ * of the slowest rank that does so most goes to the rank that would finish
+ * it first. Every rank computes the same moves from the same input.
+ *
+ * Parameters:
+ * @param num_items     (INPUT) number of items
+ * @param cost          (INPUT) cost of each item
+ * @param num_ranks     (INPUT) number of ranks
+ * @param speed         (INPUT) cost each rank gets through per second
+ * @param time          (INPUT/OUTPUT) step time of each rank, seconds,
+ *                      updated with the moves
+ * @param owner         (INPUT/OUTPUT) rank owning each item
+ *
+ * Returns:
+ * @return int          number of items moved
+ */
+int partitionMigrate( int num_items, const double *cost, int num_ranks,
+                      const double *speed, double *time, int *owner );
+
+/**
+ * Name: partitionImbalance
+ *
+ * Description:
+ * Load imbalance of a partition: the largest load over the mean load. 1 is
+ * a perfect balance; the run takes that much longer than a perfect one.
+ *
+ * Parameters:
+ * @param num_ranks     (INPUT) number of ranks
+ * @param load          (INPUT) load of each rank
+ *
+ * Returns:
+ * @return double       the imbalance, 1 if there is no load at all
+ */
+double partitionImbalance( int num_ranks, const double *load );
+
+/**
+ * Name: partitionOwned
+ *
+ * Description:
+ * Lists the items owned by a rank, in increasing order.
+ *
+ * Parameters:
+ * @param num_items     (INPUT) number of items
+ * @param owner         (INPUT) rank owning each item
+ * @param rank          (INPUT) rank whose items are listed
+ * @param items         (OUTPUT) the items, room for num_items entries
+ *
+ * Returns:
+ * @return int          number of items owned by the rank
+ */
+int partitionOwned( int num_items, const int *owner, int rank, int *items );
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef PLOT_H
 #define PLOT_H
 
+#include "trace.h"
+
 /**
  * Container for information included in plot.
  */
@@ -11,14 +13,16 @@ typedef struct PlotInfo {
   int num_dendrs;   // The number of dendrites simulated.
   double exec_time; // How long the program took to execute.
   int slaves;       // How many slave processes were involved.
+  TraceFormat format; // Format of the data file.
+  double interval;  // Time between samples of the data file (in ms).
 } PlotInfo;
 
 /**
  * Name: plotData
  *
  * Description:
- * Plots data contained in given file. The file is expected to be formatted to
- * be processed by gnuplot.
+ * Plots data contained in given file, a trace written by traceOpen in the
+ * format given in `pinfo'.
  *
  * If `image_name' is NULL, gnuplot will plot to a window, otherwise, gnuplot
  * will plot to the filename specified by `image_name'.
@@ -0,0 +1,100 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany profile.c
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "sync.h"
+
+#include <stddef.h>
+
+/**
+ * Where the time of one rank of mpi_hh went. The estimated load, the
+ * compute and halo times and the allocations are set by mpi_hh, the times
+ * added up around the calls that step the dendrites and the soma; the rest
+ * is taken from the synchronisation engine by profileGather.
+ */
+typedef struct RankProfile {
+  double load;          // Estimated cost of its dendrite step, see partition.h.
+  double compute;       // Seconds stepping the dendrites of this rank.
+  double soma;          // Seconds stepping the soma, rank 0 only.
+  double send;          // Seconds sending, see Sync.
+  double recv;          // Seconds blocked waiting for data.
+  double halo;          // Seconds waiting for the potentials at the cuts
+                        // of --decompose compartments.
+  long steps;           // Exchanges with the other ranks.
+  long allocs;          // Heap allocations of the simulation loop, MPI's
+                        // included, or -1 (see hhHeapAllocCount).
+  long hist[SYNC_HIST_BINS]; // Time between the ends of consecutive steps.
+} RankProfile;
+
+/**
+ * Name: profileGather
+ *
+ * Description:
+ * Completes the profile of this rank from its synchronisation engine and
+ * gathers the profiles of all ranks at rank 0. Collective.
+ *
+ * Parameters:
+ * @param prof          (INOUT) profile of this rank, load, compute and
+ *                      halo times set
+ * @param sync          (INPUT) synchronisation engine of this rank
+ * @param all           (OUTPUT) on rank 0 room for one profile per rank,
+ *                      elsewhere unused
+ */
+void profileGather( RankProfile *prof, const Sync *sync, RankProfile *all );
+
+/**
+ * Name: profileStepTime
+ *
+ * Description:
+ * Time between the ends of consecutive steps below which a fraction of the
+ * steps of a profile fall, to within a bin of the histogram.
+ *
+ * Parameters:
+ * @param prof          (INPUT) the profile
+ * @param fraction      (INPUT) e.g. 0.5 for the median, 0.99 for p99
+ *
+ * Returns:
+ * @return double       upper edge of the bin, us; 0 if no steps were timed
+ */
+double profileStepTime( const RankProfile *prof, double fraction );
+
+/**
+ * Name: profileLine
+ *
+ * Description:
+ * One-line summary of the profile of a rank, for the comments of the data
+ * file. The allocations are left out if they weren't counted.
+ *
+ * Parameters:
+ * @param prof          (INPUT) the profile
+ * @param rank          (INPUT) its rank
+ * @param buf           (OUTPUT) the summary
+ * @param len           (INPUT) size of `buf'
+ */
+void profileLine( const RankProfile *prof, int rank, char *buf, size_t len );
+
+/**
+ * Name: profileWrite
+ *
+ * Description:
+ * Writes the profiles of all ranks to a JSON file.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the file
+ * @param all           (INPUT) one profile per rank
+ * @param num_tasks     (INPUT) number of ranks
+ * @param sync_name     (INPUT) synchronisation mode of the run
+ * @param exec_time     (INPUT) wall time of the soma loop, seconds
+ *
+ * Returns:
+ * @return int          nonzero if the file was written
+ */
+int profileWrite( const char *fname, const RankProfile *all, int num_tasks,
+                  const char *sync_name, double exec_time );
+
+#endif
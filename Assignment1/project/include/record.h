@@ -0,0 +1,205 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany record.c and record_mpi.c
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+// First bytes of a compartment recording.
+#define RECORD_MAGIC "HHVOLT01"
+#define RECORD_MAGIC_LEN 8
+
+// Frames per chunk of a recording. A reader fetches this many consecutive
+// values of one compartment at a time; a writer keeps one chunk of its
+// dendrites in memory.
+#define RECORD_CHUNK 32
+
+/**
+ * Header of a compartment recording, 64 bytes at the start of the file.
+ *
+ * Frames are snapshots of the potential of every compartment, the first one
+ * at time 0. They are stored in chunks of `chunk_frames' frames; within a
+ * chunk the values are ordered by dendrite, then compartment, then frame, so
+ * the values of one compartment over a chunk are contiguous. Compartments
+ * are numbered from the tip of the dendrite, the dummy one and the soma are
+ * not recorded. The last chunk is padded with zeros. Numbers are in the byte
+ * order of the machine.
+ */
+typedef struct RecordHeader {
+  char magic[RECORD_MAGIC_LEN]; // RECORD_MAGIC.
+  int32_t num_dendrs;   // Dendrites recorded.
+  int32_t num_comps;    // Compartments per dendrite.
+  int32_t chunk_frames; // Frames per chunk.
+  int32_t reserved;
+  double dt;            // Time between frames, ms.
+  int64_t num_frames;   // Frames in the file.
+  char pad[24];
+} RecordHeader;
+
+/**
+ * Writer of a compartment recording. Each process fills a chunk with the
+ * dendrites of its engine and hands it to the file once it is full, through
+ * a memory map (recorderOpen) or MPI-IO (recorderOpenShared).
+ */
+typedef struct Recorder {
+  RecordHeader hdr;
+  int num_rows;         // Dendrites of the engine.
+  int by_gid;           // Nonzero if chunk rows are global dendrite ids.
+  long frames;          // Frames taken so far.
+  double *chunk;        // Current chunk, see RecordHeader.
+  int ok;               // Zero once a write failed.
+
+  int (*flush)( struct Recorder *rec ); // Writes out a full chunk.
+  int (*finish)( struct Recorder *rec );// Closes the file.
+
+  // Memory map (recorderOpen).
+  int fd;
+  double *map;
+  size_t map_len;
+  // MPI-IO (recorderOpenShared).
+  void *file;           // MPI_File.
+  void *view;           // MPI_Datatype of the rows of this process.
+} Recorder;
+
+/**
+ * Name: recordChunkLen
+ *
+ * Description:
+ * Size of one chunk of a recording.
+ *
+ * Parameters:
+ * @param hdr       (INPUT) header of the recording
+ *
+ * Returns:
+ * @return size_t   bytes in one chunk
+ */
+size_t recordChunkLen( const RecordHeader *hdr );
+
+/**
+ * Name: recordOffset
+ *
+ * Description:
+ * Locates the values of one compartment in a chunk of a recording.
+ *
+ * Parameters:
+ * @param hdr       (INPUT) header of the recording
+ * @param chunk     (INPUT) index of the chunk
+ * @param d         (INPUT) global id of the dendrite
+ * @param c         (INPUT) compartment, from 0 at the tip
+ *
+ * Returns:
+ * @return long     offset in the file of the first of `chunk_frames' values
+ */
+long recordOffset( const RecordHeader *hdr, long chunk, int d, int c );
+
+/**
+ * Name: recordHeaderInit
+ *
+ * Description:
+ * Fills in the header of a new recording.
+ *
+ * Parameters:
+ * @param hdr           (OUTPUT) the header
+ * @param num_dendrs    (INPUT) dendrites recorded
+ * @param num_comps     (INPUT) compartments per dendrite, dummy and soma ones
+ *                      included
+ * @param dt            (INPUT) time between frames, ms
+ * @param num_frames    (INPUT) frames in the recording
+ */
+void recordHeaderInit( RecordHeader *hdr, int num_dendrs, int num_comps,
+                       double dt, long num_frames );
+
+/**
+ * Name: recordReadHeader
+ *
+ * Description:
+ * Reads and checks the header of a recording.
+ *
+ * Parameters:
+ * @param file      (INPUT) the recording, positioned at its start
+ * @param hdr       (OUTPUT) the header
+ *
+ * Returns:
+ * @return int      nonzero if the file is a recording
+ */
+int recordReadHeader( FILE *file, RecordHeader *hdr );
+
+/**
+ * Name: recorderOpen
+ *
+ * Description:
+ * Creates a recording of every dendrite of an engine, written through a
+ * memory map of the whole file. Frames go straight to the mapped pages.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the file
+ * @param eng           (INPUT) the dendrites, all of them
+ * @param dt            (INPUT) time between frames, ms
+ * @param num_frames    (INPUT) frames that will be taken
+ *
+ * Returns:
+ * @return Recorder*    the writer, or NULL if the file can't be created
+ */
+Recorder *recorderOpen( const char *fname, Engine *eng, double dt,
+                        long num_frames );
+
+/**
+ * Name: recorderOpenShared
+ *
+ * Description:
+ * Creates a recording written by every rank of MPI_COMM_WORLD, each with the
+ * dendrites of its own engine. Every rank keeps a chunk of its dendrites and
+ * writes it with one collective MPI-IO call, through a file view that only
+ * covers them; nothing goes through rank 0. Collective: every rank must
+ * call it, and then take the same number of frames. Only in mpi_hh.
+ *
+ * Parameters:
+ * @param fname         (INPUT) name of the file
+ * @param eng           (INPUT) the dendrites of this rank, global ids in
+ *                      increasing order
+ * @param num_dendrs    (INPUT) dendrites over all ranks
+ * @param dt            (INPUT) time between frames, ms
+ * @param num_frames    (INPUT) frames that will be taken
+ *
+ * Returns:
+ * @return Recorder*    the writer, or NULL if the file can't be created
+ */
+Recorder *recorderOpenShared( const char *fname, Engine *eng, int num_dendrs,
+                              double dt, long num_frames );
+
+/**
+ * Name: recorderSnapshot
+ *
+ * Description:
+ * Takes the next frame from the dendrites of the engine. Never allocates
+ * memory. With recorderOpenShared, every chunk-th call is collective.
+ *
+ * Parameters:
+ * @param rec       (INOUT) the writer
+ * @param eng       (INPUT) the dendrites given when it was opened
+ */
+void recorderSnapshot( Recorder *rec, Engine *eng );
+
+/**
+ * Name: recorderClose
+ *
+ * Description:
+ * Writes out the last chunk, closes the file and releases the writer.
+ * Collective with recorderOpenShared.
+ *
+ * Parameters:
+ * @param rec       (INPUT) the writer
+ *
+ * Returns:
+ * @return int      nonzero if everything was written
+ */
+int recorderClose( Recorder *rec );
+
+#endif
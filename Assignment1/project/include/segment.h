@@ -0,0 +1,121 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany segment.c
+*/
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include "lib_hh.h"
+#include "partition.h"
+
+#include <mpi.h>
+
+// Message tags of the boundary exchange.
+#define TAG_HALO_SOMA   5   // Last compartment of a run, sent towards the soma.
+#define TAG_HALO_TIP    6   // First compartment of a run, sent towards the tip.
+
+/**
+ * A run of compartments of one dendrite stepped by this rank. The potentials
+ * are stored like a whole dendrite of `count' compartments: `v[0]' is the
+ * compartment on the tip side of the run (the dummy one at the tip) and
+ * `v[count+1]' the one on the soma side (the soma). Where the dendrite was
+ * cut these ghost compartments hold what the neighbouring rank had at the
+ * end of the last step.
+ */
+typedef struct Segment {
+  int gid;              // Global id of the dendrite.
+  int first;            // First compartment of the run, 1 being the tip.
+  int count;            // Compartments in the run.
+  int tip_rank;         // Rank stepping the compartments on the tip side, or
+                        // -1 if the run starts at the tip.
+  int soma_rank;        // Rank stepping those on the soma side, or -1 if the
+                        // run ends next to the soma.
+  double *v;            // Potentials, ghost compartments included.
+  double *g_before;     // Conductance tables of the run (conductanceTable).
+  double *g_after;
+} Segment;
+
+/**
+ * The runs of compartments stepped by one rank of mpi_hh with
+ * --decompose compartments.
+ */
+typedef struct SegmentSet {
+  int num_segs;         // Number of runs.
+  Segment *segs;        // The runs, in chain order.
+  const HHRng *rng;     // Generator of the tip currents, not owned.
+  int draws;            // Steps of the grid per integration step.
+  MPI_Request *reqs;    // Boundary exchange of the last step, in flight.
+  int num_reqs;
+} SegmentSet;
+
+/**
+ * Name: segmentsCreate
+ *
+ * Description:
+ * Sets up the runs of compartments of one rank, all at rest.
+ *
+ * Parameters:
+ * @param rank          (INPUT) rank of this process
+ * @param num_pieces    (INPUT) number of pieces of all ranks
+ * @param pieces        (INPUT) the pieces, as cut by partitionChain from the
+ *                      compartments of each dendrite, dummy and soma ones
+ *                      left out
+ * @param comps         (INPUT) compartments of each dendrite, dummy and soma
+ *                      ones included
+ * @param rng           (INPUT) generator of the tip currents
+ * @param draws         (INPUT) steps of the grid per integration step
+ *
+ * Returns:
+ * @return SegmentSet*  the runs, or NULL if out of memory
+ */
+SegmentSet *segmentsCreate( int rank, int num_pieces,
+                            const PartitionPiece *pieces, const int *comps,
+                            const HHRng *rng, int draws );
+
+/**
+ * Name: segmentsWait
+ *
+ * Description:
+ * Waits for the boundary potentials of the last step to arrive, and for the
+ * ones of this rank to go out.
+ *
+ * Parameters:
+ * @param set           (INOUT) the runs
+ */
+void segmentsWait( SegmentSet *set );
+
+/**
+ * Name: segmentsStep
+ *
+ * Description:
+ * Advances every run by one step with dendriteStepFused, holding the ghost
+ * compartments, and starts sending the new boundary potentials to the
+ * neighbouring ranks. segmentsWait must have been called since the last
+ * step.
+ *
+ * Parameters:
+ * @param set           (INOUT) the runs
+ * @param step          (INPUT) global integration step, counted from 0
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ *
+ * Returns:
+ * @return double       current injected into the soma by the runs that end
+ *                      next to it
+ */
+double segmentsStep( SegmentSet *set, long step, double delta_t, double v_m );
+
+/**
+ * Name: segmentsFree
+ *
+ * Description:
+ * Completes the exchange in flight and releases the runs. NULL is ignored.
+ *
+ * Parameters:
+ * @param set           (INPUT) the runs
+ */
+void segmentsFree( SegmentSet *set );
+
+#endif
@@ -0,0 +1,163 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany sync.c
+*/
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "cmd_args.h"
+
+#include <mpi.h>
+
+// Message tags used by the synchronisation engine.
+#define TAG_SYNC_VM     1   // Soma potential sent to the workers.
+#define TAG_SYNC_DT     2   // Integration step ('star' sends it every step).
+#define TAG_SYNC_CUR    3   // Dendritic current sent back to the soma.
+
+// Bins of the step time histogram. Bin 0 counts steps under 1 us, bin b
+// those from 2^(b-1) up to 2^b us, and the last one everything longer.
+#define SYNC_HIST_BINS  24
+
+/**
+ * Per-step exchange between the soma (rank 0) and the dendrite workers. Every
+ * step the soma hands its potential to all ranks and gets back the sum of
+ * the currents of all dendrites.
+ */
+typedef struct Sync {
+  HHSyncMode mode;        // How the exchange is done.
+  int overlap;            // Nonzero if the workers use syncStateBegin.
+  int rank;               // Rank of this process in MPI_COMM_WORLD.
+  int num_tasks;          // Number of processes.
+  double delta_t;         // Integration step, constant for the whole run.
+  double wait;            // Seconds spent in syncState and syncCurrent.
+  double send;            // Part of `wait' spent sending; the rest is spent
+                          // waiting for data. In 'coll' mode rank 0 sends
+                          // in the broadcasts and the others in the sums.
+  long steps;             // Number of syncCurrent and syncWindowCurrent
+                          // calls.
+  double last;            // MPI_Wtime at the end of the last step, or 0.
+  long hist[SYNC_HIST_BINS]; // Time between the ends of consecutive steps.
+  MPI_Request reqs[2];    // Receives posted by syncStateBegin.
+  int num_reqs;
+} Sync;
+
+/**
+ * Name: syncInit
+ *
+ * Description:
+ * Sets up the synchronisation engine. Must be called by every rank. The
+ * integration step given by rank 0 is distributed once, here; all modes but
+ * 'star' never send it again.
+ *
+ * Parameters:
+ * @param sync      (OUTPUT) the engine
+ * @param mode      (INPUT) exchange used every step
+ * @param overlap   (INPUT) nonzero if the workers receive the potential with
+ *                  syncStateBegin and syncStateWait; the same on every rank
+ * @param delta_t   (INPUT) integration step (only used on rank 0)
+ */
+void syncInit( Sync *sync, HHSyncMode mode, int overlap, double delta_t );
+
+/**
+ * Name: syncState
+ *
+ * Description:
+ * Hands the soma potential of this step from rank 0 to every other rank.
+ * In 'coll' mode this is an MPI_Bcast, in 'tree' a binomial tree of
+ * point-to-point messages and in 'star' two sends from rank 0 to every
+ * worker, one for the potential and one for the integration step. Same as
+ * syncStateBegin followed by syncStateWait, which use an MPI_Ibcast in
+ * 'coll' mode; so does this when the engine was set up for overlap, as a
+ * blocking broadcast never matches a nonblocking one.
+ *
+ * Parameters:
+ * @param sync      (INPUT/OUTPUT) the engine
+ * @param v_m       (INPUT/OUTPUT) soma potential, set on rank 0 and
+ *                  received by the others
+ * @param delta_t   (OUTPUT) integration step of this step
+ */
+void syncState( Sync *sync, double *v_m, double *delta_t );
+
+/**
+ * Name: syncStateBegin
+ *
+ * Description:
+ * Starts syncState. Rank 0 sends the potential out, the other ranks post
+ * the receives for it, so they can do work that does not need it before
+ * calling syncStateWait. `v_m' must not be touched in between.
+ *
+ * Parameters:
+ * @param sync      (INPUT/OUTPUT) the engine
+ * @param v_m       (INPUT/OUTPUT) soma potential, set on rank 0
+ */
+void syncStateBegin( Sync *sync, double *v_m );
+
+/**
+ * Name: syncStateWait
+ *
+ * Description:
+ * Completes syncStateBegin.
+ *
+ * Parameters:
+ * @param sync      (INPUT/OUTPUT) the engine
+ * @param v_m       (INPUT/OUTPUT) soma potential, received on ranks but 0
+ * @param delta_t   (OUTPUT) integration step of this step
+ */
+void syncStateWait( Sync *sync, double *v_m, double *delta_t );
+
+/**
+ * Name: syncCurrent
+ *
+ * Description:
+ * Sums the dendritic current of all ranks at rank 0. In 'coll' mode this is
+ * an MPI_Reduce, in 'tree' a binomial tree of point-to-point messages and in
+ * 'star' one receive per worker in rank order. Each mode always adds the
+ * currents in the same order, but the order differs between modes, so their
+ * traces may differ in the last bits when more than one worker is used.
+ *
+ * Parameters:
+ * @param sync      (INPUT/OUTPUT) the engine
+ * @param current   (INPUT) current of the dendrites stepped by this rank
+ *
+ * Returns:
+ * @return double   on rank 0 the total current, elsewhere undefined
+ */
+double syncCurrent( Sync *sync, double current );
+
+/**
+ * Name: syncWindow
+ *
+ * Description:
+ * Hands a block of `count' values from rank 0 to every other rank in one
+ * message per link, with the same pattern as syncState. Used to send the
+ * soma potential of a whole window of steps.
+ *
+ * Parameters:
+ * @param sync      (INPUT/OUTPUT) the engine
+ * @param msg       (INPUT/OUTPUT) the values, set on rank 0 and received by
+ *                  the others
+ * @param count     (INPUT) number of values
+ */
+void syncWindow( Sync *sync, double *msg, int count );
+
+/**
+ * Name: syncWindowCurrent
+ *
+ * Description:
+ * Element-wise sum of a block of `count' values over all ranks at rank 0,
+ * with the same pattern as syncCurrent. Used to collect the dendritic
+ * current of a whole window of steps.
+ *
+ * Parameters:
+ * @param sync      (INPUT/OUTPUT) the engine
+ * @param current   (INPUT/OUTPUT) the values of this rank, on rank 0 the
+ *                  total; elsewhere undefined afterwards
+ * @param work      (INPUT) scratch space for `count' values
+ * @param count     (INPUT) number of values
+ */
+void syncWindowCurrent( Sync *sync, double *current, double *work,
+                        int count );
+
+#endif
@@ -0,0 +1,157 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany thread_pool.c
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Size of a cache line. Data written by different threads every step is kept
+// at least this far apart to avoid false sharing.
+#define CACHE_LINE 64
+
+// Number of times a thread polls the barrier before going to sleep on it.
+// A step of dendrite work is in the order of 100 us; spinning for a few
+// microseconds catches most arrivals without a system call. Pools with more
+// threads than available CPUs do not spin at all.
+#define BARRIER_SPIN 2000
+
+/**
+ * Sense-reversing barrier. Threads spin on the shared sense for a while and
+ * then block on a condition variable, so waiting threads do not burn a core
+ * when the machine is oversubscribed.
+ */
+typedef struct Barrier {
+  int num_threads;        // Threads taking part in the barrier.
+  int spin;               // Polls before blocking.
+  atomic_int count;       // Threads yet to arrive in the current phase.
+  atomic_int sense;       // Flipped by the last thread to arrive.
+  atomic_int sleepers;    // Threads blocked on `cond'.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} Barrier;
+
+/**
+ * Per-thread bookkeeping of a pool, one cache line each.
+ */
+typedef struct PoolThread {
+  _Alignas(CACHE_LINE) struct Pool *pool;
+  pthread_t handle;       // Unused for thread 0, the caller of poolRun.
+  int id;                 // Index of the thread in the pool.
+  int sense;              // Local sense for the barrier.
+  double wait;            // Seconds spent waiting in the barrier.
+  long waits;             // Number of barrier waits.
+} PoolThread;
+
+/**
+ * A team of persistent threads. The thread calling poolRun takes part in the
+ * work as thread 0, the others sleep or spin in the barrier between calls.
+ */
+typedef struct Pool {
+  int num_threads;                  // Threads in the team, caller included.
+  Barrier barrier;
+  PoolThread *threads;              // One entry per thread.
+  void (*work)( void *arg, int id );// Work of the current poolRun call.
+  void *arg;
+  int quit;                         // Set when the pool is being freed.
+} Pool;
+
+/**
+ * Name: barrierInit
+ *
+ * Description:
+ * Sets up a barrier for `num_threads' threads.
+ *
+ * Parameters:
+ * @param b             (OUTPUT) the barrier
+ * @param num_threads   (INPUT) number of threads taking part
+ * @param spin          (INPUT) polls before a waiting thread blocks
+ */
+void barrierInit( Barrier *b, int num_threads, int spin );
+
+/**
+ * Name: barrierWait
+ *
+ * Description:
+ * Waits until all threads reached the barrier. Memory written by any thread
+ * before the barrier is visible to all threads after it.
+ *
+ * Parameters:
+ * @param b             (INOUT) the barrier
+ * @param local_sense   (INOUT) sense of the calling thread, initially 0
+ */
+void barrierWait( Barrier *b, int *local_sense );
+
+/**
+ * Name: barrierDestroy
+ *
+ * Description:
+ * Releases the resources held by a barrier.
+ *
+ * Parameters:
+ * @param b             (INOUT) the barrier
+ */
+void barrierDestroy( Barrier *b );
+
+/**
+ * Name: poolCreate
+ *
+ * Description:
+ * Starts a team of `num_threads' threads, the caller included. With one
+ * thread no thread is started and poolRun simply calls the work function.
+ *
+ * Parameters:
+ * @param num_threads   (INPUT) number of threads in the team
+ *
+ * Returns:
+ * @return Pool*        the new pool, or NULL if it could not be started
+ */
+Pool *poolCreate( int num_threads );
+
+/**
+ * Name: poolRun
+ *
+ * Description:
+ * Calls `work(arg, id)' on every thread of the pool, with `id' running from 0
+ * (the caller) to num_threads-1, and returns once all of them are done.
+ *
+ * Parameters:
+ * @param pool          (INOUT) the pool
+ * @param work          (INPUT) function run by every thread
+ * @param arg           (INPUT) argument given to `work'
+ */
+void poolRun( Pool *pool, void (*work)( void *arg, int id ), void *arg );
+
+/**
+ * Name: poolBarrierTime
+ *
+ * Description:
+ * Returns the time thread `id' spent waiting in the barrier so far, and how
+ * many times it waited.
+ *
+ * Parameters:
+ * @param pool          (INPUT) the pool
+ * @param id            (INPUT) index of the thread
+ * @param waits         (OUTPUT) number of barrier waits, may be NULL
+ *
+ * Returns:
+ * @return double       seconds spent in the barrier
+ */
+double poolBarrierTime( const Pool *pool, int id, long *waits );
+
+/**
+ * Name: poolFree
+ *
+ * Description:
+ * Stops the threads of a pool and releases it. NULL is ignored.
+ *
+ * Parameters:
+ * @param pool          (INOUT) the pool
+ */
+void poolFree( Pool *pool );
+
+#endif
@@ -0,0 +1,187 @@
+/*
+  Multiple Processor Systems.
+
+  Header file to accompany trace.c
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+// First bytes of a binary trace. They are followed by the interval between
+// samples, in ms, as a double, and then by one double per sample, the first
+// one at time 0. Doubles are in the byte order of the machine.
+#define TRACE_MAGIC "HHTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+// Samples buffered by a TraceWriter before they are handed to stdio.
+#define TRACE_BUF_LEN 4096
+
+/**
+ * Formats of the soma potential traces.
+ */
+typedef enum TraceFormat {
+  TRACE_TEXT,   // '#' comment lines, then one "time potential" line each.
+  TRACE_BINARY  // TRACE_MAGIC header, then raw doubles.
+} TraceFormat;
+
+/**
+ * Streaming writer of a soma potential trace, sampled at a fixed interval.
+ * Samples are written as the simulation goes, so traces of any length can be
+ * recorded without keeping them in memory.
+ */
+typedef struct TraceWriter {
+  FILE *file;
+  TraceFormat format;
+  double interval;      // Time between samples, ms.
+  long samples;         // Samples written so far, buffered ones included.
+  long head;            // Bytes of the comment line a text trace starts
+                        // with, 0 if none.
+  int count;            // Samples in `buf'.
+  double buf[TRACE_BUF_LEN];
+} TraceWriter;
+
+/**
+ * Name: traceOpen
+ *
+ * Description:
+ * Creates a trace file and writes its header: the comment line, if any, for
+ * text traces, TRACE_MAGIC and the interval for binary ones.
+ *
+ * Parameters:
+ * @param fname     (INPUT) name of the file
+ * @param format    (INPUT) format of the file
+ * @param interval  (INPUT) time between samples, ms
+ * @param comment   (INPUT) description of the run for text traces, without
+ *                  the leading '#', or NULL
+ *
+ * Returns:
+ * @return TraceWriter*  the writer, or NULL if the file can't be created
+ */
+TraceWriter *traceOpen( const char *fname, TraceFormat format,
+                        double interval, const char *comment );
+
+/**
+ * Name: traceResume
+ *
+ * Description:
+ * Reopens a trace written up to a checkpoint (see traceSync). Whatever was
+ * written after the checkpoint is cut off, and the next sample goes where
+ * the writer stood then. The comment line of a text trace is replaced by
+ * `comment', so that it describes the continued run; the file is copied
+ * if the new line is not as long as the one it replaces.
+ *
+ * Parameters:
+ * @param fname     (INPUT) name of the file
+ * @param format    (INPUT) format of the file
+ * @param interval  (INPUT) time between samples, ms
+ * @param samples   (INPUT) samples in the file at the checkpoint
+ * @param len       (INPUT) bytes in the file at the checkpoint
+ * @param head      (INPUT) bytes of its comment line at the checkpoint
+ * @param comment   (INPUT) description of the continued run for text traces,
+ *                  without the leading '#', or NULL to keep the old one
+ *
+ * Returns:
+ * @return TraceWriter*  the writer, or NULL if the file can't be opened or
+ *                  rewritten, or is shorter than `len'
+ */
+TraceWriter *traceResume( const char *fname, TraceFormat format,
+                          double interval, long samples, long len, long head,
+                          const char *comment );
+
+/**
+ * Name: traceWrite
+ *
+ * Description:
+ * Appends the next sample. Never allocates memory.
+ *
+ * Parameters:
+ * @param tw        (INOUT) the writer
+ * @param v         (INPUT) soma potential, mV
+ */
+void traceWrite( TraceWriter *tw, double v );
+
+/**
+ * Name: traceSync
+ *
+ * Description:
+ * Writes out the buffered samples and flushes the file, so that it holds
+ * every sample so far.
+ *
+ * Parameters:
+ * @param tw        (INOUT) the writer
+ *
+ * Returns:
+ * @return long     bytes in the file, or -1 if it could not be written
+ */
+long traceSync( TraceWriter *tw );
+
+/**
+ * Name: traceComment
+ *
+ * Description:
+ * Writes out the buffered samples and a comment line, for text traces;
+ * binary traces have no room for comments and are left alone.
+ *
+ * Parameters:
+ * @param tw        (INOUT) the writer
+ * @param comment   (INPUT) the line, without the leading '#'
+ */
+void traceComment( TraceWriter *tw, const char *comment );
+
+/**
+ * Name: traceClose
+ *
+ * Description:
+ * Writes out the buffered samples and a closing comment line, if any, for
+ * text traces, then closes the file and releases the writer.
+ *
+ * Parameters:
+ * @param tw        (INPUT) the writer
+ * @param comment   (INPUT) last line of text traces, without the leading
+ *                  '#', or NULL
+ *
+ * Returns:
+ * @return int      nonzero if everything was written
+ */
+int traceClose( TraceWriter *tw, const char *comment );
+
+/**
+ * Name: traceRead
+ *
+ * Description:
+ * Reads the soma potential at every whole ms from a trace written by seq_hh
+ * or mpi_hh, in either format. In text traces lines starting with '#' are
+ * skipped; every other line holds a time in ms and the potential at that
+ * time. Samples between two ms are skipped.
+ *
+ * Parameters:
+ * @param fname     (INPUT) name of the data file
+ * @param v         (OUTPUT) potential at each ms, indexed by time
+ * @param max       (INPUT) number of entries in `v'
+ *
+ * Returns:
+ * @return int      number of samples read, or -1 if the file cannot be read
+ */
+int traceRead( const char *fname, double *v, int max );
+
+/**
+ * Name: traceDeviation
+ *
+ * Description:
+ * Compares a trace with a reference trace read from a data file.
+ *
+ * Parameters:
+ * @param fname     (INPUT) name of the reference data file
+ * @param v         (INPUT) potential at each ms
+ * @param n         (INPUT) number of samples in `v'
+ *
+ * Returns:
+ * @return double   largest absolute difference, in mV, NaN if `v' holds a
+ *                  NaN, or a negative value if the reference cannot be read
+ *                  or is shorter than `v'
+ */
+double traceDeviation( const char *fname, const double *v, int n );
+
+#endif
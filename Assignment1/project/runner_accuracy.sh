@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Compares the implicit dendrite integrators of seq_hh with the RK4 one. A
+# run with RK4 at the default step is taken as the reference; every method is
+# then run with fewer steps per ms and its trace compared with it. Submit it
+# like runner_seq.sh.
+#
+# The traces are sampled once per ms, so a spike that moves by a fraction of
+# a ms shows up as a deviation of tens of mV. The number of spikes, counted
+# as the drops below -80 mV that follow each of them, is printed as well.
+# RK4 is not stable with fewer steps and reports a deviation of nan.
+
+#SBATCH -J accuracy_d15c10
+#SBATCH -o std/%x-%j.out
+#SBATCH -e std/%x-%j.err
+#SBATCH --partition=kgcoe-mps
+#SBATCH --account=kgcoe-mps
+#SBATCH --get-user-env
+#SBATCH --mem=1G
+#SBATCH --time=0-1:0:0
+#SBATCH --ntasks=1
+
+ARGS=${ARGS:-"-d 15 -c 10"}
+STEPS=${STEPS:-"10000 1000 100"}
+
+# Prints the number of spikes in a data file.
+spikes() {
+  awk '!/^#/ { if ($2 < -80 && prev >= -80) n++; prev = $2 }
+       END { print n + 0 }' $1
+}
+
+out=$(./seq_hh $ARGS --integrator rk4)
+ref=$(echo "$out" | sed -n 's/^Data will be stored in \(.*\)/\1/p')
+ref_time=$(echo "$out" | sed -n 's/^Execution time: \([0-9.]*\).*/\1/p')
+printf "Reference: %s (%s s, %s spikes)\n\n" $ref $ref_time $(spikes $ref)
+
+printf "%-6s %8s %14s %16s %8s\n" method steps "exec time (s)" "deviation (mV)" spikes
+for method in rk4 be cn; do
+  for steps in $STEPS; do
+    # Each run names its data file after the current second.
+    sleep 1
+    out=$(./seq_hh $ARGS --integrator $method --steps $steps --reference $ref)
+    data=$(echo "$out" | sed -n 's/^Data will be stored in \(.*\)/\1/p')
+    exec_time=$(echo "$out" | sed -n 's/^Execution time: \([0-9.]*\).*/\1/p')
+    deviation=$(echo "$out" | sed -n 's/^Largest deviation from the reference trace: \([^ ]*\).*/\1/p')
+    printf "%-6s %8s %14s %16s %8s\n" $method $steps $exec_time $deviation $(spikes $data)
+  done
+done
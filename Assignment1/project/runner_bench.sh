@@ -0,0 +1,23 @@
+#!/bin/bash
+#
+# Runs the microbenchmarks of bench_hh on two ranks, so that the per-step
+# exchange is measured between two processes as well. The kernels only run
+# on the first rank. Submit it like runner_mpi.sh, with --nodes=2 to time
+# the exchange between two nodes.
+
+#SBATCH -J bench
+#SBATCH -o std/%x-%j.out
+#SBATCH -e std/%x-%j.err
+#SBATCH --partition=kgcoe-mps
+#SBATCH --account=kgcoe-mps
+#SBATCH --get-user-env
+#SBATCH --mem=1G
+#SBATCH --time=0-0:30:0
+#SBATCH --ntasks=2
+
+spack env activate cmpe-655
+
+ARGS=${ARGS:-"--warmup 10 --reps 100"}
+NPROCS=${SLURM_NPROCS:-2}
+
+srun -n $NPROCS bench_hh $ARGS
@@ -56,3 +56,8 @@ spack env activate cmpe-655
 # have used. Using $SLURM_NPROCS guarantees a match.
 srun -n $SLURM_NPROCS mpi_hh -d 15 -c 10
 # srun -n 11 mpi_hh -d 30 -c 100
+
+# Hybrid runs use one rank per node and a pool of threads inside each worker,
+# e.g. with '#SBATCH --nodes=3', '#SBATCH --ntasks-per-node=1' and
+# '#SBATCH --cpus-per-task=48' instead of '--ntasks' above:
+# srun -n $SLURM_NNODES mpi_hh -d 1500 -c 10 -k simd -t $SLURM_CPUS_PER_TASK
@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# Measures what multi-rate integration (--substeps) costs in accuracy and
+# saves in exchanges. A run with one soma step per dendrite step is taken as
+# the reference; every M is then compared with it. The dendrites use
+# backward Euler, as RK4 is not stable at the longer dendrite steps. Submit
+# it like runner_mpi.sh.
+#
+# The number of spikes is counted as in runner_accuracy.sh.
+
+#SBATCH -J multirate_d15c10
+#SBATCH -o std/%x-%j.out
+#SBATCH -e std/%x-%j.err
+#SBATCH --partition=kgcoe-mps
+#SBATCH --account=kgcoe-mps
+#SBATCH --get-user-env
+#SBATCH --mem=1G
+#SBATCH --time=0-1:0:0
+#SBATCH --ntasks=13
+
+spack env activate cmpe-655
+
+ARGS=${ARGS:-"-d 15 -c 10 --integrator be"}
+NPROCS=${SLURM_NPROCS:-13}
+MPIRUN=${MPIRUN:-"srun -n $NPROCS"}
+SUBSTEPS=${SUBSTEPS:-"1 2 5 10 20 50 100"}
+
+# Prints the number of spikes in a data file.
+spikes() {
+  awk '!/^#/ { if ($2 < -80 && prev >= -80) n++; prev = $2 }
+       END { print n + 0 }' $1
+}
+
+out=$($MPIRUN mpi_hh $ARGS)
+ref=$(echo "$out" | sed -n 's/^Data will be stored in \(.*\)/\1/p')
+
+printf "%4s %14s %14s %12s %16s %8s\n" M "exec time (s)" "sync time (s)" \
+       exchanges "deviation (mV)" spikes
+for m in $SUBSTEPS; do
+  # Each run names its data file after the current second.
+  sleep 1
+  out=$($MPIRUN mpi_hh $ARGS --substeps $m --reference $ref)
+  data=$(echo "$out" | sed -n 's/^Data will be stored in \(.*\)/\1/p')
+  exec_time=$(echo "$out" | sed -n 's/^Execution time: \([0-9.]*\).*/\1/p')
+  sync_time=$(echo "$out" | sed -n 's/^Time spent synchronising: \([0-9.]*\) seconds.*/\1/p')
+  exchanges=$(echo "$out" | sed -n 's/^Exchanges with the workers: \([0-9]*\).*/\1/p')
+  deviation=$(echo "$out" | sed -n 's/^Largest deviation from the reference trace: \([^ ]*\).*/\1/p')
+  printf "%4s %14s %14s %12s %16s %8s\n" $m $exec_time $sync_time \
+         $exchanges $deviation $(spikes $data)
+done
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Checks that a run stopped at a checkpoint and continued with --restart
+# leaves the same data file as an uninterrupted run, header included. The
+# timings in the comments at the end of the file change from run to run, so
+# only their names are compared. The run is continued twice from the same
+# checkpoint, the second time over a header the first one already rewrote.
+# Submit it like runner_mpi.sh; prints the differences and fails if any.
+
+#SBATCH -J restart_d15c10
+#SBATCH -o std/%x-%j.out
+#SBATCH -e std/%x-%j.err
+#SBATCH --partition=kgcoe-mps
+#SBATCH --account=kgcoe-mps
+#SBATCH --get-user-env
+#SBATCH --mem=1G
+#SBATCH --time=0-0:30:0
+#SBATCH --ntasks=4
+
+spack env activate cmpe-655
+
+ARGS=${ARGS:-"-d 15 -c 10"}
+TIME=${TIME:-1001}
+STOP=${STOP:-101}
+NPROCS=${SLURM_NPROCS:-4}
+RUN=${RUN:-"srun -n $NPROCS"}
+CKPT=${CKPT:-"data/restart.ckpt"}
+
+# Prints a data file with the values of its trailing comments left out.
+untimed() {
+  sed '/^# Vm for HH model/!s/^# \([^:]*\):.*/# \1:/' $1
+}
+
+# Runs a simulation and prints the name of its data file. Each run names its
+# data file after the current second.
+run() {
+  sleep 1
+  "$@" | sed -n 's/^Data will be stored in \(.*\)/\1/p'
+}
+
+status=0
+for prog in ./seq_hh "$RUN ./mpi_hh"; do
+  full=$(run $prog $ARGS --time $TIME)
+  part=$(run $prog $ARGS --time $STOP --checkpoint $CKPT \
+             --checkpoint-every $((STOP - 1)))
+  for again in 1 2; do
+    run $prog $ARGS --time $TIME --restart $CKPT > /dev/null
+    if cmp -s <(untimed $full) <(untimed $part); then
+      printf "%s, restart %d: %s matches %s\n" "$prog" $again $part $full
+    else
+      printf "%s, restart %d: %s differs from %s\n" "$prog" $again $part $full
+      diff <(untimed $full) <(untimed $part) | head -20
+      status=1
+    fi
+  done
+done
+rm -f $CKPT
+exit $status
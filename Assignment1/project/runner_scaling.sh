@@ -0,0 +1,150 @@
+#!/bin/bash
+#
+# Strong and weak scaling sweep of mpi_hh. Every point of the grid
+# PROCS x DENDRS x COMPS is run REPS times; the wall time of each run is
+# read back from the "Execution time" comment of its data file. One process
+# means seq_hh, which is the baseline T1 of every speedup.
+#
+# Strong scaling (MODE=strong) keeps the neuron fixed; weak scaling
+# (MODE=weak) gives every process DENDRS dendrites, so that P processes
+# simulate P*DENDRS of them. With Tp the median time over the repetitions:
+#
+#   speedup     S = T1 / Tp              (weak: P * T1 / Tp, scaled speedup)
+#   efficiency  E = S / P
+#   Karp-Flatt  e = (1/S - 1/P) / (1 - 1/P), the experimentally determined
+#                   serial fraction, for P > 1
+#
+# Every run goes to data/scaling_<stamp>_runs.csv and the summary to
+# data/scaling_<stamp>.csv; their dendrs column is per process when weak.
+# With PLOT=1, speedup and efficiency against the number of processes are
+# also plotted to graphs/. Needs text traces (the default --format).
+#
+# Under SLURM the runs are started with srun; submit it with as many tasks
+# as the largest point of PROCS. Elsewhere mpirun is used, e.g.
+#
+#   $ PROCS="1 2 4" DENDRS="15 150" ARGS="--time 11" bash runner_scaling.sh
+
+#SBATCH -J scaling
+#SBATCH -o std/%x-%j.out
+#SBATCH -e std/%x-%j.err
+#SBATCH --partition=kgcoe-mps
+#SBATCH --account=kgcoe-mps
+#SBATCH --get-user-env
+#SBATCH --mem=1G
+#SBATCH --time=0-4:0:0
+#SBATCH --ntasks=13
+
+if [ -n "$SLURM_JOB_ID" ]; then
+  spack env activate cmpe-655
+  MPIRUN=${MPIRUN:-"srun -n"}
+else
+  MPIRUN=${MPIRUN:-"mpirun -np"}
+fi
+
+MODE=${MODE:-strong}
+PROCS=${PROCS:-"1 2 4 7 13"}
+DENDRS=${DENDRS:-"15 150 1500"}
+COMPS=${COMPS:-"10"}
+REPS=${REPS:-3}
+ARGS=${ARGS:-""}
+PLOT=${PLOT:-1}
+
+stamp=$(date +%m%d%y_%H%M%S)
+runs=data/scaling_${stamp}_runs.csv
+summary=data/scaling_${stamp}.csv
+mkdir -p data graphs
+
+# Runs one point and prints the wall time recorded in its data file.
+run() {
+  local p=$1 d=$2 c=$3 out data
+  # Data files are named after the current second.
+  sleep 1
+  if [ $p -eq 1 ]; then
+    out=$(./seq_hh -d $d -c $c $ARGS)
+  else
+    out=$($MPIRUN $p ./mpi_hh -d $d -c $c $ARGS)
+  fi
+  data=$(echo "$out" | sed -n 's/^Data will be stored in \(.*\)/\1/p')
+  sed -n 's/^# .*Execution time: \([0-9.]*\) s.*/\1/p' $data 2>/dev/null
+}
+
+echo "mode,procs,dendrs,comps,rep,time_s" > $runs
+for c in $COMPS; do
+  for d in $DENDRS; do
+    for p in $PROCS; do
+      n=$d
+      [ $MODE = weak ] && n=$((d * p))
+      for r in $(seq 1 $REPS); do
+        t=$(run $p $n $c)
+        if [ -z "$t" ]; then
+          echo "No execution time for P=$p D=$n C=$c!" >&2
+          continue
+        fi
+        echo "$MODE,$p,$d,$c,$r,$t" >> $runs
+        printf "P=%-3s D=%-6s C=%-6s rep %-3s %10s s\n" $p $n $c $r $t
+      done
+    done
+  done
+done
+
+# Medians per point, then the metrics against the single process point of
+# the same dendrites (per process, when weak) and compartments.
+tail -n +2 $runs | sort -t, -k4,4n -k3,3n -k2,2n -k6,6g | awk -F, '
+  function flush() {
+    if (n == 0) return
+    med = (n % 2) ? t[(n+1)/2] : (t[n/2] + t[n/2+1]) / 2
+    if (p == 1) t1 = med
+    s = (t1 > 0) ? ((mode == "weak") ? p * t1 / med : t1 / med) : ""
+    e = (s != "") ? s / p : ""
+    kf = (s != "" && p > 1) ? (1/s - 1/p) / (1 - 1/p) : ""
+    printf "%s,%d,%d,%d,%d,%.6f,%.6f,%s,%s,%s\n", mode, p, d, c, n, \
+           med, t[1], \
+           (s != "") ? sprintf("%.4f", s) : "", \
+           (e != "") ? sprintf("%.4f", e) : "", \
+           (kf != "") ? sprintf("%.4f", kf) : ""
+    n = 0
+  }
+  BEGIN { print "mode,procs,dendrs,comps,reps,median_s,min_s,speedup," \
+                "efficiency,karp_flatt" }
+  {
+    if ($2 != p || $3 != d || $4 != c) {
+      flush()
+      if ($3 != d || $4 != c) t1 = 0
+    }
+    mode = $1; p = $2; d = $3; c = $4
+    t[++n] = $6
+  }
+  END { flush() }' > $summary
+
+echo
+awk -F, '{ printf "%-7s %6s %7s %6s %5s %10s %10s %8s %10s %10s\n", \
+             $1, $2, $3, $4, $5, $6, $7, $8, $9, $10 }' $summary
+echo
+echo "Runs stored in $runs, summary in $summary"
+
+# One line per neuron, titled like the graphs of plotData.
+if [ "$PLOT" = 1 ]; then
+  for metric in speedup efficiency; do
+    col=$([ $metric = speedup ] && echo 8 || echo 9)
+    plots=""
+    for c in $COMPS; do
+      for d in $DENDRS; do
+        plots="$plots${plots:+, }'$summary' every ::1"
+        plots="$plots using 2:(\$3 == $d && \$4 == $c ? \$$col : NaN)"
+        plots="$plots with linespoints title 'd$d c$c'"
+      done
+    done
+    gnuplot -persist <<GNUPLOT
+set terminal png
+set output 'graphs/scaling_${stamp}_${metric}.png'
+set title "${MODE^} scaling of mpi_hh: ${metric}\\n\\
+Repetitions: $REPS, Options: ${ARGS:-none}"
+set xlabel 'Processes'
+set ylabel '${metric^}'
+set datafile separator ','
+set key left top
+plot $plots
+GNUPLOT
+    echo "Graph of the $metric stored in graphs/scaling_${stamp}_${metric}.png"
+  done
+fi
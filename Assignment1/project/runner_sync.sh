@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# Runs the same simulation with each per-step synchronisation mode of mpi_hh
+# and prints their timings side by side. Submit it like runner_mpi.sh.
+
+#SBATCH -J sync_d15c10
+#SBATCH -o std/%x-%j.out
+#SBATCH -e std/%x-%j.err
+#SBATCH --partition=kgcoe-mps
+#SBATCH --account=kgcoe-mps
+#SBATCH --get-user-env
+#SBATCH --mem=1G
+#SBATCH --time=0-1:0:0
+#SBATCH --ntasks=13
+
+spack env activate cmpe-655
+
+ARGS=${ARGS:-"-d 15 -c 10"}
+NPROCS=${SLURM_NPROCS:-13}
+
+printf "%-6s %14s %14s %12s\n" mode "exec time (s)" "sync time (s)" "us/step"
+for mode in star coll tree; do
+  out=$(srun -n $NPROCS mpi_hh $ARGS --sync $mode)
+  exec_time=$(echo "$out" | sed -n 's/^Execution time: \([0-9.]*\).*/\1/p')
+  sync_time=$(echo "$out" | sed -n 's/^Time spent synchronising: \([0-9.]*\) seconds (\([0-9.]*\).*/\1 \2/p')
+  printf "%-6s %14s %14s %12s\n" $mode $exec_time $sync_time
+done
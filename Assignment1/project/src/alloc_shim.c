@@ -0,0 +1,223 @@
+/*
+  Multiple Processor Systems.
+
+  Counter of every heap allocation of a process, built as alloc_shim.so and
+  loaded with LD_PRELOAD:
+
+    $ LD_PRELOAD=./alloc_shim.so ./seq_hh -d 15 -c 10
+    $ mpirun -x LD_PRELOAD=$PWD/alloc_shim.so ./mpi_hh -d 15 -c 10
+
+  The allocation functions below count every call and hand it to the next
+  definition, normally the C library's. The programs read the count through
+  hhHeapAllocCount. Nothing here is linked into the programs themselves.
+*/
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+// Bytes handed out while dlsym looks up the real functions, which may itself
+// allocate. They are never released.
+#define BOOT_LEN 4096
+
+// Heap allocations made so far, by every thread.
+static atomic_long count = 0;
+
+static char boot[BOOT_LEN] __attribute__((aligned(64)));
+static size_t boot_used = 0;
+static int resolving = 0;
+
+static void *(*real_malloc)( size_t );
+static void *(*real_calloc)( size_t, size_t );
+static void *(*real_realloc)( void *, size_t );
+static void *(*real_reallocarray)( void *, size_t, size_t );
+static void *(*real_memalign)( size_t, size_t );
+static void *(*real_aligned_alloc)( size_t, size_t );
+static int (*real_posix_memalign)( void **, size_t, size_t );
+static void *(*real_valloc)( size_t );
+static void *(*real_pvalloc)( size_t );
+static void (*real_free)( void * );
+
+/**
+ * Name: resolve
+ *
+ * Description:
+ * Looks up the functions the counting ones hand their calls to. Functions
+ * the C library lacks are left NULL, and their counterparts fail.
+ */
+__attribute__((constructor))
+static void resolve( void )
+{
+  if (real_malloc != NULL || resolving) {
+    return;
+  }
+  resolving = 1;
+  real_calloc         = dlsym( RTLD_NEXT, "calloc" );
+  real_realloc        = dlsym( RTLD_NEXT, "realloc" );
+  real_reallocarray   = dlsym( RTLD_NEXT, "reallocarray" );
+  real_memalign       = dlsym( RTLD_NEXT, "memalign" );
+  real_aligned_alloc  = dlsym( RTLD_NEXT, "aligned_alloc" );
+  real_posix_memalign = dlsym( RTLD_NEXT, "posix_memalign" );
+  real_valloc         = dlsym( RTLD_NEXT, "valloc" );
+  real_pvalloc        = dlsym( RTLD_NEXT, "pvalloc" );
+  real_free           = dlsym( RTLD_NEXT, "free" );
+  real_malloc         = dlsym( RTLD_NEXT, "malloc" );
+  resolving = 0;
+}
+
+/**
+ * Name: bootAlloc
+ *
+ * Description:
+ * Serves the allocations made while resolve runs, from `boot'.
+ *
+ * Parameters:
+ * @param size      (INPUT) number of bytes to allocate
+ *
+ * Returns:
+ * @return void*    the memory, zeroed, or NULL once `boot' is used up
+ */
+static void *bootAlloc( size_t size )
+{
+  void *p;
+
+  size = (size + 63) & ~(size_t) 63;
+  if (size > BOOT_LEN - boot_used) {
+    return NULL;
+  }
+  p = boot + boot_used;
+  boot_used += size;
+
+  return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+long allocShimCount( void )
+{
+  return atomic_load_explicit( &count, memory_order_relaxed );
+}
+
+// The counting allocation functions. Each one is counted once, whatever it
+// is made of in the C library.
+
+void *malloc( size_t size )
+{
+  resolve();
+  if (real_malloc == NULL) {
+    return bootAlloc( size );
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_malloc( size );
+}
+
+void *calloc( size_t n, size_t size )
+{
+  resolve();
+  if (real_calloc == NULL) {
+    return (size == 0 || n <= BOOT_LEN / size) ? bootAlloc( n * size ) :
+           NULL;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_calloc( n, size );
+}
+
+void *realloc( void *ptr, size_t size )
+{
+  char *p = ptr;
+  void *q;
+
+  resolve();
+  if (p >= boot && p < boot + BOOT_LEN) {
+    // Blocks of `boot' are copied out; whatever follows them is copied too.
+    if ((q = malloc( size )) != NULL) {
+      memcpy( q, p, (size < (size_t) (boot + BOOT_LEN - p)) ? size :
+                    (size_t) (boot + BOOT_LEN - p) );
+    }
+    return q;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_realloc( ptr, size );
+}
+
+void *reallocarray( void *ptr, size_t n, size_t size )
+{
+  resolve();
+  if (real_reallocarray == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_reallocarray( ptr, n, size );
+}
+
+void *memalign( size_t align, size_t size )
+{
+  resolve();
+  if (real_memalign == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_memalign( align, size );
+}
+
+void *aligned_alloc( size_t align, size_t size )
+{
+  resolve();
+  if (real_aligned_alloc == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_aligned_alloc( align, size );
+}
+
+int posix_memalign( void **ptr, size_t align, size_t size )
+{
+  resolve();
+  if (real_posix_memalign == NULL) {
+    return ENOMEM;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_posix_memalign( ptr, align, size );
+}
+
+void *valloc( size_t size )
+{
+  resolve();
+  if (real_valloc == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_valloc( size );
+}
+
+void *pvalloc( size_t size )
+{
+  resolve();
+  if (real_pvalloc == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  atomic_fetch_add_explicit( &count, 1, memory_order_relaxed );
+  return real_pvalloc( size );
+}
+
+void free( void *ptr )
+{
+  char *p = ptr;
+
+  if (p >= boot && p < boot + BOOT_LEN) {
+    return;
+  }
+  resolve();
+  if (real_free != NULL) {
+    real_free( ptr );
+  }
+}
@@ -0,0 +1,563 @@
+/*
+  Multiple Processor Systems.
+
+  Batches of neurons. Steps many neurons with the same dendrites side by side,
+  one per vector lane, for throughput rather than for the time of one run.
+*/
+
+#include "batch.h"
+#include "constants.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest line of a table of neurons.
+#define BATCH_LINE 1024
+// Doubles per cache line; the block of every group starts on a new one.
+#define BATCH_PAD (CACHE_LINE / (int) sizeof(double))
+// Rows of the parameters of somaLanes.
+#define BATCH_PARAM_ROWS ((LANE_PARAMS + HH_VLEN - 1) / HH_VLEN)
+
+/**
+ * Columns of a table of neurons.
+ */
+enum {
+  COL_INJ_MEAN,
+  COL_G_COMP,
+  COL_G_DISTR,
+  COL_G_NA,
+  COL_G_K,
+  COL_G_L,
+  COL_G_LD,
+  COL_SEED,
+  NUM_COLUMNS
+};
+
+// Names of the columns, as in the options that set them.
+static const char *column_names[NUM_COLUMNS] = {
+  "inj-mean", "g-comp", "g-distr", "g-na", "g-k", "g-l", "g-ld", "seed"
+};
+
+/**
+ * Name: readHeader
+ *
+ * Description:
+ * Reads the names of the columns of a table of neurons.
+ *
+ * Parameters:
+ * @param line          (INOUT) the line naming them, split up on return
+ * @param cols          (OUTPUT) column of each value of a neuron's line
+ * @param fname         (INPUT) name of the table, for errors
+ * @param num_line      (INPUT) number of the line, for errors
+ *
+ * Returns:
+ * @return int          number of columns, or -1 if the line is not valid
+ */
+static int readHeader( char *line, int *cols, const char *fname,
+                       int num_line )
+{
+  int num_cols = 0, c, k;
+  char *word;
+
+  for (word = strtok( line, " \t\r\n" ); word != NULL;
+       word = strtok( NULL, " \t\r\n" )) {
+    for (c = 0; c < NUM_COLUMNS && strcmp( word, column_names[c] ) != 0;
+         c++) {
+    }
+    if (c == NUM_COLUMNS) {
+      fprintf(stderr, "%s:%d: unknown column '%s'!\n", fname, num_line,
+              word);
+      return -1;
+    }
+    for (k = 0; k < num_cols; k++) {
+      if (cols[k] == c) {
+        fprintf(stderr, "%s:%d: column '%s' given twice!\n", fname,
+                num_line, word);
+        return -1;
+      }
+    }
+    cols[num_cols++] = c;
+  }
+
+  return num_cols;
+}
+
+/**
+ * Name: readNeuron
+ *
+ * Description:
+ * Reads the values of one neuron of a table over those of the command line.
+ *
+ * Parameters:
+ * @param p             (INPUT) the line, from its first value
+ * @param cols          (INPUT) column of each value
+ * @param num_cols      (INPUT) number of values
+ * @param neuron        (INOUT) the neuron
+ *
+ * Returns:
+ * @return int          0 if the line does not hold `num_cols' numbers,
+ *                      nonzero otherwise
+ */
+static int readNeuron( const char *p, const int *cols, int num_cols,
+                       BatchNeuron *neuron )
+{
+  int k;
+  char *end;
+  double value = 0.0;
+
+  for (k = 0; k < num_cols; k++) {
+    if (cols[k] == COL_SEED) {
+      neuron->seed = strtoull( p, &end, 0 );
+    } else {
+      value = strtod( p, &end );
+    }
+    if (end == p) {
+      return 0;
+    }
+    p = end;
+
+    switch (cols[k]) {
+      case COL_INJ_MEAN: neuron->params.inj_mean = value; break;
+      case COL_G_COMP:   neuron->params.g_comp   = value; break;
+      case COL_G_DISTR:  neuron->params.g_distr  = value; break;
+      case COL_G_NA:     neuron->params.g_na     = value; break;
+      case COL_G_K:      neuron->params.g_k      = value; break;
+      case COL_G_L:      neuron->params.g_l      = value; break;
+      case COL_G_LD:     neuron->params.g_ld     = value; break;
+      default: break;
+    }
+  }
+
+  while (isspace( (unsigned char) *p )) {
+    p++;
+  }
+  return *p == '\0';
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+BatchNeuron *batchRead( const char *fname, const CmdArgs *cmd_args,
+                        int *num_neurons )
+{
+  FILE *file;
+  char line[BATCH_LINE], *p;
+  int pass, num_line, num_cols, cols[NUM_COLUMNS], n = 0, ok = 1;
+  BatchNeuron *neurons = NULL;
+
+  if ((file = fopen( fname, "r" )) == NULL) {
+    fprintf(stderr, "Can't open batch %s!\n", fname);
+    return NULL;
+  }
+
+  // The first pass counts the neurons, the second one reads them.
+  for (pass = 0; pass < 2 && ok; pass++) {
+    rewind( file );
+    num_line = 0;
+    num_cols = -1;
+    n = 0;
+    while (ok && fgets( line, sizeof(line), file ) != NULL) {
+      num_line++;
+      p = line;
+      while (isspace( (unsigned char) *p )) {
+        p++;
+      }
+      if (*p == '\0' || *p == '#') {
+        continue;
+      }
+      if (num_cols < 0) {
+        ok = (num_cols = readHeader( p, cols, fname, num_line )) >= 0;
+        continue;
+      }
+      if (pass == 1) {
+        neurons[n].params = cmd_args->params;
+        neurons[n].seed   = cmd_args->seed;
+        if (!readNeuron( p, cols, num_cols, &neurons[n] )) {
+          fprintf(stderr, "%s:%d: expected the %d values of a neuron!\n",
+                  fname, num_line, num_cols);
+          ok = 0;
+        }
+      }
+      n++;
+    }
+
+    if (pass == 0 && ok) {
+      if (n == 0) {
+        fprintf(stderr, "%s has no neurons!\n", fname);
+        ok = 0;
+      } else if ((neurons = (BatchNeuron*) hhMalloc( sizeof(BatchNeuron) *
+                                                     n )) == NULL) {
+        fprintf(stderr, "Could not allocate the batch!\n");
+        ok = 0;
+      }
+    }
+  }
+  fclose( file );
+
+  if (!ok) {
+    free( neurons );
+    return NULL;
+  }
+
+  *num_neurons = n;
+  return neurons;
+}
+
+/**
+ * Name: initShare
+ *
+ * Description:
+ * Pool work that sets the neurons of one thread's share at rest, with the
+ * conductances of each lane, and clears its scratch space. Run by the
+ * thread that will step them, so that their pages are first touched, and
+ * therefore placed, on its NUMA node.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the batch
+ * @param id            (INPUT) index of the calling thread
+ */
+static void initShare( void *arg, int id )
+{
+  Batch *batch = (Batch*) arg;
+  BatchThread *th = &batch->threads[id];
+  BatchGroup *grp;
+  const HHParams *p;
+  int g, l, d, s, i;
+  size_t c, rows;
+  double *g_before = th->g_table;
+  double *g_after  = th->g_table + batch->num_comps;
+
+  memset( th->scratch, 0, sizeof(double) * batch->scratch_len );
+
+  for (g = th->first; g < th->first + th->num_groups; g++) {
+    grp = &batch->groups[g];
+    memset( grp->y, 0, sizeof(double) * batch->group_len );
+
+    for (l = 0; l < HH_VLEN; l++) {
+      p = &batch->neurons[g * HH_VLEN + l].params;
+
+      // Precomputed values from the HH model, as in seq_hh.
+      grp->y[l]             = VREST;
+      grp->y[HH_VLEN + l]   = 0.037;
+      grp->y[2*HH_VLEN + l] = 0.0148;
+      grp->y[3*HH_VLEN + l] = 0.9959;
+
+      grp->params[LANE_G_NA + l] = p->g_na;
+      grp->params[LANE_G_K + l]  = p->g_k;
+      grp->params[LANE_G_L + l]  = p->g_l;
+      grp->g_ld[l] = p->g_ld;
+
+      // The first dendrite of every length lays out its tables.
+      for (d = 0, s = 0; d < batch->num_dendrs; d++) {
+        if (batch->shape[d] != s) {
+          continue;
+        }
+        conductanceTableOf( p, batch->comps[d], g_before, g_after );
+        for (i = 0; i < batch->comps[d]-2; i++) {
+          grp->g_before[(batch->table[s] + i) * HH_VLEN + l] = g_before[i];
+          grp->g_after[(batch->table[s] + i) * HH_VLEN + l]  = g_after[i];
+        }
+        s++;
+      }
+    }
+    grp->params[LANE_DT] = 1.0 / (double) batch->steps;
+
+    rows = batch->offset[batch->num_dendrs-1] +
+           batch->comps[batch->num_dendrs-1];
+    for (c = 0; c < rows * HH_VLEN; c++) {
+      grp->volt[c] = VREST;
+    }
+  }
+}
+
+/**
+ * Name: stepDendrites
+ *
+ * Description:
+ * Takes one dendrite step of every neuron of a group, and leaves the
+ * current their dendrites inject into the soma in `i_next'. The currents
+ * are added up in dendrite order, as by a one-thread engine.
+ *
+ * Parameters:
+ * @param batch         (INPUT) the batch
+ * @param th            (INOUT) the calling thread
+ * @param g             (INPUT) index of the group
+ * @param dendr_step    (INPUT) global index of the dendrite step
+ */
+static void stepDendrites( const Batch *batch, BatchThread *th, int g,
+                           long dendr_step )
+{
+  int d, l, s;
+  BatchGroup *grp = &batch->groups[g];
+  const BatchNeuron *neurons = batch->neurons + (size_t) g * HH_VLEN;
+  const HHRng *rngs = batch->rngs + (size_t) g * HH_VLEN;
+  double delta_t = batch->substeps * (1.0 / (double) batch->steps);
+  hhvec sum = (hhvec) {0};
+
+  for (d = 0; d < batch->num_dendrs; d++) {
+    for (l = 0; l < HH_VLEN; l++) {
+      th->cur[l] = injectedCurrentSpanOf( &rngs[l],
+                                          neurons[l].params.inj_mean, d,
+                                          dendr_step * batch->draws,
+                                          batch->draws );
+    }
+    s = batch->shape[d];
+    dendriteStepLanes( grp->volt + batch->offset[d] * HH_VLEN, th->cur,
+                       batch->comps[d], delta_t, grp->y,
+                       grp->g_before + batch->table[s] * HH_VLEN,
+                       grp->g_after + batch->table[s] * HH_VLEN,
+                       grp->g_ld, th->vddt, th->current );
+    sum += *(hhvec*) th->current;
+  }
+
+  *(hhvec*) grp->i_next = sum;
+}
+
+/**
+ * Name: stepShare
+ *
+ * Description:
+ * Pool work that takes the groups of one thread's share through the ms in
+ * progress, one group at a time, with the steps of seq_hh's main loop.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the batch
+ * @param id            (INPUT) index of the calling thread
+ */
+static void stepShare( void *arg, int id )
+{
+  Batch *batch = (Batch*) arg;
+  BatchThread *th = &batch->threads[id];
+  BatchGroup *grp;
+  int g, step;
+  int steps    = batch->steps;
+  int substeps = batch->substeps;
+  int stride   = steps / batch->sample_rate;
+  long dendr_step;
+  hhvec *i_dendr, *i_prev, *i_next;
+
+  for (g = th->first; g < th->first + th->num_groups; g++) {
+    grp = &batch->groups[g];
+    i_dendr = (hhvec*) (grp->params + LANE_I_DENDR);
+    i_prev  = (hhvec*) grp->i_prev;
+    i_next  = (hhvec*) grp->i_next;
+
+    for (step = 0; step < steps; step++) {
+      // Samples within the ms. The one at its end is taken below.
+      if (step > 0 && step % stride == 0) {
+        *(hhvec*) (grp->samples + (step / stride - 1) * HH_VLEN) =
+          *(hhvec*) grp->y;
+      }
+
+      if (step % substeps == 0) {
+        dendr_step = ((long) (batch->t_ms-1) * steps + step) / substeps;
+        *i_prev = *i_next;
+        stepDendrites( batch, th, g, dendr_step );
+      }
+
+      // The current interpolated between dendrite steps, as in seq_hh.
+      if (step % substeps == substeps-1) {
+        *i_dendr = *i_next;
+      } else {
+        *i_dendr = *i_prev + (*i_next - *i_prev) *
+          (double) (step % substeps + 1) / (double) substeps;
+      }
+
+      memcpy( th->y0, grp->y, sizeof(double) * NUMVAR * HH_VLEN );
+      somaLanes( th->dydt, grp->y, grp->params );
+      rk4Step( grp->y, th->y0, th->dydt, NUMVAR * HH_VLEN, grp->params, 1,
+               somaLanes, th->rk );
+    }
+
+    *(hhvec*) (grp->samples + (batch->sample_rate-1) * HH_VLEN) =
+      *(hhvec*) grp->y;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+Batch *batchCreate( const CmdArgs *cmd_args, const BatchNeuron *neurons,
+                    int num_neurons )
+{
+  int d, e, g, n, t;
+  size_t table_rows, volt_rows, len;
+  double *v, *w;
+  BatchThread *th;
+  Batch *batch = (Batch*) hhMalloc( sizeof(Batch) );
+
+  if (batch == NULL) {
+    return NULL;
+  }
+  memset( batch, 0, sizeof(Batch) );
+
+  batch->num_neurons = num_neurons;
+  batch->num_groups  = (num_neurons + HH_VLEN - 1) / HH_VLEN;
+  batch->num_dendrs  = cmd_args->num_dendrs;
+  batch->steps       = cmd_args->steps;
+  batch->substeps    = cmd_args->substeps;
+  batch->draws       = cmd_args->params.steps / cmd_args->steps *
+                       cmd_args->substeps;
+  batch->sample_rate = cmd_args->sample_rate;
+  // Every thread needs a group of its own.
+  batch->num_threads = (cmd_args->num_threads < batch->num_groups) ?
+                       cmd_args->num_threads : batch->num_groups;
+
+  batch->comps   = dendriteComps( cmd_args );
+  batch->offset  = (size_t*) hhMalloc( sizeof(size_t) * batch->num_dendrs );
+  batch->shape   = (int*) hhMalloc( sizeof(int) * batch->num_dendrs );
+  batch->table   = (size_t*) hhMalloc( sizeof(size_t) * batch->num_dendrs );
+  batch->neurons = (BatchNeuron*) hhMalloc( sizeof(BatchNeuron) * HH_VLEN *
+                                            batch->num_groups );
+  batch->rngs    = (HHRng*) hhMalloc( sizeof(HHRng) * HH_VLEN *
+                                      batch->num_groups );
+  batch->groups  = (BatchGroup*) hhMalloc( sizeof(BatchGroup) *
+                                           batch->num_groups );
+  batch->threads = (BatchThread*) hhMallocAligned( CACHE_LINE,
+                                                   sizeof(BatchThread) *
+                                                   batch->num_threads );
+  if (batch->comps == NULL || batch->offset == NULL || batch->shape == NULL ||
+      batch->table == NULL || batch->neurons == NULL || batch->rngs == NULL ||
+      batch->groups == NULL || batch->threads == NULL) {
+    batchFree( batch );
+    return NULL;
+  }
+  memset( batch->rngs, 0, sizeof(HHRng) * HH_VLEN * batch->num_groups );
+  memset( batch->threads, 0, sizeof(BatchThread) * batch->num_threads );
+
+  // Dendrites of the same length share their tables.
+  table_rows = volt_rows = 0;
+  for (d = 0; d < batch->num_dendrs; d++) {
+    batch->offset[d] = volt_rows;
+    volt_rows += batch->comps[d];
+    if (batch->comps[d] > batch->num_comps) {
+      batch->num_comps = batch->comps[d];
+    }
+
+    for (e = 0; e < d && batch->comps[e] != batch->comps[d]; e++) {
+    }
+    if (e < d) {
+      batch->shape[d] = batch->shape[e];
+    } else {
+      batch->shape[d] = batch->num_shapes;
+      batch->table[batch->num_shapes++] = table_rows;
+      table_rows += batch->comps[d] - 2;
+    }
+  }
+
+  // The neurons, the last group padded with copies of the last one, each
+  // with its own generator.
+  for (n = 0; n < HH_VLEN * batch->num_groups; n++) {
+    batch->neurons[n] = neurons[(n < num_neurons) ? n : num_neurons-1];
+    if (!hhRngInit( &batch->rngs[n], RNG_COUNTER, batch->neurons[n].seed,
+                    batch->num_dendrs, cmd_args->params.steps )) {
+      batchFree( batch );
+      return NULL;
+    }
+  }
+
+  // One block per group, each from a cache line of its own.
+  len = (NUMVAR + BATCH_PARAM_ROWS + 3 + 2 * table_rows + volt_rows +
+         batch->sample_rate) * HH_VLEN;
+  batch->group_len = (len + BATCH_PAD - 1) / BATCH_PAD * BATCH_PAD;
+  batch->block = (double*) hhMallocAligned( CACHE_LINE, sizeof(double) *
+                                            batch->group_len *
+                                            batch->num_groups );
+  if (batch->block == NULL) {
+    batchFree( batch );
+    return NULL;
+  }
+  for (g = 0; g < batch->num_groups; g++) {
+    v = batch->block + g * batch->group_len;
+    batch->groups[g].y        = v;
+    batch->groups[g].params   = v += NUMVAR * HH_VLEN;
+    batch->groups[g].g_ld     = v += BATCH_PARAM_ROWS * HH_VLEN;
+    batch->groups[g].i_prev   = v += HH_VLEN;
+    batch->groups[g].i_next   = v += HH_VLEN;
+    batch->groups[g].g_before = v += HH_VLEN;
+    batch->groups[g].g_after  = v += table_rows * HH_VLEN;
+    batch->groups[g].volt     = v += table_rows * HH_VLEN;
+    batch->groups[g].samples  = v += volt_rows * HH_VLEN;
+  }
+
+  // Even, contiguous shares of groups; all the neurons cost the same.
+  batch->scratch_len = (6*NUMVAR + batch->num_comps + 2) * HH_VLEN +
+                       2 * batch->num_comps;
+  for (t = 0; t < batch->num_threads; t++) {
+    th = &batch->threads[t];
+    th->first      = t * batch->num_groups / batch->num_threads;
+    th->num_groups = (t+1) * batch->num_groups / batch->num_threads -
+                     th->first;
+    th->scratch    = (double*) hhMallocAligned( CACHE_LINE, sizeof(double) *
+                                                batch->scratch_len );
+    if (th->scratch == NULL) {
+      batchFree( batch );
+      return NULL;
+    }
+    w = th->scratch;
+    th->y0      = w;
+    th->dydt    = w += NUMVAR * HH_VLEN;
+    th->rk      = w += NUMVAR * HH_VLEN;
+    th->vddt    = w += 4 * NUMVAR * HH_VLEN;
+    th->cur     = w += batch->num_comps * HH_VLEN;
+    th->current = w += HH_VLEN;
+    th->g_table = w += HH_VLEN;
+  }
+
+  if ((batch->pool = poolCreate( batch->num_threads )) == NULL) {
+    batchFree( batch );
+    return NULL;
+  }
+  poolRun( batch->pool, initShare, batch );
+
+  return batch;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void batchStep( Batch *batch, int t_ms )
+{
+  batch->t_ms = t_ms;
+  poolRun( batch->pool, stepShare, batch );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double batchSample( const Batch *batch, int n, int k )
+{
+  return batch->groups[n / HH_VLEN].samples[k * HH_VLEN + n % HH_VLEN];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void batchFree( Batch *batch )
+{
+  int t, n;
+
+  if (batch == NULL) {
+    return;
+  }
+
+  poolFree( batch->pool );
+  if (batch->threads) {
+    for (t = 0; t < batch->num_threads; t++) {
+      free( batch->threads[t].scratch );
+    }
+  }
+  if (batch->rngs) {
+    for (n = 0; n < HH_VLEN * batch->num_groups; n++) {
+      hhRngFree( &batch->rngs[n] );
+    }
+  }
+
+  free( batch->comps );
+  free( batch->offset );
+  free( batch->shape );
+  free( batch->table );
+  free( batch->neurons );
+  free( batch->rngs );
+  free( batch->groups );
+  free( batch->threads );
+  free( batch->block );
+  free( batch );
+}
@@ -0,0 +1,436 @@
+/*
+  Multiple Processor Systems.
+
+  Microbenchmarks of the kernels of lib_hh and engine.c, and of the per-step
+  exchange of mpi_hh.
+*/
+
+#include "lib_hh.h"
+#include "engine.h"
+#include "sync.h"
+#include "constants.h"
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <mpi.h>
+
+// Time aimed at for one timed repetition; the number of iterations in a
+// repetition is picked to reach it.
+#define BENCH_REP_TIME 1e-3
+
+// Iterations of one repetition of the exchange benchmarks.
+#define BENCH_EXCHANGES 200
+
+// Dendrites stepped together by the engine benchmarks, a multiple of every
+// HH_VLEN.
+#define BENCH_DENDRS 8
+
+// Largest number of repetitions.
+#define BENCH_MAX_REPS 100000
+
+/**
+ * Options of a run of the suite.
+ */
+typedef struct BenchOpts {
+  int warmup;           // Untimed repetitions before the timed ones.
+  int reps;             // Timed repetitions.
+  int max_comps;        // Largest dendrite benchmarked.
+  const char *filter;   // Only run benchmarks whose name starts with this.
+  FILE *csv;            // Where the results go.
+  double *times;        // Time of each repetition, ns per unit.
+} BenchOpts;
+
+/**
+ * Arguments of the benchmarked functions. Each benchmark uses a few.
+ */
+typedef struct BenchArg {
+  Engine *eng;
+  HHWorkspace *ws;
+  HHRng rng;
+  Sync sync;
+  int num_comps;        // Compartments per dendrite, dummy and soma included.
+  long step;            // Next global step, keys the tip currents.
+  double *v;            // One dendrite (dendrite, dendriteStep).
+  double y[NUMVAR], y0[NUMVAR], dydt[NUMVAR], params[6];
+  double sink;          // Results are added here so they are not optimized out.
+} BenchArg;
+
+// A benchmarked function, run for `iters' iterations.
+typedef void (*BenchFn)( BenchArg *arg, long iters );
+
+/**
+ * Name: benchSort
+ *
+ * Description:
+ * Comparison of two doubles for qsort.
+ */
+static int benchSort( const void *a, const void *b )
+{
+  double const x = *(const double*) a, y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Name: benchRun
+ *
+ * Description:
+ * Times a function and reports the result. The number of iterations of a
+ * repetition is calibrated so that it takes about BENCH_REP_TIME, then the
+ * warm-up repetitions are run untimed and the timed ones one by one. With
+ * more than one rank the exchange benchmarks run on every rank with the
+ * iterations fixed, and rank 0 times them.
+ *
+ * Parameters:
+ * @param opts      (INOUT) options of the run
+ * @param name      (INPUT) name of the benchmark
+ * @param param     (INPUT) its parameter, e.g. compartments per dendrite
+ * @param unit      (INPUT) what the reported times are per
+ * @param fn        (INPUT) the benchmarked function
+ * @param arg       (INOUT) its arguments
+ * @param units     (INPUT) units of work in one iteration
+ * @param iters     (INPUT) iterations per repetition, or 0 to calibrate
+ */
+static void benchRun( BenchOpts *opts, const char *name, long param,
+                      const char *unit, BenchFn fn, BenchArg *arg,
+                      double units, long iters )
+{
+  int r, rank;
+  double start, elapsed, median, p99;
+
+  if (opts->filter != NULL &&
+      strncmp( name, opts->filter, strlen( opts->filter ) ) != 0) {
+    return;
+  }
+  MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+
+  // Doubles the iterations until a run is long enough to time, then scales.
+  if (iters == 0) {
+    for (iters = 1, elapsed = 0.0; elapsed < BENCH_REP_TIME / 10; iters *= 2) {
+      start = MPI_Wtime();
+      fn( arg, iters );
+      elapsed = MPI_Wtime() - start;
+    }
+    iters = (long) ceil( iters / 2 * BENCH_REP_TIME / elapsed );
+  }
+
+  for (r = 0; r < opts->warmup; r++) {
+    fn( arg, iters );
+  }
+  for (r = 0; r < opts->reps; r++) {
+    MPI_Barrier( MPI_COMM_WORLD );
+    start = MPI_Wtime();
+    fn( arg, iters );
+    opts->times[r] = (MPI_Wtime() - start) * 1e9 / (iters * units);
+  }
+  if (rank != 0) {
+    return;
+  }
+
+  qsort( opts->times, opts->reps, sizeof(double), benchSort );
+  median = (opts->reps % 2) ? opts->times[opts->reps / 2] :
+           0.5 * (opts->times[opts->reps/2 - 1] + opts->times[opts->reps/2]);
+  p99 = opts->times[(int) ceil( 0.99 * opts->reps ) - 1];
+
+  printf( "%-16s %6ld %-14s %6d %6d %9ld %11.2f %11.2f %11.2f\n", name, param,
+          unit, opts->warmup, opts->reps, iters, opts->times[0], median, p99 );
+  fprintf( opts->csv, "%s,%ld,%s,%d,%d,%ld,%.3f,%.3f,%.3f\n", name, param,
+           unit, opts->warmup, opts->reps, iters, opts->times[0], median,
+           p99 );
+  fflush( stdout );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The benchmarked functions. Each runs `iters' iterations of one kernel.
+////////////////////////////////////////////////////////////////////////////////
+static void benchDendrite( BenchArg *arg, long iters )
+{
+  long i;
+  double dydx;
+
+  for (i = 0; i < iters; i++) {
+    arg->params[4] = arg->v[i & 7];
+    dendrite( &dydx, arg->v + 1, arg->params );
+    arg->sink += dydx;
+  }
+}
+
+static void benchDendriteStep( BenchArg *arg, long iters )
+{
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    arg->sink += dendriteStep( arg->v, 100.0, arg->num_comps,
+                               1.0 / hhParams()->steps, VREST, arg->ws );
+  }
+}
+
+static void benchEngine( BenchArg *arg, long iters )
+{
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    arg->sink += engineStep( arg->eng, arg->step++, 1.0 / hhParams()->steps,
+                             VREST );
+  }
+}
+
+static void benchSoma( BenchArg *arg, long iters )
+{
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    memcpy( arg->y0, arg->y, sizeof(arg->y) );
+    soma( arg->dydt, arg->y, arg->params );
+    rk4Step( arg->y, arg->y0, arg->dydt, NUMVAR, arg->params, 1, soma,
+             arg->ws->rk );
+  }
+  arg->sink += arg->y[0];
+}
+
+static void benchRng( BenchArg *arg, long iters )
+{
+  long i;
+
+  for (i = 0; i < iters; i++) {
+    arg->sink += injectedCurrent( &arg->rng, (int) (i & 1023), arg->step++ );
+  }
+}
+
+static void benchExchange( BenchArg *arg, long iters )
+{
+  long i;
+  double v_m = VREST, delta_t = arg->sync.delta_t;
+
+  for (i = 0; i < iters; i++) {
+    syncState( &arg->sync, &v_m, &delta_t );
+    arg->sink += syncCurrent( &arg->sync, 1.0 );
+  }
+}
+
+/**
+ * Name: benchUsage
+ *
+ * Description:
+ * Prints a simple usage statement for the program.
+ *
+ * Parameters:
+ * @param name      the name used to call this program (i.e., argv[0])
+ */
+static void benchUsage( char *name )
+{
+  printf(
+"USAGE:\n"
+"  %s [-h] [--warmup N] [--reps N] [--max-comps N] [--filter NAME]\n"
+"         [--csv FILE]\n"
+"\n"
+"DESCRIPTION:\n"
+"  Microbenchmarks of the simulation kernels. Each benchmark runs a number\n"
+"  of untimed warm-up repetitions, then the timed ones; the iterations in a\n"
+"  repetition are picked so that it takes about 1 ms. The fastest, median\n"
+"  and 99th percentile repetition are reported, in ns per unit of work.\n"
+"\n"
+"  dendrite         one compartment derivative, ns per call\n"
+"  dendriteStep     reference RK4 kernel, ns per compartment-step\n"
+"  engine-scalar, engine-fused, engine-simd, engine-be, engine-cn\n"
+"                   %d dendrites stepped by the engine with that kernel or\n"
+"                   integrator, ns per compartment-step\n"
+"  soma-rk4         soma() and rk4Step, ns per step\n"
+"  rng-counter, rng-compat\n"
+"                   injectedCurrent, ns per draw\n"
+"  exchange-star, exchange-coll, exchange-tree\n"
+"                   syncState and syncCurrent on every rank, ns per step;\n"
+"                   only run with two or more MPI processes\n"
+"\n"
+"  Dendrites go from 1 compartment up to --max-comps (10000) by factors of\n"
+"  10. Results are also written as CSV to data/bench_MMDDYY_HHMMSS.csv, or\n"
+"  to --csv FILE.\n"
+"\n"
+"OPTIONS:\n"
+"  --warmup N     untimed repetitions (default 10)\n"
+"  --reps N       timed repetitions (default 100)\n"
+"  --max-comps N  largest dendrite (default 10000)\n"
+"  --filter NAME  only run the benchmarks whose name starts with NAME\n"
+"  --csv FILE     where to write the CSV results\n"
+"\n", name, BENCH_DENDRS );
+}
+
+/**
+ * Name: main
+ *
+ * Description:
+ * See usage statement (run program with '-h' flag).
+ *
+ * Parameters:
+ * @param argc    number of command line arguments
+ * @param argv    command line arguments
+ */
+int main( int argc, char **argv )
+{
+  int i, k, rank, num_tasks, num_comps;
+  char csv_fname[ FNAME_LEN ], time_str[14];
+  char *csv_arg = NULL;
+  HHParams params;
+  BenchOpts opts;
+  BenchArg arg;
+
+  static const HHKernel kernels[] = { KERNEL_SCALAR, KERNEL_FUSED,
+                                      KERNEL_SIMD, KERNEL_SCALAR,
+                                      KERNEL_SCALAR };
+  static const HHIntegrator integrators[] = { INTEGRATOR_RK4, INTEGRATOR_RK4,
+                                              INTEGRATOR_RK4, INTEGRATOR_BE,
+                                              INTEGRATOR_CN };
+  static const char *engine_names[] = { "engine-scalar", "engine-fused",
+                                        "engine-simd", "engine-be",
+                                        "engine-cn" };
+  static const HHSyncMode modes[] = { SYNC_STAR, SYNC_COLL, SYNC_TREE };
+  static const char *exchange_names[] = { "exchange-star", "exchange-coll",
+                                          "exchange-tree" };
+
+  MPI_Init( &argc, &argv );
+  MPI_Comm_size( MPI_COMM_WORLD, &num_tasks );
+  MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+
+  opts.warmup    = 10;
+  opts.reps      = 100;
+  opts.max_comps = 10000;
+  opts.filter    = NULL;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp( argv[i], "--warmup" ) == 0 && i+1 < argc) {
+      opts.warmup = atoi( argv[++i] );
+    } else if (strcmp( argv[i], "--reps" ) == 0 && i+1 < argc) {
+      opts.reps = atoi( argv[++i] );
+    } else if (strcmp( argv[i], "--max-comps" ) == 0 && i+1 < argc) {
+      opts.max_comps = atoi( argv[++i] );
+    } else if (strcmp( argv[i], "--filter" ) == 0 && i+1 < argc) {
+      opts.filter = argv[++i];
+    } else if (strcmp( argv[i], "--csv" ) == 0 && i+1 < argc) {
+      csv_arg = argv[++i];
+    } else {
+      if (rank == 0) {
+        benchUsage( argv[0] );
+      }
+      MPI_Finalize();
+      return strcmp( argv[i], "-h" ) != 0 && strcmp( argv[i], "--help" ) != 0;
+    }
+  }
+  if (opts.warmup < 0 || opts.reps <= 0 || opts.reps > BENCH_MAX_REPS ||
+      opts.max_comps <= 0) {
+    if (rank == 0) {
+      fprintf( stderr, "Bad --warmup, --reps or --max-comps!\n" );
+    }
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  hhParamsDefault( &params );
+  hhSetParams( &params );
+  opts.times = (double*) hhMalloc( sizeof(double) * opts.reps );
+  arg.ws = workspaceCreate( opts.max_comps + 2 );
+  arg.v = (double*) hhMalloc( sizeof(double) * (opts.max_comps + 2) );
+  if (opts.times == NULL || arg.ws == NULL || arg.v == NULL ||
+      !hhRngInit( &arg.rng, RNG_COUNTER, 1, BENCH_DENDRS, params.steps )) {
+    fprintf( stderr, "Could not allocate the benchmark workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  arg.sink = 0.0;
+  arg.step = 0;
+
+  // Results go to data/, like those of the simulators.
+  opts.csv = NULL;
+  if (rank == 0) {
+    time_t t = time(NULL);
+    strftime( time_str, 14, "%m%d%y_%H%M%S", localtime( &t ) );
+    snprintf( csv_fname, FNAME_LEN, "data/bench_%s.csv", time_str );
+    if (csv_arg == NULL) {
+      mkdir( "data", 0700 );
+    }
+    opts.csv = fopen( csv_arg ? csv_arg : csv_fname, "w" );
+    if (opts.csv == NULL) {
+      fprintf( stderr, "Can't open %s file!\n", csv_arg ? csv_arg : csv_fname );
+      MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+    fprintf( opts.csv, "benchmark,param,unit,warmup,reps,iters,"
+             "min_ns,median_ns,p99_ns\n" );
+    printf( "Results will be stored in %s\n\n", csv_arg ? csv_arg : csv_fname );
+    printf( "%-16s %6s %-14s %6s %6s %9s %11s %11s %11s\n", "benchmark",
+            "param", "unit", "warmup", "reps", "iters", "min (ns)",
+            "median (ns)", "p99 (ns)" );
+  }
+
+  // The kernels only run on rank 0, the others wait for the exchanges.
+  if (rank == 0) {
+    for (i = 0; i < opts.max_comps + 2; i++) {
+      arg.v[i] = VREST;
+    }
+    arg.params[0] = 1.0 / params.steps;
+    arg.params[1] = 0.0;
+    arg.params[2] = arg.params[3] = 1.0;   // Any conductance will do.
+    arg.params[5] = VREST;
+    arg.num_comps = 3;
+    benchRun( &opts, "dendrite", 1, "ns/call", benchDendrite, &arg, 1, 0 );
+
+    for (num_comps = 1; num_comps <= opts.max_comps; num_comps *= 10) {
+      arg.num_comps = num_comps + 2;
+      benchRun( &opts, "dendriteStep", num_comps, "ns/comp-step",
+                benchDendriteStep, &arg, num_comps, 0 );
+    }
+
+    for (k = 0; k < 5; k++) {
+      for (num_comps = 1; num_comps <= opts.max_comps; num_comps *= 10) {
+        arg.eng = engineCreate( kernels[k], BENCH_DENDRS, NULL, num_comps + 2,
+                                NULL, &arg.rng, 1 );
+        if (arg.eng == NULL ||
+            !engineSetIntegrator( arg.eng, integrators[k], 1 )) {
+          fprintf( stderr, "Could not allocate the benchmark workspace!\n" );
+          MPI_Abort( MPI_COMM_WORLD, 1 );
+        }
+        benchRun( &opts, engine_names[k], num_comps, "ns/comp-step",
+                  benchEngine, &arg, (double) BENCH_DENDRS * num_comps, 0 );
+        engineFree( arg.eng );
+      }
+    }
+
+    arg.y[0] = VREST;
+    arg.y[1] = 0.037;
+    arg.y[2] = 0.0148;
+    arg.y[3] = 0.9959;
+    arg.params[0] = 1.0 / params.steps;
+    arg.params[1] = arg.params[2] = 0.0;
+    benchRun( &opts, "soma-rk4", 1, "ns/step", benchSoma, &arg, 1, 0 );
+
+    benchRun( &opts, "rng-counter", 1, "ns/draw", benchRng, &arg, 1, 0 );
+    hhRngFree( &arg.rng );
+    hhRngInit( &arg.rng, RNG_COMPAT, 1, 1024, params.steps );
+    benchRun( &opts, "rng-compat", 1, "ns/draw", benchRng, &arg, 1, 0 );
+  }
+
+  // The exchange of every step, on all ranks at once.
+  if (num_tasks > 1) {
+    for (k = 0; k < 3; k++) {
+      syncInit( &arg.sync, modes[k], 0, 1.0 / params.steps );
+      benchRun( &opts, exchange_names[k], num_tasks, "ns/exchange",
+                benchExchange, &arg, 1, BENCH_EXCHANGES );
+    }
+  }
+
+  if (rank == 0) {
+    fclose( opts.csv );
+  }
+  // Keeps the results of the kernels alive.
+  if (isnan( arg.sink ) && rank < 0) {
+    printf( "%g\n", arg.sink );
+  }
+
+  workspaceFree( arg.ws );
+  hhRngFree( &arg.rng );
+  free( arg.v );
+  free( opts.times );
+  MPI_Finalize();
+
+  return 0;
+}
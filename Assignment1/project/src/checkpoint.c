@@ -0,0 +1,151 @@
+/*
+  Multiple Processor Systems.
+
+  Checkpoints of a run, and continuing a run from one.
+*/
+
+#include "checkpoint.h"
+#include "constants.h"
+
+#include <stdio.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void checkpointInit( CkptHeader *hdr, const CmdArgs *cmd_args, int num_comps,
+                     const char *time_str )
+{
+  memset( hdr, 0, sizeof(CkptHeader) );
+  memcpy( hdr->magic, CKPT_MAGIC, CKPT_MAGIC_LEN );
+  hdr->num_dendrs  = cmd_args->num_dendrs;
+  hdr->num_comps   = num_comps;
+  hdr->steps       = cmd_args->steps;
+  hdr->substeps    = cmd_args->substeps;
+  hdr->integrator  = cmd_args->integrator;
+  hdr->rng         = cmd_args->rng;
+  hdr->seed        = cmd_args->seed;
+  hdr->sample_rate = cmd_args->sample_rate;
+  hdr->format      = cmd_args->format;
+  hdr->params      = cmd_args->params;
+  strncpy( hdr->time_str, time_str, sizeof(hdr->time_str) - 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int checkpointUpdate( CkptHeader *hdr, int t_ms, const double *y,
+                      double i_dendr, double exec_time, TraceWriter *trace )
+{
+  hdr->t_ms = t_ms;
+  memcpy( hdr->y, y, sizeof(hdr->y) );
+  hdr->i_dendr = i_dendr;
+  hdr->exec_time = exec_time;
+  hdr->trace_samples = trace->samples;
+  hdr->trace_head = (int32_t) trace->head;
+  hdr->trace_len = traceSync( trace );
+
+  return hdr->trace_len >= 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int checkpointWrite( const char *fname, const CkptHeader *hdr, Engine *eng,
+                     const double *res )
+{
+  int d, c, ok;
+  char tmp_fname[ FNAME_LEN + 8 ];
+  FILE *file;
+
+  snprintf( tmp_fname, sizeof(tmp_fname), "%s.tmp", fname );
+  if ((file = fopen( tmp_fname, "wb" )) == NULL) {
+    return 0;
+  }
+
+  // The engine holds every dendrite, in order.
+  ok = (fwrite( hdr, sizeof(CkptHeader), 1, file ) == 1);
+  for (d = 0; d < eng->num_dendrs && ok; d++) {
+    for (c = 0; c < eng->num_comps; c++) {
+      ok = (fwrite( engineVolt( eng, d, c ), sizeof(double), 1, file ) == 1)
+           && ok;
+    }
+  }
+  ok = ok && fwrite( res, sizeof(double), hdr->t_ms + 1, file ) ==
+             (size_t) hdr->t_ms + 1;
+  ok = (fclose( file ) == 0) && ok;
+
+  return ok && rename( tmp_fname, fname ) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int checkpointRead( const char *fname, const CmdArgs *cmd_args,
+                    CkptHeader *hdr )
+{
+  FILE *file;
+  HHParams params;
+
+  if ((file = fopen( fname, "rb" )) == NULL ||
+      fread( hdr, sizeof(CkptHeader), 1, file ) != 1 ||
+      memcmp( hdr->magic, CKPT_MAGIC, CKPT_MAGIC_LEN ) != 0) {
+    fprintf( stderr, "Can't read checkpoint %s!\n", fname );
+    if (file != NULL) {
+      fclose( file );
+    }
+    return 0;
+  }
+  fclose( file );
+
+  // Only the length of the run may change.
+  params = cmd_args->params;
+  params.comp_time = hdr->params.comp_time;
+  if (hdr->num_dendrs != cmd_args->num_dendrs ||
+      hdr->num_comps != cmd_args->num_comps + 2 ||
+      hdr->steps != cmd_args->steps ||
+      hdr->substeps != cmd_args->substeps ||
+      hdr->integrator != (int) cmd_args->integrator ||
+      hdr->rng != (int) cmd_args->rng || hdr->seed != cmd_args->seed ||
+      hdr->sample_rate != cmd_args->sample_rate ||
+      hdr->format != (int) cmd_args->format ||
+      memcmp( &params, &hdr->params, sizeof(HHParams) ) != 0) {
+    fprintf( stderr, "Checkpoint %s was taken with other options!\n", fname );
+    return 0;
+  }
+  if (hdr->t_ms >= cmd_args->params.comp_time) {
+    fprintf( stderr, "Checkpoint %s is at %d ms, past the end of the run!\n",
+             fname, hdr->t_ms );
+    return 0;
+  }
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int checkpointRestore( const char *fname, const CkptHeader *hdr, Engine *eng,
+                       double *res )
+{
+  int d, c, ok;
+  long row_len = (long) sizeof(double) * hdr->num_comps;
+  FILE *file;
+
+  if ((file = fopen( fname, "rb" )) == NULL) {
+    return 0;
+  }
+
+  ok = 1;
+  for (d = 0; d < eng->num_dendrs && ok; d++) {
+    ok = (fseek( file, (long) sizeof(CkptHeader) + eng->gids[d] * row_len,
+                 SEEK_SET ) == 0);
+    for (c = 0; c < eng->num_comps && ok; c++) {
+      ok = (fread( engineVolt( eng, d, c ), sizeof(double), 1, file ) == 1);
+    }
+  }
+  if (res != NULL && ok) {
+    ok = (fseek( file, (long) sizeof(CkptHeader) +
+                 hdr->num_dendrs * row_len, SEEK_SET ) == 0) &&
+         fread( res, sizeof(double), hdr->t_ms + 1, file ) ==
+         (size_t) hdr->t_ms + 1;
+  }
+
+  fclose( file );
+  return ok;
+}
@@ -0,0 +1,78 @@
+/*
+  Multiple Processor Systems.
+
+  Checkpoints written by every rank of mpi_hh with MPI-IO.
+*/
+
+#include "checkpoint.h"
+#include "constants.h"
+
+#include <stdio.h>
+#include <mpi.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int checkpointWriteShared( const char *fname, const CkptHeader *hdr,
+                           Engine *eng, int num_dendrs, double *buf,
+                           const double *res )
+{
+  int d, c, rank, rc, ok;
+  int const num_comps = eng->num_comps;
+  char tmp_fname[ FNAME_LEN + 8 ];
+  MPI_File fh;
+  MPI_Datatype row, view;
+  MPI_Offset const rows_at = sizeof(CkptHeader);
+  MPI_Offset const res_at = rows_at +
+                            (MPI_Offset) sizeof(double) * num_dendrs *
+                            num_comps;
+
+  MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+  snprintf( tmp_fname, sizeof(tmp_fname), "%s.tmp", fname );
+
+  for (d = 0; d < eng->num_dendrs; d++) {
+    for (c = 0; c < num_comps; c++) {
+      buf[(size_t) d * num_comps + c] = *engineVolt( eng, d, c );
+    }
+  }
+
+  rc = MPI_File_open( MPI_COMM_WORLD, tmp_fname,
+                      MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh );
+  if (rc != MPI_SUCCESS) {
+    return 0;
+  }
+  ok = (MPI_File_set_size( fh, 0 ) == MPI_SUCCESS);
+
+  // Rank 0 writes the header and the soma potentials before the view below
+  // changes what the offsets refer to.
+  if (rank == 0 && ok) {
+    ok = MPI_File_write_at( fh, 0, (void*) hdr, sizeof(CkptHeader), MPI_BYTE,
+                            MPI_STATUS_IGNORE ) == MPI_SUCCESS &&
+         MPI_File_write_at( fh, res_at, (void*) res, hdr->t_ms + 1,
+                            MPI_DOUBLE, MPI_STATUS_IGNORE ) == MPI_SUCCESS;
+  }
+
+  // Every rank sees only its own rows, in the order of their global ids,
+  // and writes them all in one collective call.
+  MPI_Type_contiguous( num_comps, MPI_DOUBLE, &row );
+  MPI_Type_create_indexed_block( eng->num_dendrs, 1, eng->gids, row, &view );
+  MPI_Type_commit( &view );
+  rc = MPI_File_set_view( fh, rows_at, MPI_DOUBLE, view, "native",
+                          MPI_INFO_NULL );
+  if (rc == MPI_SUCCESS) {
+    rc = MPI_File_write_all( fh, buf, eng->num_dendrs * num_comps,
+                             MPI_DOUBLE, MPI_STATUS_IGNORE );
+  }
+  ok = (rc == MPI_SUCCESS) && ok;
+  ok = (MPI_File_close( &fh ) == MPI_SUCCESS) && ok;
+  MPI_Type_free( &view );
+  MPI_Type_free( &row );
+
+  // The old checkpoint is only replaced once every rank wrote its part.
+  MPI_Allreduce( MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD );
+  if (rank == 0 && ok) {
+    ok = (rename( tmp_fname, fname ) == 0);
+  }
+  MPI_Bcast( &ok, 1, MPI_INT, 0, MPI_COMM_WORLD );
+
+  return ok;
+}
@@ -1,5 +1,8 @@
 #include "cmd_args.h"
 
+#include "constants.h"
+
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -11,6 +14,16 @@ void usage( char *name )
   printf(
 "USAGE:\n"
 "  %s [-h] [-d NUM_DENDR] [-c NUM_COMPARTMENTS]\n"
+"         [--morphology FILE] [--batch FILE] [-k KERNEL] [-t NUM_THREADS]\n"
+"         [--validate] [--rng GENERATOR] [--seed SEED]\n"
+"         [--sync MODE] [--overlap] [--window STEPS] [--tolerance MV]\n"
+"         [--decompose MODE] [--rebalance MS] [--rebalance-threshold X]\n"
+"         [--reference FILE] [--integrator METHOD] [--steps N]\n"
+"         [--adaptive] [--substeps M] [--time MS] [--grid N]\n"
+"         [--inj-mean PA] [--g-comp NS] [--g-distr NS] [--g-na NS]\n"
+"         [--g-k NS] [--g-l NS] [--g-ld NS] [--sample N] [--format FORMAT]\n"
+"         [--record FILE] [--record-every N] [--checkpoint FILE]\n"
+"         [--checkpoint-every MS] [--restart FILE]\n"
 "\n"
 "DESCRIPTION:\n"
 "  Simulates a neuron using a Hodgkin Huxley simplified compartamental neuron\n"
@@ -23,6 +36,7 @@ void usage( char *name )
 "\n"
 "  The results filename will be of the form:\n"
 "     data/pWWdXXcYY_MMDDYY_HHMMSS.dat\n"
+"  or .bin for binary traces,\n"
 "  where 'WW' is the number of processes used, 'XX' the number of dendrites,\n"
 "  'YY' the number of compartments, and 'MMDDYY_...' the time at which the\n"
 "  simulation was run.\n"
@@ -49,7 +63,311 @@ void usage( char *name )
 "    The number of compartments per dendrite. Must be greater than 0. Default\n"
 "    is one.\n"
 "\n"
-, name );
+"  --morphology\n"
+"    File giving the compartments of each dendrite, for neurons whose\n"
+"    dendrites differ in length. One 'DENDRITE COMPARTMENTS' line per\n"
+"    dendrite, numbered from 0 in any order, in the manner of SWC files;\n"
+"    '#' starts a comment. Sets the number of dendrites, so -d and -c are\n"
+"    ignored; file names carry the largest number of compartments. Can't\n"
+"    be used with --record, --checkpoint or --restart.\n"
+"\n"
+"  --batch\n"
+"    Have seq_hh simulate many neurons with the same dendrites instead of\n"
+"    one, %d at a time with vector instructions. The first line of the file\n"
+"    that is not blank or a '#' comment names the columns, from 'inj-mean',\n"
+"    'g-comp', 'g-distr', 'g-na', 'g-k', 'g-l', 'g-ld' and 'seed'; every\n"
+"    further line is a neuron, whose other parameters are those of the\n"
+"    command line. Each neuron gets its own data file, ending in _nN, the\n"
+"    same bit for bit as that of a run of it alone on one thread; -t\n"
+"    splits the neurons between threads. Only 'rk4' steps with the\n"
+"    'counter' generator; -k is ignored, and --adaptive, --validate,\n"
+"    --record, --checkpoint, --restart and --reference can't be used.\n"
+"\n"
+"  -k, --kernel\n"
+"    The kernel used to step the dendrites. One of:\n"
+"      scalar  one dendrite at a time (default).\n"
+"      simd    %d dendrites at a time with vector instructions. Dendrite\n"
+"              potentials are stored compartment-major, in batches of\n"
+"              dendrites of the same length. Gives the same results as\n"
+"              'scalar'.\n"
+"      fused   one dendrite at a time, walking the compartments once with\n"
+"              precomputed conductances. Gives the same results as 'scalar'.\n"
+"\n"
+"  -t, --threads\n"
+"    The number of threads stepping the dendrites. The dendrites are split\n"
+"    by compartment count between a pool of threads that live for the\n"
+"    whole run and meet at a barrier twice per integration step; the soma\n"
+"    is stepped by the main thread. Must be greater than 0. Defaults to\n"
+"    one.\n"
+"\n"
+"  --validate\n"
+"    Also step every dendrite with the 'scalar' kernel and report the largest\n"
+"    difference between it and the selected kernel at the end of the run.\n"
+"\n"
+"  --rng\n"
+"    The generator of the current injected at the dendrite tips. One of:\n"
+"      counter  stateless counter-based generator keyed on the dendrite and\n"
+"               the integration step (default). Results do not depend on\n"
+"               how dendrites are split between threads or processes.\n"
+"      compat   reproduces the srand()/rand() stream of earlier versions so\n"
+"               old traces can be regenerated.\n"
+"\n"
+"  --seed\n"
+"    Seed of the 'counter' generator. Defaults to 1.\n"
+"\n"
+"  --sync\n"
+"    How mpi_hh exchanges the soma potential and the dendritic currents every\n"
+"    integration step. Ignored by seq_hh. One of:\n"
+"      star  rank 0 sends the potential and the integration step to every\n"
+"            worker and receives their currents one by one (default).\n"
+"      coll  MPI_Bcast of the potential and MPI_Reduce of the currents.\n"
+"      tree  the same over binomial trees of point-to-point messages.\n"
+"    'coll' and 'tree' send the integration step only once, unless it is\n"
+"    '--adaptive'. The currents are added in a different order in each\n"
+"    mode, so results may differ in the last bits.\n"
+"\n"
+"  --overlap\n"
+"    Have the mpi_hh workers step all but the compartments next to the soma\n"
+"    while the new soma potential is on its way, hiding most of the latency\n"
+"    of the exchange behind that work. Gives the same results. Ignored by\n"
+"    seq_hh.\n"
+"\n"
+"  --window\n"
+"    Have mpi_hh synchronise once per window of this many integration steps\n"
+"    instead of every step (waveform relaxation). The workers step the whole\n"
+"    window against a guess of the soma potential and send back the current\n"
+"    of every step in one message; the soma then steps the window, and the\n"
+"    window is stepped again with the new soma potential until it changes by\n"
+"    less than the tolerance. 0 (the default) synchronises every step.\n"
+"    Ignored by seq_hh.\n"
+"\n"
+"  --decompose\n"
+"    How mpi_hh splits the work between its processes. Ignored by seq_hh.\n"
+"    One of:\n"
+"      auto          'dendrites', saying so where 'compartments' is\n"
+"                    expected to be faster (default).\n"
+"      dendrites     whole dendrites, longest first.\n"
+"      compartments  the dendrites are laid end to end and cut into one\n"
+"                    run of compartments per process, so that a few long\n"
+"                    dendrites keep many processes busy. Neighbouring runs\n"
+"                    of a dendrite swap their boundary potentials every\n"
+"                    step, a step late. The dendrite step is near the\n"
+"                    stability limit, so this is not a small change: the\n"
+"                    soma potential may be mV off around spikes, and a\n"
+"                    warning is printed. Always uses the 'fused' kernel. Only\n"
+"                    for lock-step 'rk4' runs on one thread per process,\n"
+"                    without --overlap, --validate, --record, --checkpoint,\n"
+"                    --restart or --rebalance.\n"
+"\n"
+"  --rebalance\n"
+"    Have mpi_hh check the load of its processes every this many simulated\n"
+"    ms and, if the busiest one spent more than --rebalance-threshold times\n"
+"    the mean stepping since the last check, move dendrites from slow to\n"
+"    fast processes. Every check and move is logged. 0 (the default) never\n"
+"    checks. Whole dendrites only; can't be used with --adaptive, --window,\n"
+"    --validate, --record, --checkpoint or --restart. Ignored by seq_hh.\n"
+"\n"
+"  --rebalance-threshold\n"
+"    Busiest process over the mean above which --rebalance moves\n"
+"    dendrites. Defaults to 1.1.\n"
+"\n"
+"  --tolerance\n"
+"    Largest change of the soma potential, in mV, between two iterations of\n"
+"    a window for it to be accepted. Also the largest last term of the\n"
+"    'ps' series and the largest error estimate of an '--adaptive' step.\n"
+"    Defaults to 1e-6.\n"
+"\n"
+"  --reference\n"
+"    Data file of an earlier run. At the end of the simulation, report the\n"
+"    largest difference between its trace and the new one.\n"
+"\n"
+"  --integrator\n"
+"    How the dendrites are integrated. The soma is stepped with RK4 unless\n"
+"    'ps' is used. One of:\n"
+"      rk4  explicit RK4, compartment by compartment (default). Only stable\n"
+"           for the default step.\n"
+"      be   backward Euler, one tridiagonal solve per dendrite and step.\n"
+"      cn   Crank-Nicolson, the same with second order accuracy.\n"
+"      ps   Parker-Sochacki power series of the soma and the dendrites\n"
+"           together, adding terms until the last one is below the\n"
+"           tolerance. Only seq_hh; steps on one thread.\n"
+"\n"
+"  --steps\n"
+"    Integration steps per ms. Must divide the --grid steps, which is the\n"
+"    default. With fewer steps the current injected at a dendrite tip during\n"
+"    a step is the mean of the draws of the grid steps it covers.\n"
+"\n"
+"  --adaptive\n"
+"    Step the soma with an embedded Runge-Kutta pair (Dormand-Prince 5(4))\n"
+"    and pick the size of every step from its error estimate: long steps\n"
+"    between spikes, short ones around them. The dendrites follow the same\n"
+"    steps, which are whole numbers of default steps and never cross a ms.\n"
+"    The error of the dendrites is not estimated: they only shorten the\n"
+"    next step when their current into the soma changes fast. Needs the\n"
+"    'be' or 'cn' integrator, as 'rk4' dendrites are only stable at the\n"
+"    default step. --steps is ignored; --window and --overlap can't be used.\n"
+"\n"
+"  --substeps\n"
+"    Soma steps per dendrite step (multi-rate integration). The soma takes\n"
+"    M steps of the size set by --steps for every step of the dendrites,\n"
+"    with the dendritic current interpolated linearly between the ends of\n"
+"    the dendrite steps; mpi_hh exchanges once per dendrite step. M must\n"
+"    divide the steps per ms. Dendrite steps longer than the default are\n"
+"    only stable with 'be' or 'cn'. Defaults to 1.\n"
+"\n"
+"MODEL OPTIONS:\n"
+"  --time\n"
+"    Number of samples of the soma potential at whole ms; the run covers\n"
+"    one ms less. Defaults to %d.\n"
+"\n"
+"  --grid\n"
+"    Steps per ms of the finest integration grid, on which the currents\n"
+"    injected at the dendrite tips are drawn. Defaults to %d.\n"
+"\n"
+"  --inj-mean\n"
+"    Mean of the current injected at a dendrite tip, in pA. Draws are\n"
+"    within 10%% of it. Defaults to %d.\n"
+"\n"
+"  --g-comp, --g-distr\n"
+"    Conductance between two dendrite compartments, in nS, and its rise\n"
+"    towards the soma: the conductance n compartments away from the soma is\n"
+"    g-comp + floor(g-distr / n). Default to %d and %d.\n"
+"\n"
+"  --g-na, --g-k, --g-l\n"
+"    Na, K and leak conductances of the soma, in nS. Default to 20000, 6000\n"
+"    and 10.\n"
+"\n"
+"  --g-ld\n"
+"    Leak conductance of a dendrite compartment, in nS. Defaults to 0.01.\n"
+"\n"
+"OUTPUT OPTIONS:\n"
+"  --sample\n"
+"    Samples of the soma potential written per ms. Must divide the\n"
+"    integration steps per ms. The trace is written as the simulation\n"
+"    goes, so any rate and length can be recorded. Defaults to 1.\n"
+"\n"
+"  --format\n"
+"    Format of the data file. One of:\n"
+"      text    '#' comment lines, then one 'time potential' line per\n"
+"              sample (default).\n"
+"      binary  the 8 bytes 'HHTRACE1', the sample interval in ms as a\n"
+"              double, then one double per sample from time 0. Less\n"
+"              than half the size, and faster to write.\n"
+"\n"
+"  --record\n"
+"    Also record the potential of every dendrite compartment to this file,\n"
+"    in chunks of frames (see include/record.h). seq_hh writes it through a\n"
+"    memory map; every rank of mpi_hh writes its own dendrites with MPI-IO.\n"
+"    Read it back with record_hh. Can't be used with --adaptive or --window.\n"
+"\n"
+"  --record-every\n"
+"    Integration steps between two frames of the recording. Must be a\n"
+"    multiple of --substeps. Defaults to the steps per ms.\n"
+"\n"
+"CHECKPOINT OPTIONS:\n"
+"  --checkpoint\n"
+"    Save the state of the run to this file every --checkpoint-every ms:\n"
+"    the soma, every dendrite compartment, the ms reached and how far the\n"
+"    trace went. Every rank of mpi_hh writes its own dendrites with MPI-IO.\n"
+"    The previous checkpoint is only replaced once the new one is complete.\n"
+"\n"
+"  --checkpoint-every\n"
+"    Simulated ms between checkpoints. Defaults to %d.\n"
+"\n"
+"  --restart\n"
+"    Continue the run saved in this checkpoint. The options must be those\n"
+"    of the saved run, except --time, which may be longer; the trace is\n"
+"    cut back to the checkpoint and continued in the same data file. The\n"
+"    trace is the same, bit for bit, as that of an uninterrupted run (in\n"
+"    mpi_hh, with the same ranks, threads and --sync mode).\n"
+"\n"
+"    --checkpoint and --restart can't be used with --adaptive, --window,\n"
+"    --record or --validate.\n"
+"\n"
+, name, HH_VLEN, HH_VLEN, COMPTIME, STEPS, INJCURMEAN, DENDRCONDCOMP,
+DENDRCONDDISTR, CKPT_EVERY );
+}
+
+/**
+ * Name: loadMorphology
+ *
+ * Description:
+ * Reads the compartments of every dendrite from the morphology file, and
+ * sets the number of dendrites and the largest number of compartments from
+ * it.
+ *
+ * Parameters:
+ * @param cmd_args  (INOUT) the arguments, `morphology' set
+ *
+ * Returns:
+ * @return int      0 if the file can't be read or is not valid, nonzero
+ *                  otherwise
+ */
+static int loadMorphology( CmdArgs *cmd_args )
+{
+  FILE *file;
+  char line[256], *p;
+  int pass, num_lines, id, comps, count = 0, ok = 1;
+
+  if ((file = fopen( cmd_args->morphology, "r" )) == NULL) {
+    fprintf(stderr, "Can't open morphology %s!\n", cmd_args->morphology);
+    return 0;
+  }
+
+  // The first pass counts the dendrites, the second one reads them.
+  for (pass = 0; pass < 2 && ok; pass++) {
+    rewind( file );
+    num_lines = 0;
+    while (ok && fgets( line, sizeof(line), file ) != NULL) {
+      num_lines++;
+      p = line;
+      while (isspace( (unsigned char) *p )) {
+        p++;
+      }
+      if (*p == '\0' || *p == '#') {
+        continue;
+      }
+      if (pass == 0) {
+        count++;
+      } else if (sscanf( p, "%d %d", &id, &comps ) != 2 || id < 0 ||
+                 id >= count || comps <= 0 || cmd_args->comps[id] != 0) {
+        fprintf(stderr, "%s:%d: expected a new dendrite, from 0 to %d, and "
+                "its compartments!\n", cmd_args->morphology, num_lines,
+                count - 1);
+        ok = 0;
+      } else {
+        cmd_args->comps[id] = comps;
+      }
+    }
+
+    if (pass == 0) {
+      if (count == 0) {
+        fprintf(stderr, "%s has no dendrites!\n", cmd_args->morphology);
+        ok = 0;
+      } else if ((cmd_args->comps = (int*) hhMalloc( sizeof(int) * count ))
+                 == NULL) {
+        fprintf(stderr, "Could not allocate the morphology!\n");
+        ok = 0;
+      } else {
+        memset( cmd_args->comps, 0, sizeof(int) * count );
+      }
+    }
+  }
+  fclose( file );
+
+  if (!ok) {
+    return 0;
+  }
+
+  cmd_args->num_dendrs = count;
+  cmd_args->num_comps = 0;
+  for (id = 0; id < count; id++) {
+    if (cmd_args->comps[id] > cmd_args->num_comps) {
+      cmd_args->num_comps = cmd_args->comps[id];
+    }
+  }
+
+  return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -61,6 +379,34 @@ int parseArgs( CmdArgs *cmd_args, int argc, char **argv )
   // Setup default values.
   cmd_args->num_dendrs = 1;
   cmd_args->num_comps  = 1;
+  cmd_args->morphology = NULL;
+  cmd_args->comps      = NULL;
+  cmd_args->batch      = NULL;
+  cmd_args->kernel     = KERNEL_SCALAR;
+  cmd_args->validate   = 0;
+  cmd_args->rng        = RNG_COUNTER;
+  cmd_args->seed       = 1;
+  cmd_args->num_threads = 1;
+  cmd_args->sync       = SYNC_STAR;
+  cmd_args->overlap    = 0;
+  cmd_args->window     = 0;
+  cmd_args->decompose  = DECOMPOSE_AUTO;
+  cmd_args->rebalance  = 0;
+  cmd_args->rebalance_threshold = 1.1;
+  cmd_args->tolerance  = 1e-6;
+  cmd_args->reference  = NULL;
+  cmd_args->integrator = INTEGRATOR_RK4;
+  cmd_args->steps      = 0;     // The grid, see below.
+  cmd_args->adaptive   = 0;
+  cmd_args->substeps   = 1;
+  hhParamsDefault( &cmd_args->params );
+  cmd_args->sample_rate = 1;
+  cmd_args->format     = TRACE_TEXT;
+  cmd_args->record     = NULL;
+  cmd_args->record_every = 0;   // Once per ms, see below.
+  cmd_args->checkpoint = NULL;
+  cmd_args->checkpoint_every = CKPT_EVERY;
+  cmd_args->restart    = NULL;
 
   // Define a macro to make checking parameters easier.
   #define PARAM_EQUALS( sn, ln ) (strcmp( (sn), argv[i] ) == 0 ||\
@@ -96,6 +442,246 @@ int parseArgs( CmdArgs *cmd_args, int argc, char **argv )
       }
 
       i += 2;
+    } else if (strcmp( "--morphology", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->morphology = argv[i+1];
+
+      i += 2;
+    } else if (strcmp( "--batch", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->batch = argv[i+1];
+
+      i += 2;
+    } else if (PARAM_EQUALS( "-k", "--kernel" ) && i+1 < argc) {
+      if (strcmp( argv[i+1], "scalar" ) == 0) {
+        cmd_args->kernel = KERNEL_SCALAR;
+      } else if (strcmp( argv[i+1], "simd" ) == 0) {
+        cmd_args->kernel = KERNEL_SIMD;
+      } else if (strcmp( argv[i+1], "fused" ) == 0) {
+        cmd_args->kernel = KERNEL_FUSED;
+      } else {
+        fprintf(stderr, "Unknown kernel '%s'!\n", argv[i+1]);
+        return 0;
+      }
+
+      i += 2;
+    } else if (PARAM_EQUALS( "-t", "--threads" ) && i+1 < argc) {
+      cmd_args->num_threads = atoi( argv[i+1] );
+
+      if (cmd_args->num_threads <= 0) {
+        fprintf(stderr, "Number of threads must be greater than 0!\n");
+        fprintf(stderr, "Number of threads default to 1!\n");
+        cmd_args->num_threads = 1;
+      }
+
+      i += 2;
+    } else if (strcmp( "--rng", argv[i] ) == 0 && i+1 < argc) {
+      if (strcmp( argv[i+1], "counter" ) == 0) {
+        cmd_args->rng = RNG_COUNTER;
+      } else if (strcmp( argv[i+1], "compat" ) == 0) {
+        cmd_args->rng = RNG_COMPAT;
+      } else {
+        fprintf(stderr, "Unknown generator '%s'!\n", argv[i+1]);
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--sync", argv[i] ) == 0 && i+1 < argc) {
+      if (strcmp( argv[i+1], "star" ) == 0) {
+        cmd_args->sync = SYNC_STAR;
+      } else if (strcmp( argv[i+1], "coll" ) == 0) {
+        cmd_args->sync = SYNC_COLL;
+      } else if (strcmp( argv[i+1], "tree" ) == 0) {
+        cmd_args->sync = SYNC_TREE;
+      } else {
+        fprintf(stderr, "Unknown synchronisation mode '%s'!\n", argv[i+1]);
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--decompose", argv[i] ) == 0 && i+1 < argc) {
+      if (strcmp( argv[i+1], "auto" ) == 0) {
+        cmd_args->decompose = DECOMPOSE_AUTO;
+      } else if (strcmp( argv[i+1], "dendrites" ) == 0) {
+        cmd_args->decompose = DECOMPOSE_DENDRITES;
+      } else if (strcmp( argv[i+1], "compartments" ) == 0) {
+        cmd_args->decompose = DECOMPOSE_COMPARTMENTS;
+      } else {
+        fprintf(stderr, "Unknown decomposition '%s'!\n", argv[i+1]);
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--rebalance", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->rebalance = atoi( argv[i+1] );
+
+      if (cmd_args->rebalance < 0) {
+        fprintf(stderr, "Time between load checks can't be negative!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--rebalance-threshold", argv[i] ) == 0 &&
+               i+1 < argc) {
+      cmd_args->rebalance_threshold = atof( argv[i+1] );
+
+      if (cmd_args->rebalance_threshold < 1.0) {
+        fprintf(stderr, "Rebalance threshold must be at least 1!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--integrator", argv[i] ) == 0 && i+1 < argc) {
+      if (strcmp( argv[i+1], "rk4" ) == 0) {
+        cmd_args->integrator = INTEGRATOR_RK4;
+      } else if (strcmp( argv[i+1], "be" ) == 0) {
+        cmd_args->integrator = INTEGRATOR_BE;
+      } else if (strcmp( argv[i+1], "cn" ) == 0) {
+        cmd_args->integrator = INTEGRATOR_CN;
+      } else if (strcmp( argv[i+1], "ps" ) == 0) {
+        cmd_args->integrator = INTEGRATOR_PS;
+      } else {
+        fprintf(stderr, "Unknown integrator '%s'!\n", argv[i+1]);
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--steps", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->steps = atoi( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--substeps", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->substeps = atoi( argv[i+1] );
+
+      if (cmd_args->substeps <= 0) {
+        fprintf(stderr, "Soma steps per dendrite step must be positive!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--time", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.comp_time = atoi( argv[i+1] );
+
+      if (cmd_args->params.comp_time <= 0) {
+        fprintf(stderr, "Simulation time must be greater than 0!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--grid", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.steps = atoi( argv[i+1] );
+
+      if (cmd_args->params.steps <= 0) {
+        fprintf(stderr, "Grid steps per ms must be greater than 0!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--inj-mean", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.inj_mean = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--g-comp", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.g_comp = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--g-distr", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.g_distr = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--g-na", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.g_na = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--g-k", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.g_k = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--g-l", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.g_l = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--g-ld", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->params.g_ld = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--sample", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->sample_rate = atoi( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--format", argv[i] ) == 0 && i+1 < argc) {
+      if (strcmp( argv[i+1], "text" ) == 0) {
+        cmd_args->format = TRACE_TEXT;
+      } else if (strcmp( argv[i+1], "binary" ) == 0) {
+        cmd_args->format = TRACE_BINARY;
+      } else {
+        fprintf(stderr, "Unknown trace format '%s'!\n", argv[i+1]);
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--record", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->record = argv[i+1];
+
+      i += 2;
+    } else if (strcmp( "--record-every", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->record_every = atoi( argv[i+1] );
+
+      if (cmd_args->record_every <= 0) {
+        fprintf(stderr, "Steps between frames must be greater than 0!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--checkpoint", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->checkpoint = argv[i+1];
+
+      i += 2;
+    } else if (strcmp( "--checkpoint-every", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->checkpoint_every = atoi( argv[i+1] );
+
+      if (cmd_args->checkpoint_every <= 0) {
+        fprintf(stderr, "Time between checkpoints must be greater than 0!\n");
+        return 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--restart", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->restart = argv[i+1];
+
+      i += 2;
+    } else if (strcmp( "--seed", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->seed = strtoull( argv[i+1], NULL, 0 );
+
+      i += 2;
+    } else if (strcmp( "--window", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->window = atoi( argv[i+1] );
+
+      if (cmd_args->window < 0) {
+        fprintf(stderr, "Window size must not be negative!\n");
+        fprintf(stderr, "Window size default to 0!\n");
+        cmd_args->window = 0;
+      }
+
+      i += 2;
+    } else if (strcmp( "--tolerance", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->tolerance = atof( argv[i+1] );
+
+      i += 2;
+    } else if (strcmp( "--reference", argv[i] ) == 0 && i+1 < argc) {
+      cmd_args->reference = argv[i+1];
+
+      i += 2;
+    } else if (strcmp( "--overlap", argv[i] ) == 0) {
+      cmd_args->overlap = 1;
+
+      i += 1;
+    } else if (strcmp( "--adaptive", argv[i] ) == 0) {
+      cmd_args->adaptive = 1;
+
+      i += 1;
+    } else if (strcmp( "--validate", argv[i] ) == 0) {
+      cmd_args->validate = 1;
+
+      i += 1;
     } else {
       // Unknown parameter.
       usage( argv[0] );
@@ -103,6 +689,144 @@ int parseArgs( CmdArgs *cmd_args, int argc, char **argv )
     }
   }
 
+  // Explicit RK4 dendrites blow up at steps past the default one, so the
+  // controller could never grow the step.
+  if (cmd_args->adaptive && cmd_args->integrator == INTEGRATOR_RK4) {
+    fprintf(stderr, "--adaptive needs '--integrator be' or 'cn': 'rk4' "
+            "dendrites are only stable at the default step!\n");
+    return 0;
+  }
+  if (cmd_args->adaptive && cmd_args->integrator == INTEGRATOR_PS) {
+    fprintf(stderr, "--adaptive can't be used with the 'ps' integrator!\n");
+    return 0;
+  }
+  if (cmd_args->adaptive && (cmd_args->window > 0 || cmd_args->overlap)) {
+    fprintf(stderr, "--adaptive can't be used with --window or --overlap!\n");
+    return 0;
+  }
+
+  // Integration steps default to the grid, and adaptive runs count their
+  // steps in units of it.
+  if (cmd_args->steps == 0 || cmd_args->adaptive) {
+    cmd_args->steps = cmd_args->params.steps;
+  }
+
+  // Checks that depend on more than one option.
+  if (cmd_args->steps <= 0 || cmd_args->params.steps % cmd_args->steps != 0) {
+    fprintf(stderr, "Steps per ms must divide %d!\n", cmd_args->params.steps);
+    return 0;
+  }
+  if (cmd_args->sample_rate <= 0 ||
+      cmd_args->steps % cmd_args->sample_rate != 0) {
+    fprintf(stderr, "Samples per ms must divide %d!\n", cmd_args->steps);
+    return 0;
+  }
+  if (cmd_args->steps % cmd_args->substeps != 0) {
+    fprintf(stderr, "Soma steps per dendrite step must divide %d!\n",
+            cmd_args->steps);
+    return 0;
+  }
+  if (cmd_args->substeps > 1 &&
+      (cmd_args->adaptive || cmd_args->window > 0 ||
+       cmd_args->integrator == INTEGRATOR_PS)) {
+    fprintf(stderr, "--substeps can't be used with --adaptive, --window or "
+            "the 'ps' integrator!\n");
+    return 0;
+  }
+
+  if (cmd_args->record_every == 0) {
+    cmd_args->record_every = cmd_args->steps;
+  }
+  if (cmd_args->record != NULL &&
+      (cmd_args->adaptive || cmd_args->window > 0)) {
+    fprintf(stderr, "--record can't be used with --adaptive or --window!\n");
+    return 0;
+  }
+  if (cmd_args->record_every % cmd_args->substeps != 0) {
+    fprintf(stderr, "Steps between frames must be a multiple of %d!\n",
+            cmd_args->substeps);
+    return 0;
+  }
+
+  if ((cmd_args->checkpoint != NULL || cmd_args->restart != NULL) &&
+      (cmd_args->adaptive || cmd_args->window > 0 ||
+       cmd_args->record != NULL || cmd_args->validate)) {
+    fprintf(stderr, "--checkpoint and --restart can't be used with "
+            "--adaptive, --window, --record or --validate!\n");
+    return 0;
+  }
+
+  // Runs of compartments are only stepped in the plain lock-step loop.
+  if (cmd_args->integrator != INTEGRATOR_RK4 || cmd_args->adaptive ||
+      cmd_args->window > 0 || cmd_args->overlap || cmd_args->validate ||
+      cmd_args->num_threads > 1 || cmd_args->record != NULL ||
+      cmd_args->checkpoint != NULL || cmd_args->restart != NULL ||
+      cmd_args->rebalance > 0) {
+    if (cmd_args->decompose == DECOMPOSE_COMPARTMENTS) {
+      fprintf(stderr, "--decompose compartments needs the 'rk4' integrator "
+              "and one thread, and can't be used with --adaptive, "
+              "--window, --overlap, --validate, --record, --checkpoint, "
+              "--restart or --rebalance!\n");
+      return 0;
+    }
+    cmd_args->decompose = DECOMPOSE_DENDRITES;
+  }
+
+  // Dendrites only migrate between the steps of the lock-step loop, and
+  // nothing else may keep track of which rank has them.
+  if (cmd_args->rebalance > 0 &&
+      (cmd_args->adaptive || cmd_args->window > 0 || cmd_args->validate ||
+       cmd_args->record != NULL || cmd_args->checkpoint != NULL ||
+       cmd_args->restart != NULL)) {
+    fprintf(stderr, "--rebalance can't be used with --adaptive, --window, "
+            "--validate, --record, --checkpoint or --restart!\n");
+    return 0;
+  }
+
+  // Batches of neurons are only stepped in the plain fixed-step loop.
+  if (cmd_args->batch != NULL &&
+      (cmd_args->integrator != INTEGRATOR_RK4 || cmd_args->adaptive ||
+       cmd_args->rng != RNG_COUNTER || cmd_args->validate ||
+       cmd_args->record != NULL || cmd_args->checkpoint != NULL ||
+       cmd_args->restart != NULL || cmd_args->reference != NULL)) {
+    fprintf(stderr, "--batch needs the 'rk4' integrator and the 'counter' "
+            "generator, and can't be used with --adaptive, --validate, "
+            "--record, --checkpoint, --restart or --reference!\n");
+    return 0;
+  }
+
+  if (cmd_args->morphology != NULL) {
+    if (cmd_args->record != NULL || cmd_args->checkpoint != NULL ||
+        cmd_args->restart != NULL) {
+      fprintf(stderr, "--morphology can't be used with --record, "
+              "--checkpoint or --restart!\n");
+      return 0;
+    }
+    if (!loadMorphology( cmd_args )) {
+      return 0;
+    }
+  }
+
   // Everything seems hunky dorey.
   return 1;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int *dendriteComps( const CmdArgs *cmd_args )
+{
+  int d;
+  int *comps = (int*) hhMalloc( sizeof(int) * cmd_args->num_dendrs );
+
+  if (comps == NULL) {
+    return NULL;
+  }
+
+  // The first compartment is a dummy and the last is connected to the soma.
+  for (d = 0; d < cmd_args->num_dendrs; d++) {
+    comps[d] = (cmd_args->comps ? cmd_args->comps[d] : cmd_args->num_comps)
+             + 2;
+  }
+
+  return comps;
+}
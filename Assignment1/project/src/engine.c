@@ -0,0 +1,1027 @@
+/*
+  Multiple Processor Systems.
+
+  Dendrite stepping engine. Holds the state of a set of dendrites and steps it
+  with the kernel chosen on the command line.
+*/
+
+#include "engine.h"
+#include "constants.h"
+#include "partition.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Alignment of the potential block, one cache line (and one AVX-512 vector).
+#define ENGINE_ALIGN 64
+// Potentials per cache line; the share of every thread starts on a new one.
+#define ENGINE_PAD (ENGINE_ALIGN / (int) sizeof(double))
+
+/**
+ * A dendrite to place, sorted by engineCreate.
+ */
+typedef struct EngineOrder {
+  int comps;
+  int d;
+} EngineOrder;
+
+/**
+ * Name: orderCompare
+ *
+ * Description:
+ * qsort comparison of two EngineOrder: decreasing compartments, then
+ * increasing dendrite.
+ *
+ * Parameters:
+ * @param a             (INPUT) first dendrite
+ * @param b             (INPUT) second dendrite
+ *
+ * Returns:
+ * @return int          negative if `a' goes first, positive otherwise
+ */
+static int orderCompare( const void *a, const void *b )
+{
+  const EngineOrder *x = (const EngineOrder*) a;
+  const EngineOrder *y = (const EngineOrder*) b;
+
+  if (x->comps != y->comps) {
+    return (x->comps > y->comps) ? -1 : 1;
+  }
+  return x->d - y->d;
+}
+
+/**
+ * Name: intCompare
+ *
+ * Description:
+ * qsort comparison of two ints, in increasing order.
+ *
+ * Parameters:
+ * @param a             (INPUT) first int
+ * @param b             (INPUT) second int
+ *
+ * Returns:
+ * @return int          negative if `a' goes first, positive otherwise
+ */
+static int intCompare( const void *a, const void *b )
+{
+  return *(const int*) a - *(const int*) b;
+}
+
+/**
+ * Name: engineClock
+ *
+ * Description:
+ * Reads the monotonic clock.
+ *
+ * Returns:
+ * @return double       the time, in seconds
+ */
+static double engineClock( void )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/**
+ * Name: batchComps
+ *
+ * Description:
+ * Compartments of the dendrites of a batch (SIMD layout). The first lane of
+ * a batch is never padding.
+ *
+ * Parameters:
+ * @param eng           (INPUT) the engine
+ * @param b             (INPUT) index of the batch
+ *
+ * Returns:
+ * @return int          compartments of every dendrite of the batch
+ */
+static inline int batchComps( const Engine *eng, int b )
+{
+  return eng->comps[eng->lanes[b * HH_VLEN]];
+}
+
+/**
+ * Name: initShare
+ *
+ * Description:
+ * Pool work that sets the potentials of one thread's share to the rest
+ * voltage. Run by the thread that will step them, so that their pages are
+ * first touched, and therefore placed, on its NUMA node.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the engine
+ * @param id            (INPUT) index of the calling thread
+ */
+static void initShare( void *arg, int id )
+{
+  Engine *eng = (Engine*) arg;
+  EngineThread *th = &eng->threads[id];
+  int i, d;
+  size_t c;
+  double *v = eng->volt + th->first_volt;
+
+  for (c = 0; c < th->num_volts; c++) {
+    v[c] = VREST;
+  }
+
+  for (i = 0; i < th->num_dendrs; i++) {
+    d = th->dendrs[i];
+    eng->cur[d] = 0.0;
+    eng->current[d] = 0.0;
+  }
+}
+
+/**
+ * Name: splitThreads
+ *
+ * Description:
+ * Splits the dendrites (SIMD: batches) of the engine between its threads.
+ * If they all have as many compartments the shares are contiguous and even,
+ * otherwise they are packed by partitionLPT on their compartment counts.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine, layout set up
+ *
+ * Returns:
+ * @return int          0 if out of memory, nonzero otherwise
+ */
+static int splitThreads( Engine *eng )
+{
+  int u, t, lane, d, uniform = 1, ok = 1;
+  int const simd = (eng->kernel == KERNEL_SIMD);
+  int const units = simd ? eng->num_batches : eng->num_dendrs;
+  double *cost = (double*) hhMalloc( sizeof(double) * (units + 1) );
+  double *load = (double*) hhMalloc( sizeof(double) * eng->num_threads );
+  int *owner = (int*) hhMalloc( sizeof(int) * (units + 1) );
+  EngineThread *th;
+
+  if (cost == NULL || load == NULL || owner == NULL) {
+    ok = 0;
+  } else {
+    for (u = 0; u < units; u++) {
+      cost[u] = simd ? batchComps( eng, u ) : eng->comps[u];
+      uniform = uniform && (cost[u] == cost[0]);
+    }
+    for (t = 0; t < eng->num_threads; t++) {
+      load[t] = 0.0;
+    }
+
+    if (uniform) {
+      for (t = 0; t < eng->num_threads; t++) {
+        for (u = (int) ((long) units * t / eng->num_threads);
+             u < (int) ((long) units * (t+1) / eng->num_threads); u++) {
+          owner[u] = t;
+        }
+      }
+    } else {
+      ok = partitionLPT( units, cost, eng->num_threads, load, owner );
+    }
+  }
+
+  // Count the share of each thread, then list it.
+  for (u = 0; u < units && ok; u++) {
+    th = &eng->threads[owner[u]];
+    th->num_units++;
+    th->cost += cost[u];
+    for (lane = 0; lane < (simd ? HH_VLEN : 1); lane++) {
+      th->num_dendrs += (!simd || eng->lanes[u * HH_VLEN + lane] >= 0);
+    }
+  }
+  for (t = 0; t < eng->num_threads && ok; t++) {
+    th = &eng->threads[t];
+    th->units  = (int*) hhMalloc( sizeof(int) * (th->num_units + 1) );
+    th->dendrs = (int*) hhMalloc( sizeof(int) * (th->num_dendrs + 1) );
+    ok = (th->units != NULL && th->dendrs != NULL);
+    th->num_units = 0;
+    th->num_dendrs = 0;
+  }
+  for (u = 0; u < units && ok; u++) {
+    th = &eng->threads[owner[u]];
+    th->units[th->num_units++] = u;
+    for (lane = 0; lane < (simd ? HH_VLEN : 1); lane++) {
+      d = simd ? eng->lanes[u * HH_VLEN + lane] : u;
+      if (d >= 0) {
+        th->dendrs[th->num_dendrs++] = d;
+      }
+    }
+  }
+  for (t = 0; t < eng->num_threads && ok && simd; t++) {
+    th = &eng->threads[t];
+    qsort( th->dendrs, th->num_dendrs, sizeof(int), intCompare );
+  }
+
+  free( cost );
+  free( load );
+  free( owner );
+
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+Engine *engineCreate( HHKernel kernel, int num_dendrs, const int *gids,
+                      int num_comps, const int *comps, const HHRng *rng,
+                      int num_threads )
+{
+  int d, i, b, s, t, lane, run;
+  size_t count;
+  double *v;
+  EngineThread *th;
+  EngineOrder *order;
+  Engine *eng = (Engine*) hhMalloc( sizeof(Engine) );
+
+  if (eng == NULL) {
+    return NULL;
+  }
+  memset( eng, 0, sizeof(Engine) );
+
+  eng->kernel      = kernel;
+  eng->num_dendrs  = num_dendrs;
+  eng->num_comps   = num_comps;
+  eng->rng         = rng;
+  eng->num_threads = num_threads;
+  eng->integrator  = INTEGRATOR_RK4;
+  eng->draws       = 1;
+  eng->pitch       = (kernel == KERNEL_SIMD) ? HH_VLEN : 1;
+
+  eng->gids     = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  eng->comps    = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  eng->shape    = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  eng->rows     = (double**) hhMalloc( sizeof(double*) * num_dendrs );
+  eng->offset   = (size_t*) hhMalloc( sizeof(size_t) * (num_dendrs + 1) );
+  eng->cur      = (double*) hhMalloc( sizeof(double) * num_dendrs );
+  eng->current  = (double*) hhMalloc( sizeof(double) * num_dendrs );
+  eng->threads  = (EngineThread*) hhMallocAligned( CACHE_LINE,
+                                                   sizeof(EngineThread) *
+                                                   num_threads );
+  order = (EngineOrder*) hhMalloc( sizeof(EngineOrder) * (num_dendrs + 1) );
+
+  if (eng->gids == NULL || eng->comps == NULL || eng->shape == NULL ||
+      eng->rows == NULL || eng->offset == NULL || eng->cur == NULL ||
+      eng->current == NULL || eng->threads == NULL || order == NULL) {
+    free( order );
+    engineFree( eng );
+    return NULL;
+  }
+  memset( eng->threads, 0, sizeof(EngineThread) * num_threads );
+
+  eng->offset[0] = 0;
+  for (d = 0; d < num_dendrs; d++) {
+    eng->gids[d]  = gids ? gids[d] : d;
+    eng->comps[d] = comps ? comps[eng->gids[d]] : num_comps;
+    eng->offset[d+1] = eng->offset[d] + eng->comps[d];
+    order[d].comps = eng->comps[d];
+    order[d].d = d;
+  }
+
+  // Dendrites from the longest to the shortest. Each length gets its own
+  // tables and, in the SIMD layout, its own batches.
+  qsort( order, num_dendrs, sizeof(EngineOrder), orderCompare );
+  for (i = 0, run = 0; i < num_dendrs; i++, run++) {
+    if (i == 0 || order[i].comps != order[i-1].comps) {
+      eng->num_shapes++;
+      run = 0;
+    }
+    if (run % HH_VLEN == 0) {
+      eng->num_batches++;
+    }
+  }
+  if (kernel != KERNEL_SIMD) {
+    eng->num_batches = 0;
+  }
+
+  eng->shapes  = (EngineShape*) hhMalloc( sizeof(EngineShape) *
+                                          (eng->num_shapes + 1) );
+  eng->lanes   = (int*) hhMalloc( sizeof(int) * HH_VLEN *
+                                  (eng->num_batches + 1) );
+  eng->batches = (double**) hhMalloc( sizeof(double*) *
+                                      (eng->num_batches + 1) );
+  eng->v_old   = (double*) hhMallocAligned( ENGINE_ALIGN, sizeof(double) *
+                                            ((kernel == KERNEL_SIMD) ?
+                                             eng->num_batches * HH_VLEN :
+                                             num_dendrs) );
+  if (eng->shapes == NULL || eng->lanes == NULL || eng->batches == NULL ||
+      eng->v_old == NULL) {
+    free( order );
+    engineFree( eng );
+    return NULL;
+  }
+  memset( eng->shapes, 0, sizeof(EngineShape) * (eng->num_shapes + 1) );
+
+  for (i = 0, s = -1, b = -1, lane = HH_VLEN; i < num_dendrs; i++) {
+    d = order[i].d;
+    if (i == 0 || order[i].comps != order[i-1].comps) {
+      s++;
+      eng->shapes[s].num_comps = order[i].comps;
+      eng->shapes[s].g_before = (double*) hhMalloc( sizeof(double) *
+                                                    order[i].comps );
+      eng->shapes[s].g_after  = (double*) hhMalloc( sizeof(double) *
+                                                    order[i].comps );
+      if (eng->shapes[s].g_before == NULL ||
+          eng->shapes[s].g_after == NULL) {
+        free( order );
+        engineFree( eng );
+        return NULL;
+      }
+      conductanceTable( order[i].comps, eng->shapes[s].g_before,
+                        eng->shapes[s].g_after );
+      lane = HH_VLEN;
+    }
+    eng->shape[d] = s;
+
+    if (kernel == KERNEL_SIMD) {
+      if (lane == HH_VLEN) {
+        b++;
+        for (lane = 0; lane < HH_VLEN; lane++) {
+          eng->lanes[b * HH_VLEN + lane] = -1;
+        }
+        lane = 0;
+      }
+      eng->lanes[b * HH_VLEN + lane++] = d;
+    }
+  }
+  free( order );
+
+  if (!splitThreads( eng )) {
+    engineFree( eng );
+    return NULL;
+  }
+
+  // Lay the dendrites, or the batches, out share after share, each share
+  // starting on its own cache line.
+  for (t = 0, count = 0; t < num_threads; t++) {
+    th = &eng->threads[t];
+    th->first_volt = count;
+    for (i = 0; i < th->num_units; i++) {
+      count += (kernel == KERNEL_SIMD) ?
+               (size_t) batchComps( eng, th->units[i] ) * HH_VLEN :
+               (size_t) eng->comps[th->units[i]];
+    }
+    th->num_volts = count - th->first_volt;
+    count += (ENGINE_PAD - count % ENGINE_PAD) % ENGINE_PAD;
+  }
+  eng->num_volts = count;
+  eng->volt = (double*) hhMallocAligned( ENGINE_ALIGN,
+                                         sizeof(double) * count );
+  if (eng->volt == NULL) {
+    engineFree( eng );
+    return NULL;
+  }
+
+  for (t = 0; t < num_threads; t++) {
+    th = &eng->threads[t];
+    for (i = 0, v = eng->volt + th->first_volt; i < th->num_units; i++) {
+      if (kernel == KERNEL_SIMD) {
+        b = th->units[i];
+        eng->batches[b] = v;
+        for (lane = 0; lane < HH_VLEN; lane++) {
+          if ((d = eng->lanes[b * HH_VLEN + lane]) >= 0) {
+            eng->rows[d] = v + lane;
+          }
+        }
+        v += (size_t) batchComps( eng, b ) * HH_VLEN;
+      } else {
+        eng->rows[th->units[i]] = v;
+        v += eng->comps[th->units[i]];
+      }
+    }
+  }
+  for (t = 0; t < num_threads; t++) {
+    th = &eng->threads[t];
+    th->ws   = workspaceCreate( num_comps );
+    th->vddt = (double*) hhMallocAligned( ENGINE_ALIGN, sizeof(double) *
+                                          num_comps * HH_VLEN );
+    if (th->ws == NULL || th->vddt == NULL) {
+      engineFree( eng );
+      return NULL;
+    }
+  }
+
+  if ((eng->pool = poolCreate( num_threads )) == NULL) {
+    engineFree( eng );
+    return NULL;
+  }
+
+  // Initialize the potential of each dendrite compartment to the rest voltage.
+  poolRun( eng->pool, initShare, eng );
+
+  return eng;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int engineValidate( Engine *eng )
+{
+  size_t i, count = eng->offset[eng->num_dendrs];
+
+  eng->ref_volt = (double*) hhMalloc( sizeof(double) * count );
+  if (eng->ref_volt == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    eng->ref_volt[i] = VREST;
+  }
+  eng->max_error = 0.0;
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int engineSetIntegrator( Engine *eng, HHIntegrator integrator, int draws )
+{
+  int s;
+  EngineShape *shape;
+
+  eng->integrator = integrator;
+  eng->draws = draws;
+
+  if (integrator == INTEGRATOR_BE || integrator == INTEGRATOR_CN) {
+    for (s = 0; s < eng->num_shapes; s++) {
+      shape = &eng->shapes[s];
+      if (shape->implicit == NULL &&
+          (shape->implicit = (double*) hhMalloc( sizeof(double) * 2 *
+                                                 shape->num_comps )) == NULL) {
+        return 0;
+      }
+    }
+    // Built by the first step, once the step size is known.
+    eng->implicit_dt = 0.0;
+  }
+
+  return 1;
+}
+
+/**
+ * Name: implicitRefresh
+ *
+ * Description:
+ * Rebuilds the tables of the implicit integrators if the step size changed.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ */
+static void implicitRefresh( Engine *eng )
+{
+  int s;
+  EngineShape *shape;
+
+  if (eng->integrator != INTEGRATOR_RK4 && eng->delta_t != eng->implicit_dt) {
+    for (s = 0; s < eng->num_shapes; s++) {
+      shape = &eng->shapes[s];
+      implicitTable( shape->num_comps, eng->delta_t, eng->integrator,
+                     shape->g_before, shape->g_after, shape->implicit );
+    }
+    eng->implicit_dt = eng->delta_t;
+  }
+}
+
+/**
+ * Name: implicitShare
+ *
+ * Description:
+ * Steps one thread's share of the dendrites with an implicit integrator.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param th            (INOUT) the share
+ */
+static void implicitShare( Engine *eng, EngineThread *th )
+{
+  int i, d;
+  EngineShape *shape;
+
+  for (i = 0; i < th->num_dendrs; i++) {
+    d = th->dendrs[i];
+    shape = &eng->shapes[eng->shape[d]];
+    eng->current[d] = dendriteStepImplicit( eng->rows[d], eng->pitch,
+                                            eng->cur[d], eng->comps[d],
+                                            eng->delta_t, eng->v_m,
+                                            eng->integrator, shape->g_before,
+                                            shape->g_after, shape->implicit,
+                                            th->vddt );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int engineEnableRollback( Engine *eng )
+{
+  eng->saved_volt = (double*) hhMallocAligned( ENGINE_ALIGN, sizeof(double) *
+                                               eng->num_volts );
+  if (eng->saved_volt == NULL) {
+    return 0;
+  }
+
+  if (eng->ref_volt) {
+    eng->saved_ref = (double*) hhMalloc( sizeof(double) *
+                                         eng->offset[eng->num_dendrs] );
+    if (eng->saved_ref == NULL) {
+      return 0;
+    }
+  }
+
+  engineSave( eng );
+  return 1;
+}
+
+/**
+ * Name: saveShare
+ *
+ * Description:
+ * Pool work that copies the potentials of one thread's share to the saved
+ * copy. The first call places the copy's pages, like initShare.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the engine
+ * @param id            (INPUT) index of the calling thread
+ */
+static void saveShare( void *arg, int id )
+{
+  Engine *eng = (Engine*) arg;
+  EngineThread *th = &eng->threads[id];
+
+  memcpy( eng->saved_volt + th->first_volt, eng->volt + th->first_volt,
+          sizeof(double) * th->num_volts );
+}
+
+/**
+ * Name: restoreShare
+ *
+ * Description:
+ * Pool work that copies the saved potentials of one thread's share back.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the engine
+ * @param id            (INPUT) index of the calling thread
+ */
+static void restoreShare( void *arg, int id )
+{
+  Engine *eng = (Engine*) arg;
+  EngineThread *th = &eng->threads[id];
+
+  memcpy( eng->volt + th->first_volt, eng->saved_volt + th->first_volt,
+          sizeof(double) * th->num_volts );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void engineSave( Engine *eng )
+{
+  poolRun( eng->pool, saveShare, eng );
+  if (eng->saved_ref) {
+    memcpy( eng->saved_ref, eng->ref_volt,
+            sizeof(double) * eng->offset[eng->num_dendrs] );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void engineRestore( Engine *eng )
+{
+  poolRun( eng->pool, restoreShare, eng );
+  if (eng->saved_ref) {
+    memcpy( eng->ref_volt, eng->saved_ref,
+            sizeof(double) * eng->offset[eng->num_dendrs] );
+  }
+}
+
+/**
+ * Name: validateStep
+ *
+ * Description:
+ * Steps the shadow copy of the dendrites with the reference kernel and
+ * records how far the selected kernel is from it.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param delta_t       (INPUT) integration time step size
+ * @param v_m           (INPUT) soma membrane potential
+ */
+static void validateStep( Engine *eng, double delta_t, double v_m )
+{
+  int d, c;
+  double current, err, *ref;
+  EngineShape *shape;
+
+  for (d = 0; d < eng->num_dendrs; d++) {
+    ref = eng->ref_volt + eng->offset[d];
+    shape = &eng->shapes[eng->shape[d]];
+    if (eng->integrator == INTEGRATOR_RK4) {
+      current = dendriteStep( ref, eng->cur[d], eng->comps[d], delta_t, v_m,
+                              eng->threads[0].ws );
+    } else {
+      current = dendriteStepImplicit( ref, 1, eng->cur[d], eng->comps[d],
+                                      delta_t, v_m, eng->integrator,
+                                      shape->g_before, shape->g_after,
+                                      shape->implicit, eng->threads[0].vddt );
+    }
+
+    err = fabs( current - eng->current[d] );
+    for (c = 0; c < eng->comps[d]; c++) {
+      err = fmax( err, fabs( ref[c] - *engineVolt( eng, d, c ) ) );
+    }
+    eng->max_error = fmax( eng->max_error, err );
+  }
+}
+
+/**
+ * Name: drawShare
+ *
+ * Description:
+ * Draws the current injected at the tip of each dendrite of one thread's
+ * share for the step in progress.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param th            (INPUT) the share
+ */
+static void drawShare( Engine *eng, EngineThread *th )
+{
+  int i, d;
+
+  for (i = 0; i < th->num_dendrs; i++) {
+    d = th->dendrs[i];
+    eng->cur[d] = injectedCurrentSpan( eng->rng, eng->gids[d], eng->first,
+                                       eng->span );
+  }
+}
+
+/**
+ * Name: gatherBatch
+ *
+ * Description:
+ * Copies the tip currents of the dendrites of a batch to the thread, in lane
+ * order, with 0 in the padding lanes.
+ *
+ * Parameters:
+ * @param eng           (INPUT) the engine
+ * @param th            (INOUT) the thread
+ * @param b             (INPUT) index of the batch
+ */
+static void gatherBatch( Engine *eng, EngineThread *th, int b )
+{
+  int lane, d;
+
+  for (lane = 0; lane < HH_VLEN; lane++) {
+    d = eng->lanes[b * HH_VLEN + lane];
+    th->cur[lane] = (d >= 0) ? eng->cur[d] : 0.0;
+  }
+}
+
+/**
+ * Name: scatterBatch
+ *
+ * Description:
+ * Copies the currents a batch injects into the soma from the thread to the
+ * dendrites they belong to. Those of the padding lanes are dropped.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ * @param th            (INPUT) the thread
+ * @param b             (INPUT) index of the batch
+ */
+static void scatterBatch( Engine *eng, EngineThread *th, int b )
+{
+  int lane, d;
+
+  for (lane = 0; lane < HH_VLEN; lane++) {
+    if ((d = eng->lanes[b * HH_VLEN + lane]) >= 0) {
+      eng->current[d] = th->current[lane];
+    }
+  }
+}
+
+/**
+ * Name: sumShare
+ *
+ * Description:
+ * Leaves the current injected into the soma by one thread's share in its
+ * partial sum, and accounts the time the thread spent on it.
+ *
+ * Parameters:
+ * @param eng           (INPUT) the engine
+ * @param th            (INOUT) the share
+ * @param start         (INPUT) engineClock when the thread started
+ */
+static void sumShare( Engine *eng, EngineThread *th, double start )
+{
+  int i;
+  double sum = 0.0;
+
+  // Accumulate in dendrite order so that all kernels give the same sum.
+  for (i = 0; i < th->num_dendrs; i++) {
+    sum += eng->current[th->dendrs[i]];
+  }
+  th->sum = sum;
+  th->busy += engineClock() - start;
+}
+
+/**
+ * Name: stepShare
+ *
+ * Description:
+ * Pool work that steps one thread's share of the dendrites and leaves the
+ * current they inject into the soma in the thread's partial sum.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the engine
+ * @param id            (INPUT) index of the calling thread
+ */
+static void stepShare( void *arg, int id )
+{
+  Engine *eng = (Engine*) arg;
+  EngineThread *th = &eng->threads[id];
+  EngineShape *shape;
+  int i, d;
+  double const start = engineClock();
+
+  // Current injected at the tip of each dendrite
+  drawShare( eng, th );
+
+  if (eng->integrator != INTEGRATOR_RK4) {
+    implicitShare( eng, th );
+  } else if (eng->kernel == KERNEL_FUSED) {
+    for (i = 0; i < th->num_units; i++) {
+      d = th->units[i];
+      shape = &eng->shapes[eng->shape[d]];
+      eng->current[d] = dendriteStepFused( eng->rows[d], eng->cur[d],
+                                           eng->comps[d], eng->delta_t,
+                                           eng->v_m, shape->g_before,
+                                           shape->g_after );
+    }
+  } else if (eng->kernel == KERNEL_SIMD) {
+    for (i = 0; i < th->num_units; i++) {
+      gatherBatch( eng, th, th->units[i] );
+      dendriteStepBatch( eng->batches[th->units[i]], HH_VLEN, th->cur,
+                         batchComps( eng, th->units[i] ), eng->delta_t,
+                         eng->v_m, th->vddt, th->current );
+      scatterBatch( eng, th, th->units[i] );
+    }
+  } else {
+    for (i = 0; i < th->num_units; i++) {
+      d = th->units[i];
+      // This will update Vm in all compartments and will give a new injected
+      // current value from last compartment into the soma.
+      eng->current[d] = dendriteStep( eng->rows[d], eng->cur[d],
+                                      eng->comps[d], eng->delta_t, eng->v_m,
+                                      th->ws );
+    }
+  }
+
+  sumShare( eng, th, start );
+}
+
+/**
+ * Name: beginShare
+ *
+ * Description:
+ * Pool work that steps every compartment of one thread's share of the
+ * dendrites but the ones next to the soma. The scalar kernel cannot be split,
+ * so the fused one, which gives the same results, is used in its place.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the engine
+ * @param id            (INPUT) index of the calling thread
+ */
+static void beginShare( void *arg, int id )
+{
+  Engine *eng = (Engine*) arg;
+  EngineThread *th = &eng->threads[id];
+  EngineShape *shape;
+  int i, d, b;
+  double const start = engineClock();
+
+  // Current injected at the tip of each dendrite
+  drawShare( eng, th );
+
+  if (eng->integrator != INTEGRATOR_RK4) {
+    // The implicit integrators solve each dendrite as a whole.
+  } else if (eng->kernel == KERNEL_SIMD) {
+    for (i = 0; i < th->num_units; i++) {
+      b = th->units[i];
+      gatherBatch( eng, th, b );
+      dendriteBatchBegin( eng->batches[b], HH_VLEN, th->cur,
+                          batchComps( eng, b ), eng->delta_t, th->vddt,
+                          eng->v_old + b * HH_VLEN );
+    }
+  } else {
+    for (i = 0; i < th->num_units; i++) {
+      d = th->units[i];
+      shape = &eng->shapes[eng->shape[d]];
+      dendriteStepBegin( eng->rows[d], eng->cur[d], eng->comps[d],
+                         eng->delta_t, shape->g_before, shape->g_after,
+                         eng->v_old + d );
+    }
+  }
+
+  th->busy += engineClock() - start;
+}
+
+/**
+ * Name: finishShare
+ *
+ * Description:
+ * Pool work that steps the compartments next to the soma of one thread's
+ * share of the dendrites, once beginShare is done and v_m is known, and
+ * leaves the current they inject into the soma in the thread's partial sum.
+ *
+ * Parameters:
+ * @param arg           (INOUT) the engine
+ * @param id            (INPUT) index of the calling thread
+ */
+static void finishShare( void *arg, int id )
+{
+  Engine *eng = (Engine*) arg;
+  EngineThread *th = &eng->threads[id];
+  EngineShape *shape;
+  int i, d, b;
+  double const start = engineClock();
+
+  if (eng->integrator != INTEGRATOR_RK4) {
+    implicitShare( eng, th );
+  } else if (eng->kernel == KERNEL_SIMD) {
+    for (i = 0; i < th->num_units; i++) {
+      b = th->units[i];
+      gatherBatch( eng, th, b );
+      dendriteBatchFinish( eng->batches[b], HH_VLEN, th->cur,
+                           batchComps( eng, b ), eng->delta_t, eng->v_m,
+                           eng->v_old + b * HH_VLEN, th->current );
+      scatterBatch( eng, th, b );
+    }
+  } else {
+    for (i = 0; i < th->num_units; i++) {
+      d = th->units[i];
+      shape = &eng->shapes[eng->shape[d]];
+      eng->current[d] = dendriteStepFinish( eng->rows[d], eng->cur[d],
+                                            eng->comps[d], eng->delta_t,
+                                            eng->v_m, shape->g_before,
+                                            shape->g_after, eng->v_old[d] );
+    }
+  }
+
+  sumShare( eng, th, start );
+}
+
+/**
+ * Name: reduceStep
+ *
+ * Description:
+ * Validates the step just taken, if asked to, and adds up the partial
+ * currents of the threads.
+ *
+ * Parameters:
+ * @param eng           (INOUT) the engine
+ *
+ * Returns:
+ * @return double       total current injected into the soma by the dendrites
+ */
+static double reduceStep( Engine *eng )
+{
+  int t;
+  double total = 0.0;
+
+  if (eng->ref_volt) {
+    validateStep( eng, eng->delta_t, eng->v_m );
+  }
+
+  // Partial sums are reduced in thread order, so a given number of threads
+  // always gives the same total.
+  for (t = 0; t < eng->num_threads; t++) {
+    total += eng->threads[t].sum;
+  }
+
+  return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double engineStep( Engine *eng, long step, double delta_t, double v_m )
+{
+  eng->first   = step * eng->draws;
+  eng->span    = eng->draws;
+  eng->delta_t = delta_t;
+  eng->v_m     = v_m;
+  implicitRefresh( eng );
+
+  poolRun( eng->pool, stepShare, eng );
+
+  return reduceStep( eng );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double engineStepSpan( Engine *eng, long first, int span, double v_m )
+{
+  eng->first   = first;
+  eng->span    = span;
+  eng->delta_t = (double) span / hhParams()->steps;
+  eng->v_m     = v_m;
+  implicitRefresh( eng );
+
+  poolRun( eng->pool, stepShare, eng );
+
+  return reduceStep( eng );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void engineStepBegin( Engine *eng, long step, double delta_t )
+{
+  eng->first   = step * eng->draws;
+  eng->span    = eng->draws;
+  eng->delta_t = delta_t;
+  implicitRefresh( eng );
+
+  poolRun( eng->pool, beginShare, eng );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double engineStepFinish( Engine *eng, double v_m )
+{
+  eng->v_m = v_m;
+
+  poolRun( eng->pool, finishShare, eng );
+
+  return reduceStep( eng );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double *engineVolt( Engine *eng, int d, int c )
+{
+  return eng->rows[d] + (size_t) c * eng->pitch;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void engineBalance( const Engine *eng, double *predicted, double *measured )
+{
+  int t;
+  double cost = 0.0, most_cost = 0.0, busy = 0.0, most_busy = 0.0;
+
+  // partitionImbalance, without a copy of the loads of the threads.
+  for (t = 0; t < eng->num_threads; t++) {
+    cost += eng->threads[t].cost;
+    busy += eng->threads[t].busy;
+    most_cost = fmax( most_cost, eng->threads[t].cost );
+    most_busy = fmax( most_busy, eng->threads[t].busy );
+  }
+
+  *predicted = (cost > 0.0) ? most_cost * eng->num_threads / cost : 1.0;
+  *measured  = (busy > 0.0) ? most_busy * eng->num_threads / busy : 1.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void engineFree( Engine *eng )
+{
+  int t, s;
+
+  if (eng == NULL) {
+    return;
+  }
+
+  poolFree( eng->pool );
+  if (eng->threads) {
+    for (t = 0; t < eng->num_threads; t++) {
+      workspaceFree( eng->threads[t].ws );
+      free( eng->threads[t].vddt );
+      free( eng->threads[t].units );
+      free( eng->threads[t].dendrs );
+    }
+  }
+  if (eng->shapes) {
+    for (s = 0; s < eng->num_shapes; s++) {
+      free( eng->shapes[s].g_before );
+      free( eng->shapes[s].g_after );
+      free( eng->shapes[s].implicit );
+    }
+  }
+
+  free( eng->gids );
+  free( eng->comps );
+  free( eng->shape );
+  free( eng->rows );
+  free( eng->offset );
+  free( eng->lanes );
+  free( eng->batches );
+  free( eng->shapes );
+  free( eng->cur );
+  free( eng->current );
+  free( eng->volt );
+  free( eng->v_old );
+  free( eng->ref_volt );
+  free( eng->saved_volt );
+  free( eng->saved_ref );
+  free( eng->threads );
+  free( eng );
+}
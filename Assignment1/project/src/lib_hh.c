@@ -22,11 +22,12 @@
 #include <float.h>
 #include <stdlib.h>
 
-// Parameters for cell of 20,000 micometer surface area (2e-4 cm^2)
-#define gL  10      // Leak soma conductance, nS
-#define gLd 0.01    // Leak dendrite compartment conductance, nS
-#define gK  6000    // K soma conductance, nS
-#define gNa 20000   // Na soma conductance, nS
+// Parameters for cell of 20,000 micometer surface area (2e-4 cm^2). The
+// conductances are defaults that can be changed with hhSetParams.
+#define GL_DEFAULT  10      // Leak soma conductance, nS
+#define GLD_DEFAULT 0.01    // Leak dendrite compartment conductance, nS
+#define GK_DEFAULT  6000    // K soma conductance, nS
+#define GNA_DEFAULT 20000   // Na soma conductance, nS
 #define Cs  200     // Soma capacitance, pF
 #define Cd  0.1     // Compartment dendrite capacitance, pF
 #define ENa 50      // Na reversal potential, mV
@@ -34,22 +35,135 @@
 #define EL -65      // Leak reversal potential, mV
 #define Vr -65      // Resting membrane potential, mV
 
+// Conductances in use.
+#define gL  (params.g_l)
+#define gLd (params.g_ld)
+#define gK  (params.g_k)
+#define gNa (params.g_na)
+
+// Lateral conductance between the compartments `n' and `n-1' places from
+// the soma. The original model divided the rise as integers; floor() keeps
+// its conductances.
+#define G_LATERAL_OF(p, n) ((p)->g_comp + floor( (p)->g_distr / (n) ))
+#define G_LATERAL(n) G_LATERAL_OF(&params, n)
+
+// Number of hhMalloc calls made so far.
+static long alloc_count = 0;
+
+// Heap allocations of every caller, defined by alloc_shim.so when it is
+// preloaded and NULL otherwise.
+extern long allocShimCount( void ) __attribute__((weak));
+
+// Model parameters in use, see hhSetParams.
+#define PARAMS_DEFAULT { COMPTIME, STEPS, INJCURMEAN, DENDRCONDCOMP, \
+                         DENDRCONDDISTR, GNA_DEFAULT, GK_DEFAULT, \
+                         GL_DEFAULT, GLD_DEFAULT }
+static HHParams params = PARAMS_DEFAULT;
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void hhParamsDefault( HHParams *p )
+{
+  HHParams const defaults = PARAMS_DEFAULT;
+
+  *p = defaults;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void hhSetParams( const HHParams *p )
+{
+  params = *p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+const HHParams *hhParams( void )
+{
+  return &params;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void *hhMalloc( size_t size )
+{
+  alloc_count++;
+  return malloc( size );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void *hhMallocAligned( size_t align, size_t size )
+{
+  void *p;
+
+  alloc_count++;
+  if (posix_memalign( &p, align, size ) != 0) {
+    return NULL;
+  }
+
+  return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+long hhAllocCount( void )
+{
+  return alloc_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+long hhHeapAllocCount( void )
+{
+  return (allocShimCount != NULL) ? allocShimCount() : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+HHWorkspace *workspaceCreate( int num_comps )
+{
+  HHWorkspace *ws = (HHWorkspace*) hhMalloc( sizeof(HHWorkspace) );
+  if (ws == NULL) {
+    return NULL;
+  }
+
+  ws->num_comps = num_comps;
+  ws->vddt = (double*) hhMalloc( sizeof(double) * num_comps );
+  ws->rk   = (double*) hhMalloc( sizeof(double) * 7 * NUMVAR );
+
+  if (ws->vddt == NULL || ws->rk == NULL) {
+    workspaceFree( ws );
+    return NULL;
+  }
+
+  return ws;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void workspaceFree( HHWorkspace *ws )
+{
+  if (ws == NULL) {
+    return;
+  }
+
+  free( ws->vddt );
+  free( ws->rk );
+  free( ws );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-double dendriteStep( double *v_d, int seed, int num_comps, double delta_t,
-                     double v_m )
+double dendriteStep( double *v_d, double cur, int num_comps, double delta_t,
+                     double v_m, HHWorkspace *ws )
 {
   int i;
-  double current, cur, temp[1], paramD[6], *vddt;
+  double current, temp[1], paramD[6];
+  double *vddt = ws->vddt;
 
-  vddt = (double*) malloc( sizeof(double) * (num_comps - 1) );
   paramD[0] = delta_t;
 
-  srand(seed);
-
-  // Current injected at the tip of the dendrite
-  cur = INJCURMEAN + INJCURMEAN*0.1 -
-        2*INJCURMEAN*0.1*((double)rand()/((double)RAND_MAX));
   // Update somatic potential = potential of the last compartment
   v_d[num_comps-1] = v_m;
 
@@ -61,13 +175,13 @@ double dendriteStep( double *v_d, int seed, int num_comps, double delta_t,
     {// First compartment: inject current, doesn't have resistance from the left
       paramD[1] = cur;
       paramD[2] = 0;
-      paramD[3] = DENDRCONDCOMP + DENDRCONDDISTR/(num_comps-2-i);
+      paramD[3] = G_LATERAL(num_comps-2-i);
     }
     else
     {// For all others: inj cur = 0, gradualy rised conductance towards soma
       paramD[1] = 0;
-      paramD[2] = DENDRCONDCOMP + DENDRCONDDISTR/(num_comps-1-i);
-      paramD[3] = DENDRCONDCOMP + DENDRCONDDISTR/(num_comps-2-i);
+      paramD[2] = G_LATERAL(num_comps-1-i);
+      paramD[3] = G_LATERAL(num_comps-2-i);
     }
     // obtaind first Vm
     paramD[4]= v_d[i];
@@ -82,43 +196,699 @@ double dendriteStep( double *v_d, int seed, int num_comps, double delta_t,
     {// First compartment: inject current, doesn't have resistance from the left
       paramD[1] = cur;
       paramD[2] = 0;
-      paramD[3] = DENDRCONDCOMP + DENDRCONDDISTR/(num_comps-2-i);
+      paramD[3] = G_LATERAL(num_comps-2-i);
     }
     else
     {// For all others: inj cur = 0, gradualy rised conductance towards soma
       paramD[1] = 0;
-      paramD[2] = DENDRCONDCOMP + DENDRCONDDISTR/(num_comps-1-i);
-      paramD[3] = DENDRCONDCOMP + DENDRCONDDISTR/(num_comps-2-i);
+      paramD[2] = G_LATERAL(num_comps-1-i);
+      paramD[3] = G_LATERAL(num_comps-2-i);
     }
     // perform RK4 on Vm for this compartment
     paramD[4]= v_d[i];
     paramD[5]=  v_d[i+2];
     temp[0]=v_d[i+1];
-    rk4Step((v_d+i+1),temp,(vddt+i),1,paramD,1,dendrite);
+    rk4Step((v_d+i+1),temp,(vddt+i),1,paramD,1,dendrite,ws->rk);
   }
   // Calculate current injected by this dendrite into soma
   current = paramD[3]*(v_d[i] - v_m);
 
-  // Free malloced memory.
-  free( vddt );
-
   return current;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int hhRngInit( HHRng *rng, HHRngMode mode, unsigned long long key,
+               int num_dendrs, int steps )
+{
+  int seed;
+
+  rng->mode       = mode;
+  rng->key        = key;
+  rng->steps      = steps;
+  rng->compat_len = 0;
+  rng->compat     = NULL;
+
+  if (mode == RNG_COMPAT) {
+    // Seeds used to be (step within the ms) + dendrite + 1.
+    rng->compat_len = steps + num_dendrs + 1;
+    rng->compat = (int*) hhMalloc( sizeof(int) * rng->compat_len );
+    if (rng->compat == NULL) {
+      return 0;
+    }
+
+    for (seed = 0; seed < rng->compat_len; seed++) {
+      srand(seed);
+      rng->compat[seed] = rand();
+    }
+  }
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double hhRngUniform( const HHRng *rng, int dendrite, long step )
+{
+  unsigned long long z;
+
+  if (rng->mode == RNG_COMPAT) {
+    return (double)rng->compat[ step % rng->steps + dendrite + 1 ] /
+           ((double)RAND_MAX);
+  }
+
+  // SplitMix64 output function applied to a (dendrite, step) counter. The
+  // step takes the low 40 bits, enough for 10^8 ms at 10^4 steps per ms.
+  z = rng->key + ((((unsigned long long) dendrite << 40) ^
+                   (unsigned long long) step) + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+
+  // Top 53 bits give a double in [0, 1).
+  return (double) (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void hhRngFree( HHRng *rng )
+{
+  free( rng->compat );
+  rng->compat = NULL;
+  rng->compat_len = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double injectedCurrent( const HHRng *rng, int dendrite, long step )
+{
+  return injectedCurrentSpanOf( rng, params.inj_mean, dendrite, step, 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double injectedCurrentMean( const HHRng *rng, int dendrite, long step,
+                            int draws )
+{
+  return injectedCurrentSpan( rng, dendrite, step * draws, draws );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double injectedCurrentSpan( const HHRng *rng, int dendrite, long first,
+                            int count )
+{
+  return injectedCurrentSpanOf( rng, params.inj_mean, dendrite, first, count );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double injectedCurrentSpanOf( const HHRng *rng, double inj_mean, int dendrite,
+                              long first, int count )
+{
+  int j;
+  double sum = 0.0;
+
+  if (count == 1) {
+    return inj_mean + inj_mean*0.1 -
+           2*inj_mean*0.1*hhRngUniform( rng, dendrite, first );
+  }
+
+  for (j = 0; j < count; j++) {
+    sum += inj_mean + inj_mean*0.1 -
+           2*inj_mean*0.1*hhRngUniform( rng, dendrite, first + j );
+  }
+
+  return sum / count;
+}
+
+// Inlined dendrite(). Keep the expression identical to it so that the fused
+// kernel rounds exactly like the reference one.
+static inline double dendriteDeriv( double y, double dt, double I_inj,
+                                    double gBefore, double gAfter,
+                                    double yBefore, double yAfter )
+{
+  return dt*(I_inj + gBefore*yBefore - (gBefore + gAfter)*y + gAfter*yAfter -
+         (gLd)*(y-EL))/(Cd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void conductanceTable( int num_comps, double *g_before, double *g_after )
+{
+  conductanceTableOf( &params, num_comps, g_before, g_after );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void conductanceTableOf( const HHParams *p, int num_comps, double *g_before,
+                         double *g_after )
+{
+  int i;
+
+  // First compartment doesn't have resistance from the left, for all others
+  // the conductance gradually rises towards soma.
+  for (i = 0; i < num_comps-2; i++) {
+    g_before[i] = (i == 0) ? 0 : G_LATERAL_OF(p, num_comps-1-i);
+    g_after[i]  = G_LATERAL_OF(p, num_comps-2-i);
+  }
+}
+
+// One fused RK4 step (dt = 1, the step is folded into the derivative) of a
+// compartment. The first stage sees the old potential on the tip side, the
+// later stages see the already updated one.
+static inline double fusedCompartment( double y0, double delta_t,
+                                       double I_inj, double gB, double gA,
+                                       double old_before, double yBefore,
+                                       double yAfter )
+{
+  double const dt6 = 1.0/6;
+  double y, k1, k2, k3, k4;
+
+  k1 = dendriteDeriv( y0, delta_t, I_inj, gB, gA, old_before, yAfter );
+  y  = y0 + 0.5*k1;
+  k2 = dendriteDeriv( y, delta_t, I_inj, gB, gA, yBefore, yAfter );
+  y  = y0 + 0.5*k2;
+  k3 = dendriteDeriv( y, delta_t, I_inj, gB, gA, yBefore, yAfter );
+  y  = y0 + 1.0*k3;
+  k4 = dendriteDeriv( y, delta_t, I_inj, gB, gA, yBefore, yAfter );
+
+  return y0 + dt6*(k1+k4+2*(k2+k3));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void dendriteStepBegin( double *v_d, double cur, int num_comps,
+                        double delta_t, const double *g_before,
+                        const double *g_after, double *v_old )
+{
+  int i;
+  double y0;
+
+  // Potential the previous compartment had before this step.
+  double old_before = v_d[0];
+
+  // Every compartment but the one next to the soma.
+  for (i = 0; i < num_comps-3; i++) {
+    y0 = v_d[i+1];
+    v_d[i+1] = fusedCompartment( y0, delta_t, (i == 0) ? cur : 0,
+                                 g_before[i], g_after[i], old_before,
+                                 v_d[i], v_d[i+2] );
+    old_before = y0;
+  }
+
+  *v_old = old_before;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double dendriteStepFinish( double *v_d, double cur, int num_comps,
+                           double delta_t, double v_m, const double *g_before,
+                           const double *g_after, double v_old )
+{
+  int const i = num_comps-3;
+
+  // Update somatic potential = potential of the last compartment
+  v_d[num_comps-1] = v_m;
+
+  v_d[i+1] = fusedCompartment( v_d[i+1], delta_t, (i == 0) ? cur : 0,
+                               g_before[i], g_after[i], v_old, v_d[i], v_m );
+
+  // Calculate current injected by this dendrite into soma
+  return g_after[i]*(v_d[num_comps-2] - v_m);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double dendriteStepFused( double *v_d, double cur, int num_comps,
+                          double delta_t, double v_m, const double *g_before,
+                          const double *g_after )
+{
+  double v_old;
+
+  // The compartment next to the soma is the only one that sees v_m.
+  dendriteStepBegin( v_d, cur, num_comps, delta_t, g_before, g_after,
+                     &v_old );
+  return dendriteStepFinish( v_d, cur, num_comps, delta_t, v_m, g_before,
+                             g_after, v_old );
+}
+
+// Vector version of dendrite(). Keep the expression identical to the scalar
+// one so that both kernels round the same way.
+static inline hhvec dendriteVec( hhvec y, double dt, hhvec I_inj,
+                                 double gBefore, double gAfter,
+                                 hhvec yBefore, hhvec yAfter )
+{
+  return dt*(I_inj + gBefore*yBefore - (gBefore + gAfter)*y + gAfter*yAfter -
+         (gLd)*(y-(double)EL))/(Cd);
+}
+
+// Bulk RK4 step (dt = 1, the step is folded into the derivative) of one
+// compartment row, given its first stage.
+static inline hhvec batchCompartment( hhvec y0, hhvec k1, double delta_t,
+                                      hhvec I_inj, double gBefore,
+                                      double gAfter, hhvec yBefore,
+                                      hhvec yAfter )
+{
+  double const dt6 = 1.0/6;
+  hhvec y, k2, k3, k4;
+
+  y  = y0 + 0.5*k1;
+  k2 = dendriteVec( y, delta_t, I_inj, gBefore, gAfter, yBefore, yAfter );
+  y  = y0 + 0.5*k2;
+  k3 = dendriteVec( y, delta_t, I_inj, gBefore, gAfter, yBefore, yAfter );
+  y  = y0 + 1.0*k3;
+  k4 = dendriteVec( y, delta_t, I_inj, gBefore, gAfter, yBefore, yAfter );
+
+  return y0 + dt6*(k1+k4+2*(k2+k3));
+}
+
+#define ROW(c) (*(hhvec*) (v + (c)*stride))
+#define DDT(c) (*(hhvec*) (vddt + (c)*HH_VLEN))
+#define G_BEFORE(i) (((i) == 0) ? 0.0 : G_LATERAL(num_comps-1-(i)))
+#define G_AFTER(i)  (G_LATERAL(num_comps-2-(i)))
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void dendriteBatchBegin( double *v, int stride, const double *cur,
+                         int num_comps, double delta_t, double *vddt,
+                         double *v_old )
+{
+  int i, l;
+  hhvec inj, zero;
+
+  zero = (hhvec) {0};
+  for (l = 0; l < HH_VLEN; l++) {
+    inj[l] = cur[l];
+  }
+
+  // Lateral dVm for the first RK4 stage, computed from the old potentials.
+  for (i = 0; i < num_comps-3; i++) {
+    DDT(i) = dendriteVec( ROW(i+1), delta_t, (i == 0) ? inj : zero,
+                          G_BEFORE(i), G_AFTER(i), ROW(i), ROW(i+2) );
+  }
+
+  // The compartment next to the soma needs the old potential of its
+  // neighbour once v_m is known.
+  *(hhvec*) v_old = ROW(num_comps-3);
+
+  // Sweep from the tip towards the soma.
+  for (i = 0; i < num_comps-3; i++) {
+    ROW(i+1) = batchCompartment( ROW(i+1), DDT(i), delta_t,
+                                 (i == 0) ? inj : zero, G_BEFORE(i),
+                                 G_AFTER(i), ROW(i), ROW(i+2) );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void dendriteBatchFinish( double *v, int stride, const double *cur,
+                          int num_comps, double delta_t, double v_m,
+                          const double *v_old, double *current )
+{
+  int l;
+  int const i = num_comps-3;
+  hhvec inj, zero, vm, k1;
+
+  zero = (hhvec) {0};
+  for (l = 0; l < HH_VLEN; l++) {
+    inj[l] = (i == 0) ? cur[l] : 0;
+  }
+
+  // Update somatic potential = potential of the last compartment
+  vm = zero + v_m;
+  ROW(num_comps-1) = vm;
+
+  k1 = dendriteVec( ROW(i+1), delta_t, inj, G_BEFORE(i), G_AFTER(i),
+                    *(const hhvec*) v_old, vm );
+  ROW(i+1) = batchCompartment( ROW(i+1), k1, delta_t, inj, G_BEFORE(i),
+                               G_AFTER(i), ROW(i), vm );
+
+  // Calculate current injected by each dendrite into soma
+  k1 = G_AFTER(i)*(ROW(num_comps-2) - vm);
+  for (l = 0; l < HH_VLEN; l++) {
+    current[l] = k1[l];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void dendriteStepBatch( double *v, int stride, const double *cur,
+                        int num_comps, double delta_t, double v_m,
+                        double *vddt, double *current )
+{
+  // Keep the stash in the scratch row the split kernel leaves unused.
+  double *v_old = vddt + (num_comps-2)*HH_VLEN;
+
+  dendriteBatchBegin( v, stride, cur, num_comps, delta_t, vddt, v_old );
+  dendriteBatchFinish( v, stride, cur, num_comps, delta_t, v_m, v_old,
+                       current );
+}
+
+#undef ROW
+#undef DDT
+#undef G_BEFORE
+#undef G_AFTER
+
+// Vector version of dendrite() with the conductances of every lane. Keep the
+// expression identical to the scalar one so that every lane rounds the same
+// way.
+static inline hhvec laneDeriv( hhvec y, double dt, hhvec I_inj,
+                               hhvec gBefore, hhvec gAfter, hhvec gLeak,
+                               hhvec yBefore, hhvec yAfter )
+{
+  return dt*(I_inj + gBefore*yBefore - (gBefore + gAfter)*y + gAfter*yAfter -
+         (gLeak)*(y-(double)EL))/(Cd);
+}
+
+// batchCompartment with the conductances of every lane.
+static inline hhvec laneCompartment( hhvec y0, hhvec k1, double delta_t,
+                                     hhvec I_inj, hhvec gBefore,
+                                     hhvec gAfter, hhvec gLeak,
+                                     hhvec yBefore, hhvec yAfter )
+{
+  double const dt6 = 1.0/6;
+  hhvec y, k2, k3, k4;
+
+  y  = y0 + 0.5*k1;
+  k2 = laneDeriv( y, delta_t, I_inj, gBefore, gAfter, gLeak, yBefore,
+                  yAfter );
+  y  = y0 + 0.5*k2;
+  k3 = laneDeriv( y, delta_t, I_inj, gBefore, gAfter, gLeak, yBefore,
+                  yAfter );
+  y  = y0 + 1.0*k3;
+  k4 = laneDeriv( y, delta_t, I_inj, gBefore, gAfter, gLeak, yBefore,
+                  yAfter );
+
+  return y0 + dt6*(k1+k4+2*(k2+k3));
+}
+
+#define ROW(c) (*(hhvec*) (v + (c)*HH_VLEN))
+#define DDT(c) (*(hhvec*) (vddt + (c)*HH_VLEN))
+#define G_BEFORE(i) (*(const hhvec*) (g_before + (i)*HH_VLEN))
+#define G_AFTER(i)  (*(const hhvec*) (g_after + (i)*HH_VLEN))
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void dendriteStepLanes( double *v, const double *cur, int num_comps,
+                        double delta_t, const double *v_m,
+                        const double *g_before, const double *g_after,
+                        const double *g_ld, double *vddt, double *current )
+{
+  int i;
+  hhvec inj, zero, leak;
+
+  zero = (hhvec) {0};
+  inj  = *(const hhvec*) cur;
+  leak = *(const hhvec*) g_ld;
+
+  // Update somatic potential = potential of the last compartment
+  ROW(num_comps-1) = *(const hhvec*) v_m;
+
+  // Lateral dVm for the first RK4 stage, computed from the old potentials.
+  for (i = 0; i < num_comps-2; i++) {
+    DDT(i) = laneDeriv( ROW(i+1), delta_t, (i == 0) ? inj : zero,
+                        G_BEFORE(i), G_AFTER(i), leak, ROW(i), ROW(i+2) );
+  }
+
+  // Sweep from the tip towards the soma.
+  for (i = 0; i < num_comps-2; i++) {
+    ROW(i+1) = laneCompartment( ROW(i+1), DDT(i), delta_t,
+                                (i == 0) ? inj : zero, G_BEFORE(i),
+                                G_AFTER(i), leak, ROW(i), ROW(i+2) );
+  }
+
+  // Calculate current injected by each lane into soma
+  *(hhvec*) current = G_AFTER(num_comps-3)*(ROW(num_comps-2) -
+                                            ROW(num_comps-1));
+}
+
+#undef ROW
+#undef DDT
+#undef G_BEFORE
+#undef G_AFTER
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void implicitTable( int num_comps, double delta_t, HHIntegrator method,
+                    const double *g_before, const double *g_after,
+                    double *table )
+{
+  int i, j;
+  double diag, pivot;
+  double const theta = (method == INTEGRATOR_CN) ? 0.5 : 1.0;
+  double const r = delta_t/Cd;
+  double *c_prime = table;
+  double *inv_pivot = table + num_comps;
+
+  // Row j (compartment j, conductances i = j-1) of
+  //   (1 + theta*r*(gB+gA+gLd)) V_j - theta*r*gB V_j-1 - theta*r*gA V_j+1
+  // eliminated from the tip towards the soma. The tip compartment has no
+  // conductance towards the dummy compartment.
+  c_prime[0] = 0.0;
+  for (j = 1; j < num_comps-1; j++) {
+    i = j-1;
+    diag  = 1 + theta*r*(g_before[i] + g_after[i] + gLd);
+    pivot = diag + theta*r*g_before[i]*c_prime[j-1];
+    inv_pivot[j] = 1/pivot;
+    c_prime[j]   = -theta*r*g_after[i]/pivot;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double dendriteStepImplicit( double *v, int stride, double cur,
+                             int num_comps, double delta_t, double v_m,
+                             HHIntegrator method, const double *g_before,
+                             const double *g_after, const double *table,
+                             double *work )
+{
+  int i, j;
+  int const last = num_comps-2;
+  double gB, gA, yAfter, rhs;
+  double const theta = (method == INTEGRATOR_CN) ? 0.5 : 1.0;
+  double const r = delta_t/Cd;
+  const double *c_prime = table;
+  const double *inv_pivot = table + num_comps;
+  double *d_prime = work;
+
+  #define V(c) v[(size_t) (c)*stride]
+
+  // Update somatic potential = potential of the last compartment
+  V(num_comps-1) = v_m;
+
+  // Forward sweep. The right hand side is the old potential plus the
+  // explicit part of the step; the soma potential is known on both ends of
+  // the step and moves to the right hand side of the last row.
+  d_prime[0] = 0.0;
+  for (j = 1; j <= last; j++) {
+    i = j-1;
+    gB = g_before[i];
+    gA = g_after[i];
+    yAfter = V(j+1);
+
+    rhs = V(j) + r*((1-theta)*(gB*V(j-1) - (gB + gA + gLd)*V(j) + gA*yAfter) +
+                    ((i == 0) ? cur : 0) + gLd*EL);
+    if (j == last) {
+      rhs += theta*r*gA*v_m;
+    }
+
+    d_prime[j] = (rhs + theta*r*gB*d_prime[j-1])*inv_pivot[j];
+  }
+
+  // Back substitution from the soma towards the tip.
+  V(last) = d_prime[last];
+  for (j = last-1; j >= 1; j--) {
+    V(j) = d_prime[j] - c_prime[j]*V(j+1);
+  }
+
+  #undef V
+
+  // Calculate current injected by this dendrite into soma
+  return g_after[last-1]*(v[(size_t) last*stride] - v_m);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double dendriteSeries( const double *coef, double *next, int num_comps,
+                       int k, double delta_t, double cur, double v_k,
+                       const double *g_before, const double *g_after )
+{
+  int i;
+  int const last = num_comps-2;
+  double inj, yAfter;
+  double const scale = delta_t/(Cd*(k+1));
+
+  // The dummy compartment never changes.
+  next[0] = 0.0;
+
+  for (i = 0; i < num_comps-2; i++) {
+    inj = (k == 0) ? ((i == 0) ? cur : 0) + gLd*EL : 0;
+    yAfter = (i+1 == last) ? v_k : coef[i+2];
+    next[i+1] = scale*(inj + g_before[i]*coef[i] -
+                       (g_before[i] + g_after[i] + gLd)*coef[i+1] +
+                       g_after[i]*yAfter);
+  }
+
+  return g_after[last-1]*(coef[last] - v_k);
+}
+
+// Order k of the product of two series.
+static double psProduct( const double *a, const double *b, int k )
+{
+  int j;
+  double sum = 0.0;
+
+  for (j = 0; j <= k; j++) {
+    sum += a[j]*b[k-j];
+  }
+
+  return sum;
+}
+
+// Order k > 0 of f = exp(scale*v + constant), given orders 0 to k-1 of f.
+static double psExp( const double *f, const double *v, double scale, int k )
+{
+  int j;
+  double sum = 0.0;
+
+  for (j = 1; j <= k; j++) {
+    sum += j*v[j]*f[k-j];
+  }
+
+  return scale*sum/k;
+}
+
+// Order k of q = a/d, given order k of a and orders 0 to k-1 of q.
+static double psQuotient( double a_k, const double *q, const double *d, int k )
+{
+  int j;
+  double sum = a_k;
+
+  for (j = 1; j <= k; j++) {
+    sum -= d[j]*q[k-j];
+  }
+
+  return sum/d[0];
+}
+
+// Order k of c*x/(exp(x/s) - 1), with x = sign*(v - e), into the series
+// of exp(x/s), of its denominator and of the rate itself.
+//
+// The quotient divides by order 0 of the denominator, which vanishes with x,
+// and the errors grow by the ratio of the higher orders to it at every
+// order. Near x = 0 the rate is written c*s/phi(u) instead, with u = x/s and
+// phi(u) = (exp(u) - 1)/u = sum u^n/(n+1)!, which is close to 1 there; the
+// sum goes through the Horner stages starting at horner_id.
+static void psRate( double series[][PS_MAX_ORDER+1], int k, double c,
+                    double e, double sign, double s, int exp_id, int den_id,
+                    int rate_id, int horner_id )
+{
+  int j, n;
+  double const *v = series[PS_V];
+  double x, u_j, fact, *stage;
+
+  x = sign*(v[0] - e);
+  if (fabs( x/s ) < 1) {
+    // Factorial of n+1, for the last stage first.
+    fact = 1;
+    for (n = 2; n <= PS_NEAR_TERMS; n++) {
+      fact *= n;
+    }
+    for (n = PS_NEAR_TERMS-1; n >= 0; n--) {
+      stage = series[horner_id + n];
+      stage[k] = (k == 0) ? 1/fact : 0;
+      if (n+1 < PS_NEAR_TERMS) {
+        for (j = 0; j <= k; j++) {
+          u_j = (j == 0) ? x/s : sign*v[j]/s;
+          stage[k] += u_j*series[horner_id + n+1][k-j];
+        }
+      }
+      fact /= n+1;
+    }
+    series[den_id][k] = series[horner_id][k];
+    series[rate_id][k] = psQuotient( (k == 0) ? c*s : 0, series[rate_id],
+                                     series[den_id], k );
+  } else if (k == 0) {
+    series[exp_id][0] = exp(x/s);
+    series[den_id][0] = series[exp_id][0] - 1;
+    series[rate_id][0] = c*x/series[den_id][0];
+  } else {
+    series[exp_id][k] = psExp( series[exp_id], v, sign/s, k );
+    series[den_id][k] = series[exp_id][k];
+    series[rate_id][k] = psQuotient( c*sign*v[k], series[rate_id],
+                                     series[den_id], k );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void somaSeries( double series[][PS_MAX_ORDER+1], int k, double delta_t,
+                 double i_inj, double i_dendr )
+{
+  double const E_alpha_n = Vr + 15;
+  double const E_beta_n  = Vr + 10;
+  double const E_alpha_m = Vr + 13;
+  double const E_beta_m  = Vr + 40;
+  double const E_alpha_h = Vr + 17;
+  double const E_beta_h  = Vr + 40;
+  double const scale = delta_t/(k+1);
+  double *v = series[PS_V];
+  double *n = series[PS_N];
+  double *m = series[PS_M];
+  double *h = series[PS_H];
+
+  // Powers of the gates.
+  series[PS_N2][k]  = psProduct( n, n, k );
+  series[PS_N4][k]  = psProduct( series[PS_N2], series[PS_N2], k );
+  series[PS_M2][k]  = psProduct( m, m, k );
+  series[PS_M3][k]  = psProduct( series[PS_M2], m, k );
+  series[PS_M3H][k] = psProduct( series[PS_M3], h, k );
+
+  // Rate functions, as in soma().
+  psRate( series, k, 0.032, E_alpha_n, -1, 5, PS_EAN, PS_DAN, PS_AN,
+          PS_HAN );
+  series[PS_BN][k] = (k == 0) ? 0.5*exp((E_beta_n-v[0])/40) :
+                     psExp( series[PS_BN], v, -1.0/40, k );
+  series[PS_SN][k] = series[PS_AN][k] + series[PS_BN][k];
+
+  psRate( series, k, 0.32, E_alpha_m, -1, 4, PS_EAM, PS_DAM, PS_AM, PS_HAM );
+  psRate( series, k, 0.28, E_beta_m, 1, 5, PS_EBM, PS_DBM, PS_BM, PS_HBM );
+  series[PS_SM][k] = series[PS_AM][k] + series[PS_BM][k];
+
+  series[PS_AH][k] = (k == 0) ? 0.128*exp((E_alpha_h-v[0])/18) :
+                     psExp( series[PS_AH], v, -1.0/18, k );
+  series[PS_EBH][k] = (k == 0) ? exp((E_beta_h-v[0])/5) :
+                      psExp( series[PS_EBH], v, -1.0/5, k );
+  series[PS_DBH][k] = series[PS_EBH][k] + ((k == 0) ? 1 : 0);
+  series[PS_BH][k] = psQuotient( (k == 0) ? 4 : 0, series[PS_BH],
+                                 series[PS_DBH], k );
+  series[PS_SH][k] = series[PS_AH][k] + series[PS_BH][k];
+
+  // Next order of the state. alpha*(1-x) - beta*x = alpha - (alpha+beta)*x.
+  v[k+1] = scale*(((k == 0) ? i_inj : 0) + i_dendr -
+                  gK*(psProduct( series[PS_N4], v, k ) - EK*series[PS_N4][k]) -
+                  gNa*(psProduct( series[PS_M3H], v, k ) -
+                       ENa*series[PS_M3H][k]) -
+                  gL*(v[k] - ((k == 0) ? EL : 0)))/Cs;
+  n[k+1] = scale*(series[PS_AN][k] - psProduct( series[PS_SN], n, k ));
+  m[k+1] = scale*(series[PS_AM][k] - psProduct( series[PS_SM], m, k ));
+  h[k+1] = scale*(series[PS_AH][k] - psProduct( series[PS_SH], h, k ));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 void rk4Step( double *y, double *y0, double *dydt0, int nv, double *fp,
-              double dt, void (*derivs)(double*, double*, double*) )
+              double dt, void (*derivs)(double*, double*, double*),
+              double *work )
 {
     int i;
     double const dt2 = dt/2;
     double const dt6 = dt/6;
-    double *rk1,*rk2,*rk3,*dydt;
-
-    rk1  = malloc( nv * sizeof(double) );
-    rk2  = malloc( nv * sizeof(double) );
-    rk3  = malloc( nv * sizeof(double) );
-    dydt = malloc( nv * sizeof(double) );
+    double *rk1  = work;
+    double *rk2  = work + nv;
+    double *rk3  = work + 2*nv;
+    double *dydt = work + 3*nv;
 
     for (i = 0; i < nv; i++) { // 1
       rk1[i] = dydt0[i];
@@ -141,8 +911,152 @@ void rk4Step( double *y, double *y0, double *dydt0, int nv, double *fp,
     for (i = 0; i < nv; i++) {
       y[i] = y0[i] + dt6*(rk1[i]+dydt[i]+2*(rk2[i]+rk3[i]));
     }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double rk45Step( double *y, double *y0, double *dydt0, int nv, double *fp,
+                 double dt, void (*derivs)(double*, double*, double*),
+                 double *work )
+{
+    int i;
+    double e, err = 0.0;
+    double *k2 = work;
+    double *k3 = work + nv;
+    double *k4 = work + 2*nv;
+    double *k5 = work + 3*nv;
+    double *k6 = work + 4*nv;
+    double *k7 = work + 5*nv;
+    double *y5 = work + 6*nv;
+
+    for (i = 0; i < nv; i++) {
+      y[i] = y0[i] + dt*(dydt0[i]/5);
+    }
+    derivs(k2, y, fp);
+
+    for (i = 0; i < nv; i++) {
+      y[i] = y0[i] + dt*(3*dydt0[i]/40 + 9*k2[i]/40);
+    }
+    derivs(k3, y, fp);
+
+    for (i = 0; i < nv; i++) {
+      y[i] = y0[i] + dt*(44*dydt0[i]/45 - 56*k2[i]/15 + 32*k3[i]/9);
+    }
+    derivs(k4, y, fp);
+
+    for (i = 0; i < nv; i++) {
+      y[i] = y0[i] + dt*(19372*dydt0[i]/6561 - 25360*k2[i]/2187 +
+                         64448*k3[i]/6561 - 212*k4[i]/729);
+    }
+    derivs(k5, y, fp);
+
+    for (i = 0; i < nv; i++) {
+      y[i] = y0[i] + dt*(9017*dydt0[i]/3168 - 355*k2[i]/33 +
+                         46732*k3[i]/5247 + 49*k4[i]/176 -
+                         5103*k5[i]/18656);
+    }
+    derivs(k6, y, fp);
+
+    for (i = 0; i < nv; i++) {
+      y5[i] = y0[i] + dt*(35*dydt0[i]/384 + 500*k3[i]/1113 +
+                          125*k4[i]/192 - 2187*k5[i]/6784 + 11*k6[i]/84);
+    }
+    derivs(k7, y5, fp);
+
+    // Difference between the 5th and the embedded 4th order solutions.
+    for (i = 0; i < nv; i++) {
+      y[i] = y5[i];
+      e = dt*(71*dydt0[i]/57600 - 71*k3[i]/16695 + 71*k4[i]/1920 -
+              17253*k5[i]/339200 + 22*k6[i]/525 - k7[i]/40);
+      err = fmax(err, fabs(e)/(1 + fabs(y5[i])));
+    }
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void stepControlInit( HHStepControl *ctl, double tolerance, int max_span )
+{
+  ctl->tolerance = tolerance;
+  ctl->span      = 1;
+  ctl->max_span  = max_span;
+  ctl->last      = 1;
+  ctl->steps     = 0;
+  ctl->rejected  = 0;
+  ctl->smallest  = max_span;
+  ctl->largest   = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int somaStepAdaptive( HHStepControl *ctl, double *y, double *soma_params,
+                      int limit, HHWorkspace *ws )
+{
+  int i, span;
+  double err, factor, y0[NUMVAR], dydt[NUMVAR];
+
+  span = ctl->span;
+  span = (span > ctl->max_span) ? ctl->max_span : span;
+  span = (span > limit) ? limit : span;
+
+  for (i = 0; i < NUMVAR; i++) {
+    y0[i] = y[i];
+  }
+
+  // The step size is folded into the derivatives, as with rk4Step.
+  for (;;) {
+    soma_params[0] = (double) span / params.steps;
+    soma(dydt, y0, soma_params);
+    err = rk45Step(y, y0, dydt, NUMVAR, soma_params, 1, soma, ws->rk);
+
+    // Usual controller of a 5th order method, with a safety factor of 0.9.
+    factor = (err > 0) ? 0.9*pow(ctl->tolerance/err, 0.2) : 5;
+    if (err <= ctl->tolerance || span == 1) {
+      break;
+    }
+
+    ctl->rejected++;
+    factor = (factor < 0.2) ? 0.2 : factor;
+    span = (int) (span*factor);
+    span = (span < 1) ? 1 : span;
+  }
+
+  ctl->steps++;
+  ctl->last     = span;
+  ctl->smallest = (span < ctl->smallest) ? span : ctl->smallest;
+  ctl->largest  = (span > ctl->largest) ? span : ctl->largest;
+
+  factor = (factor > 5) ? 5 : factor;
+  ctl->span = (int) (span*factor);
+  ctl->span = (ctl->span < 1) ? 1 : ctl->span;
+
+  return span;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void stepControlCurrent( HHStepControl *ctl, double v_m, double i_held,
+                         double i_new )
+{
+  int span;
+  double err, factor;
+
+  // The held current is off by up to the change over the step, which moves
+  // v_m by half of that over the step; scaled like the rk45Step estimate.
+  err = 0.5 * ctl->last / params.steps * fabs( i_new - i_held ) / Cs;
+  err = err / (1.0 + fabs( v_m ));
+  if (err <= 0) {
+    return;
+  }
 
-    free(rk1); free(rk2); free(rk3); free(dydt);
+  // The error is first order in the step.
+  factor = 0.9 * ctl->tolerance / err;
+  span = (int) (ctl->last * ((factor > 5) ? 5 : factor));
+  span = (span < 1) ? 1 : span;
+  if (span < ctl->span) {
+    ctl->span = span;
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -213,3 +1127,64 @@ void dendrite( double *dydx, double *y, double *param )
   *dydx = dt*(I_inj + gBefore*yBefore - (gBefore + gAfter)**y + gAfter*yAfter -
           (gLd)*(*y-EL))/(Cd);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void somaLanes( double *dydx, double *y, double *param )
+{
+  int l;
+  double alpha_n, beta_n, alpha_m, beta_m, alpha_h, beta_h, v;
+  double const E_alpha_n = Vr + 15;
+  double const E_beta_n  = Vr + 10;
+  double const E_alpha_m = Vr + 13;
+  double const E_beta_m  = Vr + 40;
+  double const E_alpha_h = Vr + 17;
+  double const E_beta_h  = Vr + 40;
+  double const dt = param[LANE_DT];
+
+  hhvec const vm  = *(const hhvec*) (y);
+  hhvec const n   = *(const hhvec*) (y + HH_VLEN);
+  hhvec const m   = *(const hhvec*) (y + 2*HH_VLEN);
+  hhvec const h   = *(const hhvec*) (y + 3*HH_VLEN);
+  hhvec const n4  = n*n*n*n;
+  hhvec const m3h = m*m*m*h;
+  hhvec const I_dendr = *(const hhvec*) (param + LANE_I_DENDR);
+  hhvec const g_k  = *(const hhvec*) (param + LANE_G_K);
+  hhvec const g_na = *(const hhvec*) (param + LANE_G_NA);
+  hhvec const g_l  = *(const hhvec*) (param + LANE_G_L);
+
+  // No current is injected into the soma itself, as in soma().
+  *(hhvec*) dydx = dt*(I_dendr - g_k*n4*(vm-(double)EK) -
+                   g_na*m3h*(vm-(double)ENa) - g_l*(vm-(double)EL))/(double)Cs;
+
+  // The rates need exp(), which has no vector form; the lanes take turns.
+  for (l = 0; l < HH_VLEN; l++) {
+    v = y[l];
+
+    if (v == E_alpha_n) {   // protect against div by zero
+      alpha_n = 0.032*5;
+    } else {
+      alpha_n = 0.032 * (E_alpha_n-v)/(exp((E_alpha_n-v)/5) - 1);
+    }
+
+    beta_n  = 0.5*exp((E_beta_n-v)/40);
+    dydx[HH_VLEN + l] = dt*(alpha_n*(1-n[l]) - beta_n*n[l]);
+
+    if (v == E_alpha_m) {   // protect against div by zero
+      alpha_m = 0.32*4;
+    } else {
+      alpha_m = 0.32 * (E_alpha_m-v)/(exp((E_alpha_m-v)/4) - 1);
+    }
+
+    if (v == E_beta_m) {    // protect against div by zero
+      beta_m = 0.28*5;
+    } else {
+      beta_m = 0.28 * (v-E_beta_m)/(exp((v-E_beta_m)/5) - 1);
+    }
+
+    dydx[2*HH_VLEN + l] = dt*(alpha_m*(1-m[l]) - beta_m*m[l]);
+    alpha_h = 0.128 * exp((E_alpha_h-v)/18);
+    beta_h  = 4 / (exp((E_beta_h-v)/5)+1);
+    dydx[3*HH_VLEN + l] = dt*(alpha_h*(1-h[l]) - beta_h*h[l]);
+  }
+}
@@ -8,9 +8,18 @@
 
 #include "plot.h"
 #include "lib_hh.h"
+#include "engine.h"
+#include "sync.h"
+#include "profile.h"
+#include "partition.h"
+#include "segment.h"
+#include "trace.h"
+#include "record.h"
+#include "checkpoint.h"
 #include "cmd_args.h"
 #include "constants.h"
 
+#include <math.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,34 +43,891 @@
   #define ISDEF_PLOT_PNG 0
 #endif
 
+// Flag leading every waveform relaxation message.
+#define WR_NEW  0.0   // First iteration of the next window.
+#define WR_REDO 1.0   // Step the same window again.
+#define WR_DONE 2.0   // No windows left.
+
+// Iterations after which a window is accepted even if it has not converged.
+#define WR_MAX_ITERS 50
+
+// With --decompose auto, cutting the dendrites is suggested if that is
+// expected to take the most loaded rank below this fraction of its load with
+// whole dendrites.
+#define CUT_GAIN 0.9
+
+// Tag of the potentials of a dendrite moving to another rank.
+#define TAG_MIGRATE 7
+
+/**
+ * State of --rebalance. Every rank keeps the same copy of the assignment
+ * and makes the same decisions from the same gathered timings.
+ */
+typedef struct Rebalance {
+  const CmdArgs *args;  // Kernel, threads, integrator and threshold.
+  int rank;             // Rank of this process.
+  int num_tasks;        // Number of processes.
+  int num_dendrs;       // Number of dendrites.
+  const int *comps;     // Compartments of each dendrite.
+  const HHRng *rng;     // Generator of the tip currents.
+  int draws;            // Steps of the grid per dendrite step.
+  int *owner;           // Rank owning each dendrite.
+  int *prev;            // Owner before the last check.
+  int *old_slot;        // Index of each dendrite in the old engine.
+  int *new_slot;        // And in the new one.
+  double *cost;         // Estimated cost of each dendrite.
+  double soma_cost;     // Estimated extra cost of rank 0.
+  double *busy;         // Seconds each rank stepped since the last check.
+  double *speed;        // Cost each rank got through per second.
+  double *time;         // Predicted step time of each rank.
+  double *row;          // Potentials of one moving dendrite.
+  double last;          // Seconds this rank had stepped at the last check.
+  int checks;           // Load checks so far.
+  int migrations;       // Checks that moved dendrites.
+  long moved;           // Dendrites moved.
+  double seconds;       // Time spent moving them, slowest rank.
+  long allocs;          // hhMalloc calls made by the new engines.
+} Rebalance;
+
+/**
+ * Statistics of a waveform relaxation run.
+ */
+typedef struct RelaxStats {
+  long windows;       // Number of windows stepped.
+  long iterations;    // Total number of iterations over all windows.
+  int max_iters;      // Most iterations needed by one window.
+  long unconverged;   // Windows accepted after WR_MAX_ITERS iterations.
+} RelaxStats;
+
+
+/**
+ * Name: assign_dendrites
+ *
+ * Description:
+ * Splits the dendrites between all ranks by estimated cost, longest first
+ * (partitionLPT). Rank 0 starts with the cost of stepping the soma and of
+ * its extra messages, so it only gets dendrites once the workers are loaded
+ * past that point. Every rank computes the same assignment, so it is never
+ * sent around.
+ *
+ * Parameters:
+ * @param rank       MPI rank of this node
+ * @param num_tasks  total number of MPI tasks
+ * @param num_dendrs number of simulated dendrites
+ * @param comps      compartments of each dendrite, dummy and soma ones
+ *                   included
+ * @param cmd_args   synchronisation and threading options
+ * @param gids       (OUTPUT) dendrites owned by this rank, room for
+ *                   num_dendrs entries
+ * @param load       (OUTPUT) estimated cost of a dendrite step of every
+ *                   rank, in compartment updates
+ * @param owner      (OUTPUT) rank owning each dendrite, or NULL
+ *
+ * Returns:
+ * @return int       number of dendrites owned by this rank
+ */
+int assign_dendrites(int rank, int num_tasks, int num_dendrs,
+                     const int *comps, CmdArgs *cmd_args, int *gids,
+                     double *load, int *owner) {
+  int dendrite, num_owned;
+  double *cost;
+  int *own = owner;
+
+  cost = (double*) hhMalloc( sizeof(double) * num_dendrs );
+  if (own == NULL) {
+    own = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  }
+  if (cost == NULL || own == NULL) {
+    fprintf( stderr, "Could not allocate the dendrite assignment!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  // Every dendrite costs one update per compartment.
+  for (dendrite = 0; dendrite < num_dendrs; dendrite++) {
+    cost[dendrite] = (double) comps[dendrite];
+  }
+  load[0] = partitionSomaCost( cmd_args->sync, num_tasks,
+                               cmd_args->num_threads, cmd_args->substeps );
+  for (dendrite = 1; dendrite < num_tasks; dendrite++) {
+    load[dendrite] = 0.0;
+  }
+
+  if (!partitionLPT( num_dendrs, cost, num_tasks, load, own )) {
+    fprintf( stderr, "Could not allocate the dendrite assignment!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  num_owned = partitionOwned( num_dendrs, own, rank, gids );
+
+  free(cost);
+  if (own != owner) {
+    free(own);
+  }
+
+  return num_owned;
+}
+
+/**
+ * Name: rebalance_init
+ *
+ * Description:
+ * Sets up --rebalance from the assignment made by assign_dendrites.
+ *
+ * Parameters:
+ * @param rb         (OUTPUT) the rebalancing state
+ * @param rank       MPI rank of this node
+ * @param num_tasks  total number of MPI tasks
+ * @param num_dendrs number of simulated dendrites
+ * @param comps      compartments of each dendrite, dummy and soma ones
+ *                   included
+ * @param cmd_args   kernel, threading and rebalancing options
+ * @param rng        generator of the tip currents
+ * @param draws      steps of the grid per dendrite step
+ * @param owner      rank owning each dendrite; taken over by `rb'
+ */
+void rebalance_init(Rebalance *rb, int rank, int num_tasks, int num_dendrs,
+                    const int *comps, const CmdArgs *cmd_args,
+                    const HHRng *rng, int draws, int *owner) {
+  int d, longest;
+
+  rb->args       = cmd_args;
+  rb->rank       = rank;
+  rb->num_tasks  = num_tasks;
+  rb->num_dendrs = num_dendrs;
+  rb->comps      = comps;
+  rb->rng        = rng;
+  rb->draws      = draws;
+  rb->owner      = owner;
+  rb->soma_cost  = partitionSomaCost( cmd_args->sync, num_tasks,
+                                      cmd_args->num_threads,
+                                      cmd_args->substeps );
+  rb->last       = 0.0;
+  rb->checks     = 0;
+  rb->migrations = 0;
+  rb->moved      = 0;
+  rb->seconds    = 0.0;
+  rb->allocs     = 0;
+
+  rb->prev     = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  rb->old_slot = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  rb->new_slot = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  rb->cost     = (double*) hhMalloc( sizeof(double) * num_dendrs );
+  rb->busy     = (double*) hhMalloc( sizeof(double) * num_tasks );
+  rb->speed    = (double*) hhMalloc( sizeof(double) * num_tasks );
+  rb->time     = (double*) hhMalloc( sizeof(double) * num_tasks );
+  for (d = 0, longest = 0; d < num_dendrs; d++) {
+    longest = (comps[d] > longest) ? comps[d] : longest;
+  }
+  rb->row      = (double*) hhMalloc( sizeof(double) * longest );
+  if (rb->prev == NULL || rb->old_slot == NULL || rb->new_slot == NULL ||
+      rb->cost == NULL || rb->busy == NULL || rb->speed == NULL ||
+      rb->time == NULL || rb->row == NULL) {
+    fprintf( stderr, "Could not allocate the dendrite assignment!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  // Every dendrite costs one update per compartment, as in assign_dendrites.
+  for (d = 0; d < num_dendrs; d++) {
+    rb->cost[d] = (double) comps[d];
+  }
+}
+
+/**
+ * Name: migrate_dendrites
+ *
+ * Description:
+ * Moves the dendrites whose owner changed at the last check: every rank
+ * builds an engine for its new share, copies over the dendrites it keeps,
+ * and sends or receives the potentials of the others. The moves are done
+ * in increasing dendrite order on every rank, so the blocking messages
+ * always find their match.
+ *
+ * Parameters:
+ * @param rb         (INOUT) the rebalancing state
+ * @param eng        the dendrites of this rank, freed here
+ * @param gids       (OUTPUT) dendrites now owned by this rank
+ * @param num_owned  (OUTPUT) their number
+ *
+ * Returns:
+ * @return Engine*   the new engine of this rank
+ */
+Engine *migrate_dendrites(Rebalance *rb, Engine *eng, int *gids,
+                          int *num_owned) {
+  int d, c;
+  Engine *next;
+
+  *num_owned = partitionOwned( rb->num_dendrs, rb->owner, rb->rank, gids );
+  next = engineCreate( rb->args->kernel, *num_owned, gids, eng->num_comps,
+                       rb->comps, rb->rng, rb->args->num_threads );
+  if (next == NULL ||
+      !engineSetIntegrator( next, rb->args->integrator, rb->draws )) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  // Engines order their dendrites by length.
+  for (d = 0; d < eng->num_dendrs; d++) {
+    rb->old_slot[eng->gids[d]] = d;
+  }
+  for (d = 0; d < next->num_dendrs; d++) {
+    rb->new_slot[next->gids[d]] = d;
+  }
+
+  for (d = 0; d < rb->num_dendrs; d++) {
+    if (rb->prev[d] == rb->rank) {
+      for (c = 0; c < rb->comps[d]; c++) {
+        rb->row[c] = *engineVolt( eng, rb->old_slot[d], c );
+      }
+      if (rb->owner[d] != rb->rank) {
+        MPI_Send( rb->row, rb->comps[d], MPI_DOUBLE, rb->owner[d],
+                  TAG_MIGRATE, MPI_COMM_WORLD );
+      }
+    } else if (rb->owner[d] == rb->rank) {
+      MPI_Recv( rb->row, rb->comps[d], MPI_DOUBLE, rb->prev[d], TAG_MIGRATE,
+                MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    }
+    if (rb->owner[d] == rb->rank) {
+      for (c = 0; c < rb->comps[d]; c++) {
+        *engineVolt( next, rb->new_slot[d], c ) = rb->row[c];
+      }
+    }
+  }
+
+  engineFree( eng );
+  return next;
+}
+
+/**
+ * Name: rebalance_check
+ *
+ * Description:
+ * Load check of --rebalance, made by every rank at the same step. The time
+ * each rank spent stepping dendrites and the soma since the last check is
+ * gathered everywhere. If the busiest rank is above the threshold over the
+ * mean, the speed of every rank is taken from its estimated load and that
+ * time, and dendrites move from slow to fast ranks (partitionMigrate).
+ * Rank 0 logs every check: the imbalance found, and for a migration the
+ * dendrites moved, what it took and the imbalance it predicts, to be
+ * compared with the one found at the next check.
+ *
+ * Parameters:
+ * @param rb         (INOUT) the rebalancing state
+ * @param eng        the dendrites of this rank
+ * @param gids       (INOUT) dendrites owned by this rank
+ * @param num_owned  (INOUT) their number
+ * @param prof       (INOUT) timings of this rank; its load is updated
+ * @param t_ms       simulated time of the check, ms
+ *
+ * Returns:
+ * @return Engine*   the dendrites of this rank, in a new engine if any
+ *                   moved
+ */
+Engine *rebalance_check(Rebalance *rb, Engine *eng, int *gids,
+                        int *num_owned, RankProfile *prof, int t_ms) {
+  int d, r, known, moved, slowest;
+  long allocs;
+  double busy, imbalance, predicted, mean, start, took, longest;
+
+  busy = prof->compute + prof->soma - rb->last;
+  MPI_Allgather( &busy, 1, MPI_DOUBLE, rb->busy, 1, MPI_DOUBLE,
+                 MPI_COMM_WORLD );
+  rb->last += busy;
+  rb->checks++;
+  imbalance = partitionImbalance( rb->num_tasks, rb->busy );
+  if (imbalance <= rb->args->rebalance_threshold) {
+    if (rb->rank == 0) {
+      printf( "\r%02d ms: load imbalance %.3f\n", t_ms, imbalance );
+    }
+    return eng;
+  }
+
+  start = MPI_Wtime();
+  allocs = hhAllocCount();
+
+  // Speed of every rank from its estimated load. Ranks with nothing to time
+  // are taken to run at the mean speed of the others.
+  for (r = 0; r < rb->num_tasks; r++) {
+    rb->time[r] = (r == 0) ? rb->soma_cost : 0.0;
+  }
+  for (d = 0; d < rb->num_dendrs; d++) {
+    rb->time[rb->owner[d]] += rb->cost[d];
+    rb->prev[d] = rb->owner[d];
+  }
+  for (r = 0, known = 0, mean = 0.0; r < rb->num_tasks; r++) {
+    rb->speed[r] = (rb->busy[r] > 0.0) ? rb->time[r] / rb->busy[r] : 0.0;
+    mean  += rb->speed[r];
+    known += (rb->speed[r] > 0.0);
+  }
+  mean = (known > 0) ? mean / known : 1.0;
+  for (r = 0, slowest = 0; r < rb->num_tasks; r++) {
+    if (rb->speed[r] <= 0.0) {
+      rb->speed[r] = mean;
+    }
+    rb->time[r] /= rb->speed[r];
+    slowest = (rb->speed[r] < rb->speed[slowest]) ? r : slowest;
+  }
+
+  moved = partitionMigrate( rb->num_dendrs, rb->cost, rb->num_tasks,
+                            rb->speed, rb->time, rb->owner );
+  predicted = partitionImbalance( rb->num_tasks, rb->time );
+  if (moved > 0) {
+    eng = migrate_dendrites( rb, eng, gids, num_owned );
+    prof->load = (rb->rank == 0) ? rb->soma_cost : 0.0;
+    for (d = 0; d < *num_owned; d++) {
+      prof->load += rb->cost[gids[d]];
+    }
+  }
+  rb->allocs += hhAllocCount() - allocs;
+
+  took = MPI_Wtime() - start;
+  MPI_Reduce( &took, &longest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD );
+  if (moved > 0) {
+    rb->migrations++;
+    rb->moved += moved;
+    rb->seconds += longest;
+  }
+  if (rb->rank == 0) {
+    printf( "\r%02d ms: load imbalance %.3f, rank %d at %.2f of the mean "
+            "speed; moved %d dendrites in %.6f s, predicted imbalance "
+            "%.3f\n", t_ms, imbalance, slowest, rb->speed[slowest] / mean,
+            moved, longest, predicted );
+  }
+
+  return eng;
+}
+
+/**
+ * Name: rebalance_free
+ *
+ * Description:
+ * Releases the rebalancing state, the assignment included.
+ *
+ * Parameters:
+ * @param rb         the rebalancing state
+ */
+void rebalance_free(Rebalance *rb) {
+  free(rb->owner);
+  free(rb->prev);
+  free(rb->old_slot);
+  free(rb->new_slot);
+  free(rb->cost);
+  free(rb->busy);
+  free(rb->speed);
+  free(rb->time);
+  free(rb->row);
+}
+
+/**
+ * Name: cut_dendrites
+ *
+ * Description:
+ * Decides whether the ranks step runs of compartments instead of whole
+ * dendrites (--decompose). The dendrites are laid end to end and cut into
+ * one run per rank (partitionChain), rank 0 starting with the cost of the
+ * soma as in assign_dendrites. Runs only see the potentials of their
+ * neighbours a step late, which changes the results, so the dendrites are
+ * only cut if 'compartments' was asked for. In 'auto' mode rank 0 says so
+ * if the cut would take the most loaded rank below CUT_GAIN of its load
+ * with whole dendrites: when there are few dendrites for many ranks, or
+ * long ones that do not share out evenly.
+ *
+ * Parameters:
+ * @param rank       MPI rank of this node
+ * @param num_tasks  total number of MPI tasks
+ * @param num_dendrs number of simulated dendrites
+ * @param comps      compartments of each dendrite, dummy and soma ones
+ *                   included
+ * @param cmd_args   decomposition, synchronisation and threading options
+ * @param load       (INOUT) estimated load of every rank with whole
+ *                   dendrites, as left by assign_dendrites; replaced by
+ *                   the one with runs of compartments if those are used
+ * @param pieces     (OUTPUT) the runs of all ranks, room for
+ *                   num_dendrs+num_tasks-1 entries
+ *
+ * Returns:
+ * @return int       number of runs, or 0 to step whole dendrites
+ */
+int cut_dendrites(int rank, int num_tasks, int num_dendrs, const int *comps,
+                  CmdArgs *cmd_args, double *load, PartitionPiece *pieces) {
+  int d, r, num_pieces;
+  int *size;
+  double *cut_load, most = 0.0, cut_most = 0.0;
+
+  if (cmd_args->decompose == DECOMPOSE_DENDRITES) {
+    return 0;
+  }
+
+  size     = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  cut_load = (double*) hhMalloc( sizeof(double) * num_tasks );
+  if (size == NULL || cut_load == NULL) {
+    fprintf( stderr, "Could not allocate the dendrite assignment!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  // Only the real compartments are cut up.
+  for (d = 0; d < num_dendrs; d++) {
+    size[d] = comps[d] - 2;
+  }
+  cut_load[0] = partitionSomaCost( cmd_args->sync, num_tasks,
+                                   cmd_args->num_threads, cmd_args->substeps );
+  for (r = 1; r < num_tasks; r++) {
+    cut_load[r] = 0.0;
+  }
+  num_pieces = partitionChain( num_dendrs, size, num_tasks, cut_load,
+                               pieces );
+  // Runs are costed like dendrites, dummy and soma compartments included.
+  for (d = 0; d < num_pieces; d++) {
+    cut_load[pieces[d].rank] += 2.0;
+  }
+
+  for (r = 0; r < num_tasks; r++) {
+    most = (load[r] > most) ? load[r] : most;
+    cut_most = (cut_load[r] > cut_most) ? cut_load[r] : cut_most;
+  }
+  if (cmd_args->decompose == DECOMPOSE_AUTO) {
+    if (rank == 0 && cut_most < CUT_GAIN * most) {
+      printf( "Cutting the dendrites (--decompose compartments) would "
+              "bring the predicted imbalance from %.3f to %.3f, but gives "
+              "inexact results.\n", partitionImbalance( num_tasks, load ),
+              partitionImbalance( num_tasks, cut_load ) );
+    }
+    num_pieces = 0;
+  } else {
+    for (r = 0; r < num_tasks; r++) {
+      load[r] = cut_load[r];
+    }
+  }
+
+  free(size);
+  free(cut_load);
+
+  return num_pieces;
+}
+
+/**
+ * Name: step_dendrites
+ *
+ * Description:
+ * Lock-step dendrite step of this rank: its whole dendrites, or its runs
+ * of compartments once the boundary potentials of the last step are in.
+ *
+ * Parameters:
+ * @param eng        the dendrites of this rank
+ * @param segs       its runs of compartments, or NULL
+ * @param step       global index of the dendrite step
+ * @param delta_t    integration step of the dendrites
+ * @param v_m        soma membrane potential
+ * @param prof       (INOUT) timings of this rank
+ *
+ * Returns:
+ * @return double    current injected into the soma by this rank
+ */
+double step_dendrites(Engine *eng, SegmentSet *segs, long step,
+                      double delta_t, double v_m, RankProfile *prof) {
+  double current, tick = MPI_Wtime();
+
+  if (segs != NULL) {
+    segmentsWait(segs);
+    prof->halo += MPI_Wtime() - tick;
+    tick = MPI_Wtime();
+    current = segmentsStep(segs, step, delta_t, v_m);
+  } else {
+    current = engineStep(eng, step, delta_t, v_m);
+  }
+  prof->compute += MPI_Wtime() - tick;
+
+  return current;
+}
+
+/**
+ * Name: open_record
+ *
+ * Description:
+ * Opens the compartment recording on every rank, each with its own
+ * dendrites. Collective.
+ *
+ * Parameters:
+ * @param eng        the dendrites of this rank
+ * @param num_dendrs number of simulated dendrites
+ * @param cmd_args   name of the recording and steps between frames
+ *
+ * Returns:
+ * @return Recorder* the writer of this rank
+ */
+Recorder *open_record(Engine *eng, int num_dendrs, CmdArgs *cmd_args) {
+  int steps = cmd_args->steps;
+  Recorder *rec;
+
+  rec = recorderOpenShared(cmd_args->record, eng, num_dendrs,
+                           (double) cmd_args->record_every / steps,
+                           (long) (cmd_args->params.comp_time-1) * steps
+                           / cmd_args->record_every + 1);
+  if (rec == NULL) {
+    fprintf( stderr, "Can't open %s file!\n", cmd_args->record );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  return rec;
+}
+
+/**
+ * Name: step_window
+ *
+ * Description:
+ * One waveform relaxation iteration of the dendrites of this rank. Steps
+ * them through a window against the soma potential in `msg', starting over
+ * from the start of the window if the message asks for it, and adds up the
+ * current of every step over all ranks at rank 0.
+ *
+ * Parameters:
+ * @param sync       the synchronisation engine
+ * @param eng        the dendrites of this rank
+ * @param msg        flag followed by the soma potential of every step
+ * @param cur        (OUTPUT) current of every step, on rank 0 the total
+ * @param work       scratch space of `n' doubles
+ * @param s0         global step at the start of the window
+ * @param n          number of steps in the window
+ * @param prof       (INOUT) timings of this rank
+ */
+void step_window(Sync *sync, Engine *eng, const double *msg, double *cur,
+                 double *work, long s0, int n, RankProfile *prof) {
+  int k;
+  double start = MPI_Wtime();
+
+  if (msg[0] == WR_NEW) {
+    engineSave(eng);
+  } else {
+    engineRestore(eng);
+  }
+
+  for (k = 0; k < n; k++) {
+    cur[k] = engineStep( eng, s0 + k, sync->delta_t, msg[1+k] );
+  }
+  prof->compute += MPI_Wtime() - start;
+
+  syncWindowCurrent(sync, cur, work, n);
+}
+
+/**
+ * Name: soma_relax
+ *
+ * Description:
+ * Main loop of the soma with waveform relaxation. Every window starts with
+ * the soma potential extrapolated linearly from the end of the last one.
+ * The dendrites are stepped against it, the soma is stepped with the
+ * currents they return, and the window is stepped again against the new
+ * soma potential until it changes by at most `tolerance'. A window of one
+ * step reproduces the lock-step loop exactly.
+ *
+ * Parameters:
+ * @param sync        the synchronisation engine
+ * @param eng         the dendrites of this rank
+ * @param ws          scratch space of the soma stepper
+ * @param y           (INOUT) soma state
+ * @param soma_params (INOUT) soma parameters
+ * @param res         (OUTPUT) soma potential at the end of every ms
+ * @param trace       (INOUT) trace the accepted windows are sampled to
+ * @param stride      integration steps per sample
+ * @param steps       integration steps per ms
+ * @param window      steps per window
+ * @param tolerance   largest accepted change of the soma potential, mV
+ * @param buf         scratch space of 4*window+1 doubles
+ * @param stats       (OUTPUT) iteration counts
+ * @param prof        (INOUT) timings of this rank
+ */
+void soma_relax(Sync *sync, Engine *eng, HHWorkspace *ws, double *y,
+                double *soma_params, double *res, TraceWriter *trace,
+                int stride, int steps, int window, double tolerance,
+                double *buf, RelaxStats *stats, RankProfile *prof) {
+  int i, k, n, iter;
+  long s0, total = (long) (hhParams()->comp_time-1) * steps;
+  double change, slope, prev, y_start[NUMVAR], y0[NUMVAR], dydt[NUMVAR];
+  double start;
+  double *msg  = buf;                 // Flag and guessed soma potential.
+  double *traj = buf + window + 1;    // Soma potential of the last iteration.
+  double *cur  = buf + 2*window + 1;  // Dendritic current of every step.
+  double *work = buf + 3*window + 1;
+
+  stats->windows = 0;
+  stats->iterations = 0;
+  stats->max_iters = 0;
+  stats->unconverged = 0;
+
+  prev = y[0];
+  for (s0 = 0; s0 < total; s0 += window) {
+    n = (total - s0 < window) ? (int) (total - s0) : window;
+
+    // Guess the soma potential from the slope at the end of the last window.
+    slope = y[0] - prev;
+    msg[0] = WR_NEW;
+    for (k = 0; k < n; k++) {
+      msg[1+k] = y[0] + k * slope;
+    }
+    for (i = 0; i < NUMVAR; i++) {
+      y_start[i] = y[i];
+    }
+
+    for (iter = 1; ; iter++) {
+      syncWindow(sync, msg, window + 1);
+      step_window(sync, eng, msg, cur, work, s0, n, prof);
+
+      // Step the soma through the window with the currents just received.
+      start = MPI_Wtime();
+      for (i = 0; i < NUMVAR; i++) {
+        y[i] = y_start[i];
+      }
+      change = 0.0;
+      for (k = 0; k < n; k++) {
+        traj[k] = y[0];
+        change = fmax(change, fabs(y[0] - msg[1+k]));
+
+        soma_params[2] = cur[k];
+        y0[0] = y[0]; y0[1] = y[1]; y0[2] = y[2]; y0[3] = y[3];
+        soma(dydt, y, soma_params);
+        rk4Step(y, y0, dydt, NUMVAR, soma_params, 1, soma, ws->rk);
+
+        if ((s0 + k + 1) % steps == 0) {
+          res[(s0 + k + 1) / steps] = y[0];
+        }
+      }
+      prof->soma += MPI_Wtime() - start;
+
+      if (change <= tolerance || iter == WR_MAX_ITERS) {
+        break;
+      }
+
+      // Step the window again against the new soma potential.
+      msg[0] = WR_REDO;
+      for (k = 0; k < n; k++) {
+        msg[1+k] = traj[k];
+      }
+    }
+    prev = traj[n-1];
+
+    // Only the last iteration of a window is kept. traj[k] is the potential
+    // at the start of step k of the window.
+    for (k = 1; k <= n; k++) {
+      if ((s0 + k) % stride == 0) {
+        traceWrite(trace, (k < n) ? traj[k] : y[0]);
+      }
+    }
+
+    stats->windows++;
+    stats->iterations += iter;
+    stats->max_iters = (iter > stats->max_iters) ? iter : stats->max_iters;
+    stats->unconverged += (change > tolerance);
+
+    // Let's show where we are in terms of computation.
+    if ((s0 + n) / steps != s0 / steps) {
+      printf("\r%02ld ms", (s0 + n) / steps); fflush(stdout);
+    }
+  }
+
+  // Let the workers go.
+  msg[0] = WR_DONE;
+  syncWindow(sync, msg, window + 1);
+}
+
+/**
+ * Name: worker_relax
+ *
+ * Description:
+ * Main loop of a worker with waveform relaxation (see soma_relax).
+ *
+ * Parameters:
+ * @param sync       the synchronisation engine
+ * @param eng        the dendrites of this rank
+ * @param steps      integration steps per ms
+ * @param window     steps per window
+ * @param buf        scratch space of 4*window+1 doubles
+ * @param prof       (INOUT) timings of this rank
+ */
+void worker_relax(Sync *sync, Engine *eng, int steps, int window,
+                  double *buf, RankProfile *prof) {
+  int n;
+  long s0 = -window, total = (long) (hhParams()->comp_time-1) * steps;
+  double *msg  = buf;
+  double *cur  = buf + 2*window + 1;
+  double *work = buf + 3*window + 1;
+
+  for (;;) {
+    syncWindow(sync, msg, window + 1);
+    if (msg[0] == WR_DONE) {
+      break;
+    }
+
+    // Each window starts where the last one ended.
+    if (msg[0] == WR_NEW) {
+      s0 += window;
+    }
+    n = (total - s0 < window) ? (int) (total - s0) : window;
+
+    step_window(sync, eng, msg, cur, work, s0, n, prof);
+  }
+}
+
+/**
+ * Name: soma_adaptive
+ *
+ * Description:
+ * Main loop of the soma with adaptive steps (see somaStepAdaptive). Every
+ * step the soma goes first, with the dendritic current of the last step
+ * held; its new potential and the size of the step are then sent to the
+ * workers in one message, and all ranks step their dendrites over it. Steps
+ * stop at every sample.
+ *
+ * Parameters:
+ * @param sync        the synchronisation engine
+ * @param eng         the dendrites of this rank
+ * @param ws          scratch space of the soma stepper
+ * @param ctl         (INOUT) step size controller
+ * @param y           (INOUT) soma state
+ * @param soma_params (INOUT) soma parameters
+ * @param res         (OUTPUT) soma potential at the end of every ms
+ * @param trace       (INOUT) trace the soma potential is sampled to
+ * @param stride      grid steps per sample
+ * @param prof        (INOUT) timings of this rank
+ */
+void soma_adaptive(Sync *sync, Engine *eng, HHWorkspace *ws,
+                   HHStepControl *ctl, double *y, double *soma_params,
+                   double *res, TraceWriter *trace, int stride,
+                   RankProfile *prof) {
+  int t_ms, span;
+  int const grid = hhParams()->steps;
+  long first = 0;
+  double current, msg[2], start;
+
+  for (t_ms = 1; t_ms < hhParams()->comp_time; t_ms++) {
+    while (first < (long) t_ms * grid) {
+      start = MPI_Wtime();
+      span = somaStepAdaptive(ctl, y, soma_params,
+                              (int) (stride - first % stride), ws);
+      prof->soma += MPI_Wtime() - start;
+
+      msg[0] = y[0];
+      msg[1] = span;
+      syncWindow(sync, msg, 2);
+
+      start = MPI_Wtime();
+      current = engineStepSpan(eng, first, span, y[0]);
+      prof->compute += MPI_Wtime() - start;
+      current = syncCurrent(sync, current);
+      stepControlCurrent(ctl, y[0], soma_params[2], current);
+      soma_params[2] = current;
+      first += span;
+
+      if (first % stride == 0) {
+        traceWrite(trace, y[0]);
+      }
+    }
+
+    printf("\r%02d ms", t_ms); fflush(stdout);
+    res[t_ms] = y[0];
+  }
+}
+
+/**
+ * Name: worker_adaptive
+ *
+ * Description:
+ * Main loop of a worker with adaptive steps (see soma_adaptive).
+ *
+ * Parameters:
+ * @param sync       the synchronisation engine
+ * @param eng        the dendrites of this rank
+ * @param prof       (INOUT) timings of this rank
+ */
+void worker_adaptive(Sync *sync, Engine *eng, RankProfile *prof) {
+  int span;
+  long first, total = (long) (hhParams()->comp_time-1) * hhParams()->steps;
+  double msg[2], start, current;
+
+  for (first = 0; first < total; first += span) {
+    syncWindow(sync, msg, 2);
+    span = (int) msg[1];
+
+    start = MPI_Wtime();
+    current = engineStepSpan(eng, first, span, msg[0]);
+    prof->compute += MPI_Wtime() - start;
+    syncCurrent(sync, current);
+  }
+}
 
 /**
  * Name: worker
  *
  * Description:
- * The master process
+ * The master process. Besides stepping the soma it steps a share of the
+ * dendrites while the workers step theirs.
  * 
  * Parameters:
  * @param rank       MPI rank of this node
  * @param num_tasks  total number of MPI tasks
  * @param num_dendrs number of simulated dendrites
  * @param num_comps  number of simulated compartments
+ * @param cmd_args   kernel, validation, threading and synchronisation
+ *                   options
+ * @param restart    checkpoint to continue from, or NULL
 */
-void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
+void soma_runner(int num_tasks, int num_dendrs, int num_comps,
+                 CmdArgs *cmd_args, const CkptHeader *restart) {
   struct timeval start, stop, diff;       // Values used to measure time.
-  int dest, t_ms, step;                   // indexing vars
+  int dest, d, t_ms, step, sub;           // indexing vars
+  int t_start;                            // first ms to simulate
+  int substeps = cmd_args->substeps;      // Soma steps per dendrite step.
+  long setup_allocs;                      // hhMalloc calls made by the setup.
+  long setup_heap;                        // Heap allocations of the setup.
+  long worker_heap;                       // Those of the other ranks' loops.
 
   // message receive status
   MPI_Status status;
 
   double current; // for accumulating dendrite currents
+  double i_prev;  // dendrite current at the end of the last dendrite step
+  double dendr_dt; // integration step of the dendrites
+
+  double max_error; // largest kernel validation error of all workers
 
   double exec_time;  // How long we take.
+  double prior_time; // How long the runs we continue took.
+
+  HHWorkspace *ws;   // Scratch space used by the soma stepper.
+  Sync sync;         // Per-step exchange with the workers.
+
+  int *gids, num_owned; // Dendrites stepped by this rank.
+  int *comps;        // Compartments of each dendrite.
+  long total_comps;  // Compartments of all dendrites.
+  PartitionPiece *pieces; // Runs of compartments of all ranks, if cut.
+  int num_pieces, num_cuts;
+  SegmentSet *segs = NULL; // Runs of compartments stepped by this rank.
+  int *owner = NULL; // Rank owning each dendrite, with --rebalance.
+  Rebalance rb;      // Migration of dendrites between ranks.
+  double *loads;     // Estimated, then measured, load of every rank.
+  double predicted, measured; // Load imbalance of the ranks.
+  Engine *eng;
+  HHRng rng;         // Generator of the dendrite tip currents.
+
+  double *wr_buf = NULL; // Waveform relaxation buffers.
+  RelaxStats wr_stats;
+  HHStepControl ctl; // Step size controller of --adaptive.
+  Recorder *rec = NULL; // This rank's share of the compartment recording.
+  long dendr_step;   // Global index of a dendrite step.
+  CkptHeader ckpt;   // State saved by --checkpoint.
+  double *ckpt_buf = NULL; // Dendrites of this rank, as written to it.
+  RankProfile prof, *profs; // Timings of this rank, and of all at the end.
+  double tick;       // MPI_Wtime at the start of a timed section.
+
+  static const char *sync_names[] = { "star", "coll", "tree" };
 
   char graph_fname[ FNAME_LEN ];
   char data_fname[ FNAME_LEN ];
+  char prof_fname[ FNAME_LEN ];
 
-  FILE *data_file;  // The output file where we store the soma potential values.
+  char comment[ 256 ];
+  int comp_time = cmd_args->params.comp_time; // Samples, one per ms.
+  int grid = cmd_args->params.steps;      // Grid steps per ms.
+  int stride = cmd_args->steps / cmd_args->sample_rate; // Steps per sample.
+
+  TraceWriter *trace; // The output file where we store the soma potential.
   FILE *graph_file; // File where graph will be saved.
 
   PlotInfo pinfo;   // Info passed to the plotting functions.
@@ -69,24 +935,58 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
   // Accumulators used during dendrite simulation.
   // NOTE: We depend on the compiler to handle the use of double[] variables as
   //       double*.
-  double res[COMPTIME], y[NUMVAR], y0[NUMVAR], dydt[NUMVAR], soma_params[3];
+  double *res, y[NUMVAR], y0[NUMVAR], dydt[NUMVAR], soma_params[3];
 
   // Strings used to store filenames for the graph and data files.
   char time_str[14];
 
-  printf( "Simulating %d dendrites with %d compartments per dendrite.\n",
-      num_dendrs, num_comps );
+  if (cmd_args->morphology != NULL) {
+    for (d = 0, total_comps = 0; d < num_dendrs; d++) {
+      total_comps += cmd_args->comps[d];
+    }
+    printf( "Simulating %d dendrites of up to %d compartments, %ld in all, "
+            "from %s.\n", num_dendrs, num_comps, total_comps,
+            cmd_args->morphology );
+  } else {
+    printf( "Simulating %d dendrites with %d compartments per dendrite.\n",
+        num_dendrs, num_comps );
+  }
 
   printf("Simulating with num_tasks = %d\n", num_tasks);
+  printf("Workers are synchronised with '%s'.\n", sync_names[cmd_args->sync]);
+  if (cmd_args->window > 0) {
+    printf("Waveform relaxation over windows of %d steps, tolerance %g mV.\n",
+           cmd_args->window, cmd_args->tolerance);
+  }
+  if (substeps > 1) {
+    printf("Taking %d soma steps per dendrite step.\n", substeps);
+  }
+  if (cmd_args->adaptive) {
+    printf("Picking the step size from the soma error, tolerance %g.\n",
+           cmd_args->tolerance);
+  }
+  if (cmd_args->num_threads > 1) {
+    printf("Each worker steps its dendrites with %d threads.\n",
+           cmd_args->num_threads);
+  }
+  if (cmd_args->integrator != INTEGRATOR_RK4) {
+    printf("Integrating the dendrites with %s.\n",
+           (cmd_args->integrator == INTEGRATOR_BE) ? "backward Euler" :
+           "Crank-Nicolson");
+  }
 
   //////////////////////////////////////////////////////////////////////////////
   // Create files where results will be stored.
   //////////////////////////////////////////////////////////////////////////////
 
-  // Generate the graph and data file names.
+  // Generate the graph and data file names. A restarted run continues the
+  // files of the run it was saved from.
   time_t t = time(NULL);
   struct tm *tmp = localtime( &t );
   strftime( time_str, 14, "%m%d%y_%H%M%S", tmp );
+  if (restart != NULL) {
+    snprintf( time_str, 14, "%.13s", restart->time_str );
+  }
 
   // The resulting filenames will resemble
   //    pWWdXXcYY_MoDaYe_HoMiSe.xxx
@@ -95,7 +995,10 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
   // simulation was run.
   sprintf( graph_fname, "graphs/p1d%dc%d_%s.png",
        num_dendrs, num_comps, time_str );
-  sprintf( data_fname,  "data/p1d%dc%d_%s.dat",
+  sprintf( data_fname,  "data/p1d%dc%d_%s.%s",
+       num_dendrs, num_comps, time_str,
+       (cmd_args->format == TRACE_BINARY) ? "bin" : "dat" );
+  sprintf( prof_fname,  "data/p1d%dc%d_%s.json",
        num_dendrs, num_comps, time_str );
 
   // Verify that the graphs/ and data/ directories exist. Create them if they
@@ -113,8 +1016,24 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
     exit(1);
   }
 
-  // Verify that we can open files where results will be stored.
-  if ((data_file = fopen(data_fname, "wb")) == NULL) {
+  // Verify that we can open files where results will be stored. The trace is
+  // written as the simulation goes, so the header goes first.
+  sprintf( comment,
+       "Vm for HH model. "
+       "Simulation time: %d ms, Integration step: %f ms, "
+       "Compartments: %d, Dendrites: %d, Slave processes: %d, "
+       "Samples per ms: %d",
+       comp_time, 1.0 / cmd_args->steps, num_comps, num_dendrs, num_tasks-1,
+       cmd_args->sample_rate );
+  if (restart != NULL) {
+    trace = traceResume( data_fname, cmd_args->format,
+                         1.0 / cmd_args->sample_rate, restart->trace_samples,
+                         restart->trace_len, restart->trace_head, comment );
+  } else {
+    trace = traceOpen( data_fname, cmd_args->format,
+                       1.0 / cmd_args->sample_rate, comment );
+  }
+  if (trace == NULL) {
     fprintf(stderr, "Can't open %s file!\n", data_fname);
     exit(1);
   } else {
@@ -136,7 +1055,7 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
   //////////////////////////////////////////////////////////////////////////////
 
   // Setup parameters for the soma.
-  soma_params[0] = 1.0 / (double) STEPS;  // dt
+  soma_params[0] = 1.0 / (double) cmd_args->steps;  // dt
   soma_params[1] = 0.0;  // Direct current injection into soma is always zero.
   soma_params[2] = 0.0;  // Dendritic current injected into soma. This is the
              // value that our simulation will update at each step.
@@ -152,6 +1071,128 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
 
   printf( "\nIntegration step dt = %f\n", soma_params[0]);
 
+  // Hands the integration step of the dendrites to the workers.
+  dendr_dt = substeps * soma_params[0];
+  syncInit( &sync, cmd_args->sync, cmd_args->overlap, dendr_dt );
+
+  // The soma stepper gets all its scratch space up front.
+  if ((ws = workspaceCreate( num_comps )) == NULL) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
+  // Set up the share of dendrites stepped by this rank, if any.
+  gids  = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  loads = (double*) hhMalloc( sizeof(double) * num_tasks );
+  comps = dendriteComps( cmd_args );
+  pieces = (PartitionPiece*) hhMalloc( sizeof(PartitionPiece) *
+                                       (num_dendrs + num_tasks - 1) );
+  if (cmd_args->rebalance > 0) {
+    owner = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  }
+  if (gids == NULL || loads == NULL || comps == NULL || pieces == NULL ||
+      (cmd_args->rebalance > 0 && owner == NULL)) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  num_owned = assign_dendrites( 0, num_tasks, num_dendrs, comps, cmd_args,
+                                gids, loads, owner );
+  num_pieces = cut_dendrites( 0, num_tasks, num_dendrs, comps, cmd_args,
+                              loads, pieces );
+  predicted = partitionImbalance( num_tasks, loads );
+  if (num_pieces > 0) {
+    for (d = 1, num_cuts = 0; d < num_pieces; d++) {
+      num_cuts += (pieces[d].item == pieces[d-1].item);
+    }
+    printf( "Compartments are split between the processes in %d runs, "
+            "with %d cuts through dendrites.\n", num_pieces, num_cuts );
+    if (num_cuts > 0) {
+      fprintf( stderr, "Warning: every cut sees the potentials across it a "
+               "step late, so the results differ from those of whole "
+               "dendrites, by up to mV around spikes.\n" );
+    }
+    num_owned = 0;
+  } else {
+    printf( "The soma process steps %d of the dendrites.\n", num_owned );
+  }
+
+  if (!hhRngInit( &rng, cmd_args->rng, cmd_args->seed, num_dendrs,
+                  cmd_args->params.steps )) {
+    fprintf( stderr, "Could not set up the random number generator!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  eng = engineCreate( cmd_args->kernel, num_owned, gids, num_comps, comps,
+                      &rng, cmd_args->num_threads );
+  if (eng == NULL ||
+      !engineSetIntegrator( eng, cmd_args->integrator,
+                            grid / cmd_args->steps * substeps ) ||
+      (cmd_args->validate && !engineValidate( eng ))) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  if (num_pieces > 0) {
+    segs = segmentsCreate( 0, num_pieces, pieces, comps, &rng,
+                           grid / cmd_args->steps * substeps );
+  }
+  if (num_pieces > 0 && segs == NULL) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  if (cmd_args->rebalance > 0) {
+    rebalance_init( &rb, 0, num_tasks, num_dendrs, comps, cmd_args, &rng,
+                    grid / cmd_args->steps * substeps, owner );
+    printf( "Checking the load of the ranks every %d ms.\n",
+            cmd_args->rebalance );
+  }
+  if (cmd_args->window > 0) {
+    wr_buf = (double*) hhMalloc( sizeof(double) * (4*cmd_args->window + 1) );
+    if (wr_buf == NULL || !engineEnableRollback( eng )) {
+      fprintf( stderr, "Could not allocate the integration workspace!\n" );
+      MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+  }
+  stepControlInit( &ctl, cmd_args->tolerance, grid );
+  res = (double*) hhMalloc( sizeof(double) * comp_time );
+  profs = (RankProfile*) hhMalloc( sizeof(RankProfile) * num_tasks );
+  if (res == NULL || profs == NULL) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  prof.compute = 0.0;
+  prof.soma = 0.0;
+  prof.halo = 0.0;
+  prof.load = loads[0];
+  if (cmd_args->record != NULL) {
+    rec = open_record(eng, num_dendrs, cmd_args);
+    printf( "Compartments will be recorded in %s\n", cmd_args->record );
+  }
+  if (cmd_args->checkpoint != NULL) {
+    ckpt_buf = (double*) hhMalloc( sizeof(double) * num_comps *
+                                   (num_owned + 1) );
+    if (ckpt_buf == NULL) {
+      fprintf( stderr, "Could not allocate the integration workspace!\n" );
+      MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+    checkpointInit( &ckpt, cmd_args, num_comps, time_str );
+  }
+
+  // Pick up the state of the run that was interrupted.
+  t_start = 1;
+  prior_time = 0.0;
+  if (restart != NULL) {
+    if (!checkpointRestore( cmd_args->restart, restart, eng, res )) {
+      fprintf( stderr, "Can't read checkpoint %s!\n", cmd_args->restart );
+      MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+    y[0] = restart->y[0]; y[1] = restart->y[1];
+    y[2] = restart->y[2]; y[3] = restart->y[3];
+    soma_params[2] = restart->i_dendr;
+    t_start = restart->t_ms + 1;
+    prior_time = restart->exec_time;
+  }
+  setup_allocs = hhAllocCount();
+  setup_heap = hhHeapAllocCount();
+
   // Start the clock.
   gettimeofday( &start, NULL );
 
@@ -160,39 +1201,91 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
   //////////////////////////////////////////////////////////////////////////////
 
   // Record the initial potential value in our results array.
-  res[0] = y[0];
-
-  // Loop over milliseconds.
-  for (t_ms = 1; t_ms < COMPTIME; t_ms++) {
-    // Loop over integration time steps in each millisecond.
-    for (step = 0; step < STEPS; step++) {
-      // send values to workers to start working this step (y[0], soma_params[0])
-      // can't use MPI_Bcast for this assignment, so just use a for loop
-      for (dest = 1; dest < num_tasks; dest++) {
-        MPI_Send(&y[0], 1, MPI_DOUBLE, dest, 1, MPI_COMM_WORLD);
-        MPI_Send(&soma_params[0], 1, MPI_DOUBLE, dest, 2, MPI_COMM_WORLD);
-      }
-      // wait for workers to get back with soma_params[2] contributions
-      soma_params[2] = 0.0;
-      for (dest = 1; dest < num_tasks; dest++) {
-        MPI_Recv(&current, 1, MPI_DOUBLE, dest, 3, MPI_COMM_WORLD, &status);
-        soma_params[2] += current;
+  if (t_start == 1) {
+    res[0] = y[0];
+    traceWrite(trace, y[0]);
+  }
+  if (rec != NULL) {
+    recorderSnapshot(rec, eng);
+  }
+
+  if (cmd_args->window > 0) {
+    soma_relax(&sync, eng, ws, y, soma_params, res, trace, stride,
+               cmd_args->steps, cmd_args->window, cmd_args->tolerance,
+               wr_buf, &wr_stats, &prof);
+  } else if (cmd_args->adaptive) {
+    soma_adaptive(&sync, eng, ws, &ctl, y, soma_params, res, trace, stride,
+                  &prof);
+  } else {
+    // Loop over milliseconds.
+    for (t_ms = t_start; t_ms < comp_time; t_ms++) {
+      // Loop over dendrite steps in each millisecond.
+      for (step = 0; step < cmd_args->steps; step += substeps) {
+        // send values to workers to start working this step (y[0], dendr_dt)
+        syncState(&sync, &y[0], &dendr_dt);
+        // step our own dendrites while the workers step theirs
+        dendr_step = ((long) (t_ms-1) * cmd_args->steps + step) / substeps;
+        current = step_dendrites(eng, segs, dendr_step, dendr_dt, y[0],
+                                 &prof);
+        if (rec != NULL &&
+            (dendr_step + 1) % (cmd_args->record_every / substeps) == 0) {
+          recorderSnapshot(rec, eng);
+        }
+        // wait for workers to get back with soma_params[2] contributions
+        i_prev = soma_params[2];
+        current = syncCurrent(&sync, current);
+
+        // The soma takes 'substeps' steps per dendrite step, with the
+        // current interpolated linearly between the dendrite steps.
+        tick = MPI_Wtime();
+        for (sub = 1; sub <= substeps; sub++) {
+          soma_params[2] = (sub == substeps) ? current :
+            i_prev + (current - i_prev) * sub / substeps;
+
+          // Store previous HH model parameters.
+          y0[0] = y[0]; y0[1] = y[1]; y0[2] = y[2]; y0[3] = y[3];
+
+          // This is the main HH computation. It updates the potential, Vm, of
+          // the soma, injects current, and calculates action potential. Good
+          // stuff.
+          soma(dydt, y, soma_params);
+          rk4Step(y, y0, dydt, NUMVAR, soma_params, 1, soma, ws->rk);
+
+          if ((step + sub) % stride == 0) {
+            traceWrite(trace, y[0]);
+          }
+        }
+        prof.soma += MPI_Wtime() - tick;
       }
+      // Record the membrane potential of the soma at this simulation step.
+      // Let's show where we are in terms of computation.
+      printf("\r%02d ms",t_ms); fflush(stdout);
 
-      // Store previous HH model parameters.
-      y0[0] = y[0]; y0[1] = y[1]; y0[2] = y[2]; y0[3] = y[3];
+      res[t_ms] = y[0];
 
+      // Move dendrites off ranks that have fallen behind.
+      if (cmd_args->rebalance > 0 && t_ms % cmd_args->rebalance == 0 &&
+          t_ms + 1 < comp_time) {
+        eng = rebalance_check(&rb, eng, gids, &num_owned, &prof, t_ms);
+      }
 
-      // This is the main HH computation. It updates the potential, Vm, of the
-      // soma, injects current, and calculates action potential. Good stuff.
-      soma(dydt, y, soma_params);
-      rk4Step(y, y0, dydt, NUMVAR, soma_params, 1, soma);
+      // Save the state every so often, every rank its own dendrites.
+      if (cmd_args->checkpoint != NULL &&
+          t_ms % cmd_args->checkpoint_every == 0) {
+        gettimeofday( &stop, NULL );
+        timersub( &stop, &start, &diff );
+        exec_time = (double) (diff.tv_sec) +
+                    (double) (diff.tv_usec) * 0.000001;
+        if (!checkpointUpdate(&ckpt, t_ms, y, soma_params[2],
+                              prior_time + exec_time, trace) ||
+            !checkpointWriteShared(cmd_args->checkpoint, &ckpt, eng,
+                                   num_dendrs, ckpt_buf, res)) {
+          fprintf( stderr, "\nCould not write checkpoint %s!\n",
+                   cmd_args->checkpoint );
+          MPI_Abort( MPI_COMM_WORLD, 1 );
+        }
+      }
     }
-    // Record the membrane potential of the soma at this simulation step.
-    // Let's show where we are in terms of computation.
-    printf("\r%02d ms",t_ms); fflush(stdout);
-
-    res[t_ms] = y[0];
   }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -204,39 +1297,143 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
   gettimeofday( &stop, NULL );
   timersub( &stop, &start, &diff );
   exec_time = (double) (diff.tv_sec) + (double) (diff.tv_usec) * 0.000001;
+  prof.allocs = (setup_heap >= 0) ? hhHeapAllocCount() - setup_heap : -1;
+  profileGather(&prof, &sync, profs);
   printf("\n\nExecution time: %f seconds.\n", exec_time);
+  if (restart != NULL) {
+    printf("Execution time of the whole run, from the start: %f seconds.\n",
+           prior_time + exec_time);
+  }
+  printf("Time spent synchronising: %f seconds (%.2f us per step).\n",
+         sync.wait, 1e6 * sync.wait / sync.steps);
+  printf("Exchanges with the workers: %ld.\n", sync.steps);
+  // Ranks are busy unless they wait for data.
+  for (dest = 0; dest < num_tasks; dest++) {
+    loads[dest] = profs[dest].compute + profs[dest].soma + profs[dest].send;
+  }
+  measured = partitionImbalance( num_tasks, loads );
+  printf("Load imbalance (most loaded rank over mean): predicted %.3f, "
+         "measured %.3f\n", predicted, measured);
+  if (cmd_args->window > 0) {
+    printf("Waveform relaxation: %ld windows, %.2f iterations per window "
+           "(at most %d), %ld not converged.\n",
+           wr_stats.windows, (double) wr_stats.iterations / wr_stats.windows,
+           wr_stats.max_iters, wr_stats.unconverged);
+  }
+  if (cmd_args->adaptive) {
+    printf("Adaptive steps: %ld (%ld rejected), from %g to %g ms.\n",
+           ctl.steps, ctl.rejected, (double) ctl.smallest / grid,
+           (double) ctl.largest / grid);
+  }
 
-  // Record the parameters for this simulation as well as data for gnuplot.
-  fprintf( data_file,
-       "# Vm for HH model. "
-       "Simulation time: %d ms, Integration step: %f ms, "
-       "Compartments: %d, Dendrites: %d, Execution time: %f s, "
-       "Slave processes: %d\n",
-       COMPTIME, soma_params[0], num_comps - 2, num_dendrs, exec_time,
-       num_tasks-1 );
-  fprintf( data_file, "# X Y\n");
+  if (cmd_args->rebalance > 0) {
+    printf("Rebalancing: %d checks, %d migrations, %ld dendrites moved in "
+           "%f seconds.\n", rb.checks, rb.migrations, rb.moved, rb.seconds);
+    // Migrations build new engines; nothing else may allocate.
+    setup_allocs += rb.allocs;
+  }
 
-  for (t_ms = 0; t_ms < COMPTIME; t_ms++) {
-    fprintf(data_file, "%d %f\n", t_ms, res[t_ms]);
+  printf("Heap allocations during simulation: %ld\n",
+         hhAllocCount() - setup_allocs);
+  if (hhAllocCount() != setup_allocs) {
+    fprintf( stderr, "Soma loop allocated memory!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  // Everything else the loop allocated, MPI's included; only known when
+  // alloc_shim.so is preloaded.
+  if (profs[0].allocs >= 0) {
+    worker_heap = 0;
+    for (dest = 1; dest < num_tasks; dest++) {
+      worker_heap += profs[dest].allocs;
+    }
+    printf("Heap allocations by any caller, MPI included: %ld on rank 0, "
+           "%ld on the others.\n", profs[0].allocs, worker_heap);
+  }
+
+  // Collect the largest kernel error seen by any worker.
+  if (cmd_args->validate) {
+    max_error = eng->max_error;
+    for (dest = 1; dest < num_tasks; dest++) {
+      MPI_Recv(&current, 1, MPI_DOUBLE, dest, 4, MPI_COMM_WORLD, &status);
+      max_error = (current > max_error) ? current : max_error;
+    }
+    printf("Largest difference from the reference kernel: %g\n", max_error);
+  }
+
+  if (cmd_args->reference) {
+    current = traceDeviation( cmd_args->reference, res, comp_time );
+    if (current < 0.0) {
+      fprintf( stderr, "Can't read reference trace %s!\n",
+               cmd_args->reference );
+    } else {
+      printf("Largest deviation from the reference trace: %g mV\n", current);
+    }
+  }
+
+  // Close the data file so that gnuplot will see all of it. Text traces end
+  // with the timings of every rank and the execution time, which were not
+  // known when the header went out.
+  sprintf( comment, "Load imbalance: predicted %.3f, measured %.3f",
+           predicted, measured );
+  traceComment( trace, comment );
+  if (cmd_args->rebalance > 0) {
+    sprintf( comment, "Rebalancing: %d checks, %d migrations, %ld dendrites "
+             "moved in %f s", rb.checks, rb.migrations, rb.moved,
+             rb.seconds );
+    traceComment( trace, comment );
+  }
+  for (dest = 0; dest < num_tasks; dest++) {
+    profileLine( &profs[dest], dest, comment, sizeof(comment) );
+    traceComment( trace, comment );
+  }
+  sprintf( comment, "Execution time: %f s", prior_time + exec_time );
+  if (!traceClose( trace, comment )) {
+    fprintf( stderr, "Could not write %s!\n", data_fname );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  if (!profileWrite( prof_fname, profs, num_tasks,
+                     sync_names[cmd_args->sync], exec_time )) {
+    fprintf( stderr, "Could not write %s!\n", prof_fname );
+  } else {
+    printf( "Timings of every rank stored in %s\n", prof_fname );
+  }
+  if (rec != NULL && !recorderClose(rec)) {
+    fprintf( stderr, "Could not write %s!\n", cmd_args->record );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
   }
-  fflush(data_file);  // Flush and close the data file so that gnuplot will
-  fclose(data_file);  // see it.
 
   //////////////////////////////////////////////////////////////////////////////
   // Plot results if approriate macro was defined.
   //////////////////////////////////////////////////////////////////////////////
   if (ISDEF_PLOT_PNG || ISDEF_PLOT_SCREEN) {
-    pinfo.sim_time = COMPTIME;
-    pinfo.int_step = soma_params[0];
+    pinfo.sim_time = comp_time;
+    pinfo.int_step = 1.0 / cmd_args->steps;
     pinfo.num_comps = num_comps - 2;
     pinfo.num_dendrs = num_dendrs;
-    pinfo.exec_time = exec_time;
+    pinfo.exec_time = prior_time + exec_time;
     pinfo.slaves = num_tasks-1;
+    pinfo.format = cmd_args->format;
+    pinfo.interval = 1.0 / cmd_args->sample_rate;
   }
 
   if (ISDEF_PLOT_PNG) {    plotData( &pinfo, data_fname, graph_fname ); }
   if (ISDEF_PLOT_SCREEN) { plotData( &pinfo, data_fname, NULL ); }
 
+  workspaceFree(ws);
+  engineFree(eng);
+  segmentsFree(segs);
+  if (cmd_args->rebalance > 0) {
+    rebalance_free(&rb);
+  }
+  hhRngFree(&rng);
+  free(gids);
+  free(comps);
+  free(pieces);
+  free(loads);
+  free(wr_buf);
+  free(ckpt_buf);
+  free(profs);
+  free(res);
 }
 
 /**
@@ -250,15 +1447,38 @@ void soma_runner(int num_tasks, int num_dendrs, int num_comps) {
  * @param num_tasks  total number of MPI tasks
  * @param num_dendrs number of simulated dendrites
  * @param num_comps  number of simulated compartments
+ * @param cmd_args   kernel, validation, generator and synchronisation
+ *                   options
+ * @param restart    checkpoint to continue from, or NULL
  */
-void worker_runner(int rank, int num_tasks, int num_dendrs, int num_comps) {
-  double current, **dendr_volt;
-
-  int i, j, dendrite, t_ms, step; // Various indexing variables.
+void worker_runner(int rank, int num_tasks, int num_dendrs, int num_comps,
+                   CmdArgs *cmd_args, const CkptHeader *restart) {
+  int *gids, num_owned, t_ms, step; // Various indexing variables.
+  int *comps;        // Compartments of each dendrite.
+  PartitionPiece *pieces; // Runs of compartments of all ranks, if cut.
+  int num_pieces;
+  SegmentSet *segs = NULL; // Runs of compartments stepped by this worker.
+  int *owner = NULL; // Rank owning each dendrite, with --rebalance.
+  Rebalance rb;      // Migration of dendrites between ranks.
+  double *loads;     // Estimated load of every rank.
+  int dendr_steps = cmd_args->steps / cmd_args->substeps; // Steps per ms.
 
   double worker_y_0, worker_soma_params_0, worker_soma_params_2;
 
-  MPI_Status status;
+  long setup_allocs; // hhMalloc calls made by the setup.
+  long setup_heap;   // Heap allocations of the setup.
+
+  Engine *eng;       // The dendrites owned by this worker.
+  HHRng rng;         // Generator of the dendrite tip currents.
+  Sync sync;         // Per-step exchange with the soma.
+
+  double *wr_buf = NULL; // Waveform relaxation buffers.
+  Recorder *rec = NULL;  // This rank's share of the compartment recording.
+  int rec_every = cmd_args->record_every / cmd_args->substeps;
+  double *ckpt_buf = NULL; // Dendrites of this rank, as checkpointed.
+  int t_start = (restart != NULL) ? restart->t_ms + 1 : 1;
+  RankProfile prof;  // Timings of this worker.
+  double tick;       // MPI_Wtime at the start of a timed section.
 
 
   //////////////////////////////////////////////////////////////////////////////
@@ -268,58 +1488,196 @@ void worker_runner(int rank, int num_tasks, int num_dendrs, int num_comps) {
   // The first compartment is a dummy and the last is connected to the soma.
   num_comps = num_comps + 2;
 
-  // Initialize the potential of each dendrite compartment to the rest voltage.
-  // Most entries will be unused, but the size of the malloc is fairly small.
-  dendr_volt = (double**) malloc(num_dendrs * sizeof(double*));
-  for (i = 0; i < num_dendrs; i++) {
-    dendr_volt[i] = (double*) malloc( num_comps * sizeof(double) );
-    for (j = 0; j < num_comps; j++) {
-      dendr_volt[i][j] = VREST;
+  // Find the dendrites this worker owns.
+  gids  = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  loads = (double*) hhMalloc( sizeof(double) * num_tasks );
+  comps = dendriteComps( cmd_args );
+  pieces = (PartitionPiece*) hhMalloc( sizeof(PartitionPiece) *
+                                       (num_dendrs + num_tasks - 1) );
+  if (cmd_args->rebalance > 0) {
+    owner = (int*) hhMalloc( sizeof(int) * num_dendrs );
+  }
+  if (gids == NULL || loads == NULL || comps == NULL || pieces == NULL ||
+      (cmd_args->rebalance > 0 && owner == NULL)) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  num_owned = assign_dendrites( rank, num_tasks, num_dendrs, comps, cmd_args,
+                                gids, loads, owner );
+  num_pieces = cut_dendrites( rank, num_tasks, num_dendrs, comps, cmd_args,
+                              loads, pieces );
+  if (num_pieces > 0) {
+    num_owned = 0;
+  }
+  prof.load = loads[rank];
+
+  // Initialize the potential of each owned dendrite compartment to the rest
+  // voltage. All scratch space needed by the stepper is allocated once, here.
+  if (!hhRngInit( &rng, cmd_args->rng, cmd_args->seed, num_dendrs,
+                  cmd_args->params.steps )) {
+    fprintf( stderr, "Could not set up the random number generator!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  // Worker threads never call MPI, this thread does all the communication.
+  eng = engineCreate( cmd_args->kernel, num_owned, gids, num_comps, comps,
+                      &rng, cmd_args->num_threads );
+  if (eng == NULL ||
+      !engineSetIntegrator( eng, cmd_args->integrator,
+                            cmd_args->params.steps / dendr_steps ) ||
+      (cmd_args->validate && !engineValidate( eng ))) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  if (num_pieces > 0) {
+    segs = segmentsCreate( rank, num_pieces, pieces, comps, &rng,
+                           cmd_args->params.steps / dendr_steps );
+  }
+  if (num_pieces > 0 && segs == NULL) {
+    fprintf( stderr, "Could not allocate the integration workspace!\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  if (cmd_args->rebalance > 0) {
+    rebalance_init( &rb, rank, num_tasks, num_dendrs, comps, cmd_args, &rng,
+                    cmd_args->params.steps / dendr_steps, owner );
+  }
+  if (cmd_args->window > 0) {
+    wr_buf = (double*) hhMalloc( sizeof(double) * (4*cmd_args->window + 1) );
+    if (wr_buf == NULL || !engineEnableRollback( eng )) {
+      fprintf( stderr, "Could not allocate the integration workspace!\n" );
+      MPI_Abort( MPI_COMM_WORLD, 1 );
     }
   }
 
+  // Receive the integration step from the soma.
+  syncInit( &sync, cmd_args->sync, cmd_args->overlap, 0.0 );
+
+  if (cmd_args->record != NULL) {
+    rec = open_record(eng, num_dendrs, cmd_args);
+    recorderSnapshot(rec, eng);
+  }
+  if (cmd_args->checkpoint != NULL) {
+    ckpt_buf = (double*) hhMalloc( sizeof(double) * num_comps *
+                                   (num_owned + 1) );
+    if (ckpt_buf == NULL) {
+      fprintf( stderr, "Could not allocate the integration workspace!\n" );
+      MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+  }
+  if (restart != NULL &&
+      !checkpointRestore( cmd_args->restart, restart, eng, NULL )) {
+    fprintf( stderr, "Worker %d can't read checkpoint %s!\n", rank,
+             cmd_args->restart );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  prof.compute = 0.0;
+  prof.soma = 0.0;
+  prof.halo = 0.0;
+  setup_allocs = hhAllocCount();
+  setup_heap = hhHeapAllocCount();
+
   //////////////////////////////////////////////////////////////////////////////
   // Main computation.
   //////////////////////////////////////////////////////////////////////////////
 
-  // Loop over milliseconds.
-  for (t_ms = 1; t_ms < COMPTIME; t_ms++) {
-    // Loop over integration time steps in each millisecond.
-    for (step = 0; step < STEPS; step++) {
-
-      // Wait for message from soma to begin calculating this step (y[0], soma_params[0])
-      MPI_Recv(&worker_y_0, 1, MPI_DOUBLE, 0, 1, MPI_COMM_WORLD, &status);
-      MPI_Recv(&worker_soma_params_0, 1, MPI_DOUBLE, 0, 2, MPI_COMM_WORLD, &status);
-
-      worker_soma_params_2 = 0.0;
-
-      // Loop over all the dendrites this worker is assigned 
-      // for (dendrite = 0; dendrite < worker_num_dendrs; dendrite++) {
-      for (dendrite = rank-1; dendrite < num_dendrs; dendrite += (num_tasks-1)) {
-        // This will update Vm in all compartments and will give a new injected
-        // current value from last compartment into the soma.
-        current = dendriteStep( dendr_volt[ dendrite ],
-                    step + dendrite + 1,
-                    num_comps,
-                    worker_soma_params_0,
-                    worker_y_0 );
-
-        // Accumulate the current generated by the dendrite.
-        worker_soma_params_2 += current;
+  if (cmd_args->window > 0) {
+    worker_relax(&sync, eng, cmd_args->steps, cmd_args->window, wr_buf,
+                 &prof);
+  } else if (cmd_args->adaptive) {
+    worker_adaptive(&sync, eng, &prof);
+  } else {
+    // Loop over milliseconds.
+    for (t_ms = t_start; t_ms < cmd_args->params.comp_time; t_ms++) {
+      // Loop over dendrite steps in each millisecond.
+      for (step = 0; step < dendr_steps; step++) {
+
+        // Wait for message from soma to begin calculating this step (y[0], soma_params[0])
+        if (cmd_args->overlap) {
+          // Step everything but the compartments next to the soma while the
+          // new soma potential is on its way. The integration step never
+          // changes, the one given at start-up is used.
+          syncStateBegin(&sync, &worker_y_0);
+          tick = MPI_Wtime();
+          engineStepBegin( eng, (long) (t_ms-1) * dendr_steps + step,
+                           sync.delta_t );
+          prof.compute += MPI_Wtime() - tick;
+          syncStateWait(&sync, &worker_y_0, &worker_soma_params_0);
+          tick = MPI_Wtime();
+          worker_soma_params_2 = engineStepFinish( eng, worker_y_0 );
+          prof.compute += MPI_Wtime() - tick;
+        } else {
+          syncState(&sync, &worker_y_0, &worker_soma_params_0);
+
+          // Update Vm in all compartments of the dendrites this worker is
+          // assigned and accumulate the current they inject into the soma.
+          worker_soma_params_2 =
+            step_dendrites( eng, segs, (long) (t_ms-1) * dendr_steps + step,
+                            worker_soma_params_0, worker_y_0, &prof );
+        }
+
+        if (rec != NULL &&
+            ((long) (t_ms-1) * dendr_steps + step + 1) % rec_every == 0) {
+          recorderSnapshot(rec, eng);
+        }
+
+        // send worker_soma_params_2 back to soma to be added to other workers
+        syncCurrent(&sync, worker_soma_params_2);
+      }
+
+      if (cmd_args->rebalance > 0 && t_ms % cmd_args->rebalance == 0 &&
+          t_ms + 1 < cmd_args->params.comp_time) {
+        eng = rebalance_check(&rb, eng, gids, &num_owned, &prof, t_ms);
+      }
+
+      if (cmd_args->checkpoint != NULL &&
+          t_ms % cmd_args->checkpoint_every == 0 &&
+          !checkpointWriteShared(cmd_args->checkpoint, NULL, eng, num_dendrs,
+                                 ckpt_buf, NULL)) {
+        fprintf( stderr, "Worker %d could not write checkpoint %s!\n", rank,
+                 cmd_args->checkpoint );
+        MPI_Abort( MPI_COMM_WORLD, 1 );
       }
-      // send worker_soma_params_2 back to soma to be added to other workers
-      MPI_Send(&worker_soma_params_2, 1, MPI_DOUBLE, 0, 3, MPI_COMM_WORLD);
     }
   }
 
+  // Migrations build new engines; nothing else may allocate.
+  if (cmd_args->rebalance > 0) {
+    setup_allocs += rb.allocs;
+  }
+  if (hhAllocCount() != setup_allocs) {
+    fprintf( stderr, "Worker %d allocated memory during the simulation!\n",
+             rank );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  prof.allocs = (setup_heap >= 0) ? hhHeapAllocCount() - setup_heap : -1;
+
+  profileGather(&prof, &sync, NULL);
+
+  if (cmd_args->validate) {
+    MPI_Send(&eng->max_error, 1, MPI_DOUBLE, 0, 4, MPI_COMM_WORLD);
+  }
+
+  if (rec != NULL && !recorderClose(rec)) {
+    fprintf( stderr, "Worker %d could not write %s!\n", rank,
+             cmd_args->record );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+
   //////////////////////////////////////////////////////////////////////////////
   // Free up allocated memory.
   //////////////////////////////////////////////////////////////////////////////
 
-  for(i = 0; i < num_dendrs; i++) {
-    free(dendr_volt[i]);
+  engineFree(eng);
+  segmentsFree(segs);
+  if (cmd_args->rebalance > 0) {
+    rebalance_free(&rb);
   }
-  free(dendr_volt);
+  hhRngFree(&rng);
+  free(gids);
+  free(comps);
+  free(pieces);
+  free(loads);
+  free(wr_buf);
+  free(ckpt_buf);
 }
 
 /**
@@ -336,12 +1694,15 @@ int main( int argc, char **argv )
 {
   CmdArgs cmd_args;                       // Command line arguments.
 
-  int num_tasks, rank, rc;                // MPI vars
+  int num_tasks, rank, rc, provided;      // MPI vars
   int num_comps, num_dendrs;              // Simulation parameters.
+  int ok;
+  CkptHeader restart;                     // Checkpoint of --restart.
 
 
-  // MPI initialization and node params
-  rc = MPI_Init(&argc, &argv);
+  // MPI initialization and node params. Workers may step their dendrites with
+  // a pool of threads, but only the main thread of each rank calls MPI.
+  rc = MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   if (rc != MPI_SUCCESS) {
     printf("Error starting MPI.\n");
     MPI_Abort(MPI_COMM_WORLD, rc);
@@ -363,13 +1724,53 @@ int main( int argc, char **argv )
   num_dendrs = cmd_args.num_dendrs;
   num_comps  = cmd_args.num_comps;
 
+  if (cmd_args.num_threads > 1 && provided < MPI_THREAD_FUNNELED) {
+    if (rank == 0) {
+      fprintf(stderr, "This MPI library does not support threads!\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  if (cmd_args.integrator == INTEGRATOR_PS) {
+    if (rank == 0) {
+      fprintf(stderr, "Parker-Sochacki is only available in seq_hh!\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  if (cmd_args.batch != NULL) {
+    if (rank == 0) {
+      fprintf(stderr, "--batch is only available in seq_hh!\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  // Every function of the model picks the parameters up from here.
+  hhSetParams(&cmd_args.params);
+
+  // Rank 0 checks the checkpoint to continue from and hands it around.
+  if (cmd_args.restart != NULL) {
+    ok = (rank != 0) || checkpointRead(cmd_args.restart, &cmd_args, &restart);
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!ok) {
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Bcast(&restart, sizeof(CkptHeader), MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+      printf("Continuing from %d ms, saved in %s.\n", restart.t_ms,
+             cmd_args.restart);
+    }
+  }
+
   // determine whether the rank denotes this runner as the soma or as a dendrite worker
   if (rank == 0) {
-    soma_runner(num_tasks, num_dendrs, num_comps);
+    soma_runner(num_tasks, num_dendrs, num_comps, &cmd_args,
+                cmd_args.restart ? &restart : NULL);
   } else {
-    worker_runner(rank, num_tasks, num_dendrs, num_comps);
+    worker_runner(rank, num_tasks, num_dendrs, num_comps, &cmd_args,
+                  cmd_args.restart ? &restart : NULL);
   }
 
+  free(cmd_args.comps);
   MPI_Finalize();
 
   return 0;
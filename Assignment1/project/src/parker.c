@@ -0,0 +1,135 @@
+/*
+  Multiple Processor Systems.
+
+  Parker-Sochacki integration of the whole neuron, after Stewart RD, Bair W.
+  (2009) Spiking neural network simulation: numerical integration with the
+  Parker-Sochacki method. J Comput Neurosci 27(1):115-133.
+*/
+
+#include "parker.h"
+#include "constants.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+PSSolver *psCreate( Engine *eng, double tolerance )
+{
+  size_t const n = eng->offset[eng->num_dendrs];
+  PSSolver *ps = (PSSolver*) hhMalloc( sizeof(PSSolver) );
+
+  if (ps == NULL) {
+    return NULL;
+  }
+
+  ps->tolerance = tolerance;
+  ps->coef = (double*) hhMalloc( sizeof(double) * n );
+  ps->next = (double*) hhMalloc( sizeof(double) * n );
+  ps->sum  = (double*) hhMalloc( sizeof(double) * n );
+  if (ps->coef == NULL || ps->next == NULL || ps->sum == NULL) {
+    psFree( ps );
+    return NULL;
+  }
+
+  ps->stats.steps = 0;
+  ps->stats.terms = 0;
+  ps->stats.max_order = 0;
+  ps->stats.capped = 0;
+
+  return ps;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void psStep( PSSolver *ps, Engine *eng, long step, double delta_t, double *y,
+             double i_inj )
+{
+  int d, c, i, k, num_comps;
+  double err, i_dendr, *swap;
+  double *row, *next, *sum;
+  EngineShape *shape;
+
+  // Order 0 is the state at the start of the step.
+  for (d = 0; d < eng->num_dendrs; d++) {
+    eng->cur[d] = injectedCurrentMean( eng->rng, eng->gids[d], step,
+                                       eng->draws );
+    row = ps->coef + eng->offset[d];
+    sum = ps->sum  + eng->offset[d];
+    for (c = 0; c < eng->comps[d]-1; c++) {
+      row[c] = sum[c] = *engineVolt( eng, d, c );
+    }
+  }
+  for (i = 0; i < NUMVAR; i++) {
+    ps->series[i][0] = y[i];
+  }
+
+  // Add one order at a time to the dendrites and the soma. Both only need
+  // the last order of the other one.
+  for (k = 0; ; k++) {
+    err = 0.0;
+    i_dendr = 0.0;
+    for (d = 0; d < eng->num_dendrs; d++) {
+      row  = ps->coef + eng->offset[d];
+      next = ps->next + eng->offset[d];
+      sum  = ps->sum  + eng->offset[d];
+      num_comps = eng->comps[d];
+      shape = &eng->shapes[eng->shape[d]];
+      i_dendr += dendriteSeries( row, next, num_comps, k, delta_t,
+                                 eng->cur[d], ps->series[PS_V][k],
+                                 shape->g_before, shape->g_after );
+      for (c = 1; c < num_comps-1; c++) {
+        sum[c] += next[c];
+        if (fabs( next[c] ) > err) {
+          err = fabs( next[c] );
+        }
+      }
+    }
+
+    somaSeries( ps->series, k, delta_t, i_inj, i_dendr );
+    for (i = 0; i < NUMVAR; i++) {
+      y[i] += ps->series[i][k+1];
+      if (fabs( ps->series[i][k+1] ) > err) {
+        err = fabs( ps->series[i][k+1] );
+      }
+    }
+
+    swap = ps->coef;
+    ps->coef = ps->next;
+    ps->next = swap;
+
+    if (err <= ps->tolerance || k+1 == PS_MAX_ORDER) {
+      break;
+    }
+  }
+
+  for (d = 0; d < eng->num_dendrs; d++) {
+    sum = ps->sum + eng->offset[d];
+    for (c = 1; c < eng->comps[d]-1; c++) {
+      *engineVolt( eng, d, c ) = sum[c];
+    }
+  }
+
+  ps->stats.steps++;
+  ps->stats.terms += k+1;
+  if (k+1 > ps->stats.max_order) {
+    ps->stats.max_order = k+1;
+  }
+  if (err > ps->tolerance) {
+    ps->stats.capped++;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void psFree( PSSolver *ps )
+{
+  if (ps == NULL) {
+    return;
+  }
+
+  free( ps->coef );
+  free( ps->next );
+  free( ps->sum );
+  free( ps );
+}
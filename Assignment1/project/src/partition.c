@@ -0,0 +1,244 @@
+/*
+  Multiple Processor Systems.
+
+  Assignment of dendrites, or of runs of their compartments, to processes
+  and threads by estimated cost.
+*/
+
+#include "partition.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/**
+ * An item to hand out, sorted by partitionLPT.
+ */
+typedef struct LPTItem {
+  double cost;
+  int item;
+} LPTItem;
+
+/**
+ * Name: lptCompare
+ *
+ * Description:
+ * qsort comparison of two LPTItem: decreasing cost, then increasing index.
+ *
+ * Parameters:
+ * @param a             (INPUT) first item
+ * @param b             (INPUT) second item
+ *
+ * Returns:
+ * @return int          negative if `a' goes first, positive otherwise
+ */
+static int lptCompare( const void *a, const void *b )
+{
+  const LPTItem *x = (const LPTItem*) a, *y = (const LPTItem*) b;
+
+  if (x->cost != y->cost) {
+    return (x->cost > y->cost) ? -1 : 1;
+  }
+  return x->item - y->item;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double partitionSomaCost( HHSyncMode mode, int num_tasks, int num_threads,
+                          int substeps )
+{
+  int rounds = 0;
+  double messages = 0.0;
+
+  // Rounds of a binomial tree over all ranks.
+  while ((1 << rounds) < num_tasks) {
+    rounds++;
+  }
+
+  switch (mode) {
+  case SYNC_STAR:
+    // Three messages per worker, a worker only handles its own three.
+    messages = (num_tasks > 2) ? 3.0 * (num_tasks - 2) : 0.0;
+    break;
+  case SYNC_COLL:
+  case SYNC_TREE:
+    // The root takes part in every round of both trees, a leaf in one.
+    messages = (rounds > 1) ? 2.0 * (rounds - 1) : 0.0;
+    break;
+  }
+
+  return (SOMA_COST * substeps + MSG_COST * messages) * num_threads;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void partitionGreedy( int num_items, const double *cost, int num_ranks,
+                      double *load, int *owner )
+{
+  int i, r, best;
+
+  for (i = 0; i < num_items; i++) {
+    best = 0;
+    for (r = 1; r < num_ranks; r++) {
+      if (load[r] < load[best]) {
+        best = r;
+      }
+    }
+    owner[i] = best;
+    load[best] += cost[i];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int partitionLPT( int num_items, const double *cost, int num_ranks,
+                  double *load, int *owner )
+{
+  int i, r, best;
+  LPTItem *order = (LPTItem*) hhMalloc( sizeof(LPTItem) * num_items );
+
+  if (order == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < num_items; i++) {
+    order[i].cost = cost[i];
+    order[i].item = i;
+  }
+  qsort( order, num_items, sizeof(LPTItem), lptCompare );
+
+  for (i = 0; i < num_items; i++) {
+    best = 0;
+    for (r = 1; r < num_ranks; r++) {
+      if (load[r] < load[best]) {
+        best = r;
+      }
+    }
+    owner[order[i].item] = best;
+    load[best] += order[i].cost;
+  }
+
+  free( order );
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int partitionChain( int num_items, const int *size, int num_ranks,
+                    double *load, PartitionPiece *pieces )
+{
+  int i = 0, off = 0, r, p, n = 0, take;
+  long left = 0;
+  double ahead, share;
+
+  for (p = 0; p < num_items; p++) {
+    left += size[p];
+  }
+
+  for (r = 0; r < num_ranks && left > 0; r++) {
+    // Even out this rank with the ones still to come.
+    for (p = r, ahead = (double) left; p < num_ranks; p++) {
+      ahead += load[p];
+    }
+    share = (r == num_ranks - 1) ? (double) left :
+            floor( ahead / (num_ranks - r) - load[r] + 0.5 );
+    share = (share < 0.0) ? 0.0 : (share > left) ? (double) left : share;
+
+    for (; share > 0.0; n++) {
+      take = size[i] - off;
+      take = (take > share) ? (int) share : take;
+      pieces[n].item  = i;
+      pieces[n].first = off;
+      pieces[n].count = take;
+      pieces[n].rank  = r;
+      load[r] += take;
+      left    -= take;
+      share   -= take;
+      off     += take;
+      if (off == size[i]) {
+        i++;
+        off = 0;
+      }
+    }
+  }
+
+  // A cut sends and receives one potential per step on either side.
+  for (p = 1; p < n; p++) {
+    if (pieces[p].item == pieces[p-1].item) {
+      load[pieces[p].rank]   += 2.0 * MSG_COST;
+      load[pieces[p-1].rank] += 2.0 * MSG_COST;
+    }
+  }
+
+  return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int partitionMigrate( int num_items, const double *cost, int num_ranks,
+                      const double *speed, double *time, int *owner )
+{
+  int i, r, slow, fast, best, moved;
+  double after, best_after;
+
+  for (moved = 0; moved < num_items; moved++) {
+    slow = fast = 0;
+    for (r = 1; r < num_ranks; r++) {
+      slow = (time[r] > time[slow]) ? r : slow;
+      fast = (time[r] < time[fast]) ? r : fast;
+    }
+
+    // The item that leaves the two ranks with the shortest longer step.
+    best = -1;
+    best_after = time[slow];
+    for (i = 0; i < num_items; i++) {
+      if (owner[i] != slow) {
+        continue;
+      }
+      after = fmax( time[slow] - cost[i] / speed[slow],
+                    time[fast] + cost[i] / speed[fast] );
+      if (after < best_after) {
+        best = i;
+        best_after = after;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+
+    owner[best] = fast;
+    time[slow] -= cost[best] / speed[slow];
+    time[fast] += cost[best] / speed[fast];
+  }
+
+  return moved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double partitionImbalance( int num_ranks, const double *load )
+{
+  int r;
+  double total = 0.0, most = 0.0;
+
+  for (r = 0; r < num_ranks; r++) {
+    total += load[r];
+    most = (load[r] > most) ? load[r] : most;
+  }
+
+  return (total > 0.0) ? most * num_ranks / total : 1.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int partitionOwned( int num_items, const int *owner, int rank, int *items )
+{
+  int i, count = 0;
+
+  for (i = 0; i < num_items; i++) {
+    if (owner[i] == rank) {
+      items[count++] = i;
+    }
+  }
+
+  return count;
+}
@@ -28,6 +28,13 @@ void plotData( PlotInfo *pinfo, char *data_name, char *image_name )
   fprintf( pipe, "set xlabel 'Time, ms'\n" );
   fprintf( pipe, "set ylabel 'Vm, mV'\n" );
   fprintf( pipe, "unset key\n" );
-  fprintf( pipe, "plot '%s' using 1:2 with lines\n", data_name );
+  if (pinfo->format == TRACE_BINARY) {
+    // Skip the header and derive the time from the sample index.
+    fprintf( pipe, "plot '%s' binary skip=%d format='%%float64' "
+                   "using ($0*%.10g):1 with lines\n", data_name,
+             TRACE_MAGIC_LEN + (int) sizeof(double), pinfo->interval );
+  } else {
+    fprintf( pipe, "plot '%s' using 1:2 with lines\n", data_name );
+  }
   pclose( pipe );
 }
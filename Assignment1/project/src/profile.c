@@ -0,0 +1,111 @@
+/*
+  Multiple Processor Systems.
+
+  Per-rank timings of mpi_hh, gathered at rank 0 at the end of a run.
+*/
+
+#include "profile.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <mpi.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void profileGather( RankProfile *prof, const Sync *sync, RankProfile *all )
+{
+  int i;
+
+  prof->send  = sync->send;
+  prof->recv  = sync->wait - sync->send;
+  prof->steps = sync->steps;
+  for (i = 0; i < SYNC_HIST_BINS; i++) {
+    prof->hist[i] = sync->hist[i];
+  }
+
+  // All ranks run the same binary on the same kind of machine.
+  MPI_Gather( prof, sizeof(RankProfile), MPI_BYTE, all, sizeof(RankProfile),
+              MPI_BYTE, 0, MPI_COMM_WORLD );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double profileStepTime( const RankProfile *prof, double fraction )
+{
+  int i;
+  long timed = 0, seen = 0;
+
+  for (i = 0; i < SYNC_HIST_BINS; i++) {
+    timed += prof->hist[i];
+  }
+  if (timed == 0) {
+    return 0.0;
+  }
+
+  for (i = 0; i < SYNC_HIST_BINS - 1; i++) {
+    seen += prof->hist[i];
+    if (seen >= fraction * timed) {
+      break;
+    }
+  }
+
+  return ldexp( 1.0, i );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void profileLine( const RankProfile *prof, int rank, char *buf, size_t len )
+{
+  int n;
+
+  n = snprintf( buf, len, "Rank %d: load %.0f, dendrites %.6f s, soma %.6f s, "
+                "send %.6f s, receive %.6f s, halo %.6f s, steps %ld, "
+                "step p50 < %g us, p99 < %g us", rank, prof->load,
+                prof->compute, prof->soma, prof->send, prof->recv, prof->halo,
+                prof->steps, profileStepTime( prof, 0.5 ),
+                profileStepTime( prof, 0.99 ) );
+  if (prof->allocs >= 0 && n >= 0 && (size_t) n < len) {
+    snprintf( buf + n, len - n, ", allocations %ld", prof->allocs );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int profileWrite( const char *fname, const RankProfile *all, int num_tasks,
+                  const char *sync_name, double exec_time )
+{
+  int r, i;
+  FILE *file;
+
+  if ((file = fopen( fname, "w" )) == NULL) {
+    return 0;
+  }
+
+  // Bin i of a histogram counts the steps from hist_lower_us[i] up to the
+  // next edge; the last one has no upper edge.
+  fprintf( file, "{\n  \"num_tasks\": %d,\n  \"sync\": \"%s\",\n"
+           "  \"exec_time_s\": %.6f,\n  \"hist_lower_us\": [0", num_tasks,
+           sync_name, exec_time );
+  for (i = 1; i < SYNC_HIST_BINS; i++) {
+    fprintf( file, ", %.0f", ldexp( 1.0, i - 1 ) );
+  }
+  fprintf( file, "],\n  \"ranks\": [\n" );
+
+  for (r = 0; r < num_tasks; r++) {
+    fprintf( file, "    {\"rank\": %d, \"load\": %.0f, \"compute_s\": %.6f, "
+             "\"soma_s\": %.6f,\n     \"send_s\": %.6f, \"recv_s\": %.6f, "
+             "\"halo_s\": %.6f, \"steps\": %ld, \"allocs\": %ld,\n"
+             "     \"step_p50_us\": %g, \"step_p99_us\": %g,\n"
+             "     \"step_hist\": [", r, all[r].load, all[r].compute,
+             all[r].soma, all[r].send, all[r].recv, all[r].halo, all[r].steps,
+             all[r].allocs, profileStepTime( &all[r], 0.5 ),
+             profileStepTime( &all[r], 0.99 ) );
+    for (i = 0; i < SYNC_HIST_BINS; i++) {
+      fprintf( file, "%s%ld", (i > 0) ? ", " : "", all[r].hist[i] );
+    }
+    fprintf( file, "]}%s\n", (r + 1 < num_tasks) ? "," : "" );
+  }
+  fprintf( file, "  ]\n}\n" );
+
+  return (fclose( file ) == 0);
+}
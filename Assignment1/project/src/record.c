@@ -0,0 +1,194 @@
+/*
+  Multiple Processor Systems.
+
+  Recording the potential of every dendrite compartment, and reading it back.
+*/
+
+#include "record.h"
+#include "lib_hh.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+size_t recordChunkLen( const RecordHeader *hdr )
+{
+  return sizeof(double) * hdr->chunk_frames * hdr->num_comps *
+         (size_t) hdr->num_dendrs;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+long recordOffset( const RecordHeader *hdr, long chunk, int d, int c )
+{
+  return (long) sizeof(RecordHeader) + chunk * (long) recordChunkLen( hdr ) +
+         ((long) d * hdr->num_comps + c) * hdr->chunk_frames *
+         (long) sizeof(double);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int recordReadHeader( FILE *file, RecordHeader *hdr )
+{
+  return fread( hdr, sizeof(RecordHeader), 1, file ) == 1 &&
+         memcmp( hdr->magic, RECORD_MAGIC, RECORD_MAGIC_LEN ) == 0 &&
+         hdr->num_dendrs > 0 && hdr->num_comps > 0 && hdr->chunk_frames > 0;
+}
+
+/**
+ * Name: mapFlush
+ *
+ * Description:
+ * Moves a memory-mapped recorder on to the next chunk of the file. The full
+ * one is already in the mapped pages.
+ *
+ * Parameters:
+ * @param rec       (INOUT) the writer
+ *
+ * Returns:
+ * @return int      nonzero
+ */
+static int mapFlush( Recorder *rec )
+{
+  rec->chunk += recordChunkLen( &rec->hdr ) / sizeof(double);
+
+  return 1;
+}
+
+/**
+ * Name: mapFinish
+ *
+ * Description:
+ * Unmaps and closes the file of a memory-mapped recorder.
+ *
+ * Parameters:
+ * @param rec       (INOUT) the writer
+ *
+ * Returns:
+ * @return int      nonzero if the file was closed cleanly
+ */
+static int mapFinish( Recorder *rec )
+{
+  int ok = (munmap( rec->map, rec->map_len ) == 0);
+
+  return (close( rec->fd ) == 0) && ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void recordHeaderInit( RecordHeader *hdr, int num_dendrs, int num_comps,
+                       double dt, long num_frames )
+{
+  memset( hdr, 0, sizeof(RecordHeader) );
+  memcpy( hdr->magic, RECORD_MAGIC, RECORD_MAGIC_LEN );
+  hdr->num_dendrs   = num_dendrs;
+  hdr->num_comps    = num_comps - 2;
+  hdr->chunk_frames = RECORD_CHUNK;
+  hdr->dt           = dt;
+  hdr->num_frames   = num_frames;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+Recorder *recorderOpen( const char *fname, Engine *eng, double dt,
+                        long num_frames )
+{
+  long num_chunks = (num_frames + RECORD_CHUNK - 1) / RECORD_CHUNK;
+  Recorder *rec = (Recorder*) hhMalloc( sizeof(Recorder) );
+
+  if (rec == NULL) {
+    return NULL;
+  }
+
+  recordHeaderInit( &rec->hdr, eng->num_dendrs, eng->num_comps, dt,
+                    num_frames );
+  rec->num_rows = eng->num_dendrs;
+  rec->by_gid   = 1;
+  rec->frames   = 0;
+  rec->ok       = 1;
+  rec->flush    = mapFlush;
+  rec->finish   = mapFinish;
+  rec->file     = NULL;
+  rec->view     = NULL;
+
+  // The file gets its final size up front; the pages are zero until a frame
+  // lands in them.
+  rec->map_len = sizeof(RecordHeader) +
+                 num_chunks * recordChunkLen( &rec->hdr );
+  rec->fd = open( fname, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if (rec->fd < 0) {
+    free( rec );
+    return NULL;
+  }
+  rec->map = (ftruncate( rec->fd, (off_t) rec->map_len ) != 0) ? MAP_FAILED :
+             (double*) mmap( NULL, rec->map_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, rec->fd, 0 );
+  if (rec->map == MAP_FAILED) {
+    close( rec->fd );
+    free( rec );
+    return NULL;
+  }
+
+  memcpy( rec->map, &rec->hdr, sizeof(RecordHeader) );
+  rec->chunk = rec->map + sizeof(RecordHeader) / sizeof(double);
+
+  return rec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void recorderSnapshot( Recorder *rec, Engine *eng )
+{
+  int d, c;
+  int const num_comps = rec->hdr.num_comps;
+  int const frame = (int) (rec->frames % RECORD_CHUNK);
+  double *row;
+
+  if (rec->frames >= rec->hdr.num_frames) {
+    return;
+  }
+
+  for (d = 0; d < rec->num_rows; d++) {
+    row = rec->chunk + (size_t) (rec->by_gid ? eng->gids[d] : d) *
+                       num_comps * RECORD_CHUNK;
+    for (c = 0; c < num_comps; c++) {
+      row[c * RECORD_CHUNK + frame] = *engineVolt( eng, d, c+1 );
+    }
+  }
+
+  if (++rec->frames % RECORD_CHUNK == 0) {
+    rec->ok = rec->flush( rec ) && rec->ok;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int recorderClose( Recorder *rec )
+{
+  int ok;
+  int const frame = (int) (rec->frames % RECORD_CHUNK);
+  size_t const num_values = (size_t) rec->num_rows * rec->hdr.num_comps;
+  size_t i;
+
+  // The frames past the end of the last chunk are left as zeros; a chunk
+  // buffer still holds the ones of the previous chunk there.
+  if (frame != 0) {
+    if (!rec->by_gid) {
+      for (i = 0; i < num_values; i++) {
+        memset( rec->chunk + i * RECORD_CHUNK + frame, 0,
+                sizeof(double) * (RECORD_CHUNK - frame) );
+      }
+    }
+    rec->ok = rec->flush( rec ) && rec->ok;
+  }
+
+  ok = rec->finish( rec ) && rec->ok;
+  free( rec );
+
+  return ok;
+}
@@ -0,0 +1,88 @@
+/*
+  Multiple Processor Systems.
+
+  Reads compartment recordings written by seq_hh and mpi_hh with --record.
+*/
+
+#include "record.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Name: main
+ *
+ * Description:
+ * With only a file name, prints the header of a recording. With a dendrite
+ * and a compartment as well, prints the potential of that compartment at
+ * every frame, one 'time potential' line each, like a text trace. Only the
+ * values of that compartment are read, one chunk at a time.
+ *
+ * Parameters:
+ * @param argc    number of command line arguments
+ * @param argv    command line arguments
+ */
+int main( int argc, char **argv )
+{
+  FILE *file;
+  RecordHeader hdr;
+  int d, c, f, n;
+  long chunk, frame;
+  double buf[RECORD_CHUNK];
+
+  if (argc != 2 && argc != 4) {
+    fprintf( stderr, "USAGE:\n  %s FILE [DENDRITE COMPARTMENT]\n\n"
+             "Prints the header of a recording made with --record, or the\n"
+             "potential of one compartment over time. Dendrites and\n"
+             "compartments are numbered from 0, compartments from the tip.\n",
+             argv[0] );
+    return 1;
+  }
+
+  if ((file = fopen( argv[1], "rb" )) == NULL ||
+      !recordReadHeader( file, &hdr )) {
+    fprintf( stderr, "Can't read recording %s!\n", argv[1] );
+    return 1;
+  }
+  if (hdr.chunk_frames > RECORD_CHUNK) {
+    fprintf( stderr, "Chunks of %d frames are not supported!\n",
+             hdr.chunk_frames );
+    return 1;
+  }
+
+  if (argc == 2) {
+    printf( "Dendrites: %d\nCompartments: %d\nFrames: %ld\n"
+            "Time between frames: %g ms\nFrames per chunk: %d\n",
+            hdr.num_dendrs, hdr.num_comps, (long) hdr.num_frames, hdr.dt,
+            hdr.chunk_frames );
+    fclose( file );
+    return 0;
+  }
+
+  d = atoi( argv[2] );
+  c = atoi( argv[3] );
+  if (d < 0 || d >= hdr.num_dendrs || c < 0 || c >= hdr.num_comps) {
+    fprintf( stderr, "No compartment %d of dendrite %d in %s!\n", c, d,
+             argv[1] );
+    fclose( file );
+    return 1;
+  }
+
+  printf( "# Vm of compartment %d of dendrite %d\n# X Y\n", c, d );
+  for (frame = 0, chunk = 0; frame < hdr.num_frames; chunk++) {
+    n = (hdr.num_frames - frame < hdr.chunk_frames) ?
+        (int) (hdr.num_frames - frame) : hdr.chunk_frames;
+    if (fseek( file, recordOffset( &hdr, chunk, d, c ), SEEK_SET ) != 0 ||
+        fread( buf, sizeof(double), n, file ) != (size_t) n) {
+      fprintf( stderr, "Recording %s is truncated!\n", argv[1] );
+      fclose( file );
+      return 1;
+    }
+    for (f = 0; f < n; f++, frame++) {
+      printf( "%.10g %f\n", frame * hdr.dt, buf[f] );
+    }
+  }
+
+  fclose( file );
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+  Multiple Processor Systems.
+
+  Compartment recordings written by every rank of mpi_hh with MPI-IO.
+*/
+
+#include "record.h"
+#include "lib_hh.h"
+
+#include <stdlib.h>
+#include <mpi.h>
+
+/**
+ * Name: sharedFlush
+ *
+ * Description:
+ * Writes the full chunk of this rank into its dendrites' slices of the
+ * chunk in the file. Collective.
+ *
+ * Parameters:
+ * @param rec       (INOUT) the writer
+ *
+ * Returns:
+ * @return int      nonzero if the chunk was written
+ */
+static int sharedFlush( Recorder *rec )
+{
+  MPI_File *fh = (MPI_File*) rec->file;
+  MPI_Datatype *view = (MPI_Datatype*) rec->view;
+  long chunk = (rec->frames - 1) / RECORD_CHUNK;
+  int rc;
+
+  rc = MPI_File_set_view( *fh, recordOffset( &rec->hdr, chunk, 0, 0 ),
+                          MPI_DOUBLE, *view, "native", MPI_INFO_NULL );
+  if (rc == MPI_SUCCESS) {
+    rc = MPI_File_write_all( *fh, rec->chunk, rec->num_rows *
+                             rec->hdr.num_comps * RECORD_CHUNK, MPI_DOUBLE,
+                             MPI_STATUS_IGNORE );
+  }
+
+  return rc == MPI_SUCCESS;
+}
+
+/**
+ * Name: sharedFinish
+ *
+ * Description:
+ * Closes the file of a shared recorder and releases its view and buffer.
+ * Collective.
+ *
+ * Parameters:
+ * @param rec       (INOUT) the writer
+ *
+ * Returns:
+ * @return int      nonzero if the file was closed cleanly
+ */
+static int sharedFinish( Recorder *rec )
+{
+  MPI_File *fh = (MPI_File*) rec->file;
+  MPI_Datatype *view = (MPI_Datatype*) rec->view;
+  int ok = (MPI_File_close( fh ) == MPI_SUCCESS);
+
+  MPI_Type_free( view );
+  free( fh );
+  free( view );
+  free( rec->chunk );
+
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+Recorder *recorderOpenShared( const char *fname, Engine *eng, int num_dendrs,
+                              double dt, long num_frames )
+{
+  int d, rank, rc, ok;
+  int const num_comps = eng->num_comps - 2;
+  long num_chunks = (num_frames + RECORD_CHUNK - 1) / RECORD_CHUNK;
+  int *disp = (int*) hhMalloc( sizeof(int) * (eng->num_dendrs + 1) );
+  Recorder *rec = (Recorder*) hhMalloc( sizeof(Recorder) );
+  MPI_File *fh = (MPI_File*) hhMalloc( sizeof(MPI_File) );
+  MPI_Datatype *view = (MPI_Datatype*) hhMalloc( sizeof(MPI_Datatype) );
+  double *chunk = (double*) hhMalloc( sizeof(double) * RECORD_CHUNK *
+                                      num_comps * (eng->num_dendrs + 1) );
+
+  // Every rank must take part in the collective calls below, even if it is
+  // out of memory, so failures are only reported at the end.
+  ok = (disp != NULL && rec != NULL && fh != NULL && view != NULL &&
+        chunk != NULL);
+  MPI_Allreduce( MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD );
+  if (!ok) {
+    free( disp );
+    free( rec );
+    free( fh );
+    free( view );
+    free( chunk );
+    return NULL;
+  }
+
+  MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+  recordHeaderInit( &rec->hdr, num_dendrs, eng->num_comps, dt, num_frames );
+  rec->num_rows = eng->num_dendrs;
+  rec->by_gid   = 0;
+  rec->frames   = 0;
+  rec->chunk    = chunk;
+  rec->ok       = 1;
+  rec->flush    = sharedFlush;
+  rec->finish   = sharedFinish;
+  rec->file     = fh;
+  rec->view     = view;
+
+  // Within a chunk the rows of this rank are blocks of `num_comps' times
+  // RECORD_CHUNK doubles, in the order of their global ids.
+  for (d = 0; d < eng->num_dendrs; d++) {
+    disp[d] = eng->gids[d] * num_comps * RECORD_CHUNK;
+  }
+  MPI_Type_create_indexed_block( eng->num_dendrs, num_comps * RECORD_CHUNK,
+                                 disp, MPI_DOUBLE, view );
+  MPI_Type_commit( view );
+  free( disp );
+
+  rc = MPI_File_open( MPI_COMM_WORLD, (char*) fname,
+                      MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, fh );
+  if (rc == MPI_SUCCESS) {
+    rc = MPI_File_set_size( *fh, recordOffset( &rec->hdr, num_chunks, 0, 0 ) );
+    if (rc == MPI_SUCCESS && rank == 0) {
+      rc = MPI_File_write_at( *fh, 0, &rec->hdr, sizeof(RecordHeader),
+                              MPI_BYTE, MPI_STATUS_IGNORE );
+    }
+    ok = (rc == MPI_SUCCESS);
+    MPI_Allreduce( MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD );
+    if (!ok) {
+      MPI_File_close( fh );
+    }
+  } else {
+    ok = 0;
+  }
+
+  if (!ok) {
+    MPI_Type_free( view );
+    free( rec );
+    free( fh );
+    free( view );
+    free( chunk );
+    return NULL;
+  }
+
+  return rec;
+}
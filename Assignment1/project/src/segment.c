@@ -0,0 +1,185 @@
+/*
+  Multiple Processor Systems.
+
+  Runs of compartments of dendrites cut between the ranks of mpi_hh, and the
+  exchange of the potentials at the cuts.
+*/
+
+#include "segment.h"
+#include "constants.h"
+
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+SegmentSet *segmentsCreate( int rank, int num_pieces,
+                            const PartitionPiece *pieces, const int *comps,
+                            const HHRng *rng, int draws )
+{
+  int p, n, c, longest = 0;
+  double *g_before = NULL, *g_after = NULL;
+  SegmentSet *set;
+  Segment *seg;
+
+  if ((set = (SegmentSet*) hhMalloc( sizeof(SegmentSet) )) == NULL) {
+    return NULL;
+  }
+  set->num_segs = 0;
+  set->rng      = rng;
+  set->draws    = draws;
+  set->num_reqs = 0;
+
+  for (p = 0; p < num_pieces; p++) {
+    if (pieces[p].rank == rank) {
+      set->num_segs++;
+    }
+    longest = (comps[pieces[p].item] > longest) ? comps[pieces[p].item]
+                                                : longest;
+  }
+
+  // Only the first and the last run can have neighbours elsewhere, one
+  // send and one receive each.
+  set->segs = (Segment*) hhMalloc( sizeof(Segment) * (set->num_segs + 1) );
+  set->reqs = (MPI_Request*) hhMalloc( sizeof(MPI_Request) * 4 );
+  g_before  = (double*) hhMalloc( sizeof(double) * longest );
+  g_after   = (double*) hhMalloc( sizeof(double) * longest );
+  if (set->segs == NULL || set->reqs == NULL || g_before == NULL ||
+      g_after == NULL) {
+    free( g_before );
+    free( g_after );
+    set->num_segs = 0;
+    segmentsFree( set );
+    return NULL;
+  }
+
+  for (p = 0, seg = set->segs; p < num_pieces; p++) {
+    if (pieces[p].rank != rank) {
+      continue;
+    }
+    n = pieces[p].count;
+    seg->gid   = pieces[p].item;
+    seg->first = pieces[p].first + 1;
+    seg->count = n;
+    seg->tip_rank = (p > 0 && pieces[p-1].item == seg->gid) ?
+                    pieces[p-1].rank : -1;
+    seg->soma_rank = (p+1 < num_pieces && pieces[p+1].item == seg->gid) ?
+                     pieces[p+1].rank : -1;
+
+    seg->v = (double*) hhMalloc( sizeof(double) * (3*n + 2) );
+    if (seg->v == NULL) {
+      free( g_before );
+      free( g_after );
+      set->num_segs = (int) (seg - set->segs);
+      segmentsFree( set );
+      return NULL;
+    }
+    seg->g_before = seg->v + n + 2;
+    seg->g_after  = seg->g_before + n;
+
+    // Entry i of the tables of the dendrite describes compartment i+1.
+    conductanceTable( comps[seg->gid], g_before, g_after );
+    for (c = 0; c < n; c++) {
+      seg->g_before[c] = g_before[seg->first - 1 + c];
+      seg->g_after[c]  = g_after[seg->first - 1 + c];
+    }
+    for (c = 0; c < n + 2; c++) {
+      seg->v[c] = VREST;
+    }
+    seg++;
+  }
+
+  free( g_before );
+  free( g_after );
+  return set;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void segmentsWait( SegmentSet *set )
+{
+  MPI_Waitall( set->num_reqs, set->reqs, MPI_STATUSES_IGNORE );
+  set->num_reqs = 0;
+}
+
+/**
+ * Name: segmentsPost
+ *
+ * Description:
+ * Starts the exchange of the potentials at the cuts: the ends of every run
+ * go to the ranks stepping the neighbouring compartments, whose ends come
+ * back into the ghost compartments. A pair of ranks shares at most one cut,
+ * so the direction alone tells the messages apart.
+ *
+ * Parameters:
+ * @param set           (INOUT) the runs
+ */
+static void segmentsPost( SegmentSet *set )
+{
+  int s;
+  Segment *seg;
+
+  for (s = 0; s < set->num_segs; s++) {
+    seg = &set->segs[s];
+    if (seg->tip_rank >= 0) {
+      MPI_Isend( &seg->v[1], 1, MPI_DOUBLE, seg->tip_rank, TAG_HALO_TIP,
+                 MPI_COMM_WORLD, &set->reqs[set->num_reqs++] );
+      MPI_Irecv( &seg->v[0], 1, MPI_DOUBLE, seg->tip_rank, TAG_HALO_SOMA,
+                 MPI_COMM_WORLD, &set->reqs[set->num_reqs++] );
+    }
+    if (seg->soma_rank >= 0) {
+      MPI_Isend( &seg->v[seg->count], 1, MPI_DOUBLE, seg->soma_rank,
+                 TAG_HALO_SOMA, MPI_COMM_WORLD, &set->reqs[set->num_reqs++] );
+      MPI_Irecv( &seg->v[seg->count+1], 1, MPI_DOUBLE, seg->soma_rank,
+                 TAG_HALO_TIP, MPI_COMM_WORLD, &set->reqs[set->num_reqs++] );
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double segmentsStep( SegmentSet *set, long step, double delta_t, double v_m )
+{
+  int s;
+  double cur, current, total = 0.0;
+  Segment *seg;
+
+  for (s = 0; s < set->num_segs; s++) {
+    seg = &set->segs[s];
+
+    // Only the run at the tip gets the injected current, and only the one
+    // next to the soma sees v_m; the others step against their ghosts.
+    cur = (seg->first == 1) ?
+          injectedCurrentSpan( set->rng, seg->gid, step * set->draws,
+                               set->draws ) : 0.0;
+    current = dendriteStepFused( seg->v, cur, seg->count + 2, delta_t,
+                                 (seg->soma_rank < 0) ? v_m :
+                                 seg->v[seg->count+1],
+                                 seg->g_before, seg->g_after );
+    if (seg->soma_rank < 0) {
+      total += current;
+    }
+  }
+
+  segmentsPost( set );
+
+  return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void segmentsFree( SegmentSet *set )
+{
+  int s;
+
+  if (set == NULL) {
+    return;
+  }
+
+  segmentsWait( set );
+  for (s = 0; s < set->num_segs; s++) {
+    free( set->segs[s].v );
+  }
+  free( set->segs );
+  free( set->reqs );
+  free( set );
+}
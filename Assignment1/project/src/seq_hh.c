@@ -8,6 +8,12 @@
 
 #include "plot.h"
 #include "lib_hh.h"
+#include "batch.h"
+#include "engine.h"
+#include "parker.h"
+#include "trace.h"
+#include "record.h"
+#include "checkpoint.h"
 #include "cmd_args.h"
 #include "constants.h"
 
@@ -33,6 +39,162 @@
   #define ISDEF_PLOT_PNG 0
 #endif
 
+/**
+ * Name: runBatch
+ *
+ * Description:
+ * Simulates every neuron of the --batch table, HH_VLEN at a time, and writes
+ * the trace of each one to a data file of its own, named after the run with
+ * the neuron's index in the table appended.
+ *
+ * Parameters:
+ * @param cmd_args  command line arguments, with the model parameters set
+ */
+static void runBatch( CmdArgs *cmd_args )
+{
+  int num_neurons, n, k, t_ms;            // Indexing variables.
+  int num_dendrs = cmd_args->num_dendrs;
+  int num_comps  = cmd_args->num_comps;
+  int comp_time  = cmd_args->params.comp_time;
+  long setup_allocs;                      // hhMalloc calls made by the setup.
+  long setup_heap;                        // Heap allocations of the setup.
+  struct timeval start, stop, diff;       // Values used to measure time.
+  double exec_time;                       // How long we take.
+  const HHParams *p;
+
+  BatchNeuron *neurons; // Parameters of every neuron, as in the table.
+  Batch *batch;         // State of every neuron.
+  TraceWriter **traces; // Output file of every neuron.
+
+  char time_str[14];
+  char data_fname[ FNAME_LEN ];
+  char comment[ 512 ];
+
+  if ((neurons = batchRead( cmd_args->batch, cmd_args, &num_neurons ))
+	  == NULL) {
+	exit(1);
+  }
+  printf( "Simulating %d neurons from %s, %d at a time with vector "
+		  "instructions.\n", num_neurons, cmd_args->batch, HH_VLEN );
+  printf( "Every neuron has %d dendrites of %s%d compartments.\n",
+		  num_dendrs, (cmd_args->morphology != NULL) ? "up to " : "",
+		  num_comps );
+  if (cmd_args->substeps > 1) {
+	printf( "Taking %d soma steps per dendrite step.\n",
+			cmd_args->substeps );
+  }
+
+  time_t t = time(NULL);
+  struct tm *tmp = localtime( &t );
+  strftime( time_str, 14, "%m%d%y_%H%M%S", tmp );
+
+  struct stat stat_buf;
+  stat( "data", &stat_buf );
+  if ((!S_ISDIR(stat_buf.st_mode)) && (mkdir( "data", 0700 ) != 0)) {
+	fprintf( stderr, "Could not create 'data' directory!\n" );
+	exit(1);
+  }
+
+  // One trace per neuron, its parameters in the header.
+  if ((traces = (TraceWriter**) hhMalloc( sizeof(TraceWriter*) *
+										  num_neurons )) == NULL) {
+	fprintf( stderr, "Could not allocate the batch!\n" );
+	exit(1);
+  }
+  for (n = 0; n < num_neurons; n++) {
+	p = &neurons[n].params;
+	sprintf( data_fname, "data/p1d%dc%d_%s_n%d.%s",
+			 num_dendrs, num_comps, time_str, n,
+			 (cmd_args->format == TRACE_BINARY) ? "bin" : "dat" );
+	sprintf( comment,
+			 "Vm for HH model. "
+			 "Simulation time: %d ms, Integration step: %f ms, "
+			 "Compartments: %d, Dendrites: %d, Slave processes: %d, "
+			 "Samples per ms: %d, Neuron: %d of %s, "
+			 "inj-mean %g, g-comp %g, g-distr %g, g-na %g, g-k %g, "
+			 "g-l %g, g-ld %g, seed %llu",
+			 comp_time, 1.0 / cmd_args->steps, num_comps, num_dendrs, 0,
+			 cmd_args->sample_rate, n, cmd_args->batch, p->inj_mean,
+			 p->g_comp, p->g_distr, p->g_na, p->g_k, p->g_l, p->g_ld,
+			 neurons[n].seed );
+	traces[n] = traceOpen( data_fname, cmd_args->format,
+						   1.0 / cmd_args->sample_rate, comment );
+	if (traces[n] == NULL) {
+	  fprintf( stderr, "Can't open %s file!\n", data_fname );
+	  exit(1);
+	}
+  }
+  printf( "\nData will be stored in data/p1d%dc%d_%s_n*.%s\n",
+		  num_dendrs, num_comps, time_str,
+		  (cmd_args->format == TRACE_BINARY) ? "bin" : "dat" );
+
+  // Start the clock.
+  gettimeofday( &start, NULL );
+
+  // All the state of the neurons is set up here. The main loop below must
+  // not allocate anything else.
+  if ((batch = batchCreate( cmd_args, neurons, num_neurons )) == NULL) {
+	fprintf( stderr, "Could not allocate the integration workspace!\n" );
+	exit(1);
+  }
+  if (batch->num_threads > 1) {
+	printf( "Stepping neurons with %d threads.\n", batch->num_threads );
+  }
+  setup_allocs = hhAllocCount();
+  setup_heap = hhHeapAllocCount();
+
+  // Every neuron starts at rest.
+  for (n = 0; n < num_neurons; n++) {
+	traceWrite( traces[n], VREST );
+  }
+
+  for (t_ms = 1; t_ms < comp_time; t_ms++) {
+	batchStep( batch, t_ms );
+
+	printf("\r%02d ms",t_ms); fflush(stdout);
+
+	for (n = 0; n < num_neurons; n++) {
+	  for (k = 0; k < cmd_args->sample_rate; k++) {
+		traceWrite( traces[n], batchSample( batch, n, k ) );
+	  }
+	}
+  }
+
+  gettimeofday( &stop, NULL );
+  timersub( &stop, &start, &diff );
+  exec_time = (double) (diff.tv_sec) + (double) (diff.tv_usec) * 0.000001;
+  printf("\n\nExecution time: %f seconds.\n", exec_time);
+  printf("Throughput: %.1f neuron ms per second.\n",
+		 (double) num_neurons * (comp_time-1) / exec_time);
+
+  // The simulation loop is expected to run entirely out of the storage set up
+  // before it started.
+  printf("Heap allocations during simulation: %ld\n",
+		 hhAllocCount() - setup_allocs);
+  if (hhAllocCount() != setup_allocs) {
+	fprintf( stderr, "Simulation loop allocated memory!\n" );
+	exit(1);
+  }
+  // Everything else it allocated, stdio included; only known when
+  // alloc_shim.so is preloaded.
+  if (setup_heap >= 0) {
+	printf("Heap allocations by any caller: %ld\n",
+		   hhHeapAllocCount() - setup_heap);
+  }
+
+  sprintf( comment, "Execution time: %f s", exec_time );
+  for (n = 0; n < num_neurons; n++) {
+	if (!traceClose( traces[n], comment )) {
+	  fprintf( stderr, "Could not write the trace of neuron %d!\n", n );
+	  exit(1);
+	}
+  }
+
+  batchFree(batch);
+  free(traces);
+  free(neurons);
+}
+
 /**
  * Name: main
  *
@@ -46,24 +208,50 @@
 int main( int argc, char **argv )
 {
   CmdArgs cmd_args;                       // Command line arguments.
-  int num_comps, num_dendrs;              // Simulation parameters.
-  int i, j, t_ms, step, dendrite;         // Various indexing variables.
+  int num_comps, num_dendrs, steps;       // Simulation parameters.
+  int *comps;                             // Compartments of each dendrite.
+  long total_comps;                       // Compartments of all dendrites.
+  int substeps;                           // Soma steps per dendrite step.
+  int comp_time, grid;                    // Samples and grid steps per ms.
+  int stride;                             // Integration steps per sample.
+  int rec_every;                          // Dendrite steps per frame.
+  int i, t_ms, step;                      // Various indexing variables.
+  int t_start;                            // First ms to simulate.
+  long num_steps;                         // Integration steps simulated.
+  long first;                             // Grid steps done.
+  long dendr_step;                        // Global index of a dendrite step.
   struct timeval start, stop, diff;       // Values used to measure time.
+  long setup_allocs;                      // hhMalloc calls made by the setup.
+  long setup_heap;                        // Heap allocations of the setup.
 
   double exec_time;  // How long we take.
+  double prior_time = 0.0; // How long the runs we continue took.
+  double barrier_time; // How long the dendrite threads waited on each other.
+  double predicted, measured; // Load imbalance of the dendrite threads.
+  double deviation;  // Largest difference from the reference trace.
+  double current;    // Dendritic current at the end of an adaptive step.
+  double i_prev, i_next; // Dendritic current at the ends of a dendrite step.
+
+  HHWorkspace *ws;   // Scratch space used by the soma stepper.
+  Engine *eng;       // State of every dendrite and the kernel stepping them.
+  PSSolver *ps = NULL; // Parker-Sochacki integrator, if used.
+  HHStepControl ctl; // Step size controller of --adaptive.
+  HHRng rng;         // Generator of the dendrite tip currents.
 
   // Accumulators used during dendrite simulation.
   // NOTE: We depend on the compiler to handle the use of double[] variables as
   //       double*.
-  double current, **dendr_volt;
-  double res[COMPTIME], y[NUMVAR], y0[NUMVAR], dydt[NUMVAR], soma_params[3];
+  double *res, y[NUMVAR], y0[NUMVAR], dydt[NUMVAR], soma_params[3];
 
   // Strings used to store filenames for the graph and data files.
   char time_str[14];
   char graph_fname[ FNAME_LEN ];
   char data_fname[ FNAME_LEN ];
+  char comment[ 256 ];
 
-  FILE *data_file;  // The output file where we store the soma potential values.
+  TraceWriter *trace; // The output file where we store the soma potential.
+  Recorder *rec = NULL; // Recording of every compartment, if asked for.
+  CkptHeader ckpt;   // State saved by --checkpoint, or read by --restart.
   FILE *graph_file; // File where graph will be saved.
 
   PlotInfo pinfo;   // Info passed to the plotting functions.
@@ -80,18 +268,80 @@ int main( int argc, char **argv )
   // Pull out the parameters so we don't need to type 'cmd_args.' all the time.
   num_dendrs = cmd_args.num_dendrs;
   num_comps  = cmd_args.num_comps;
+  steps      = cmd_args.steps;
+  substeps   = cmd_args.substeps;
+  comp_time  = cmd_args.params.comp_time;
+  grid       = cmd_args.params.steps;
+  stride     = steps / cmd_args.sample_rate;
+  rec_every  = cmd_args.record_every / substeps;
+
+  // Every function of the model picks the parameters up from here.
+  hhSetParams( &cmd_args.params );
+
+  // Many neurons at once are simulated on their own.
+  if (cmd_args.batch != NULL) {
+	runBatch( &cmd_args );
+	free(cmd_args.comps);
+	return 0;
+  }
 
-  printf( "Simulating %d dendrites with %d compartments per dendrite.\n",
-		  num_dendrs, num_comps );
+  if (cmd_args.morphology != NULL) {
+	for (i = 0, total_comps = 0; i < num_dendrs; i++) {
+	  total_comps += cmd_args.comps[i];
+	}
+	printf( "Simulating %d dendrites of up to %d compartments, %ld in all, "
+			"from %s.\n", num_dendrs, num_comps, total_comps,
+			cmd_args.morphology );
+  } else {
+	printf( "Simulating %d dendrites with %d compartments per dendrite.\n",
+			num_dendrs, num_comps );
+  }
+  if (cmd_args.kernel == KERNEL_SIMD) {
+	printf( "Stepping %d dendrites at a time with the SIMD kernel.\n",
+			HH_VLEN );
+  }
+  if (cmd_args.num_threads > 1) {
+	printf( "Stepping dendrites with %d threads.\n", cmd_args.num_threads );
+  }
+  if (cmd_args.integrator == INTEGRATOR_PS) {
+	printf( "Integrating the neuron with Parker-Sochacki series, "
+			"tolerance %g.\n", cmd_args.tolerance );
+	if (cmd_args.validate) {
+	  fprintf( stderr, "--validate does not apply to Parker-Sochacki!\n" );
+	  exit(1);
+	}
+  } else if (cmd_args.integrator != INTEGRATOR_RK4) {
+	printf( "Integrating the dendrites with %s.\n",
+			(cmd_args.integrator == INTEGRATOR_BE) ? "backward Euler" :
+			"Crank-Nicolson" );
+  }
+  if (substeps > 1) {
+	printf( "Taking %d soma steps per dendrite step.\n", substeps );
+  }
+  if (cmd_args.adaptive) {
+	printf( "Picking the step size from the soma error, tolerance %g.\n",
+			cmd_args.tolerance );
+  }
+  if (cmd_args.restart != NULL) {
+	if (!checkpointRead( cmd_args.restart, &cmd_args, &ckpt )) {
+	  exit(1);
+	}
+	printf( "Continuing from %d ms, saved in %s.\n", ckpt.t_ms,
+			cmd_args.restart );
+  }
 
   //////////////////////////////////////////////////////////////////////////////
   // Create files where results will be stored.
   //////////////////////////////////////////////////////////////////////////////
 
-  // Generate the graph and data file names.
+  // Generate the graph and data file names. A restarted run continues the
+  // files of the run it was saved from.
   time_t t = time(NULL);
   struct tm *tmp = localtime( &t );
   strftime( time_str, 14, "%m%d%y_%H%M%S", tmp );
+  if (cmd_args.restart != NULL) {
+	snprintf( time_str, 14, "%.13s", ckpt.time_str );
+  }
 
   // The resulting filenames will resemble
   //    pWWdXXcYY_MoDaYe_HoMiSe.xxx
@@ -100,8 +350,9 @@ int main( int argc, char **argv )
   // simulation was run.
   sprintf( graph_fname, "graphs/p1d%dc%d_%s.png",
 		   num_dendrs, num_comps, time_str );
-  sprintf( data_fname,  "data/p1d%dc%d_%s.dat",
-		   num_dendrs, num_comps, time_str );
+  sprintf( data_fname,  "data/p1d%dc%d_%s.%s",
+		   num_dendrs, num_comps, time_str,
+		   (cmd_args.format == TRACE_BINARY) ? "bin" : "dat" );
 
   // Verify that the graphs/ and data/ directories exist. Create them if they
   // don't.
@@ -118,8 +369,24 @@ int main( int argc, char **argv )
 	exit(1);
   }
 
-  // Verify that we can open files where results will be stored.
-  if ((data_file = fopen(data_fname, "wb")) == NULL) {
+  // Verify that we can open files where results will be stored. The trace is
+  // written as the simulation goes, so the header goes first.
+  sprintf( comment,
+		   "Vm for HH model. "
+		   "Simulation time: %d ms, Integration step: %f ms, "
+		   "Compartments: %d, Dendrites: %d, Slave processes: %d, "
+		   "Samples per ms: %d",
+		   comp_time, 1.0 / steps, num_comps, num_dendrs, 0,
+		   cmd_args.sample_rate );
+  if (cmd_args.restart != NULL) {
+	trace = traceResume( data_fname, cmd_args.format,
+						 1.0 / cmd_args.sample_rate, ckpt.trace_samples,
+						 ckpt.trace_len, ckpt.trace_head, comment );
+  } else {
+	trace = traceOpen( data_fname, cmd_args.format,
+					   1.0 / cmd_args.sample_rate, comment );
+  }
+  if (trace == NULL) {
 	fprintf(stderr, "Can't open %s file!\n", data_fname);
 	exit(1);
   } else {
@@ -148,7 +415,7 @@ int main( int argc, char **argv )
   y[3] = 0.9959;
 
   // Setup parameters for the soma.
-  soma_params[0] = 1.0 / (double) STEPS;  // dt
+  soma_params[0] = 1.0 / (double) steps;  // dt
   soma_params[1] = 0.0;  // Direct current injection into soma is always zero.
   soma_params[2] = 0.0;  // Dendritic current injected into soma. This is the
 						 // value that our simulation will update at each step.
@@ -159,40 +426,135 @@ int main( int argc, char **argv )
   gettimeofday( &start, NULL );
 
   // Initialize the potential of each dendrite compartment to the rest voltage.
-  dendr_volt = (double**) malloc( num_dendrs * sizeof(double*) );
-  for (i = 0; i < num_dendrs; i++) {
-	dendr_volt[i] = (double*) malloc( num_comps * sizeof(double) );
-	for (j = 0; j < num_comps; j++) {
-	  dendr_volt[i][j] = VREST;
+  // All scratch space needed by the steppers is allocated once, here. The main
+  // loop below must not allocate anything else.
+  if (!hhRngInit( &rng, cmd_args.rng, cmd_args.seed, num_dendrs, grid )) {
+	fprintf( stderr, "Could not set up the random number generator!\n" );
+	exit(1);
+  }
+  if ((comps = dendriteComps( &cmd_args )) == NULL) {
+	fprintf( stderr, "Could not allocate the integration workspace!\n" );
+	exit(1);
+  }
+  eng = engineCreate( cmd_args.kernel, num_dendrs, NULL, num_comps, comps,
+					  &rng, cmd_args.num_threads );
+  ws  = workspaceCreate( num_comps );
+  res = (double*) hhMalloc( sizeof(double) * comp_time );
+  if (eng == NULL || ws == NULL || res == NULL ||
+	  !engineSetIntegrator( eng, cmd_args.integrator,
+							grid / steps * substeps ) ||
+	  (cmd_args.validate && !engineValidate( eng ))) {
+	fprintf( stderr, "Could not allocate the integration workspace!\n" );
+	exit(1);
+  }
+  if (cmd_args.integrator == INTEGRATOR_PS &&
+	  (ps = psCreate( eng, cmd_args.tolerance )) == NULL) {
+	fprintf( stderr, "Could not allocate the integration workspace!\n" );
+	exit(1);
+  }
+  if (cmd_args.record != NULL) {
+	rec = recorderOpen( cmd_args.record, eng,
+						(double) cmd_args.record_every / steps,
+						(long) (comp_time-1) * steps / cmd_args.record_every
+						+ 1 );
+	if (rec == NULL) {
+	  fprintf( stderr, "Can't open %s file!\n", cmd_args.record );
+	  exit(1);
 	}
+	printf( "Compartments will be recorded in %s\n", cmd_args.record );
   }
+  // Pick up the state of the run that was interrupted.
+  t_start = 1;
+  if (cmd_args.restart != NULL) {
+	if (!checkpointRestore( cmd_args.restart, &ckpt, eng, res )) {
+	  fprintf( stderr, "Can't read checkpoint %s!\n", cmd_args.restart );
+	  exit(1);
+	}
+	for (i = 0; i < NUMVAR; i++) {
+	  y[i] = ckpt.y[i];
+	}
+	soma_params[2] = ckpt.i_dendr;
+	t_start = ckpt.t_ms + 1;
+	prior_time = ckpt.exec_time;
+  }
+  checkpointInit( &ckpt, &cmd_args, num_comps, time_str );
+  stepControlInit( &ctl, cmd_args.tolerance, grid );
+  first = 0;
+  i_prev = i_next = soma_params[2];
+  setup_allocs = hhAllocCount();
+  setup_heap = hhHeapAllocCount();
 
   //////////////////////////////////////////////////////////////////////////////
   // Main computation.
   //////////////////////////////////////////////////////////////////////////////
 
   // Record the initial potential value in our results array.
-  res[0] = y[0];
+  if (t_start == 1) {
+	res[0] = y[0];
+	traceWrite( trace, y[0] );
+  }
+  if (rec != NULL) {
+	recorderSnapshot( rec, eng );
+  }
 
   // Loop over milliseconds.
-  for (t_ms = 1; t_ms < COMPTIME; t_ms++) {
+  for (t_ms = t_start; t_ms < comp_time; t_ms++) {
+
+	// Adaptive steps: the soma picks the step and the dendrites follow it
+	// with the potential at its end. Steps stop at every sample.
+	while (cmd_args.adaptive && first < (long) t_ms * grid) {
+	  step = somaStepAdaptive( &ctl, y, soma_params,
+							   (int) (stride - first % stride), ws );
+	  current = engineStepSpan( eng, first, step, y[0] );
+	  stepControlCurrent( &ctl, y[0], soma_params[2], current );
+	  soma_params[2] = current;
+	  first += step;
+
+	  if (first % stride == 0 && first % grid != 0) {
+		traceWrite( trace, y[0] );
+	  }
+	}
 
 	// Loop over integration time steps in each millisecond.
-	for (step = 0; step < STEPS; step++) {
-	  soma_params[2] = 0.0;
-
-	  // Loop over all the dendrites.
-	  for (dendrite = 0; dendrite < num_dendrs; dendrite++) {
-		// This will update Vm in all compartments and will give a new injected
-		// current value from last compartment into the soma.
-		current = dendriteStep( dendr_volt[ dendrite ],
-								step + dendrite + 1,
-								num_comps,
-								soma_params[0],
-								y[0] );
-
-		// Accumulate the current generated by the dendrite.
-		soma_params[2] += current;
+	for (step = 0; step < steps && !cmd_args.adaptive; step++) {
+	  // Samples within the ms. The one at its end is written below.
+	  if (step > 0 && step % stride == 0) {
+		traceWrite( trace, y[0] );
+	  }
+
+	  // The series integrator steps the soma and the dendrites together.
+	  if (ps != NULL) {
+		psStep( ps, eng, (long) (t_ms-1) * steps + step, soma_params[0], y,
+				soma_params[1] );
+		if (rec != NULL &&
+			((long) (t_ms-1) * steps + step + 1) % rec_every == 0) {
+		  recorderSnapshot( rec, eng );
+		}
+		continue;
+	  }
+
+	  // Update Vm in all compartments of all the dendrites and accumulate the
+	  // current they inject into the soma. The dendrites take one step for
+	  // every 'substeps' soma steps.
+	  if (step % substeps == 0) {
+		dendr_step = ((long) (t_ms-1) * steps + step) / substeps;
+		i_prev = i_next;
+		i_next = engineStep( eng, dendr_step, substeps * soma_params[0], y[0] );
+
+		// Frames are taken at the end of a dendrite step, which the soma
+		// reaches 'substeps' steps later.
+		if (rec != NULL && (dendr_step + 1) % rec_every == 0) {
+		  recorderSnapshot( rec, eng );
+		}
+	  }
+
+	  // In between, the soma sees the current interpolated linearly from the
+	  // end of the last dendrite step to the end of this one.
+	  if (step % substeps == substeps-1) {
+		soma_params[2] = i_next;
+	  } else {
+		soma_params[2] = i_prev + (i_next - i_prev) *
+		  (step % substeps + 1) / substeps;
 	  }
 
 	  // Store previous HH model parameters.
@@ -201,7 +563,7 @@ int main( int argc, char **argv )
 	  // This is the main HH computation. It updates the potential, Vm, of the
 	  // soma, injects current, and calculates action potential. Good stuff.
 	  soma(dydt, y, soma_params);
-	  rk4Step(y, y0, dydt, NUMVAR, soma_params, 1, soma);
+	  rk4Step(y, y0, dydt, NUMVAR, soma_params, 1, soma, ws->rk);
 	}
 
 	// Record the membrane potential of the soma at this simulation step.
@@ -209,6 +571,22 @@ int main( int argc, char **argv )
 	printf("\r%02d ms",t_ms); fflush(stdout);
 
 	res[t_ms] = y[0];
+	traceWrite( trace, y[0] );
+
+	// Save the state every so often.
+	if (cmd_args.checkpoint != NULL &&
+		t_ms % cmd_args.checkpoint_every == 0) {
+	  gettimeofday( &stop, NULL );
+	  timersub( &stop, &start, &diff );
+	  exec_time = (double) (diff.tv_sec) + (double) (diff.tv_usec) * 0.000001;
+	  if (!checkpointUpdate( &ckpt, t_ms, y, soma_params[2],
+							 prior_time + exec_time, trace ) ||
+		  !checkpointWrite( cmd_args.checkpoint, &ckpt, eng, res )) {
+		fprintf( stderr, "\nCould not write checkpoint %s!\n",
+				 cmd_args.checkpoint );
+		exit(1);
+	  }
+	}
   }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -221,33 +599,102 @@ int main( int argc, char **argv )
   timersub( &stop, &start, &diff );
   exec_time = (double) (diff.tv_sec) + (double) (diff.tv_usec) * 0.000001;
   printf("\n\nExecution time: %f seconds.\n", exec_time);
+  if (cmd_args.restart != NULL) {
+	printf("Execution time of the whole run, from the start: %f seconds.\n",
+		   prior_time + exec_time);
+  }
 
-  // Record the parameters for this simulation as well as data for gnuplot.
-  fprintf( data_file,
-		   "# Vm for HH model. "
-		   "Simulation time: %d ms, Integration step: %f ms, "
-		   "Compartments: %d, Dendrites: %d, Execution time: %f s, "
-		   "Slave processes: %d\n",
-		   COMPTIME, soma_params[0], num_comps - 2, num_dendrs, exec_time,
-		   0 );
-  fprintf( data_file, "# X Y\n");
+  if (cmd_args.validate) {
+	printf("Largest difference from the reference kernel: %g\n",
+		   eng->max_error);
+  }
+
+  if (ps != NULL) {
+	printf("Parker-Sochacki: %ld steps, average order %.2f (at most %d), "
+		   "%ld steps at the order limit.\n",
+		   ps->stats.steps, (double) ps->stats.terms / ps->stats.steps,
+		   ps->stats.max_order, ps->stats.capped);
+  }
+
+  if (cmd_args.adaptive) {
+	printf("Adaptive steps: %ld (%ld rejected), from %g to %g ms.\n",
+		   ctl.steps, ctl.rejected, (double) ctl.smallest / grid,
+		   (double) ctl.largest / grid);
+  }
 
-  for (t_ms = 0; t_ms < COMPTIME; t_ms++) {
-	fprintf(data_file, "%d %f\n", t_ms, res[t_ms]);
+  // Every step the threads meet twice: to pick up the soma potential and to
+  // hand in their currents. Time spent there is pure synchronization cost.
+  if (cmd_args.num_threads > 1) {
+	num_steps = cmd_args.adaptive ? ctl.steps : (long) (comp_time-1) * steps;
+	barrier_time = 0.0;
+	for (i = 0; i < cmd_args.num_threads; i++) {
+	  barrier_time += poolBarrierTime( eng->pool, i, NULL );
+	}
+	printf("Time per step: %.3f us, barrier overhead per step: %.3f us "
+		   "(soma thread), %.3f us (average of %d threads)\n",
+		   exec_time / num_steps * 1e6,
+		   poolBarrierTime( eng->pool, 0, NULL ) / num_steps * 1e6,
+		   barrier_time / cmd_args.num_threads / num_steps * 1e6,
+		   cmd_args.num_threads);
+	// Parker-Sochacki steps every dendrite on this thread.
+	if (ps == NULL) {
+	  engineBalance( eng, &predicted, &measured );
+	  printf("Thread load imbalance (most loaded over mean): "
+			 "predicted %.3f, measured %.3f\n", predicted, measured);
+	}
+  }
+
+  // The simulation loop is expected to run entirely out of the storage set up
+  // before it started.
+  printf("Heap allocations during simulation: %ld\n",
+		 hhAllocCount() - setup_allocs);
+  if (hhAllocCount() != setup_allocs) {
+	fprintf( stderr, "Simulation loop allocated memory!\n" );
+	exit(1);
+  }
+  // Everything else it allocated, stdio included; only known when
+  // alloc_shim.so is preloaded.
+  if (setup_heap >= 0) {
+	printf("Heap allocations by any caller: %ld\n",
+		   hhHeapAllocCount() - setup_heap);
+  }
+
+  if (cmd_args.reference) {
+	deviation = traceDeviation( cmd_args.reference, res, comp_time );
+	if (deviation < 0.0) {
+	  fprintf( stderr, "Can't read reference trace %s!\n",
+			   cmd_args.reference );
+	} else {
+	  printf("Largest deviation from the reference trace: %g mV\n",
+			 deviation);
+	}
+  }
+
+  // Close the data file so that gnuplot will see all of it. Text traces end
+  // with the execution time, which was not known when the header went out.
+  // A restarted run adds the time of the runs it continued.
+  sprintf( comment, "Execution time: %f s", prior_time + exec_time );
+  if (!traceClose( trace, comment )) {
+	fprintf( stderr, "Could not write %s!\n", data_fname );
+	exit(1);
+  }
+  if (rec != NULL && !recorderClose( rec )) {
+	fprintf( stderr, "Could not write %s!\n", cmd_args.record );
+	exit(1);
   }
-  fflush(data_file);  // Flush and close the data file so that gnuplot will
-  fclose(data_file);  // see it.
 
   //////////////////////////////////////////////////////////////////////////////
   // Plot results if approriate macro was defined.
   //////////////////////////////////////////////////////////////////////////////
   if (ISDEF_PLOT_PNG || ISDEF_PLOT_SCREEN) {
-	pinfo.sim_time = COMPTIME;
-	pinfo.int_step = soma_params[0];
+	pinfo.sim_time = comp_time;
+	pinfo.int_step = 1.0 / steps;
 	pinfo.num_comps = num_comps - 2;
 	pinfo.num_dendrs = num_dendrs;
-	pinfo.exec_time = exec_time;
+	pinfo.exec_time = prior_time + exec_time;
 	pinfo.slaves = 0;
+	pinfo.format = cmd_args.format;
+	pinfo.interval = 1.0 / cmd_args.sample_rate;
   }
 
   if (ISDEF_PLOT_PNG) {    plotData( &pinfo, data_fname, graph_fname ); }
@@ -257,10 +704,13 @@ int main( int argc, char **argv )
   // Free up allocated memory.
   //////////////////////////////////////////////////////////////////////////////
 
-  for(i = 0; i < num_dendrs; i++) {
-	free(dendr_volt[i]);
-  }
-  free(dendr_volt);
+  psFree(ps);
+  engineFree(eng);
+  workspaceFree(ws);
+  hhRngFree(&rng);
+  free(comps);
+  free(cmd_args.comps);
+  free(res);
 
   return 0;
 }
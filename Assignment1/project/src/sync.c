@@ -0,0 +1,346 @@
+/*
+  Multiple Processor Systems.
+
+  Per-step synchronisation between the soma and the dendrite workers of
+  mpi_hh.
+*/
+
+#include "sync.h"
+
+#include <math.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void syncInit( Sync *sync, HHSyncMode mode, int overlap, double delta_t )
+{
+  int i;
+
+  sync->mode = mode;
+  sync->overlap = overlap;
+  MPI_Comm_rank( MPI_COMM_WORLD, &sync->rank );
+  MPI_Comm_size( MPI_COMM_WORLD, &sync->num_tasks );
+
+  // The integration step never changes, so it is only sent once.
+  sync->delta_t = delta_t;
+  MPI_Bcast( &sync->delta_t, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD );
+
+  sync->wait = 0.0;
+  sync->send = 0.0;
+  sync->steps = 0;
+  sync->last = 0.0;
+  for (i = 0; i < SYNC_HIST_BINS; i++) {
+    sync->hist[i] = 0;
+  }
+  sync->num_reqs = 0;
+}
+
+/**
+ * Name: syncSend
+ *
+ * Description:
+ * MPI_Send of `count' doubles, with the time it takes added to sync->send.
+ *
+ * Parameters:
+ * @param sync      (INOUT) the engine
+ * @param buf       (INPUT) the values
+ * @param count     (INPUT) number of values
+ * @param dest      (INPUT) rank to send to
+ * @param tag       (INPUT) message tag
+ */
+static void syncSend( Sync *sync, double *buf, int count, int dest, int tag )
+{
+  double start = MPI_Wtime();
+
+  MPI_Send( buf, count, MPI_DOUBLE, dest, tag, MPI_COMM_WORLD );
+  sync->send += MPI_Wtime() - start;
+}
+
+/**
+ * Name: syncStepDone
+ *
+ * Description:
+ * Ends a step: counts it and adds the time since the end of the last step
+ * to the histogram.
+ *
+ * Parameters:
+ * @param sync      (INOUT) the engine
+ * @param now       (INPUT) MPI_Wtime at the end of the step
+ */
+static void syncStepDone( Sync *sync, double now )
+{
+  int bin;
+
+  if (sync->last > 0.0) {
+    frexp( (now - sync->last) * 1e6, &bin );
+    bin = (bin < 0) ? 0 : bin;
+    sync->hist[(bin < SYNC_HIST_BINS) ? bin : SYNC_HIST_BINS - 1]++;
+  }
+  sync->last = now;
+  sync->steps++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Binomial tree broadcast from rank 0. Each rank receives from the rank that
+// differs in its lowest set bit (its parent) and forwards to the ranks below
+// that bit, so the value reaches all ranks in ceil(log2(num_tasks)) rounds.
+//
+// treeParentMask returns the lowest set bit of the rank, or for rank 0 the
+// first power of two not below num_tasks. treeForward sends the `count'
+// values to the children of the rank.
+////////////////////////////////////////////////////////////////////////////////
+static int treeParentMask( Sync *sync )
+{
+  int mask;
+
+  for (mask = 1; mask < sync->num_tasks; mask <<= 1) {
+    if (sync->rank & mask) {
+      break;
+    }
+  }
+
+  return mask;
+}
+
+static void treeForward( Sync *sync, double *value, int count )
+{
+  int mask;
+
+  for (mask = treeParentMask( sync ) >> 1; mask > 0; mask >>= 1) {
+    if (sync->rank + mask < sync->num_tasks) {
+      syncSend( sync, value, count, sync->rank + mask, TAG_SYNC_VM );
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Binomial tree sum to rank 0, the mirror image of the broadcast. Partial sums
+// are always combined in the same order. `value' holds the `count' values of
+// this rank and ends up with the partial sums of its subtree; `part' is
+// scratch space for as many values.
+////////////////////////////////////////////////////////////////////////////////
+static void treeReduce( Sync *sync, double *value, double *part, int count )
+{
+  int i, mask;
+
+  for (mask = 1; mask < sync->num_tasks; mask <<= 1) {
+    if (sync->rank & mask) {
+      syncSend( sync, value, count, sync->rank - mask, TAG_SYNC_CUR );
+      break;
+    }
+    if (sync->rank + mask < sync->num_tasks) {
+      MPI_Recv( part, count, MPI_DOUBLE, sync->rank + mask, TAG_SYNC_CUR,
+                MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+      for (i = 0; i < count; i++) {
+        value[i] += part[i];
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void syncStateBegin( Sync *sync, double *v_m )
+{
+  int dest;
+  double start = MPI_Wtime();
+
+  sync->num_reqs = 0;
+
+  switch (sync->mode) {
+  case SYNC_STAR:
+    if (sync->rank == 0) {
+      for (dest = 1; dest < sync->num_tasks; dest++) {
+        syncSend( sync, v_m, 1, dest, TAG_SYNC_VM );
+        syncSend( sync, &sync->delta_t, 1, dest, TAG_SYNC_DT );
+      }
+    } else {
+      MPI_Irecv( v_m, 1, MPI_DOUBLE, 0, TAG_SYNC_VM, MPI_COMM_WORLD,
+                 &sync->reqs[sync->num_reqs++] );
+      MPI_Irecv( &sync->delta_t, 1, MPI_DOUBLE, 0, TAG_SYNC_DT,
+                 MPI_COMM_WORLD, &sync->reqs[sync->num_reqs++] );
+    }
+    break;
+  case SYNC_COLL:
+    MPI_Ibcast( v_m, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD,
+                &sync->reqs[sync->num_reqs++] );
+    if (sync->rank == 0) {
+      sync->send += MPI_Wtime() - start;
+    }
+    break;
+  case SYNC_TREE:
+    if (sync->rank == 0) {
+      treeForward( sync, v_m, 1 );
+    } else {
+      MPI_Irecv( v_m, 1, MPI_DOUBLE, sync->rank - treeParentMask( sync ),
+                 TAG_SYNC_VM, MPI_COMM_WORLD, &sync->reqs[sync->num_reqs++] );
+    }
+    break;
+  }
+
+  sync->wait += MPI_Wtime() - start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void syncStateWait( Sync *sync, double *v_m, double *delta_t )
+{
+  double start = MPI_Wtime();
+
+  MPI_Waitall( sync->num_reqs, sync->reqs, MPI_STATUSES_IGNORE );
+  sync->num_reqs = 0;
+
+  // Rank 0 can only be waiting for its own broadcast to go out.
+  if (sync->rank == 0) {
+    sync->send += MPI_Wtime() - start;
+  }
+
+  // Tree nodes pass the potential on to their children once they have it.
+  if (sync->mode == SYNC_TREE && sync->rank != 0) {
+    treeForward( sync, v_m, 1 );
+  }
+
+  *delta_t = sync->delta_t;
+  sync->wait += MPI_Wtime() - start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void syncState( Sync *sync, double *v_m, double *delta_t )
+{
+  double start;
+
+  // Unlike MPI_Ibcast, which builds its schedule on the heap at every call,
+  // the blocking broadcast doesn't allocate. Every rank must use the same
+  // one, so with overlap the soma posts an MPI_Ibcast like the workers.
+  if (sync->mode == SYNC_COLL && !sync->overlap) {
+    start = MPI_Wtime();
+    MPI_Bcast( v_m, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD );
+    if (sync->rank == 0) {
+      sync->send += MPI_Wtime() - start;
+    }
+    *delta_t = sync->delta_t;
+    sync->wait += MPI_Wtime() - start;
+    return;
+  }
+
+  syncStateBegin( sync, v_m );
+  syncStateWait( sync, v_m, delta_t );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double syncCurrent( Sync *sync, double current )
+{
+  int dest;
+  double part, total = current;
+  double now, start = MPI_Wtime();
+
+  switch (sync->mode) {
+  case SYNC_STAR:
+    if (sync->rank == 0) {
+      for (dest = 1; dest < sync->num_tasks; dest++) {
+        MPI_Recv( &part, 1, MPI_DOUBLE, dest, TAG_SYNC_CUR, MPI_COMM_WORLD,
+                  MPI_STATUS_IGNORE );
+        total += part;
+      }
+    } else {
+      syncSend( sync, &current, 1, 0, TAG_SYNC_CUR );
+    }
+    break;
+  case SYNC_COLL:
+    MPI_Reduce( &current, &total, 1, MPI_DOUBLE, MPI_SUM, 0,
+                MPI_COMM_WORLD );
+    if (sync->rank != 0) {
+      sync->send += MPI_Wtime() - start;
+    }
+    break;
+  case SYNC_TREE:
+    treeReduce( sync, &total, &part, 1 );
+    break;
+  }
+
+  now = MPI_Wtime();
+  sync->wait += now - start;
+  syncStepDone( sync, now );
+
+  return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void syncWindow( Sync *sync, double *msg, int count )
+{
+  int dest;
+  double start = MPI_Wtime();
+
+  switch (sync->mode) {
+  case SYNC_STAR:
+    if (sync->rank == 0) {
+      for (dest = 1; dest < sync->num_tasks; dest++) {
+        syncSend( sync, msg, count, dest, TAG_SYNC_VM );
+      }
+    } else {
+      MPI_Recv( msg, count, MPI_DOUBLE, 0, TAG_SYNC_VM, MPI_COMM_WORLD,
+                MPI_STATUS_IGNORE );
+    }
+    break;
+  case SYNC_COLL:
+    MPI_Bcast( msg, count, MPI_DOUBLE, 0, MPI_COMM_WORLD );
+    if (sync->rank == 0) {
+      sync->send += MPI_Wtime() - start;
+    }
+    break;
+  case SYNC_TREE:
+    if (sync->rank != 0) {
+      MPI_Recv( msg, count, MPI_DOUBLE, sync->rank - treeParentMask( sync ),
+                TAG_SYNC_VM, MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    }
+    treeForward( sync, msg, count );
+    break;
+  }
+
+  sync->wait += MPI_Wtime() - start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void syncWindowCurrent( Sync *sync, double *current, double *work,
+                        int count )
+{
+  int i, dest;
+  double now, start = MPI_Wtime();
+
+  switch (sync->mode) {
+  case SYNC_STAR:
+    if (sync->rank == 0) {
+      for (dest = 1; dest < sync->num_tasks; dest++) {
+        MPI_Recv( work, count, MPI_DOUBLE, dest, TAG_SYNC_CUR,
+                  MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+        for (i = 0; i < count; i++) {
+          current[i] += work[i];
+        }
+      }
+    } else {
+      syncSend( sync, current, count, 0, TAG_SYNC_CUR );
+    }
+    break;
+  case SYNC_COLL:
+    MPI_Reduce( current, work, count, MPI_DOUBLE, MPI_SUM, 0,
+                MPI_COMM_WORLD );
+    if (sync->rank == 0) {
+      for (i = 0; i < count; i++) {
+        current[i] = work[i];
+      }
+    } else {
+      sync->send += MPI_Wtime() - start;
+    }
+    break;
+  case SYNC_TREE:
+    treeReduce( sync, current, work, count );
+    break;
+  }
+
+  now = MPI_Wtime();
+  sync->wait += now - start;
+  syncStepDone( sync, now );
+}
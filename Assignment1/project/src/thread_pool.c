@@ -0,0 +1,252 @@
+/*
+  Multiple Processor Systems.
+
+  Persistent thread team and spin-then-block sense-reversing barrier used to
+  step the dendrites with several threads.
+*/
+
+#define _GNU_SOURCE     // For sched_getaffinity.
+
+#include "thread_pool.h"
+#include "lib_hh.h"
+
+#include <time.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tell the core we are in a spin loop.
+#if defined(__x86_64__) || defined(__i386__)
+  #define CPU_RELAX() __builtin_ia32_pause()
+#else
+  #define CPU_RELAX() ((void) 0)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void barrierInit( Barrier *b, int num_threads, int spin )
+{
+  b->num_threads = num_threads;
+  b->spin = spin;
+  atomic_init( &b->count, num_threads );
+  atomic_init( &b->sense, 0 );
+  atomic_init( &b->sleepers, 0 );
+  pthread_mutex_init( &b->lock, NULL );
+  pthread_cond_init( &b->cond, NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void barrierWait( Barrier *b, int *local_sense )
+{
+  int i;
+  int const sense = !*local_sense;
+
+  *local_sense = sense;
+
+  if (atomic_fetch_sub( &b->count, 1 ) == 1) {
+    // Last one in: reset the count for the next phase and release everybody.
+    atomic_store( &b->count, b->num_threads );
+    atomic_store( &b->sense, sense );
+
+    // A sleeper registers itself before checking the sense, so either it sees
+    // the new sense or we see it registered here.
+    if (atomic_load( &b->sleepers ) > 0) {
+      pthread_mutex_lock( &b->lock );
+      pthread_cond_broadcast( &b->cond );
+      pthread_mutex_unlock( &b->lock );
+    }
+    return;
+  }
+
+  for (i = 0; i < b->spin; i++) {
+    if (atomic_load_explicit( &b->sense, memory_order_acquire ) == sense) {
+      return;
+    }
+    CPU_RELAX();
+  }
+
+  pthread_mutex_lock( &b->lock );
+  atomic_fetch_add( &b->sleepers, 1 );
+  while (atomic_load( &b->sense ) != sense) {
+    pthread_cond_wait( &b->cond, &b->lock );
+  }
+  atomic_fetch_sub( &b->sleepers, 1 );
+  pthread_mutex_unlock( &b->lock );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void barrierDestroy( Barrier *b )
+{
+  pthread_mutex_destroy( &b->lock );
+  pthread_cond_destroy( &b->cond );
+}
+
+/**
+ * Name: poolBarrier
+ *
+ * Description:
+ * barrierWait on the pool barrier, accounting the time spent in it.
+ *
+ * Parameters:
+ * @param t             (INOUT) the calling thread
+ */
+static void poolBarrier( PoolThread *t )
+{
+  struct timespec start, stop;
+
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  barrierWait( &t->pool->barrier, &t->sense );
+  clock_gettime( CLOCK_MONOTONIC, &stop );
+
+  t->wait += (double) (stop.tv_sec - start.tv_sec) +
+             (double) (stop.tv_nsec - start.tv_nsec) * 1e-9;
+  t->waits++;
+}
+
+/**
+ * Name: poolMain
+ *
+ * Description:
+ * Body of the pool threads: wait for work, do it, report completion.
+ *
+ * Parameters:
+ * @param arg           (INPUT) the PoolThread of this thread
+ *
+ * Returns:
+ * @return void*        always NULL
+ */
+static void *poolMain( void *arg )
+{
+  PoolThread *t = (PoolThread*) arg;
+  Pool *pool = t->pool;
+
+  for (;;) {
+    poolBarrier( t );
+    if (pool->quit) {
+      break;
+    }
+    pool->work( pool->arg, t->id );
+    poolBarrier( t );
+  }
+
+  return NULL;
+}
+
+/**
+ * Name: availableCpus
+ *
+ * Description:
+ * Returns how many CPUs this process may run on.
+ *
+ * Returns:
+ * @return int          number of CPUs in the affinity mask of the process
+ */
+static int availableCpus( void )
+{
+  cpu_set_t set;
+
+  if (sched_getaffinity( 0, sizeof(set), &set ) != 0) {
+    return 1;
+  }
+
+  return CPU_COUNT( &set );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+Pool *poolCreate( int num_threads )
+{
+  int i;
+  Pool *pool = (Pool*) hhMalloc( sizeof(Pool) );
+
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pool->num_threads = num_threads;
+  pool->work = NULL;
+  pool->arg = NULL;
+  pool->quit = 0;
+  pool->threads = (PoolThread*) hhMallocAligned( CACHE_LINE,
+                                                 sizeof(PoolThread) *
+                                                 num_threads );
+  if (pool->threads == NULL) {
+    free( pool );
+    return NULL;
+  }
+  memset( pool->threads, 0, sizeof(PoolThread) * num_threads );
+
+  // Spinning only pays off when every thread has a core of its own.
+  barrierInit( &pool->barrier, num_threads,
+               (num_threads <= availableCpus()) ? BARRIER_SPIN : 0 );
+
+  for (i = 0; i < num_threads; i++) {
+    pool->threads[i].pool = pool;
+    pool->threads[i].id = i;
+  }
+
+  for (i = 1; i < num_threads; i++) {
+    if (pthread_create( &pool->threads[i].handle, NULL, poolMain,
+                        &pool->threads[i] ) != 0) {
+      // The threads already started are parked in the barrier waiting for
+      // the missing ones, so the pool cannot be released. Callers give up on
+      // the run anyway.
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void poolRun( Pool *pool, void (*work)( void *arg, int id ), void *arg )
+{
+  if (pool->num_threads == 1) {
+    work( arg, 0 );
+    return;
+  }
+
+  pool->work = work;
+  pool->arg = arg;
+
+  poolBarrier( &pool->threads[0] );   // Start everybody.
+  work( arg, 0 );
+  poolBarrier( &pool->threads[0] );   // Wait until everybody is done.
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double poolBarrierTime( const Pool *pool, int id, long *waits )
+{
+  if (waits) {
+    *waits = pool->threads[id].waits;
+  }
+
+  return pool->threads[id].wait;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void poolFree( Pool *pool )
+{
+  int i;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  if (pool->num_threads > 1) {
+    pool->quit = 1;
+    barrierWait( &pool->barrier, &pool->threads[0].sense );
+    for (i = 1; i < pool->num_threads; i++) {
+      pthread_join( pool->threads[i].handle, NULL );
+    }
+  }
+
+  barrierDestroy( &pool->barrier );
+  free( pool->threads );
+  free( pool );
+}
@@ -0,0 +1,330 @@
+/*
+  Multiple Processor Systems.
+
+  Writing and reading back the soma potential traces stored under data/.
+*/
+
+#include "trace.h"
+#include "lib_hh.h"
+#include "constants.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+TraceWriter *traceOpen( const char *fname, TraceFormat format,
+                        double interval, const char *comment )
+{
+  TraceWriter *tw = (TraceWriter*) hhMalloc( sizeof(TraceWriter) );
+
+  if (tw == NULL) {
+    return NULL;
+  }
+  if ((tw->file = fopen( fname, "wb" )) == NULL) {
+    free( tw );
+    return NULL;
+  }
+
+  tw->format   = format;
+  tw->interval = interval;
+  tw->samples  = 0;
+  tw->count    = 0;
+  tw->head     = 0;
+
+  if (format == TRACE_BINARY) {
+    fwrite( TRACE_MAGIC, 1, TRACE_MAGIC_LEN, tw->file );
+    fwrite( &tw->interval, sizeof(double), 1, tw->file );
+  } else {
+    if (comment != NULL) {
+      tw->head = fprintf( tw->file, "# %s\n", comment );
+    }
+    fprintf( tw->file, "# X Y\n" );
+  }
+
+  return tw;
+}
+
+/**
+ * Name: traceReplaceHead
+ *
+ * Description:
+ * Replaces the comment line a text trace starts with, keeping what followed
+ * it up to a checkpoint. The line is overwritten in place if the new one is
+ * as long; otherwise the trace is copied under a temporary name, which is
+ * then renamed, so a failed copy leaves the old trace in place.
+ *
+ * Parameters:
+ * @param fname     (INPUT) name of the file
+ * @param len       (INPUT) bytes in the file at the checkpoint
+ * @param head      (INPUT) bytes of its comment line at the checkpoint
+ * @param comment   (INPUT) the new comment, without the leading '#'
+ *
+ * Returns:
+ * @return long     bytes up to the checkpoint in the new file, or -1 on error
+ */
+static long traceReplaceHead( const char *fname, long len, long head,
+                              const char *comment )
+{
+  char tmp_fname[ FNAME_LEN + 8 ], buf[ 8192 ];
+  long cur, left, new_head = (long) strlen( comment ) + 3;
+  size_t n;
+  int c, ok;
+  FILE *file, *tmp;
+
+  if ((file = fopen( fname, "r+b" )) == NULL) {
+    return -1;
+  }
+  // The line may have been replaced by an earlier restart from the same
+  // checkpoint, so its length is read back from the file.
+  cur = 0;
+  while ((c = fgetc( file )) != EOF && c != '\n') {
+    cur++;
+  }
+  cur++;
+  if (c == EOF) {
+    fclose( file );
+    return -1;
+  }
+
+  if (cur == head && new_head == head) {
+    ok = (fseek( file, 0, SEEK_SET ) == 0) &&
+         fprintf( file, "# %s\n", comment ) == new_head;
+    ok = (fclose( file ) == 0) && ok;
+    return ok ? len : -1;
+  }
+
+  snprintf( tmp_fname, sizeof(tmp_fname), "%s.tmp", fname );
+  if ((tmp = fopen( tmp_fname, "wb" )) == NULL) {
+    fclose( file );
+    return -1;
+  }
+  ok = fprintf( tmp, "# %s\n", comment ) == new_head;
+  for (left = len - head; left > 0 && ok; left -= (long) n) {
+    n = fread( buf, 1, (left < (long) sizeof(buf)) ? (size_t) left :
+               sizeof(buf), file );
+    ok = n > 0 && fwrite( buf, 1, n, tmp ) == n;
+  }
+  ok = (fclose( tmp ) == 0) && ok;
+  fclose( file );
+  if (!ok || rename( tmp_fname, fname ) != 0) {
+    remove( tmp_fname );
+    return -1;
+  }
+
+  return len - head + new_head;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+TraceWriter *traceResume( const char *fname, TraceFormat format,
+                          double interval, long samples, long len, long head,
+                          const char *comment )
+{
+  TraceWriter *tw;
+
+  if (format == TRACE_TEXT && comment != NULL && head > 0) {
+    if ((len = traceReplaceHead( fname, len, head, comment )) < 0) {
+      return NULL;
+    }
+    head = (long) strlen( comment ) + 3;
+  }
+  if ((tw = (TraceWriter*) hhMalloc( sizeof(TraceWriter) )) == NULL) {
+    return NULL;
+  }
+  if ((tw->file = fopen( fname, "r+b" )) == NULL) {
+    free( tw );
+    return NULL;
+  }
+  if (fseek( tw->file, 0, SEEK_END ) != 0 || ftell( tw->file ) < len ||
+      ftruncate( fileno( tw->file ), len ) != 0 ||
+      fseek( tw->file, len, SEEK_SET ) != 0) {
+    fclose( tw->file );
+    free( tw );
+    return NULL;
+  }
+
+  tw->format   = format;
+  tw->interval = interval;
+  tw->samples  = samples;
+  tw->count    = 0;
+  tw->head     = head;
+
+  return tw;
+}
+
+/**
+ * Name: traceFlush
+ *
+ * Description:
+ * Hands the buffered samples of a writer to stdio.
+ *
+ * Parameters:
+ * @param tw        (INOUT) the writer
+ */
+static void traceFlush( TraceWriter *tw )
+{
+  int i;
+  long first = tw->samples - tw->count;
+
+  if (tw->format == TRACE_BINARY) {
+    fwrite( tw->buf, sizeof(double), tw->count, tw->file );
+  } else {
+    // Times are computed from the sample index so that they don't drift;
+    // with one sample per ms they are the whole numbers of old traces.
+    for (i = 0; i < tw->count; i++) {
+      fprintf( tw->file, "%.10g %f\n", (first + i) * tw->interval,
+               tw->buf[i] );
+    }
+  }
+
+  tw->count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void traceWrite( TraceWriter *tw, double v )
+{
+  tw->buf[tw->count++] = v;
+  tw->samples++;
+
+  if (tw->count == TRACE_BUF_LEN) {
+    traceFlush( tw );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+long traceSync( TraceWriter *tw )
+{
+  traceFlush( tw );
+  if (fflush( tw->file ) != 0 || ferror( tw->file )) {
+    return -1;
+  }
+
+  return ftell( tw->file );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void traceComment( TraceWriter *tw, const char *comment )
+{
+  traceFlush( tw );
+  if (tw->format == TRACE_TEXT) {
+    fprintf( tw->file, "# %s\n", comment );
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int traceClose( TraceWriter *tw, const char *comment )
+{
+  int ok;
+
+  traceFlush( tw );
+  if (tw->format == TRACE_TEXT && comment != NULL) {
+    fprintf( tw->file, "# %s\n", comment );
+  }
+
+  ok = !ferror( tw->file );
+  ok = (fclose( tw->file ) == 0) && ok;
+  free( tw );
+
+  return ok;
+}
+
+/**
+ * Name: traceKeep
+ *
+ * Description:
+ * Stores a sample read by traceRead if it falls on a whole ms.
+ *
+ * Parameters:
+ * @param t         (INPUT) time of the sample, ms
+ * @param value     (INPUT) the sample
+ * @param v         (OUTPUT) potential at each ms
+ * @param max       (INPUT) number of entries in `v'
+ * @param count     (INOUT) one past the last ms stored so far
+ */
+static void traceKeep( double t, double value, double *v, int max,
+                       int *count )
+{
+  int ms = (int) floor( t + 0.5 );
+
+  if (fabs( t - ms ) < 1e-6 && ms >= 0 && ms < max) {
+    v[ms] = value;
+    *count = (ms+1 > *count) ? ms+1 : *count;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+int traceRead( const char *fname, double *v, int max )
+{
+  FILE *file;
+  char line[256];
+  int count = 0;
+  long k;
+  double t, value, interval;
+
+  if ((file = fopen( fname, "rb" )) == NULL) {
+    return -1;
+  }
+
+  // Binary traces start with the magic string and the sample interval.
+  if (fread( line, 1, TRACE_MAGIC_LEN, file ) == TRACE_MAGIC_LEN &&
+      memcmp( line, TRACE_MAGIC, TRACE_MAGIC_LEN ) == 0) {
+    if (fread( &interval, sizeof(double), 1, file ) != 1) {
+      fclose( file );
+      return -1;
+    }
+    for (k = 0; fread( &value, sizeof(double), 1, file ) == 1; k++) {
+      traceKeep( k * interval, value, v, max, &count );
+    }
+
+    fclose( file );
+    return count;
+  }
+
+  rewind( file );
+  while (fgets( line, sizeof(line), file ) != NULL) {
+    if (line[0] == '#') {
+      continue;
+    }
+    if (sscanf( line, "%lf %lf", &t, &value ) == 2) {
+      traceKeep( t, value, v, max, &count );
+    }
+  }
+
+  fclose( file );
+  return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+double traceDeviation( const char *fname, const double *v, int n )
+{
+  int t;
+  double dev = 0.0;
+  double *ref = (double*) hhMalloc( sizeof(double) * n );
+
+  if (ref == NULL || traceRead( fname, ref, n ) < n) {
+    free( ref );
+    return -1.0;
+  }
+
+  for (t = 0; t < n; t++) {
+    // fmax drops NaNs, but a trace that blew up must not look exact.
+    if (isnan( v[t] )) {
+      dev = v[t];
+      break;
+    }
+    dev = fmax( dev, fabs( v[t] - ref[t] ) );
+  }
+
+  free( ref );
+  return dev;
+}